@@ -0,0 +1,331 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+/**
+ * Speed and quality of the scolorq precisions. Quality is the RMSE of the
+ * quantized image and the RMSE after a 3x3 blur, which is closer to what is
+ * seen of a dithered image. The blurred RMSE of float must stay within
+ * QUANT_TOLERANCE of double.
+ *
+ * The second part paints a stroke into a quantized image and quantizes it
+ * again, from scratch and with a warm start from the previous palette. The
+ * blurred RMSE of the warm start must stay within QUANT_WARM_TOLERANCE of
+ * the cold start.
+ *
+ * The last part compares the fast preview quantizers of quantize.c (median
+ * cut or k-means++, with each dithering) against scolorq.
+ **/
+
+#include "spatial_color_quant.h"
+#include "quantize.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define QUANT_SIZE 128
+#define QUANT_COLORS 16
+#define QUANT_IMAGES 3
+
+// Allowed relative difference of the blurred RMSE
+#define QUANT_TOLERANCE 0.05
+#define QUANT_WARM_TOLERANCE 0.10
+
+// Runs of the fast quantizers per measurement
+#define QUANT_FAST_RUNS 20
+
+static double
+bench_now()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t
+bench_random()
+{
+    static uint32_t state = 0x12345678;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static void
+bench_fill(uint8_t *rgb, int kind)
+{
+    for (int y=0; y<QUANT_SIZE; ++y) {
+        for (int x=0; x<QUANT_SIZE; ++x) {
+            uint8_t *p = rgb + (y * QUANT_SIZE + x) * 3;
+            if (kind == 0) {
+                // Gradients with noise
+                p[0] = x * 2;
+                p[1] = y * 2;
+                p[2] = ((x ^ y) + bench_random() % 16) & 0xFF;
+            } else if (kind == 1) {
+                // Smooth shapes
+                double r = hypot(x - QUANT_SIZE / 2, y - QUANT_SIZE / 2);
+                p[0] = 128 + 120 * sin(r / 6);
+                p[1] = 128 + 120 * cos(x / 9.0);
+                p[2] = 128 + 100 * sin(y / 7.0 + x / 13.0);
+            } else {
+                // Hard edges and noise
+                p[0] = ((x / 16 + y / 16) & 1) ? 200 : 40;
+                p[1] = x * 2;
+                p[2] = bench_random();
+            }
+        }
+    }
+}
+
+static void
+bench_error(const uint8_t *a, const uint8_t *b, double *rmse, double *blurred_rmse)
+{
+    double sum = 0.0, blurred_sum = 0.0;
+    for (int y=0; y<QUANT_SIZE; ++y) {
+        for (int x=0; x<QUANT_SIZE; ++x) {
+            for (int c=0; c<3; ++c) {
+                double d = a[(y * QUANT_SIZE + x) * 3 + c] - b[(y * QUANT_SIZE + x) * 3 + c];
+                sum += d * d;
+
+                double blurred = 0.0, weights = 0.0;
+                for (int dy=-1; dy<=1; ++dy) {
+                    for (int dx=-1; dx<=1; ++dx) {
+                        int xx = x + dx, yy = y + dy;
+                        if (xx < 0 || yy < 0 || xx >= QUANT_SIZE || yy >= QUANT_SIZE) {
+                            continue;
+                        }
+                        double weight = (dx == 0 && dy == 0) ? 4 : ((dx == 0 || dy == 0) ? 2 : 1);
+                        int i = (yy * QUANT_SIZE + xx) * 3 + c;
+                        blurred += weight * (a[i] - b[i]);
+                        weights += weight;
+                    }
+                }
+                blurred /= weights;
+                blurred_sum += blurred * blurred;
+            }
+        }
+    }
+
+    *rmse = sqrt(sum / (QUANT_SIZE * QUANT_SIZE * 3));
+    *blurred_rmse = sqrt(blurred_sum / (QUANT_SIZE * QUANT_SIZE * 3));
+}
+
+struct BenchResult {
+    double time;
+    double rmse;
+    double blurred_rmse;
+};
+
+static struct BenchResult
+bench_run_warm(const uint8_t *source, uint8_t *rgb, int precision, uint32_t seed, const struct scolorq_warm_start *warm)
+{
+    memcpy(rgb, source, QUANT_SIZE * QUANT_SIZE * 3);
+
+    struct scolorq_ctx *ctx = scolorq_ctx_new(seed);
+    scolorq_ctx_set_precision(ctx, precision);
+
+    struct BenchResult result;
+    double start = bench_now();
+    if (scolorq_quantize_warm(ctx, QUANT_SIZE, QUANT_SIZE, rgb, QUANT_COLORS, NULL, warm) != 0) {
+        fprintf(stderr, "quantization failed\n");
+        exit(1);
+    }
+    result.time = bench_now() - start;
+    scolorq_ctx_free(ctx);
+
+    bench_error(source, rgb, &result.rmse, &result.blurred_rmse);
+    return result;
+}
+
+static struct BenchResult
+bench_run(const uint8_t *source, int precision, uint32_t seed)
+{
+    static uint8_t rgb[QUANT_SIZE * QUANT_SIZE * 3];
+    return bench_run_warm(source, rgb, precision, seed, NULL);
+}
+
+// Distinct colors of a quantized image
+static int
+bench_palette(const uint8_t *rgb, uint8_t *palette)
+{
+    int count = 0;
+    for (int i=0; i<QUANT_SIZE * QUANT_SIZE; ++i) {
+        int j = 0;
+        while (j < count && memcmp(palette + 3 * j, rgb + 3 * i, 3) != 0) {
+            ++j;
+        }
+        if (j == count && count < QUANT_COLORS) {
+            memcpy(palette + 3 * count++, rgb + 3 * i, 3);
+        }
+    }
+    return count;
+}
+
+// A touch-up: a round blob of a new color
+static void
+bench_paint(uint8_t *rgb, int kind)
+{
+    int cx = 40 + 24 * kind, cy = 80 - 16 * kind;
+    for (int y=0; y<QUANT_SIZE; ++y) {
+        for (int x=0; x<QUANT_SIZE; ++x) {
+            if ((x - cx) * (x - cx) + (y - cy) * (y - cy) < 8 * 8) {
+                uint8_t *p = rgb + (y * QUANT_SIZE + x) * 3;
+                p[0] = 230;
+                p[1] = 120;
+                p[2] = 30;
+            }
+        }
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    static uint8_t source[QUANT_SIZE * QUANT_SIZE * 3];
+    double time_double = 0.0, time_float = 0.0;
+    int ok = 1;
+
+    printf("%d colors, %dx%d, serial\n", QUANT_COLORS, QUANT_SIZE, QUANT_SIZE);
+    printf("          %-24s %-24s %-24s\n", "double", "float", "double, other seed");
+
+    for (int kind=0; kind<QUANT_IMAGES; ++kind) {
+        bench_fill(source, kind);
+
+        struct BenchResult d = bench_run(source, SCOLORQ_PRECISION_DOUBLE, SCOLORQ_DEFAULT_SEED);
+        struct BenchResult f = bench_run(source, SCOLORQ_PRECISION_FLOAT, SCOLORQ_DEFAULT_SEED);
+        struct BenchResult other = bench_run(source, SCOLORQ_PRECISION_DOUBLE, 1);
+
+        printf("image %d:  %5.3fs %5.2f (%5.2f)      %5.3fs %5.2f (%5.2f)      %5.3fs %5.2f (%5.2f)\n", kind,
+                d.time, d.rmse, d.blurred_rmse, f.time, f.rmse, f.blurred_rmse,
+                other.time, other.rmse, other.blurred_rmse);
+
+        time_double += d.time;
+        time_float += f.time;
+        if (fabs(f.blurred_rmse - d.blurred_rmse) > QUANT_TOLERANCE * d.blurred_rmse) {
+            ok = 0;
+        }
+    }
+
+    printf("float: %.1fx faster than double, blurred RMSE within %.0f%%: %s\n",
+            time_double / time_float, QUANT_TOLERANCE * 100, ok ? "yes" : "NO");
+
+    printf("\nquantizing again after a touch-up, float\n");
+    printf("          %-24s %-24s %-24s\n", "cold", "warm", "warm, dirty pixels only");
+
+    double time_cold = 0.0, time_warm = 0.0;
+    int warm_ok = 1;
+    for (int kind=0; kind<QUANT_IMAGES; ++kind) {
+        static uint8_t quantized[QUANT_SIZE * QUANT_SIZE * 3];
+        static uint8_t edited[QUANT_SIZE * QUANT_SIZE * 3];
+        static uint8_t rgb[QUANT_SIZE * QUANT_SIZE * 3];
+        static uint8_t dirty[QUANT_SIZE * QUANT_SIZE];
+        uint8_t palette[QUANT_COLORS * 3];
+
+        bench_fill(source, kind);
+        bench_run_warm(source, quantized, SCOLORQ_PRECISION_FLOAT, SCOLORQ_DEFAULT_SEED, NULL);
+
+        memcpy(edited, quantized, sizeof(edited));
+        bench_paint(edited, kind);
+        for (int i=0; i<QUANT_SIZE * QUANT_SIZE; ++i) {
+            dirty[i] = (memcmp(edited + 3 * i, quantized + 3 * i, 3) != 0);
+        }
+
+        struct scolorq_warm_start warm = { palette, bench_palette(quantized, palette), SCOLORQ_WARM_TEMPERATURE, NULL };
+        struct scolorq_warm_start warm_dirty = warm;
+        warm_dirty.dirty = dirty;
+
+        struct BenchResult c = bench_run_warm(edited, rgb, SCOLORQ_PRECISION_FLOAT, SCOLORQ_DEFAULT_SEED, NULL);
+        struct BenchResult w = bench_run_warm(edited, rgb, SCOLORQ_PRECISION_FLOAT, SCOLORQ_DEFAULT_SEED, &warm);
+        struct BenchResult wd = bench_run_warm(edited, rgb, SCOLORQ_PRECISION_FLOAT, SCOLORQ_DEFAULT_SEED, &warm_dirty);
+
+        printf("image %d:  %5.3fs %5.2f (%5.2f)      %5.3fs %5.2f (%5.2f)      %5.3fs %5.2f (%5.2f)\n", kind,
+                c.time, c.rmse, c.blurred_rmse, w.time, w.rmse, w.blurred_rmse,
+                wd.time, wd.rmse, wd.blurred_rmse);
+
+        time_cold += c.time;
+        time_warm += wd.time;
+        if (w.blurred_rmse > (1 + QUANT_WARM_TOLERANCE) * c.blurred_rmse ||
+            wd.blurred_rmse > (1 + QUANT_WARM_TOLERANCE) * c.blurred_rmse) {
+            warm_ok = 0;
+        }
+    }
+
+    printf("warm start: %.1fx faster than cold, blurred RMSE within %.0f%%: %s\n",
+            time_cold / time_warm, QUANT_WARM_TOLERANCE * 100, warm_ok ? "yes" : "NO");
+
+    ok = ok && warm_ok;
+
+    printf("\nfast quantizers (%s), time per image and blurred RMSE\n", quantize_kernel_name());
+    printf("          ");
+    for (int dither=0; dither<QUANTIZE_DITHER_COUNT; ++dither) {
+        for (int method=0; method<QUANTIZE_PALETTE_COUNT; ++method) {
+            printf(" %-10.10s %-8.8s", quantize_palette_name(method), quantize_dither_name(dither));
+        }
+    }
+    printf("\n");
+
+    for (int kind=0; kind<QUANT_IMAGES; ++kind) {
+        static uint32_t source_rgba[QUANT_SIZE * QUANT_SIZE];
+        static uint32_t rgba[QUANT_SIZE * QUANT_SIZE];
+        static uint8_t rgb[QUANT_SIZE * QUANT_SIZE * 3];
+
+        bench_fill(source, kind);
+        for (int i=0; i<QUANT_SIZE * QUANT_SIZE; ++i) {
+            source_rgba[i] = 0xFF000000 | source[3 * i] | (source[3 * i + 1] << 8) | (source[3 * i + 2] << 16);
+        }
+
+        printf("image %d: ", kind);
+        for (int dither=0; dither<QUANTIZE_DITHER_COUNT; ++dither) {
+            for (int method=0; method<QUANTIZE_PALETTE_COUNT; ++method) {
+                struct QuantizeOptions options = { method, dither };
+
+                double start = bench_now();
+                for (int run=0; run<QUANT_FAST_RUNS; ++run) {
+                    memcpy(rgba, source_rgba, sizeof(rgba));
+                    quantize_fast(rgba, NULL, QUANT_SIZE, QUANT_SIZE, QUANT_COLORS, &options);
+                }
+                double time = (bench_now() - start) / QUANT_FAST_RUNS;
+
+                for (int i=0; i<QUANT_SIZE * QUANT_SIZE; ++i) {
+                    for (int c=0; c<3; ++c) {
+                        rgb[3 * i + c] = (rgba[i] >> (8 * c)) & 0xFF;
+                    }
+                }
+
+                double rmse, blurred_rmse;
+                bench_error(source, rgb, &rmse, &blurred_rmse);
+                printf(" %6.2fms (%5.2f)   ", time * 1000.0, blurred_rmse);
+            }
+        }
+        printf("\n");
+    }
+
+    return ok ? 0 : 1;
+}
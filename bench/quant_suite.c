@@ -0,0 +1,705 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+/**
+ * Benchmark and quality suite of the quantizers over a corpus: the default
+ * skins of all teams (when editor.wad and the game's WADs are in the current
+ * folder, as for the editor), the .dat files and savegames given on the
+ * command line, and synthetic gradients and noise.
+ *
+ * For each image and quantizer it reports the time (best of --runs), the
+ * tracked allocations and peak memory of the quantizer (see memstat.h), the
+ * work per annealing level of scolorq, and quality: PSNR, an S-CIELAB-like
+ * error and the number of colors used.
+ * The default skins already have 16 colors, --colors 8 makes them a harder
+ * test. --json FILE also writes everything as JSON, to compare changes.
+ **/
+
+#include "spatial_color_quant.h"
+#include "quantize.h"
+#include "shipdat.h"
+#include "saveskin.h"
+#include "fileio.h"
+#include "memstat.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SUITE_SIZE 128
+#define SUITE_PIXELS (SUITE_SIZE * SUITE_SIZE)
+
+/**
+ * S-CIELAB blurs the opponent color channels with the spread of the eye's
+ * sensitivity before comparing in CIELAB, so dithering that averages out at
+ * viewing distance is not counted as error. This uses one Gaussian per
+ * channel with the main spread of the S-CIELAB filters (in degrees), for
+ * PSP screen pixels seen from about 30 cm, one texel per pixel.
+ **/
+#define SUITE_SAMPLES_PER_DEGREE 26.0
+
+static const double
+SUITE_SPREAD[3] = { 0.05, 0.0685, 0.0920 };
+
+// XYZ to the opponent channels (luminance, red-green, blue-yellow)
+static const double
+SUITE_OPPONENT[3][3] = {
+    {  0.2787336,  0.7218031, -0.1065520 },
+    { -0.4487736,  0.2898056, -0.0771569 },
+    {  0.0859513, -0.5899859,  0.5011089 },
+};
+
+// Linear sRGB to XYZ (D65)
+static const double
+SUITE_XYZ[3][3] = {
+    { 0.4124, 0.3576, 0.1805 },
+    { 0.2126, 0.7152, 0.0722 },
+    { 0.0193, 0.1192, 0.9505 },
+};
+
+static const double
+SUITE_WHITE[3] = { 0.9505, 1.0, 1.089 };
+
+enum SuiteQuantizerKind {
+    SUITE_SCOLORQ = 0,
+    SUITE_FAST,
+};
+
+struct SuiteQuantizer {
+    char name[64];
+    enum SuiteQuantizerKind kind;
+
+    // SUITE_SCOLORQ, the context is kept across the corpus like in the editor
+    int precision;
+    int threads;
+    struct scolorq_ctx *ctx;
+
+    // SUITE_FAST
+    struct QuantizeOptions options;
+
+    // Sums for the summary
+    double time;
+    double psnr;
+    double scielab;
+    int count;
+};
+
+struct SuiteImage {
+    char name[64];
+    const char *source;
+    uint8_t rgb[3 * SUITE_PIXELS];
+};
+
+struct SuiteCorpus {
+    struct SuiteImage *images;
+    int count;
+};
+
+struct SuiteQuality {
+    double psnr;
+    double scielab;
+    int colors;
+};
+
+static double
+suite_now()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t
+suite_random()
+{
+    static uint32_t state = 0x12345678;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static struct SuiteImage *
+suite_add_image(struct SuiteCorpus *corpus, const char *source, const char *name)
+{
+    corpus->images = realloc(corpus->images, (corpus->count + 1) * sizeof(struct SuiteImage));
+
+    struct SuiteImage *image = &corpus->images[corpus->count++];
+    snprintf(image->name, sizeof(image->name), "%s", name);
+    image->source = source;
+    return image;
+}
+
+// Adds all materials of a ship.dat or savegame buffer
+static int
+suite_add_dat(struct SuiteCorpus *corpus, const char *source, const char *name, const uint8_t *buf, size_t len)
+{
+    static uint32_t rgba[SUITE_PIXELS];
+
+    int index = 0;
+    while (shipdat_decode_material(buf, len, index, rgba, NULL)) {
+        char image_name[64];
+        snprintf(image_name, sizeof(image_name), "%s/%d", name, index);
+
+        struct SuiteImage *image = suite_add_image(corpus, source, image_name);
+        for (int i=0; i<SUITE_PIXELS; ++i) {
+            for (int c=0; c<3; ++c) {
+                image->rgb[3 * i + c] = (rgba[i] >> (8 * c)) & 0xFF;
+            }
+        }
+
+        ++index;
+    }
+
+    return index;
+}
+
+static void
+suite_add_file(struct SuiteCorpus *corpus, const char *filename)
+{
+    size_t len;
+    char *buf = read_file(filename, &len);
+    if (buf == NULL) {
+        return;
+    }
+
+    if (strstr(filename, "16034453") != NULL && !saveskin_decrypt(buf, &len)) {
+        printf("Could not decrypt %s\n", filename);
+    } else if (suite_add_dat(corpus, "file", filename, (const uint8_t *)buf, len) == 0) {
+        printf("No images in %s\n", filename);
+    }
+
+    free(buf);
+}
+
+static void
+suite_mount_line(const char *line, void *user_data)
+{
+    (void)user_data;
+
+    if (line[0] != '#' && line[0] != '\0') {
+        mount_wad(line);
+    }
+}
+
+// Lines of data/editor/list.txt are "team name, label, slug"
+static void
+suite_team_line(const char *line, void *user_data)
+{
+    struct SuiteCorpus *corpus = user_data;
+
+    const char *slug = strrchr(line, ',');
+    if (line[0] == '#' || line[0] == '\0' || slug == NULL) {
+        return;
+    }
+
+    ++slug;
+    while (*slug == ' ') {
+        ++slug;
+    }
+
+    char filename[128];
+    snprintf(filename, sizeof(filename), "data/ships/%s/ship.dat", slug);
+
+    size_t len;
+    char *buf = read_file(filename, &len);
+    if (buf != NULL) {
+        suite_add_dat(corpus, "wad", slug, (const uint8_t *)buf, len);
+        free(buf);
+    }
+}
+
+static void
+suite_add_synthetic(struct SuiteCorpus *corpus)
+{
+    static const char *
+    names[] = { "gradient", "radial", "gradient-noise", "checker-noise", "noise" };
+
+    for (int kind=0; kind<(int)(sizeof(names)/sizeof(names[0])); ++kind) {
+        struct SuiteImage *image = suite_add_image(corpus, "synthetic", names[kind]);
+
+        for (int y=0; y<SUITE_SIZE; ++y) {
+            for (int x=0; x<SUITE_SIZE; ++x) {
+                uint8_t *p = image->rgb + (y * SUITE_SIZE + x) * 3;
+                if (kind == 0) {
+                    p[0] = x * 2;
+                    p[1] = y * 2;
+                    p[2] = 255 - x - y / 2;
+                } else if (kind == 1) {
+                    double r = hypot(x - SUITE_SIZE / 2, y - SUITE_SIZE / 2);
+                    p[0] = 128 + 120 * sin(r / 6);
+                    p[1] = 128 + 120 * cos(x / 9.0);
+                    p[2] = 128 + 100 * sin(y / 7.0 + x / 13.0);
+                } else if (kind == 2) {
+                    p[0] = x * 2;
+                    p[1] = y * 2;
+                    p[2] = ((x ^ y) + suite_random() % 16) & 0xFF;
+                } else if (kind == 3) {
+                    p[0] = ((x / 16 + y / 16) & 1) ? 200 : 40;
+                    p[1] = x * 2;
+                    p[2] = suite_random();
+                } else {
+                    uint32_t r = suite_random();
+                    p[0] = r;
+                    p[1] = r >> 8;
+                    p[2] = r >> 16;
+                }
+            }
+        }
+    }
+}
+
+static void
+suite_invert(const double m[3][3], double inv[3][3])
+{
+    double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                 m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                 m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+
+    for (int i=0; i<3; ++i) {
+        for (int j=0; j<3; ++j) {
+            // Cofactor of (j, i), transposed
+            int r0 = (j + 1) % 3, r1 = (j + 2) % 3, c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+            inv[i][j] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) / det;
+        }
+    }
+}
+
+static double
+suite_lab_f(double t)
+{
+    return (t > 216.0 / 24389.0) ? cbrt(t) : (24389.0 / 27.0 * t + 16.0) / 116.0;
+}
+
+// Opponent channels of an image, blurred with the spread of each channel
+static void
+suite_opponent(const uint8_t *rgb, double *planes)
+{
+    static double linear[256];
+    if (linear[255] == 0.0) {
+        for (int i=0; i<256; ++i) {
+            double v = i / 255.0;
+            linear[i] = (v <= 0.04045) ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+        }
+    }
+
+    for (int i=0; i<SUITE_PIXELS; ++i) {
+        double xyz[3];
+        for (int r=0; r<3; ++r) {
+            xyz[r] = 0.0;
+            for (int c=0; c<3; ++c) {
+                xyz[r] += SUITE_XYZ[r][c] * linear[rgb[3 * i + c]];
+            }
+        }
+        for (int r=0; r<3; ++r) {
+            planes[r * SUITE_PIXELS + i] = SUITE_OPPONENT[r][0] * xyz[0] +
+                SUITE_OPPONENT[r][1] * xyz[1] + SUITE_OPPONENT[r][2] * xyz[2];
+        }
+    }
+
+    static double tmp[SUITE_PIXELS];
+    for (int r=0; r<3; ++r) {
+        double sigma = SUITE_SPREAD[r] * SUITE_SAMPLES_PER_DEGREE / sqrt(2.0);
+        int radius = (int)ceil(3.0 * sigma);
+
+        double kernel[64];
+        double sum = 0.0;
+        for (int k=-radius; k<=radius; ++k) {
+            kernel[k + radius] = exp(-0.5 * k * k / (sigma * sigma));
+            sum += kernel[k + radius];
+        }
+        for (int k=0; k<=2*radius; ++k) {
+            kernel[k] /= sum;
+        }
+
+        // Separable, borders clamped
+        double *plane = planes + r * SUITE_PIXELS;
+        for (int pass=0; pass<2; ++pass) {
+            const double *src = (pass == 0) ? plane : tmp;
+            double *dst = (pass == 0) ? tmp : plane;
+            for (int y=0; y<SUITE_SIZE; ++y) {
+                for (int x=0; x<SUITE_SIZE; ++x) {
+                    double v = 0.0;
+                    for (int k=-radius; k<=radius; ++k) {
+                        int xx = x, yy = y;
+                        if (pass == 0) {
+                            xx = (x + k < 0) ? 0 : ((x + k >= SUITE_SIZE) ? SUITE_SIZE - 1 : x + k);
+                        } else {
+                            yy = (y + k < 0) ? 0 : ((y + k >= SUITE_SIZE) ? SUITE_SIZE - 1 : y + k);
+                        }
+                        v += kernel[k + radius] * src[yy * SUITE_SIZE + xx];
+                    }
+                    dst[y * SUITE_SIZE + x] = v;
+                }
+            }
+        }
+    }
+}
+
+static void
+suite_lab(const double *planes, double *lab)
+{
+    static double inverse[3][3];
+    if (inverse[0][0] == 0.0) {
+        suite_invert(SUITE_OPPONENT, inverse);
+    }
+
+    for (int i=0; i<SUITE_PIXELS; ++i) {
+        double f[3];
+        for (int r=0; r<3; ++r) {
+            double v = inverse[r][0] * planes[i] + inverse[r][1] * planes[SUITE_PIXELS + i] +
+                inverse[r][2] * planes[2 * SUITE_PIXELS + i];
+            f[r] = suite_lab_f(v / SUITE_WHITE[r]);
+        }
+
+        lab[3 * i + 0] = 116.0 * f[1] - 16.0;
+        lab[3 * i + 1] = 500.0 * (f[0] - f[1]);
+        lab[3 * i + 2] = 200.0 * (f[1] - f[2]);
+    }
+}
+
+static int
+suite_compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void
+suite_quality(const uint8_t *source, const uint8_t *result, struct SuiteQuality *quality)
+{
+    double sum = 0.0;
+    for (int i=0; i<3 * SUITE_PIXELS; ++i) {
+        double d = source[i] - result[i];
+        sum += d * d;
+    }
+    double mse = sum / (3 * SUITE_PIXELS);
+    quality->psnr = (mse > 0.0) ? 10.0 * log10(255.0 * 255.0 / mse) : INFINITY;
+
+    static double planes[3 * SUITE_PIXELS];
+    static double lab_source[3 * SUITE_PIXELS];
+    static double lab_result[3 * SUITE_PIXELS];
+    suite_opponent(source, planes);
+    suite_lab(planes, lab_source);
+    suite_opponent(result, planes);
+    suite_lab(planes, lab_result);
+
+    double delta = 0.0;
+    for (int i=0; i<SUITE_PIXELS; ++i) {
+        double dl = lab_source[3 * i + 0] - lab_result[3 * i + 0];
+        double da = lab_source[3 * i + 1] - lab_result[3 * i + 1];
+        double db = lab_source[3 * i + 2] - lab_result[3 * i + 2];
+        delta += sqrt(dl * dl + da * da + db * db);
+    }
+    quality->scielab = delta / SUITE_PIXELS;
+
+    static uint32_t colors[SUITE_PIXELS];
+    for (int i=0; i<SUITE_PIXELS; ++i) {
+        colors[i] = result[3 * i] | (result[3 * i + 1] << 8) | (result[3 * i + 2] << 16);
+    }
+    qsort(colors, SUITE_PIXELS, sizeof(uint32_t), suite_compare_u32);
+    quality->colors = 1;
+    for (int i=1; i<SUITE_PIXELS; ++i) {
+        quality->colors += (colors[i] != colors[i - 1]);
+    }
+}
+
+static void
+suite_json_string(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (; *str; ++str) {
+        if (*str == '"' || *str == '\\') {
+            fprintf(fp, "\\%c", *str);
+        } else if ((unsigned char)*str < 0x20) {
+            fprintf(fp, "\\u%04x", *str);
+        } else {
+            fputc(*str, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+// JSON has no infinity, a lossless result is reported as null
+static void
+suite_json_number(FILE *fp, double value)
+{
+    if (isfinite(value)) {
+        fprintf(fp, "%.4f", value);
+    } else {
+        fprintf(fp, "null");
+    }
+}
+
+// Quantizes an image runs times, returns the best time
+static double
+suite_run(struct SuiteQuantizer *quantizer, const uint8_t *source, uint8_t *rgb, int colors, int runs)
+{
+    static uint32_t rgba[SUITE_PIXELS];
+    double best = INFINITY;
+
+    for (int run=0; run<runs; ++run) {
+        double start = suite_now();
+
+        if (quantizer->kind == SUITE_SCOLORQ) {
+            memcpy(rgb, source, 3 * SUITE_PIXELS);
+            if (scolorq_quantize(quantizer->ctx, SUITE_SIZE, SUITE_SIZE, rgb, colors, NULL) != 0) {
+                fprintf(stderr, "%s failed\n", quantizer->name);
+                exit(1);
+            }
+        } else {
+            for (int i=0; i<SUITE_PIXELS; ++i) {
+                rgba[i] = 0xFF000000 | source[3 * i] | (source[3 * i + 1] << 8) | (source[3 * i + 2] << 16);
+            }
+            quantize_fast(rgba, NULL, SUITE_SIZE, SUITE_SIZE, colors, &quantizer->options);
+            for (int i=0; i<SUITE_PIXELS; ++i) {
+                for (int c=0; c<3; ++c) {
+                    rgb[3 * i + c] = (rgba[i] >> (8 * c)) & 0xFF;
+                }
+            }
+        }
+
+        double time = suite_now() - start;
+        if (time < best) {
+            best = time;
+        }
+    }
+
+    return best;
+}
+
+static int
+suite_quantizers(struct SuiteQuantizer *quantizers)
+{
+    int count = 0;
+
+    static const struct {
+        const char *name;
+        int precision;
+        int threads;
+    } scolorq[] = {
+        { "scolorq", SCOLORQ_PRECISION_FLOAT, 1 },
+        { "scolorq double", SCOLORQ_PRECISION_DOUBLE, 1 },
+        { "scolorq all cores", SCOLORQ_PRECISION_FLOAT, 0 },
+    };
+
+    for (int i=0; i<(int)(sizeof(scolorq)/sizeof(scolorq[0])); ++i) {
+        struct SuiteQuantizer *quantizer = &quantizers[count++];
+        memset(quantizer, 0, sizeof(*quantizer));
+        snprintf(quantizer->name, sizeof(quantizer->name), "%s", scolorq[i].name);
+        quantizer->kind = SUITE_SCOLORQ;
+        quantizer->precision = scolorq[i].precision;
+        quantizer->threads = scolorq[i].threads;
+    }
+
+    for (int dither=0; dither<QUANTIZE_DITHER_COUNT; ++dither) {
+        for (int method=0; method<QUANTIZE_PALETTE_COUNT; ++method) {
+            struct SuiteQuantizer *quantizer = &quantizers[count++];
+            memset(quantizer, 0, sizeof(*quantizer));
+            snprintf(quantizer->name, sizeof(quantizer->name), "%s, %s",
+                    quantize_palette_name(method), quantize_dither_name(dither));
+            quantizer->kind = SUITE_FAST;
+            quantizer->options.palette = method;
+            quantizer->options.dither = dither;
+        }
+    }
+
+    return count;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *json_filename = NULL;
+    int runs = 1;
+    int colors = 16;
+    bool skip_wads = false;
+
+    struct SuiteCorpus corpus = { NULL, 0 };
+
+    for (int i=1; i<argc; ++i) {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_filename = argv[++i];
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--colors") == 0 && i + 1 < argc) {
+            colors = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-wads") == 0) {
+            skip_wads = true;
+        } else if (argv[i][0] == '-') {
+            printf("Usage: %s [--json FILE] [--runs N] [--colors N] [--no-wads] [DATFILE...]\n\n"
+                   " --json FILE .. Also write the results as JSON\n"
+                   " --runs N ..... Quantize each image N times and report the best time (default: 1)\n"
+                   " --colors N ... Palette size, 2 to %d (default: 16)\n"
+                   " --no-wads .... Do not load the default skins from the WADs in the current folder\n"
+                   " DATFILE ...... ship.dat files or savegames (16034453) to add to the corpus\n",
+                   argv[0], QUANTIZE_MAX_COLORS);
+            return 1;
+        } else {
+            suite_add_file(&corpus, argv[i]);
+        }
+    }
+
+    if (runs < 1 || colors < 2 || colors > QUANTIZE_MAX_COLORS) {
+        fprintf(stderr, "Invalid --runs or --colors\n");
+        return 1;
+    }
+
+    if (!skip_wads && mount_wad("editor.wad")) {
+        parse_file_lines("data/editor/wadlist.txt", suite_mount_line, NULL);
+
+        int before = corpus.count;
+        parse_file_lines("data/editor/list.txt", suite_team_line, &corpus);
+        if (corpus.count == before) {
+            printf("No default skins (fedata.wad missing?), using the other images only\n");
+        }
+    }
+
+    suite_add_synthetic(&corpus);
+
+    struct SuiteQuantizer quantizers[3 + QUANTIZE_PALETTE_COUNT * QUANTIZE_DITHER_COUNT];
+    int num_quantizers = suite_quantizers(quantizers);
+
+    FILE *json = NULL;
+    if (json_filename != NULL) {
+        json = fopen(json_filename, "w");
+        if (json == NULL) {
+            fprintf(stderr, "Could not write %s\n", json_filename);
+            return 1;
+        }
+
+        fprintf(json, "{\n  \"size\": %d,\n  \"colors\": %d,\n  \"runs\": %d,\n  \"kernel\": ", SUITE_SIZE, colors, runs);
+        suite_json_string(json, quantize_kernel_name());
+        fprintf(json, ",\n  \"results\": [");
+    }
+
+    printf("%d images, %d colors, %dx%d, best of %d run(s), fast quantizers: %s\n\n",
+            corpus.count, colors, SUITE_SIZE, SUITE_SIZE, runs, quantize_kernel_name());
+    printf("%-28s %-24s %9s %7s %8s %6s %6s %9s\n",
+            "quantizer", "image", "time", "PSNR", "S-CIELAB", "colors", "allocs", "peak");
+
+    static uint8_t rgb[3 * SUITE_PIXELS];
+    bool first = true;
+    for (int q=0; q<num_quantizers; ++q) {
+        struct SuiteQuantizer *quantizer = &quantizers[q];
+        if (quantizer->kind == SUITE_SCOLORQ) {
+            quantizer->ctx = scolorq_ctx_new(SCOLORQ_DEFAULT_SEED);
+            scolorq_ctx_set_precision(quantizer->ctx, quantizer->precision);
+            scolorq_ctx_set_threads(quantizer->ctx, quantizer->threads);
+        }
+
+        for (int i=0; i<corpus.count; ++i) {
+            const struct SuiteImage *image = &corpus.images[i];
+
+            // Includes the buffers kept by the context
+            memstat_reset_peak(MEMSTAT_QUANTIZER);
+            size_t allocations = memstat_allocations(MEMSTAT_QUANTIZER);
+
+            double time = suite_run(quantizer, image->rgb, rgb, colors, runs);
+
+            // Per run, the first run of a context includes creating its buffers
+            allocations = (memstat_allocations(MEMSTAT_QUANTIZER) - allocations + runs - 1) / runs;
+            size_t peak = memstat_peak(MEMSTAT_QUANTIZER);
+
+            struct SuiteQuality quality;
+            suite_quality(image->rgb, rgb, &quality);
+
+            quantizer->time += time;
+            quantizer->psnr += isfinite(quality.psnr) ? quality.psnr : 99.0;
+            quantizer->scielab += quality.scielab;
+            quantizer->count++;
+
+            char peak_text[32];
+            memstat_format_bytes(peak, peak_text, sizeof(peak_text));
+            printf("%-28.28s %-24.24s %7.2fms %7.2f %8.3f %6d %6zu %9s\n", quantizer->name, image->name,
+                    time * 1000.0, quality.psnr, quality.scielab, quality.colors, allocations, peak_text);
+
+            if (json == NULL) {
+                continue;
+            }
+
+            fprintf(json, "%s\n    {\"image\": ", first ? "" : ",");
+            first = false;
+            suite_json_string(json, image->name);
+            fprintf(json, ", \"source\": ");
+            suite_json_string(json, image->source);
+            fprintf(json, ", \"quantizer\": ");
+            suite_json_string(json, quantizer->name);
+            fprintf(json, ", \"time_ms\": %.4f, \"psnr\": ", time * 1000.0);
+            suite_json_number(json, quality.psnr);
+            fprintf(json, ", \"scielab\": ");
+            suite_json_number(json, quality.scielab);
+            fprintf(json, ", \"colors\": %d, \"allocations\": %zu, \"peak_bytes\": %zu", quality.colors, allocations, peak);
+
+            if (quantizer->kind == SUITE_SCOLORQ) {
+                struct scolorq_stats stats;
+                scolorq_ctx_get_stats(quantizer->ctx, &stats);
+
+                fprintf(json, ", \"levels\": [");
+                for (int level=0; level<stats.levels; ++level) {
+                    const struct scolorq_level_stats *s = &stats.level[level];
+                    fprintf(json, "%s{\"width\": %d, \"height\": %d, \"temperatures\": %d, \"visits\": %lld, \"changes\": %lld}",
+                            level ? ", " : "", s->width, s->height, s->temperatures, s->visits, s->changes);
+                }
+                fprintf(json, "]");
+            }
+
+            fprintf(json, "}");
+        }
+
+        if (quantizer->ctx != NULL) {
+            scolorq_ctx_free(quantizer->ctx);
+            quantizer->ctx = NULL;
+        }
+        printf("\n");
+    }
+
+    // Lossless results count as 99 dB
+    printf("%-28s %9s %7s %8s\n", "mean", "time", "PSNR", "S-CIELAB");
+    for (int q=0; q<num_quantizers; ++q) {
+        const struct SuiteQuantizer *quantizer = &quantizers[q];
+        int count = quantizer->count ? quantizer->count : 1;
+        printf("%-28.28s %7.2fms %7.2f %8.3f\n", quantizer->name,
+                quantizer->time * 1000.0 / count, quantizer->psnr / count, quantizer->scielab / count);
+    }
+
+    if (json != NULL) {
+        fprintf(json, "\n  ],\n  \"summary\": [");
+        for (int q=0; q<num_quantizers; ++q) {
+            const struct SuiteQuantizer *quantizer = &quantizers[q];
+            int count = quantizer->count ? quantizer->count : 1;
+            fprintf(json, "%s\n    {\"quantizer\": ", q ? "," : "");
+            suite_json_string(json, quantizer->name);
+            fprintf(json, ", \"images\": %d, \"time_ms\": %.4f, \"psnr\": %.4f, \"scielab\": %.4f}", quantizer->count,
+                    quantizer->time * 1000.0 / count, quantizer->psnr / count, quantizer->scielab / count);
+        }
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+    }
+
+    free(corpus.images);
+
+    return 0;
+}
@@ -0,0 +1,247 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+/**
+ * Benchmark of the 4bpp codec (shipdat.c) against the previous
+ * implementations of load_shipdat() and encode_image(), which are kept
+ * here as the reference. Results are checked to be identical.
+ **/
+
+#include "shipdat.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_MATERIALS 3
+#define BENCH_LENGTH 24800
+#define BENCH_ITERATIONS 2000
+
+static double
+bench_now()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t
+bench_random()
+{
+    static uint32_t state = 0x12345678;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// Previous load_shipdat(), without the file format checks
+static uint32_t *
+reference_decode(const uint8_t *buffer, int index)
+{
+    uint32_t *result = malloc(sizeof(uint32_t) * 128 * 128);
+
+    const uint8_t *read_ptr = buffer + 32 + index * (4 * 16 + 128 * 128 / 2);
+    uint32_t *palette = malloc(4 * 16);
+    memcpy(palette, read_ptr, 4 * 16);
+    read_ptr += 4 * 16;
+
+    uint8_t *map = malloc(128 * 128 / 2);
+    memcpy(map, read_ptr, 128 * 128 / 2);
+
+    for (int y=0; y<128; ++y) {
+        for (int x=0; x<128; ++x) {
+            uint8_t pixel = map[(y * 128 + x) / 2];
+            pixel = (x % 2 == 0) ? (pixel >> 4) : (pixel & 0x0F);
+            result[y * 128 + x] = palette[pixel];
+        }
+    }
+
+    free(map);
+    free(palette);
+    return result;
+}
+
+static int
+reference_nearest(const uint32_t *palette, int palette_size, uint32_t pixel)
+{
+    int result = 0;
+    int best = -1;
+
+    for (int i=0; i<palette_size; ++i) {
+        int distance = 0;
+        for (int c=0; c<4; ++c) {
+            int d = (int)((palette[i] >> (8 * c)) & 0xFF) - (int)((pixel >> (8 * c)) & 0xFF);
+            distance += d * d;
+        }
+
+        if (best == -1 || distance < best) {
+            best = distance;
+            result = i;
+        }
+    }
+
+    return result;
+}
+
+// Previous encode_image()
+static bool
+reference_encode(uint8_t *buf, int index, const uint32_t *pixels, const uint8_t *coverage)
+{
+    size_t palette_offset = 32 + index * (4 * 16 + 128 * 128 / 2);
+    uint32_t *palette = (uint32_t *)(buf + palette_offset);
+    uint8_t *image = buf + palette_offset + 4 * 16;
+    uint32_t palette_size = 0;
+
+    memset(buf + palette_offset, 0, 4 * 16 + 128 * 128 / 2);
+
+    for (int pass=0; pass<2; ++pass) {
+        bool visible = (pass == 0);
+
+        for (int i=0; i<128*128; ++i) {
+            bool texel_visible = (coverage == NULL || coverage[i] != 0);
+            if (texel_visible != visible) {
+                continue;
+            }
+
+            int pixel_index = -1;
+            for (uint32_t j=0; j<palette_size; ++j) {
+                if (palette[j] == pixels[i]) {
+                    pixel_index = j;
+                    break;
+                }
+            }
+
+            if (pixel_index == -1 && !visible && palette_size == 16) {
+                pixel_index = reference_nearest(palette, palette_size, pixels[i]);
+            }
+
+            if (pixel_index == -1) {
+                pixel_index = palette_size++;
+                palette[pixel_index] = pixels[i];
+                if (palette_size > 16) {
+                    return false;
+                }
+            }
+
+            image[i / 2] |= (i % 2 == 0) ? (pixel_index << 4) : pixel_index;
+        }
+    }
+
+    return true;
+}
+
+static void
+bench_fill(uint8_t *buffer, uint32_t **images, uint8_t *coverage)
+{
+    memset(buffer, 0, BENCH_LENGTH);
+    for (size_t i=SHIPDAT_HEADER_SIZE; i<BENCH_LENGTH; ++i) {
+        buffer[i] = bench_random();
+    }
+
+    for (int i=0; i<128*128; ++i) {
+        coverage[i] = (bench_random() % 4) != 0;
+    }
+
+    for (int m=0; m<BENCH_MATERIALS; ++m) {
+        images[m] = reference_decode(buffer, m);
+
+        // Some colors only on uncovered texels, which need the nearest color
+        for (int k=0; k<64; ++k) {
+            int i = bench_random() % (128 * 128);
+            if (!coverage[i]) {
+                images[m][i] = bench_random();
+            }
+        }
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    static uint8_t buffer[BENCH_LENGTH];
+    static uint8_t encoded[BENCH_LENGTH];
+    static uint8_t reference[BENCH_LENGTH];
+    static uint8_t coverage[128 * 128];
+    static uint32_t decoded[128 * 128];
+    uint32_t *images[BENCH_MATERIALS];
+
+    bench_fill(buffer, images, coverage);
+
+    printf("shipdat kernel: %s\n", shipdat_kernel_name());
+
+    // Correctness
+    bool ok = true;
+    for (int m=0; m<BENCH_MATERIALS; ++m) {
+        uint32_t *expected = reference_decode(buffer, m);
+        ok = ok && shipdat_decode_material(buffer, BENCH_LENGTH, m, decoded, NULL);
+        ok = ok && memcmp(decoded, expected, sizeof(decoded)) == 0;
+        free(expected);
+
+        ok = ok && reference_encode(reference, m, images[m], coverage);
+        ok = ok && shipdat_encode_material(encoded, BENCH_LENGTH, m, images[m], coverage);
+    }
+    ok = ok && memcmp(encoded, reference, BENCH_LENGTH) == 0;
+
+    printf("results identical: %s\n", ok ? "yes" : "NO");
+
+    double start = bench_now();
+    for (int i=0; i<BENCH_ITERATIONS; ++i) {
+        free(reference_decode(buffer, i % BENCH_MATERIALS));
+    }
+    double reference_decode_time = bench_now() - start;
+
+    start = bench_now();
+    for (int i=0; i<BENCH_ITERATIONS; ++i) {
+        shipdat_decode_material(buffer, BENCH_LENGTH, i % BENCH_MATERIALS, decoded, NULL);
+    }
+    double decode_time = bench_now() - start;
+
+    start = bench_now();
+    for (int i=0; i<BENCH_ITERATIONS; ++i) {
+        reference_encode(reference, i % BENCH_MATERIALS, images[i % BENCH_MATERIALS], coverage);
+    }
+    double reference_encode_time = bench_now() - start;
+
+    start = bench_now();
+    for (int i=0; i<BENCH_ITERATIONS; ++i) {
+        shipdat_encode_material(encoded, BENCH_LENGTH, i % BENCH_MATERIALS, images[i % BENCH_MATERIALS], coverage);
+    }
+    double encode_time = bench_now() - start;
+
+    printf("decode: %8.2f us/image (previous: %8.2f us/image, %.1fx)\n",
+            decode_time * 1e6 / BENCH_ITERATIONS, reference_decode_time * 1e6 / BENCH_ITERATIONS,
+            reference_decode_time / decode_time);
+    printf("encode: %8.2f us/image (previous: %8.2f us/image, %.1fx)\n",
+            encode_time * 1e6 / BENCH_ITERATIONS, reference_encode_time * 1e6 / BENCH_ITERATIONS,
+            reference_encode_time / encode_time);
+
+    for (int m=0; m<BENCH_MATERIALS; ++m) {
+        free(images[m]);
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,450 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "brush.h"
+#include "material.h"
+#include "indexed.h"
+#include "memstat.h"
+
+#include <string.h>
+#include <math.h>
+
+#if defined(__AVX2__)
+#define BRUSH_KERNEL_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BRUSH_KERNEL_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define BRUSH_KERNEL_NEON
+#include <arm_neon.h>
+#endif
+
+/**
+ * All kernels compute the same as material_plot():
+ *
+ *   a = (alpha < drawn) ? 0 : alpha
+ *   pixel.rgba = (color.rgba * a + pixel.rgba * (255 - a)) / 255
+ *   pixel.a |= opaque.a
+ *   drawn += a (wrapping around)
+ *
+ * Color alpha is always 255, so on layers (opaque = 0) this is "over" with
+ * premultiplied alpha, and on the base (opaque = 0xFF000000) alpha stays 255.
+ *
+ * The division is done as (t + 1 + (t >> 8)) >> 8, which is exact for
+ * all 0 <= t <= 255 * 255.
+ **/
+
+static inline uint32_t
+brush_div255(uint32_t t)
+{
+    return (t + 1 + (t >> 8)) >> 8;
+}
+
+static void
+brush_blend_scalar(uint32_t *pixels, uint8_t *drawn, const uint32_t *index, const uint8_t *alpha, size_t count, uint32_t color, uint32_t opaque)
+{
+    for (size_t i=0; i<count; ++i) {
+        uint32_t idx = index[i];
+        uint32_t a = (alpha[i] < drawn[idx]) ? 0 : alpha[i];
+        uint32_t pixel = pixels[idx];
+
+        uint32_t result = opaque;
+        for (int shift=0; shift<32; shift+=8) {
+            uint32_t c1 = (color >> shift) & 0xFF;
+            uint32_t c2 = (pixel >> shift) & 0xFF;
+            result |= brush_div255(c1 * a + c2 * (255 - a)) << shift;
+        }
+
+        pixels[idx] = result;
+        drawn[idx] += a;
+    }
+}
+
+#if defined(BRUSH_KERNEL_SSE2)
+static size_t
+brush_blend_simd(uint32_t *pixels, uint8_t *drawn, const uint32_t *index, const uint8_t *alpha, size_t count, uint32_t color, uint32_t opaque)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i c255 = _mm_set1_epi16(255);
+    const __m128i opaque4 = _mm_set1_epi32(opaque);
+    const __m128i color16 = _mm_unpacklo_epi8(_mm_set1_epi32(color), zero);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const uint32_t *idx = index + i;
+
+        __m128i a = _mm_set_epi32(alpha[i+3], alpha[i+2], alpha[i+1], alpha[i+0]);
+        __m128i d = _mm_set_epi32(drawn[idx[3]], drawn[idx[2]], drawn[idx[1]], drawn[idx[0]]);
+        __m128i p = _mm_set_epi32(pixels[idx[3]], pixels[idx[2]], pixels[idx[1]], pixels[idx[0]]);
+
+        // already drawn with a stronger alpha in this stroke -> don't blend
+        a = _mm_andnot_si128(_mm_cmpgt_epi32(d, a), a);
+        d = _mm_add_epi32(d, a);
+
+        // replicate alpha into all four bytes of each pixel
+        __m128i a4 = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+        a4 = _mm_or_si128(a4, _mm_slli_epi32(a4, 16));
+
+        __m128i a_lo = _mm_unpacklo_epi8(a4, zero);
+        __m128i a_hi = _mm_unpackhi_epi8(a4, zero);
+
+        __m128i t_lo = _mm_add_epi16(_mm_mullo_epi16(color16, a_lo),
+                _mm_mullo_epi16(_mm_unpacklo_epi8(p, zero), _mm_sub_epi16(c255, a_lo)));
+        __m128i t_hi = _mm_add_epi16(_mm_mullo_epi16(color16, a_hi),
+                _mm_mullo_epi16(_mm_unpackhi_epi8(p, zero), _mm_sub_epi16(c255, a_hi)));
+
+        t_lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t_lo, one), _mm_srli_epi16(t_lo, 8)), 8);
+        t_hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t_hi, one), _mm_srli_epi16(t_hi, 8)), 8);
+
+        p = _mm_or_si128(_mm_packus_epi16(t_lo, t_hi), opaque4);
+
+        uint32_t out_p[4];
+        uint32_t out_d[4];
+        _mm_storeu_si128((__m128i *)out_p, p);
+        _mm_storeu_si128((__m128i *)out_d, d);
+
+        for (int k=0; k<4; ++k) {
+            pixels[idx[k]] = out_p[k];
+            drawn[idx[k]] = (uint8_t)out_d[k];
+        }
+    }
+
+    return i;
+}
+#elif defined(BRUSH_KERNEL_AVX2)
+static size_t
+brush_blend_simd(uint32_t *pixels, uint8_t *drawn, const uint32_t *index, const uint8_t *alpha, size_t count, uint32_t color, uint32_t opaque)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i c255 = _mm256_set1_epi16(255);
+    const __m256i opaque8 = _mm256_set1_epi32(opaque);
+    const __m256i replicate = _mm256_set1_epi32(0x01010101);
+    const __m256i color16 = _mm256_unpacklo_epi8(_mm256_set1_epi32(color), zero);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const uint32_t *idx = index + i;
+
+        __m256i vidx = _mm256_loadu_si256((const __m256i *)idx);
+        __m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(alpha + i)));
+        __m256i d = _mm256_set_epi32(drawn[idx[7]], drawn[idx[6]], drawn[idx[5]], drawn[idx[4]],
+                drawn[idx[3]], drawn[idx[2]], drawn[idx[1]], drawn[idx[0]]);
+        __m256i p = _mm256_i32gather_epi32((const int *)pixels, vidx, 4);
+
+        // already drawn with a stronger alpha in this stroke -> don't blend
+        a = _mm256_andnot_si256(_mm256_cmpgt_epi32(d, a), a);
+        d = _mm256_add_epi32(d, a);
+
+        // replicate alpha into all four bytes of each pixel
+        __m256i a4 = _mm256_mullo_epi32(a, replicate);
+
+        __m256i a_lo = _mm256_unpacklo_epi8(a4, zero);
+        __m256i a_hi = _mm256_unpackhi_epi8(a4, zero);
+
+        __m256i t_lo = _mm256_add_epi16(_mm256_mullo_epi16(color16, a_lo),
+                _mm256_mullo_epi16(_mm256_unpacklo_epi8(p, zero), _mm256_sub_epi16(c255, a_lo)));
+        __m256i t_hi = _mm256_add_epi16(_mm256_mullo_epi16(color16, a_hi),
+                _mm256_mullo_epi16(_mm256_unpackhi_epi8(p, zero), _mm256_sub_epi16(c255, a_hi)));
+
+        t_lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(t_lo, one), _mm256_srli_epi16(t_lo, 8)), 8);
+        t_hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(t_hi, one), _mm256_srli_epi16(t_hi, 8)), 8);
+
+        // unpack/pack work within 128-bit lanes, so the pixel order is preserved
+        p = _mm256_or_si256(_mm256_packus_epi16(t_lo, t_hi), opaque8);
+
+        uint32_t out_p[8];
+        uint32_t out_d[8];
+        _mm256_storeu_si256((__m256i *)out_p, p);
+        _mm256_storeu_si256((__m256i *)out_d, d);
+
+        for (int k=0; k<8; ++k) {
+            pixels[idx[k]] = out_p[k];
+            drawn[idx[k]] = (uint8_t)out_d[k];
+        }
+    }
+
+    return i;
+}
+#elif defined(BRUSH_KERNEL_NEON)
+static size_t
+brush_blend_simd(uint32_t *pixels, uint8_t *drawn, const uint32_t *index, const uint8_t *alpha, size_t count, uint32_t color, uint32_t opaque)
+{
+    const uint16x8_t one = vdupq_n_u16(1);
+    const uint32x4_t opaque4 = vdupq_n_u32(opaque);
+    const uint8x8_t color8 = vreinterpret_u8_u32(vdup_n_u32(color));
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const uint32_t *idx = index + i;
+
+        uint32_t tmp_a[4] = { alpha[i+0], alpha[i+1], alpha[i+2], alpha[i+3] };
+        uint32_t tmp_d[4] = { drawn[idx[0]], drawn[idx[1]], drawn[idx[2]], drawn[idx[3]] };
+        uint32_t tmp_p[4] = { pixels[idx[0]], pixels[idx[1]], pixels[idx[2]], pixels[idx[3]] };
+
+        uint32x4_t a = vld1q_u32(tmp_a);
+        uint32x4_t d = vld1q_u32(tmp_d);
+        uint8x16_t p = vreinterpretq_u8_u32(vld1q_u32(tmp_p));
+
+        // already drawn with a stronger alpha in this stroke -> don't blend
+        a = vbicq_u32(a, vcgtq_u32(d, a));
+        d = vaddq_u32(d, a);
+
+        // replicate alpha into all four bytes of each pixel
+        uint8x16_t a4 = vreinterpretq_u8_u32(vmulq_n_u32(a, 0x01010101));
+        uint8x16_t ia4 = vmvnq_u8(a4);
+
+        uint16x8_t t_lo = vmull_u8(color8, vget_low_u8(a4));
+        t_lo = vmlal_u8(t_lo, vget_low_u8(p), vget_low_u8(ia4));
+        uint16x8_t t_hi = vmull_u8(color8, vget_high_u8(a4));
+        t_hi = vmlal_u8(t_hi, vget_high_u8(p), vget_high_u8(ia4));
+
+        t_lo = vaddq_u16(vaddq_u16(t_lo, one), vshrq_n_u16(t_lo, 8));
+        t_hi = vaddq_u16(vaddq_u16(t_hi, one), vshrq_n_u16(t_hi, 8));
+
+        uint8x16_t result = vcombine_u8(vshrn_n_u16(t_lo, 8), vshrn_n_u16(t_hi, 8));
+        vst1q_u32(tmp_p, vorrq_u32(vreinterpretq_u32_u8(result), opaque4));
+        vst1q_u32(tmp_d, d);
+
+        for (int k=0; k<4; ++k) {
+            pixels[idx[k]] = tmp_p[k];
+            drawn[idx[k]] = (uint8_t)tmp_d[k];
+        }
+    }
+
+    return i;
+}
+#endif
+
+const char *
+brush_kernel_name()
+{
+#if defined(BRUSH_KERNEL_AVX2)
+    return "avx2";
+#elif defined(BRUSH_KERNEL_SSE2)
+    return "sse2";
+#elif defined(BRUSH_KERNEL_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+void
+brush_blend_texels(uint32_t *pixels, uint8_t *drawn, const uint32_t *index, const uint8_t *alpha, size_t count, uint32_t color, uint32_t opaque)
+{
+    size_t done = 0;
+
+#if defined(BRUSH_KERNEL_AVX2) || defined(BRUSH_KERNEL_SSE2) || defined(BRUSH_KERNEL_NEON)
+    // SIMD kernels require all texels to be distinct
+    done = brush_blend_simd(pixels, drawn, index, alpha, count, color, opaque);
+#endif
+
+    brush_blend_scalar(pixels, drawn, index + done, alpha + done, count - done, color, opaque);
+}
+
+struct Brush *
+brush_new()
+{
+    return calloc(1, sizeof(struct Brush));
+}
+
+static void
+brush_entries_free(struct BrushEntries *entries)
+{
+    free(entries->index);
+    free(entries->alpha);
+    memset(entries, 0, sizeof(*entries));
+}
+
+void
+brush_free(struct Brush *brush)
+{
+    for (int i=0; i<BRUSH_MAX_MATERIALS; ++i) {
+        struct BrushTarget *target = &brush->targets[i];
+        brush_entries_free(&target->first);
+        brush_entries_free(&target->repeat);
+        free(target->stamp);
+        memstat_sub(MEMSTAT_SCENE, sizeof(uint32_t) * target->stamp_length);
+    }
+
+    free(brush->mask.alpha);
+    free(brush->mask.alpha_int);
+    free(brush);
+}
+
+uint8_t
+brush_mask_alpha_int(const struct BrushMask *mask, float alpha)
+{
+    if (alpha > 1.f) {
+        return 0;
+    }
+
+    alpha = 1.f - alpha;
+    alpha *= mask->alpha_factor;
+    return 255 * alpha;
+}
+
+const struct BrushMask *
+brush_mask(struct Brush *brush, float radius, float alpha_factor)
+{
+    struct BrushMask *mask = &brush->mask;
+
+    if (mask->alpha != NULL && mask->radius == radius && mask->alpha_factor == alpha_factor) {
+        return mask;
+    }
+
+    mask->radius = radius;
+    mask->alpha_factor = alpha_factor;
+    mask->grow = 2 * radius;
+    mask->size = 2 * mask->grow + 1;
+
+    mask->alpha = realloc(mask->alpha, sizeof(float) * mask->size * mask->size);
+    mask->alpha_int = realloc(mask->alpha_int, sizeof(uint8_t) * mask->size * mask->size);
+
+    for (int dy=-mask->grow; dy<1+mask->grow; ++dy) {
+        for (int dx=-mask->grow; dx<1+mask->grow; ++dx) {
+            int i = (dy + mask->grow) * mask->size + (dx + mask->grow);
+
+            // Same expressions as in plot_here() and material_plot()
+            float alpha = sqrtf((((float)dx*(float)dx) + ((float)dy*(float)dy))) / radius;
+            mask->alpha[i] = alpha;
+            mask->alpha_int[i] = brush_mask_alpha_int(mask, alpha);
+        }
+    }
+
+    return mask;
+}
+
+void
+brush_begin(struct Brush *brush, uint32_t color)
+{
+    brush->color = 0xFF000000 | color;
+
+    if (++brush->serial == 0) {
+        // Serial wrapped around, old stamps could now match again
+        for (int i=0; i<BRUSH_MAX_MATERIALS; ++i) {
+            struct BrushTarget *target = &brush->targets[i];
+            if (target->stamp) {
+                memset(target->stamp, 0, sizeof(uint32_t) * target->stamp_length);
+            }
+        }
+        brush->serial = 1;
+    }
+
+    for (int i=0; i<BRUSH_MAX_MATERIALS; ++i) {
+        brush->targets[i].material = NULL;
+        brush->targets[i].first.count = 0;
+        brush->targets[i].repeat.count = 0;
+    }
+}
+
+static void
+brush_entries_add(struct BrushEntries *entries, uint32_t index, uint8_t alpha)
+{
+    if (entries->count == entries->capacity) {
+        entries->capacity = entries->capacity ? 2 * entries->capacity : 1024;
+        entries->index = realloc(entries->index, sizeof(uint32_t) * entries->capacity);
+        entries->alpha = realloc(entries->alpha, sizeof(uint8_t) * entries->capacity);
+    }
+
+    entries->index[entries->count] = index;
+    entries->alpha[entries->count] = alpha;
+    ++entries->count;
+}
+
+void
+brush_add(struct Brush *brush, struct Material *material, int u, int v, uint8_t alpha_int)
+{
+    if (material->index < 0 || material->index >= BRUSH_MAX_MATERIALS) {
+        return;
+    }
+
+    struct BrushTarget *target = &brush->targets[material->index];
+
+    if (target->material != material) {
+        target->material = material;
+
+        size_t length = material->width * material->height;
+        if (target->stamp_length != length) {
+            memstat_sub(MEMSTAT_SCENE, sizeof(uint32_t) * target->stamp_length);
+            free(target->stamp);
+            target->stamp = calloc(length, sizeof(uint32_t));
+            target->stamp_length = length;
+            memstat_add(MEMSTAT_SCENE, sizeof(uint32_t) * target->stamp_length);
+        }
+    }
+
+    uint32_t index = v + u * material->width;
+
+    if (target->stamp[index] != brush->serial) {
+        target->stamp[index] = brush->serial;
+        brush_entries_add(&target->first, index, alpha_int);
+    } else {
+        brush_entries_add(&target->repeat, index, alpha_int);
+    }
+}
+
+void
+brush_apply(struct Brush *brush)
+{
+    for (int i=0; i<BRUSH_MAX_MATERIALS; ++i) {
+        struct BrushTarget *target = &brush->targets[i];
+        struct Material *material = target->material;
+
+        if (material == NULL || target->first.count == 0) {
+            continue;
+        }
+
+        if (material->indices != NULL) {
+            uint8_t color = indexed_nearest(material->palette, material->palette_count, brush->color);
+
+            // Repeated hits come after the first ones, like below
+            indexed_paint_texels(material->indices, material->pixels_drawn, material->width,
+                    target->first.index, target->first.alpha, target->first.count, color);
+            indexed_paint_texels(material->indices, material->pixels_drawn, material->width,
+                    target->repeat.index, target->repeat.alpha, target->repeat.count, color);
+
+            material_touch_texels(material, target->first.index, target->first.count);
+            material->pixels_dirty = true;
+            continue;
+        }
+
+        uint32_t *pixels = (uint32_t *)material_surface(material);
+
+        // Layers above the base keep (premultiplied) alpha, the base stays opaque
+        uint32_t opaque = material_surface_is_layer(material) ? 0 : 0xFF000000;
+
+        brush_blend_texels(pixels, material->pixels_drawn, target->first.index, target->first.alpha,
+                target->first.count, brush->color, opaque);
+
+        // Repeated hits depend on the result of earlier ones, so apply them in order
+        brush_blend_scalar(pixels, material->pixels_drawn, target->repeat.index, target->repeat.alpha,
+                target->repeat.count, brush->color, opaque);
+
+        material_touch_texels(material, target->first.index, target->first.count);
+        material->pixels_dirty = true;
+    }
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "shipmodelformat.h"
+
+/**
+ * Brush dab engine.
+ *
+ * The radial falloff of the pen is precomputed once per (radius, alpha factor).
+ * Texels hit by a dab are collected per material and then blended in one go
+ * with a SIMD kernel (SSE2, AVX2 or NEON, chosen at compile time, with a scalar
+ * fallback). Results are bit-identical to material_plot().
+ **/
+
+#define BRUSH_MAX_MATERIALS 4
+
+struct BrushMask {
+    float radius;
+    float alpha_factor;
+
+    // Mask covers [-grow, +grow] in both directions, size = 2 * grow + 1
+    int grow;
+    int size;
+
+    // Distance from the center relative to the radius (> 1 means outside)
+    float *alpha;
+    // Blend factor as computed by material_plot()
+    uint8_t *alpha_int;
+};
+
+struct BrushEntries {
+    uint32_t *index;
+    uint8_t *alpha;
+    size_t count;
+    size_t capacity;
+};
+
+struct BrushTarget {
+    struct Material *material;
+
+    // First hit of each texel in this dab (texels are unique, can be blended in parallel)
+    struct BrushEntries first;
+    // Further hits of the same texels, blended afterwards in order
+    struct BrushEntries repeat;
+
+    // Dab serial number per texel, to detect repeated hits
+    uint32_t *stamp;
+    size_t stamp_length;
+};
+
+struct Brush {
+    struct BrushMask mask;
+
+    uint32_t color;
+    uint32_t serial;
+    struct BrushTarget targets[BRUSH_MAX_MATERIALS];
+};
+
+struct Brush *
+brush_new();
+
+void
+brush_free(struct Brush *brush);
+
+const struct BrushMask *
+brush_mask(struct Brush *brush, float radius, float alpha_factor);
+
+uint8_t
+brush_mask_alpha_int(const struct BrushMask *mask, float alpha);
+
+void
+brush_begin(struct Brush *brush, uint32_t color);
+
+void
+brush_add(struct Brush *brush, struct Material *material, int u, int v, uint8_t alpha_int);
+
+void
+brush_apply(struct Brush *brush);
+
+const char *
+brush_kernel_name();
+
+void
+brush_blend_texels(uint32_t *pixels, uint8_t *drawn, const uint32_t *index, const uint8_t *alpha, size_t count, uint32_t color, uint32_t opaque);
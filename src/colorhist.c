@@ -0,0 +1,250 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "colorhist.h"
+#include "memstat.h"
+
+#include <string.h>
+
+#define COLORHIST_INITIAL_CAPACITY 64
+
+static inline uint32_t
+colorhist_hash(uint32_t color)
+{
+    // Multiplicative hashing, the high bits are well mixed
+    return color * 2654435761u;
+}
+
+static inline uint32_t
+colorhist_slot(const struct ColorHistogram *hist, uint32_t color)
+{
+    uint32_t mask = hist->capacity - 1;
+    uint32_t slot = (colorhist_hash(color) >> 8) & mask;
+
+    while (hist->counts[slot] != 0 && hist->colors[slot] != color) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+static size_t
+colorhist_table_size(uint32_t capacity)
+{
+    return 2 * sizeof(uint32_t) * capacity;
+}
+
+static void
+colorhist_resize(struct ColorHistogram *hist, uint32_t capacity)
+{
+    uint32_t *colors = hist->colors;
+    uint32_t *counts = hist->counts;
+    uint32_t old_capacity = hist->capacity;
+
+    hist->colors = calloc(capacity, sizeof(uint32_t));
+    hist->counts = calloc(capacity, sizeof(uint32_t));
+    hist->capacity = capacity;
+
+    for (uint32_t i=0; i<old_capacity; ++i) {
+        if (counts[i] != 0) {
+            uint32_t slot = colorhist_slot(hist, colors[i]);
+            hist->colors[slot] = colors[i];
+            hist->counts[slot] = counts[i];
+        }
+    }
+
+    free(colors);
+    free(counts);
+
+    memstat_add(MEMSTAT_MATERIALS, colorhist_table_size(capacity));
+    memstat_sub(MEMSTAT_MATERIALS, colorhist_table_size(old_capacity));
+}
+
+static void
+colorhist_add(struct ColorHistogram *hist, uint32_t color)
+{
+    uint32_t slot = colorhist_slot(hist, color);
+    if (hist->counts[slot]++ != 0) {
+        return;
+    }
+
+    hist->colors[slot] = color;
+    if (++hist->distinct * 2 > hist->capacity) {
+        colorhist_resize(hist, hist->capacity * 2);
+    }
+}
+
+static void
+colorhist_remove(struct ColorHistogram *hist, uint32_t color)
+{
+    uint32_t mask = hist->capacity - 1;
+    uint32_t slot = colorhist_slot(hist, color);
+    if (hist->counts[slot] == 0 || --hist->counts[slot] != 0) {
+        return;
+    }
+
+    hist->distinct--;
+
+    // Backward shift deletion: move entries up that would not be found anymore
+    uint32_t hole = slot;
+    uint32_t next = (hole + 1) & mask;
+    while (hist->counts[next] != 0) {
+        uint32_t home = (colorhist_hash(hist->colors[next]) >> 8) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            hist->colors[hole] = hist->colors[next];
+            hist->counts[hole] = hist->counts[next];
+            hist->counts[next] = 0;
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+struct ColorHistogram *
+colorhist_new(const uint32_t *pixels, const uint8_t *coverage, int width, int height)
+{
+    struct ColorHistogram *hist = calloc(1, sizeof(struct ColorHistogram));
+
+    hist->capacity = COLORHIST_INITIAL_CAPACITY;
+    hist->colors = calloc(hist->capacity, sizeof(uint32_t));
+    hist->counts = calloc(hist->capacity, sizeof(uint32_t));
+
+    hist->coverage = coverage;
+    hist->width = width;
+    hist->height = height;
+    hist->tiles_x = (width + COLORHIST_TILE_SIZE - 1) / COLORHIST_TILE_SIZE;
+    hist->tiles_y = (height + COLORHIST_TILE_SIZE - 1) / COLORHIST_TILE_SIZE;
+    hist->dirty = calloc(hist->tiles_x * hist->tiles_y, sizeof(uint8_t));
+
+    hist->shadow = malloc(sizeof(uint32_t) * width * height);
+    memcpy(hist->shadow, pixels, sizeof(uint32_t) * width * height);
+
+    memstat_add(MEMSTAT_MATERIALS, sizeof(struct ColorHistogram) + colorhist_table_size(hist->capacity) +
+            hist->tiles_x * hist->tiles_y + sizeof(uint32_t) * width * height);
+
+    for (int i=0; i<width*height; ++i) {
+        if (coverage == NULL || coverage[i] != 0) {
+            colorhist_add(hist, pixels[i]);
+        }
+    }
+
+    return hist;
+}
+
+void
+colorhist_free(struct ColorHistogram *hist)
+{
+    if (hist == NULL) {
+        return;
+    }
+
+    memstat_sub(MEMSTAT_MATERIALS, sizeof(struct ColorHistogram) + colorhist_table_size(hist->capacity) +
+            hist->tiles_x * hist->tiles_y + sizeof(uint32_t) * hist->width * hist->height);
+
+    free(hist->colors);
+    free(hist->counts);
+    free(hist->shadow);
+    free(hist->dirty);
+    free(hist);
+}
+
+void
+colorhist_mark_rect(struct ColorHistogram *hist, int x, int y, int w, int h)
+{
+    if (hist == NULL || w <= 0 || h <= 0) {
+        return;
+    }
+
+    int tx0 = x / COLORHIST_TILE_SIZE;
+    int ty0 = y / COLORHIST_TILE_SIZE;
+    int tx1 = (x + w - 1) / COLORHIST_TILE_SIZE;
+    int ty1 = (y + h - 1) / COLORHIST_TILE_SIZE;
+
+    for (int ty=ty0; ty<=ty1 && ty<hist->tiles_y; ++ty) {
+        for (int tx=tx0; tx<=tx1 && tx<hist->tiles_x; ++tx) {
+            hist->dirty[ty * hist->tiles_x + tx] = 1;
+        }
+    }
+
+    hist->any_dirty = true;
+}
+
+void
+colorhist_mark_texels(struct ColorHistogram *hist, const uint32_t *index, size_t count)
+{
+    if (hist == NULL || count == 0) {
+        return;
+    }
+
+    for (size_t i=0; i<count; ++i) {
+        int x = index[i] % hist->width;
+        int y = index[i] / hist->width;
+        hist->dirty[(y / COLORHIST_TILE_SIZE) * hist->tiles_x + (x / COLORHIST_TILE_SIZE)] = 1;
+    }
+
+    hist->any_dirty = true;
+}
+
+void
+colorhist_update(struct ColorHistogram *hist, const uint32_t *pixels)
+{
+    if (hist == NULL || !hist->any_dirty) {
+        return;
+    }
+
+    for (int tile=0; tile<hist->tiles_x*hist->tiles_y; ++tile) {
+        if (!hist->dirty[tile]) {
+            continue;
+        }
+
+        int x0 = (tile % hist->tiles_x) * COLORHIST_TILE_SIZE;
+        int y0 = (tile / hist->tiles_x) * COLORHIST_TILE_SIZE;
+        int x1 = (x0 + COLORHIST_TILE_SIZE < hist->width) ? (x0 + COLORHIST_TILE_SIZE) : hist->width;
+        int y1 = (y0 + COLORHIST_TILE_SIZE < hist->height) ? (y0 + COLORHIST_TILE_SIZE) : hist->height;
+
+        for (int y=y0; y<y1; ++y) {
+            for (int x=x0; x<x1; ++x) {
+                int i = y * hist->width + x;
+                if (hist->shadow[i] == pixels[i]) {
+                    continue;
+                }
+
+                if (hist->coverage == NULL || hist->coverage[i] != 0) {
+                    colorhist_remove(hist, hist->shadow[i]);
+                    colorhist_add(hist, pixels[i]);
+                }
+                hist->shadow[i] = pixels[i];
+            }
+        }
+
+        hist->dirty[tile] = 0;
+    }
+
+    hist->any_dirty = false;
+}
+
+uint32_t
+colorhist_count(const struct ColorHistogram *hist, uint32_t color)
+{
+    return hist->counts[colorhist_slot(hist, color)];
+}
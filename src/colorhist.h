@@ -0,0 +1,77 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/**
+ * Live color histogram of a material (color -> number of texels).
+ *
+ * Only texels covered by the model count, which is what decides whether
+ * encode_image() can export the image. Edits mark the tiles they touch;
+ * colorhist_update() then compares just those tiles against a copy of the
+ * counted pixels and adjusts the counts, so keeping the number of distinct
+ * colors current costs time proportional to what was painted.
+ **/
+
+#define COLORHIST_TILE_SIZE 16
+
+struct ColorHistogram {
+    // Open addressing (linear probing), a count of 0 marks an empty slot
+    uint32_t *colors;
+    uint32_t *counts;
+    uint32_t capacity;
+    uint32_t distinct;
+
+    // Pixels as they were counted, and which texels count (NULL = all)
+    uint32_t *shadow;
+    const uint8_t *coverage;
+
+    int width;
+    int height;
+    int tiles_x;
+    int tiles_y;
+    uint8_t *dirty;
+    bool any_dirty;
+};
+
+struct ColorHistogram *
+colorhist_new(const uint32_t *pixels, const uint8_t *coverage, int width, int height);
+
+void
+colorhist_free(struct ColorHistogram *hist);
+
+void
+colorhist_mark_rect(struct ColorHistogram *hist, int x, int y, int w, int h);
+
+void
+colorhist_mark_texels(struct ColorHistogram *hist, const uint32_t *index, size_t count);
+
+void
+colorhist_update(struct ColorHistogram *hist, const uint32_t *pixels);
+
+uint32_t
+colorhist_count(const struct ColorHistogram *hist, uint32_t color);
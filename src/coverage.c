@@ -0,0 +1,221 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "coverage.h"
+#include "memstat.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+static int
+coverage_wrap(int value, int size)
+{
+    value %= size;
+    return (value < 0) ? (value + size) : value;
+}
+
+static void
+coverage_rasterize(struct Material *material, const struct Vertex *v)
+{
+    int width = material->width;
+    int height = material->height;
+
+    // Texel space, texel centers at integer coordinates
+    float x[3], y[3];
+    for (int i=0; i<3; ++i) {
+        x[i] = v[i].u * width - 0.5f;
+        y[i] = v[i].v * height - 0.5f;
+    }
+
+    float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (fabsf(area) < 1e-6f) {
+        // Nothing of the texture is shown on a degenerate triangle
+        return;
+    }
+
+    int x0 = floorf(fminf(x[0], fminf(x[1], x[2])));
+    int x1 = ceilf(fmaxf(x[0], fmaxf(x[1], x[2])));
+    int y0 = floorf(fminf(y[0], fminf(y[1], y[2])));
+    int y1 = ceilf(fmaxf(y[0], fmaxf(y[1], y[2])));
+
+    for (int py=y0; py<=y1; ++py) {
+        for (int px=x0; px<=x1; ++px) {
+            float w0 = (x[2] - x[1]) * (py - y[1]) - (y[2] - y[1]) * (px - x[1]);
+            float w1 = (x[0] - x[2]) * (py - y[2]) - (y[0] - y[2]) * (px - x[2]);
+            float w2 = (x[1] - x[0]) * (py - y[0]) - (y[1] - y[0]) * (px - x[0]);
+
+            bool inside = (area >= 0.f) ? (w0 >= 0.f && w1 >= 0.f && w2 >= 0.f) : (w0 <= 0.f && w1 <= 0.f && w2 <= 0.f);
+
+            // Slivers still touch the texel their corners are in
+            bool corner = false;
+            for (int i=0; i<3; ++i) {
+                corner = corner || (lroundf(x[i]) == px && lroundf(y[i]) == py);
+            }
+
+            if (inside || corner) {
+                material->coverage[coverage_wrap(px, width) + coverage_wrap(py, height) * width] = 1;
+            }
+        }
+    }
+}
+
+void
+coverage_build(struct ShipModel *model)
+{
+    TRACE_BEGIN("coverage_build");
+
+    struct Material *material = model->materials;
+    while (material != NULL) {
+        if (material->index != -1 && (material->pixels != NULL || material->indices != NULL) && material->coverage == NULL) {
+            material->coverage = calloc(material->width * material->height, sizeof(uint8_t));
+            memstat_add(MEMSTAT_MATERIALS, sizeof(uint8_t) * material->width * material->height);
+        }
+
+        material = material->next;
+    }
+
+    struct Object *obj = model->objects;
+    while (obj != NULL) {
+        if (obj->material != NULL && obj->material->coverage != NULL) {
+            for (size_t i=0; i+2<obj->vertexdata_size; i+=3) {
+                coverage_rasterize(obj->material, obj->vertexdata + i);
+            }
+        }
+
+        obj = obj->next;
+    }
+
+    // Grow by one texel, as texture filtering also samples the neighbors
+    material = model->materials;
+    while (material != NULL) {
+        if (material->coverage != NULL) {
+            int width = material->width;
+            int height = material->height;
+
+            uint8_t *grown = calloc(width * height, sizeof(uint8_t));
+            for (int y=0; y<height; ++y) {
+                for (int x=0; x<width; ++x) {
+                    for (int dy=-1; dy<=1; ++dy) {
+                        for (int dx=-1; dx<=1; ++dx) {
+                            grown[y * width + x] |= material->coverage[coverage_wrap(x + dx, width) + coverage_wrap(y + dy, height) * width];
+                        }
+                    }
+                }
+            }
+
+            free(material->coverage);
+            material->coverage = grown;
+
+            printf("Coverage of material %d: %d/%d texels\n", material->index, coverage_count(material), width * height);
+        }
+
+        material = material->next;
+    }
+
+    TRACE_END("coverage_build");
+}
+
+void
+coverage_free(struct ShipModel *model)
+{
+    struct Material *material = model->materials;
+    while (material != NULL) {
+        if (material->coverage != NULL) {
+            memstat_sub(MEMSTAT_MATERIALS, sizeof(uint8_t) * material->width * material->height);
+            free(material->coverage);
+            material->coverage = NULL;
+        }
+
+        material = material->next;
+    }
+}
+
+int
+coverage_count(const struct Material *material)
+{
+    if (material->coverage == NULL) {
+        return material->width * material->height;
+    }
+
+    int result = 0;
+    for (int i=0; i<material->width*material->height; ++i) {
+        result += material->coverage[i];
+    }
+
+    return result;
+}
+
+void
+coverage_fill(const struct Material *material, uint8_t *pixels, int bytes_per_pixel)
+{
+    if (material->coverage == NULL) {
+        return;
+    }
+
+    int width = material->width;
+    int height = material->height;
+    int texels = width * height;
+
+    // Breadth-first from all covered texels, so each uncovered texel gets the
+    // color of a nearby covered one (keeps invisible texels from adding colors)
+    int *queue = malloc(sizeof(int) * texels);
+    uint8_t *done = malloc(sizeof(uint8_t) * texels);
+    int head = 0;
+    int tail = 0;
+
+    for (int i=0; i<texels; ++i) {
+        done[i] = material->coverage[i];
+        if (done[i]) {
+            queue[tail++] = i;
+        }
+    }
+
+    static const int
+    NEIGHBORS[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+
+    while (head < tail) {
+        int i = queue[head++];
+        int x = i % width;
+        int y = i / width;
+
+        for (int n=0; n<4; ++n) {
+            int nx = x + NEIGHBORS[n][0];
+            int ny = y + NEIGHBORS[n][1];
+            if (nx < 0 || ny < 0 || nx >= width || ny >= height) {
+                continue;
+            }
+
+            int j = nx + ny * width;
+            if (!done[j]) {
+                done[j] = 1;
+                memcpy(pixels + j * bytes_per_pixel, pixels + i * bytes_per_pixel, bytes_per_pixel);
+                queue[tail++] = j;
+            }
+        }
+    }
+
+    free(done);
+    free(queue);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+
+#include "shipmodelformat.h"
+
+/**
+ * Texel coverage masks.
+ *
+ * Large parts of each material are not mapped by any triangle of the ship.
+ * The coverage mask marks the texels that can actually be seen (rasterized
+ * from the UVs, grown by one texel for texture filtering), so that quantizing
+ * and exporting can ignore or freely remap all other texels.
+ **/
+
+void
+coverage_build(struct ShipModel *model);
+
+void
+coverage_free(struct ShipModel *model);
+
+int
+coverage_count(const struct Material *material);
+
+void
+coverage_fill(const struct Material *material, uint8_t *pixels, int bytes_per_pixel);
@@ -22,6 +22,8 @@
 
 #include "fileio.h"
 #include "util.h"
+#include "trace.h"
+#include "memstat.h"
 
 #include <stdio.h>
 #include <stdint.h>
@@ -136,6 +138,8 @@ g_mounted_wads = NULL;
 bool
 mount_wad(const char *filename)
 {
+    TRACE_BEGIN("mount_wad");
+
     struct MountedWAD *wad = malloc(sizeof(struct MountedWAD));
     memset(wad, 0, sizeof(wad));
 
@@ -143,19 +147,27 @@ mount_wad(const char *filename)
 
     if (wad->header == NULL) {
         free(wad);
+        TRACE_END("mount_wad");
         return false;
     }
 
     wad->filename = strdup(filename);
 
+    // mounted archives stay resident for the lifetime of the process
+    memstat_add(MEMSTAT_WAD, wad->len);
+
     wad->next = g_mounted_wads;
     g_mounted_wads = wad;
+
+    TRACE_END("mount_wad");
     return true;
 }
 
 char *
 read_wad_file(const char *filename, size_t *len)
 {
+    TRACE_BEGIN("read_wad_file");
+
     struct MountedWAD *wad = g_mounted_wads;
 
     uint32_t name = crc32(0xFFFFFFFF, (const Bytef *)filename, strlen(filename));
@@ -215,6 +227,7 @@ read_wad_file(const char *filename, size_t *len)
                     memcpy(result, read_ptr, entry->length);
                 }
 
+                TRACE_END("read_wad_file");
                 return result;
             }
         }
@@ -222,6 +235,7 @@ read_wad_file(const char *filename, size_t *len)
         wad = wad->next;
     }
 
+    TRACE_END("read_wad_file");
     return NULL;
 }
 
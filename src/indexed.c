@@ -0,0 +1,243 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "indexed.h"
+#include "memstat.h"
+
+#include <string.h>
+
+// 4x4 ordered dither thresholds (Bayer matrix)
+static const uint8_t
+INDEXED_DITHER[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+static int
+indexed_find(const uint32_t *palette, int count, uint32_t color)
+{
+    for (int i=0; i<count; ++i) {
+        if (palette[i] == color) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+size_t
+indexed_bytes(const struct Material *material)
+{
+    return (size_t)material->width * material->height / 2;
+}
+
+int
+indexed_colors(const struct Material *material, uint32_t *colors)
+{
+    const uint32_t *pixels = (const uint32_t *)material->pixels;
+    size_t length = material->width * material->height;
+
+    int count = 0;
+
+    for (size_t i=0; i<length; ++i) {
+        // Neighbouring texels mostly share colors
+        if (count > 0 && pixels[i] == colors[count - 1]) {
+            continue;
+        }
+
+        if (indexed_find(colors, count, pixels[i]) == -1) {
+            if (count == INDEXED_COLORS) {
+                return -1;
+            }
+            colors[count++] = pixels[i];
+        }
+    }
+
+    return count;
+}
+
+bool
+indexed_fits(const struct Material *material)
+{
+    // Packed rows must start on a byte, undo saves tiles as byte ranges
+    uint32_t colors[INDEXED_COLORS];
+    return material->width % 2 == 0 && indexed_colors(material, colors) != -1;
+}
+
+bool
+indexed_enable(struct Material *material)
+{
+    if (material->indices != NULL) {
+        return true;
+    }
+
+    const uint32_t *pixels = (const uint32_t *)material->pixels;
+    size_t length = material->width * material->height;
+
+    uint32_t colors[INDEXED_COLORS];
+    int count = indexed_colors(material, colors);
+    if (count == -1 || material->width % 2 != 0) {
+        return false;
+    }
+
+    if (material->palette == NULL) {
+        material->palette = calloc(INDEXED_COLORS, sizeof(uint32_t));
+    }
+
+    // Keep the existing palette (and its order) if it has all colors,
+    // so that a loaded skin is exported unchanged
+    bool keep = true;
+    for (int i=0; i<count && keep; ++i) {
+        keep = (indexed_find(material->palette, INDEXED_COLORS, colors[i]) != -1);
+    }
+
+    // A kept palette is all real colors (even those no texel uses yet), the
+    // entries after a rebuilt one are padding that painting must never pick
+    if (keep) {
+        material->palette_count = INDEXED_COLORS;
+    } else {
+        memset(material->palette, 0, INDEXED_COLORS * sizeof(uint32_t));
+        memcpy(material->palette, colors, count * sizeof(uint32_t));
+        material->palette_count = count;
+    }
+
+    material->indices = malloc(indexed_bytes(material));
+    memstat_add(MEMSTAT_MATERIALS, indexed_bytes(material));
+
+    for (size_t i=0; i<length; i+=2) {
+        material->indices[i / 2] = (indexed_find(material->palette, INDEXED_COLORS, pixels[i]) << 4) |
+            indexed_find(material->palette, INDEXED_COLORS, pixels[i + 1]);
+    }
+
+    free(material->pixels);
+    material->pixels = NULL;
+    memstat_sub(MEMSTAT_MATERIALS, sizeof(uint32_t) * length);
+
+    return true;
+}
+
+void
+indexed_disable(struct Material *material)
+{
+    if (material->indices == NULL) {
+        return;
+    }
+
+    size_t length = material->width * material->height;
+
+    uint32_t *pixels = malloc(sizeof(uint32_t) * length);
+    memstat_add(MEMSTAT_MATERIALS, sizeof(uint32_t) * length);
+    indexed_expand(material, pixels);
+    material->pixels = (char *)pixels;
+
+    free(material->indices);
+    material->indices = NULL;
+    memstat_sub(MEMSTAT_MATERIALS, indexed_bytes(material));
+}
+
+void
+indexed_expand(const struct Material *material, uint32_t *rgba)
+{
+    size_t length = material->width * material->height;
+
+    for (size_t i=0; i<length; i+=2) {
+        uint8_t pair = material->indices[i / 2];
+        rgba[i] = material->palette[pair >> 4];
+        rgba[i + 1] = material->palette[pair & 0x0F];
+    }
+}
+
+int
+indexed_distinct(const struct Material *material)
+{
+    size_t length = material->width * material->height;
+
+    bool used[INDEXED_COLORS] = { false };
+    for (size_t i=0; i<length; ++i) {
+        if (material->coverage == NULL || material->coverage[i] != 0) {
+            used[indexed_get(material->indices, i)] = true;
+        }
+    }
+
+    // Entries of a loaded palette need not be unique
+    uint32_t colors[INDEXED_COLORS];
+    int count = 0;
+    for (int i=0; i<INDEXED_COLORS; ++i) {
+        if (used[i] && indexed_find(colors, count, material->palette[i]) == -1) {
+            colors[count++] = material->palette[i];
+        }
+    }
+
+    return count;
+}
+
+uint8_t
+indexed_nearest(const uint32_t *palette, int count, uint32_t color)
+{
+    uint8_t result = 0;
+    int best = -1;
+
+    for (int i=0; i<count; ++i) {
+        // Alpha counts as well, so that a (transparent) padding entry of a
+        // kept palette is never nearer than an opaque color
+        int distance = 0;
+        for (int c=0; c<4; ++c) {
+            int d = (int)((palette[i] >> (8 * c)) & 0xFF) - (int)((color >> (8 * c)) & 0xFF);
+            distance += d * d;
+        }
+
+        if (best == -1 || distance < best) {
+            best = distance;
+            result = i;
+        }
+    }
+
+    return result;
+}
+
+void
+indexed_paint_texels(uint8_t *indices, uint8_t *drawn, int width, const uint32_t *index, const uint8_t *alpha, size_t count, uint8_t color)
+{
+    for (size_t i=0; i<count; ++i) {
+        uint32_t idx = index[i];
+        uint32_t a = (alpha[i] < drawn[idx]) ? 0 : alpha[i];
+
+        // Same coverage rule as the RGBA brush, just dithered instead of blended
+        uint32_t threshold = INDEXED_DITHER[(idx / width) & 3][(idx % width) & 3] * 16 + 8;
+        if (a > threshold) {
+            indexed_set(indices, idx, color);
+        }
+
+        drawn[idx] += a;
+    }
+}
+
+void
+indexed_encode(const struct Material *material, uint32_t *palette, uint8_t *image)
+{
+    // Same packing as the indices
+    memcpy(palette, material->palette, INDEXED_COLORS * sizeof(uint32_t));
+    memcpy(image, material->indices, indexed_bytes(material));
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "shipmodelformat.h"
+
+/**
+ * Indexed (16 color) editing of a material.
+ *
+ * In indexed mode, material->indices holds the palette index of each texel,
+ * packed two per byte (high nibble first, like the exported image), and is
+ * what brush strokes and undo operate on. The RGBA pixels are freed while
+ * the material is indexed: material_rgba() expands the indices whenever the
+ * texture upload, journal or PNG export needs RGBA, so an indexed image takes
+ * an eighth of the memory. Soft brush edges are turned into an ordered dither
+ * between the brush color and the texel's color. Since the image never has
+ * more than 16 colors, exporting it needs no quantization pass.
+ **/
+
+#define INDEXED_COLORS 16
+
+static inline uint8_t
+indexed_get(const uint8_t *indices, size_t i)
+{
+    return (i & 1) ? (indices[i / 2] & 0x0F) : (indices[i / 2] >> 4);
+}
+
+static inline void
+indexed_set(uint8_t *indices, size_t i, uint8_t color)
+{
+    if (i & 1) {
+        indices[i / 2] = (indices[i / 2] & 0xF0) | color;
+    } else {
+        indices[i / 2] = (indices[i / 2] & 0x0F) | (color << 4);
+    }
+}
+
+// Bytes of the packed indices of a material
+size_t
+indexed_bytes(const struct Material *material);
+
+// Distinct colors of the pixels (in order of appearance), -1 if more than INDEXED_COLORS
+int
+indexed_colors(const struct Material *material, uint32_t *colors);
+
+bool
+indexed_fits(const struct Material *material);
+
+// Builds palette + indices from the pixels and frees the pixels, false if there are too many colors
+bool
+indexed_enable(struct Material *material);
+
+// Expands the indices into newly allocated pixels and frees the indices
+void
+indexed_disable(struct Material *material);
+
+// Writes the RGBA image (width * height texels)
+void
+indexed_expand(const struct Material *material, uint32_t *rgba);
+
+// Distinct colors of the texels covered by the model (like the color histogram)
+int
+indexed_distinct(const struct Material *material);
+
+// Nearest of the first count entries (by RGBA)
+uint8_t
+indexed_nearest(const uint32_t *palette, int count, uint32_t color);
+
+void
+indexed_paint_texels(uint8_t *indices, uint8_t *drawn, int width, const uint32_t *index, const uint8_t *alpha, size_t count, uint8_t color);
+
+// Writes the 16 entry palette and the 4bpp image (high nibble first)
+void
+indexed_encode(const struct Material *material, uint32_t *palette, uint8_t *image);
@@ -0,0 +1,986 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "journal.h"
+#include "material.h"
+#include "memstat.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL.h>
+#include <zlib.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// The journal is only ever read back on the machine that wrote it,
+// so all values are stored in native byte order.
+static const char
+JOURNAL_MAGIC[8] = { 'S', 'H', 'J', 'O', 'U', 'R', 'N', '1' };
+
+// Pending records are written out (and fsynced) at least this often
+static const uint32_t
+JOURNAL_FLUSH_INTERVAL_MS = 250;
+
+// A checkpoint is made after this much time or data since the last one
+static const uint32_t
+JOURNAL_CHECKPOINT_INTERVAL_MS = 60 * 1000;
+
+static const size_t
+JOURNAL_CHECKPOINT_BYTES = 4 * 1024 * 1024;
+
+enum JournalRecordType {
+    JOURNAL_CHECKPOINT = 1,
+    JOURNAL_STEP,
+    JOURNAL_DABS,
+    JOURNAL_TILES,
+    JOURNAL_UNDO,
+    JOURNAL_REDO,
+    JOURNAL_CLEAR,
+};
+
+enum JournalStepFlags {
+    JOURNAL_STEP_STROKE = (1 << 0),
+};
+
+struct JournalBuffer {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+};
+
+struct Journal {
+    char *filename;
+    char *tmp_filename;
+    struct JournalHost host;
+
+    // Teams that have been modified (and are included in checkpoints)
+    bool *team_modified;
+
+    bool running;
+    SDL_Thread *thread;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+
+    // Shared with the writer thread (protected by mutex)
+    struct JournalBuffer pending;
+    bool pending_rotate;
+    bool quit;
+
+    // Only used by the writer thread
+    FILE *fp;
+
+    // Only used by the UI thread
+    struct JournalBuffer record;
+    size_t dab_count_offset;
+    uint32_t dab_count;
+    size_t bytes_since_checkpoint;
+    uint32_t last_checkpoint_ticks;
+};
+
+static void
+journal_buffer_reserve(struct JournalBuffer *buffer, size_t length)
+{
+    if (buffer->length + length <= buffer->capacity) {
+        return;
+    }
+
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->length + length) {
+        capacity *= 2;
+    }
+
+    buffer->data = realloc(buffer->data, capacity);
+    memstat_add(MEMSTAT_JOURNAL, capacity - buffer->capacity);
+    buffer->capacity = capacity;
+}
+
+static void
+journal_buffer_free(struct JournalBuffer *buffer)
+{
+    free(buffer->data);
+    memstat_sub(MEMSTAT_JOURNAL, buffer->capacity);
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+static void
+journal_put(struct JournalBuffer *buffer, const void *data, size_t length)
+{
+    journal_buffer_reserve(buffer, length);
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+static void
+journal_put_u8(struct JournalBuffer *buffer, uint8_t value)
+{
+    journal_put(buffer, &value, sizeof(value));
+}
+
+static void
+journal_put_u16(struct JournalBuffer *buffer, uint16_t value)
+{
+    journal_put(buffer, &value, sizeof(value));
+}
+
+static void
+journal_put_u32(struct JournalBuffer *buffer, uint32_t value)
+{
+    journal_put(buffer, &value, sizeof(value));
+}
+
+static void
+journal_put_f32(struct JournalBuffer *buffer, float value)
+{
+    journal_put(buffer, &value, sizeof(value));
+}
+
+struct JournalReader {
+    const uint8_t *data;
+    size_t length;
+    size_t offset;
+    bool error;
+};
+
+static const uint8_t *
+journal_get(struct JournalReader *reader, size_t length)
+{
+    if (reader->error || reader->length - reader->offset < length) {
+        reader->error = true;
+        return NULL;
+    }
+
+    const uint8_t *result = reader->data + reader->offset;
+    reader->offset += length;
+    return result;
+}
+
+static uint8_t
+journal_get_u8(struct JournalReader *reader)
+{
+    uint8_t value = 0;
+    const uint8_t *data = journal_get(reader, sizeof(value));
+    if (data) {
+        memcpy(&value, data, sizeof(value));
+    }
+    return value;
+}
+
+static uint16_t
+journal_get_u16(struct JournalReader *reader)
+{
+    uint16_t value = 0;
+    const uint8_t *data = journal_get(reader, sizeof(value));
+    if (data) {
+        memcpy(&value, data, sizeof(value));
+    }
+    return value;
+}
+
+static uint32_t
+journal_get_u32(struct JournalReader *reader)
+{
+    uint32_t value = 0;
+    const uint8_t *data = journal_get(reader, sizeof(value));
+    if (data) {
+        memcpy(&value, data, sizeof(value));
+    }
+    return value;
+}
+
+static float
+journal_get_f32(struct JournalReader *reader)
+{
+    float value = 0.f;
+    const uint8_t *data = journal_get(reader, sizeof(value));
+    if (data) {
+        memcpy(&value, data, sizeof(value));
+    }
+    return value;
+}
+
+static bool
+journal_active(struct Journal *journal)
+{
+    return journal != NULL && journal->running;
+}
+
+static void
+journal_touch(struct Journal *journal, int team)
+{
+    if (team >= 0 && team < journal->host.num_teams) {
+        journal->team_modified[team] = true;
+    }
+}
+
+static struct Material *
+journal_get_material(struct Journal *journal, int team, int index)
+{
+    if (team < 0 || team >= journal->host.num_teams || index < 0 || index >= JOURNAL_MAX_MATERIALS) {
+        return NULL;
+    }
+
+    return journal->host.get_material(team, index, journal->host.user_data);
+}
+
+static bool
+journal_find_material(struct Journal *journal, struct Material *material, int *team)
+{
+    for (int i=0; i<journal->host.num_teams; ++i) {
+        if (journal_get_material(journal, i, material->index) == material) {
+            *team = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void
+journal_record_begin(struct Journal *journal, enum JournalRecordType type)
+{
+    journal->record.length = 0;
+    journal_put_u8(&journal->record, type);
+    // payload length, filled in by journal_record_commit()
+    journal_put_u32(&journal->record, 0);
+}
+
+static void
+journal_record_commit(struct Journal *journal, bool checkpoint)
+{
+    uint32_t payload_length = journal->record.length - 5;
+    memcpy(journal->record.data + 1, &payload_length, sizeof(payload_length));
+
+    SDL_LockMutex(journal->mutex);
+    if (checkpoint) {
+        // Everything not yet written is superseded by the checkpoint
+        journal->pending.length = 0;
+        journal->pending_rotate = true;
+        SDL_CondSignal(journal->cond);
+    }
+    journal_put(&journal->pending, journal->record.data, journal->record.length);
+    SDL_UnlockMutex(journal->mutex);
+
+    journal->bytes_since_checkpoint += journal->record.length;
+    journal->record.length = 0;
+}
+
+static void
+journal_sync(FILE *fp)
+{
+    fflush(fp);
+#if defined(_WIN32)
+    _commit(_fileno(fp));
+#else
+    fsync(fileno(fp));
+#endif
+}
+
+static void
+journal_write_block(struct Journal *journal, const struct JournalBuffer *buffer, bool rotate)
+{
+    TRACE_BEGIN("journal write");
+
+    uLongf compressed_length = compressBound(buffer->length);
+    uint8_t *compressed = malloc(compressed_length);
+    if (compress2(compressed, &compressed_length, buffer->data, buffer->length, 1) != Z_OK) {
+        printf("Could not compress journal block\n");
+        free(compressed);
+        TRACE_END("journal write");
+        return;
+    }
+
+    uint32_t header[3] = {
+        buffer->length,
+        compressed_length,
+        crc32(0, compressed, compressed_length),
+    };
+
+    if (rotate) {
+        // Write the checkpoint to a new file and atomically replace the journal
+        if (journal->fp) {
+            fclose(journal->fp);
+            journal->fp = NULL;
+        }
+
+        FILE *fp = fopen(journal->tmp_filename, "wb");
+        if (fp) {
+            fwrite(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC), 1, fp);
+            fwrite(header, sizeof(header), 1, fp);
+            fwrite(compressed, compressed_length, 1, fp);
+            journal_sync(fp);
+            fclose(fp);
+
+#if defined(_WIN32)
+            MoveFileEx(journal->tmp_filename, journal->filename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+            rename(journal->tmp_filename, journal->filename);
+#endif
+        } else {
+            printf("Could not write journal checkpoint: %s\n", journal->tmp_filename);
+        }
+
+        journal->fp = fopen(journal->filename, "ab");
+    } else if (journal->fp) {
+        fwrite(header, sizeof(header), 1, journal->fp);
+        fwrite(compressed, compressed_length, 1, journal->fp);
+        journal_sync(journal->fp);
+    }
+
+    free(compressed);
+
+    TRACE_END("journal write");
+}
+
+static int
+journal_writer_thread(void *user_data)
+{
+    struct Journal *journal = user_data;
+    struct JournalBuffer block = { NULL, 0, 0 };
+
+    trace_thread_name("journal");
+
+    SDL_LockMutex(journal->mutex);
+    while (true) {
+        if (!journal->quit && !journal->pending_rotate) {
+            SDL_CondWaitTimeout(journal->cond, journal->mutex, JOURNAL_FLUSH_INTERVAL_MS);
+        }
+
+        // Take all pending records, so the UI thread can continue appending
+        struct JournalBuffer tmp = block;
+        block = journal->pending;
+        journal->pending = tmp;
+        journal->pending.length = 0;
+
+        bool rotate = journal->pending_rotate;
+        journal->pending_rotate = false;
+
+        bool quit = journal->quit;
+        SDL_UnlockMutex(journal->mutex);
+
+        if (block.length > 0 || rotate) {
+            journal_write_block(journal, &block, rotate);
+        }
+        block.length = 0;
+
+        SDL_LockMutex(journal->mutex);
+        if (quit && journal->pending.length == 0 && !journal->pending_rotate) {
+            break;
+        }
+    }
+    SDL_UnlockMutex(journal->mutex);
+
+    journal_buffer_free(&block);
+
+    return 0;
+}
+
+struct Journal *
+journal_new(const char *filename, const struct JournalHost *host)
+{
+    struct Journal *journal = calloc(1, sizeof(struct Journal));
+
+    journal->filename = strdup(filename);
+    journal->tmp_filename = malloc(strlen(filename) + 5);
+    sprintf(journal->tmp_filename, "%s.tmp", filename);
+
+    journal->host = *host;
+    journal->team_modified = calloc(host->num_teams, sizeof(bool));
+
+    return journal;
+}
+
+void
+journal_free(struct Journal *journal, bool discard)
+{
+    if (journal->running) {
+        SDL_LockMutex(journal->mutex);
+        journal->quit = true;
+        SDL_CondSignal(journal->cond);
+        SDL_UnlockMutex(journal->mutex);
+
+        SDL_WaitThread(journal->thread, NULL);
+
+        SDL_DestroyCond(journal->cond);
+        SDL_DestroyMutex(journal->mutex);
+
+        if (journal->fp) {
+            fclose(journal->fp);
+        }
+
+        if (discard) {
+            remove(journal->filename);
+        }
+    }
+
+    journal_buffer_free(&journal->pending);
+    journal_buffer_free(&journal->record);
+
+    free(journal->team_modified);
+    free(journal->tmp_filename);
+    free(journal->filename);
+    free(journal);
+}
+
+bool
+journal_has_recovery(struct Journal *journal)
+{
+    FILE *fp = fopen(journal->filename, "rb");
+    if (!fp) {
+        return false;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    fclose(fp);
+
+    return length > (long)sizeof(JOURNAL_MAGIC);
+}
+
+struct JournalReplay {
+    struct Journal *journal;
+    struct Undo *undo;
+    int team;
+    // Set after undo/redo markers, whose tiles must not create undo history
+    bool after_undo;
+};
+
+static void
+journal_replay_checkpoint(struct JournalReplay *replay, struct JournalReader *reader)
+{
+    replay->team = journal_get_u16(reader);
+    int count = journal_get_u16(reader);
+
+    for (int i=0; i<count && !reader->error; ++i) {
+        int team = journal_get_u16(reader);
+        int index = journal_get_u8(reader);
+        int width = journal_get_u16(reader);
+        int height = journal_get_u16(reader);
+        const uint8_t *pixels = journal_get(reader, sizeof(uint32_t) * width * height);
+
+        struct Material *material = journal_get_material(replay->journal, team, index);
+        if (pixels && material && material->width == width && material->height == height) {
+            memcpy(material->pixels, pixels, sizeof(uint32_t) * width * height);
+            material_touch(material, 0, 0, width, height);
+            journal_touch(replay->journal, team);
+        }
+    }
+}
+
+static void
+journal_replay_step(struct JournalReplay *replay, struct JournalReader *reader)
+{
+    replay->team = journal_get_u16(reader);
+    int flags = journal_get_u8(reader);
+    int label_length = journal_get_u16(reader);
+    const uint8_t *label = journal_get(reader, label_length);
+
+    if (reader->error) {
+        return;
+    }
+
+    char tmp[128];
+    if (label_length >= sizeof(tmp)) {
+        label_length = sizeof(tmp) - 1;
+    }
+    memcpy(tmp, label, label_length);
+    tmp[label_length] = '\0';
+
+    undo_push(replay->undo, tmp);
+    replay->after_undo = false;
+
+    if ((flags & JOURNAL_STEP_STROKE) != 0) {
+        // clear plot area, like when a new stroke is started in the editor
+        for (int index=0; index<JOURNAL_MAX_MATERIALS; ++index) {
+            struct Material *material = journal_get_material(replay->journal, replay->team, index);
+            if (material) {
+                memset(material->pixels_drawn, 0, sizeof(uint8_t) * material->width * material->height);
+            }
+        }
+    }
+}
+
+static void
+journal_replay_dabs(struct JournalReplay *replay, struct JournalReader *reader)
+{
+    uint32_t color = journal_get_u32(reader);
+    float alpha_factor = journal_get_f32(reader);
+    uint32_t count = journal_get_u32(reader);
+
+    for (uint32_t i=0; i<count && !reader->error; ++i) {
+        int index = journal_get_u8(reader);
+        int u = journal_get_u16(reader);
+        int v = journal_get_u16(reader);
+        float alpha = journal_get_f32(reader);
+
+        struct Material *material = journal_get_material(replay->journal, replay->team, index);
+        if (!reader->error && material && u < material->height && v < material->width) {
+            undo_save_material_texel(replay->undo, material, v, u);
+            material_plot(material, u, v, alpha, color, alpha_factor);
+            journal_touch(replay->journal, replay->team);
+        }
+    }
+}
+
+static void
+journal_replay_tiles(struct JournalReplay *replay, struct JournalReader *reader)
+{
+    int team = journal_get_u16(reader);
+    int index = journal_get_u8(reader);
+    uint32_t count = journal_get_u32(reader);
+
+    struct Material *material = journal_get_material(replay->journal, team, index);
+
+    for (uint32_t i=0; i<count && !reader->error; ++i) {
+        int x = journal_get_u16(reader);
+        int y = journal_get_u16(reader);
+        int w = journal_get_u16(reader);
+        int h = journal_get_u16(reader);
+        const uint8_t *pixels = journal_get(reader, sizeof(uint32_t) * w * h);
+
+        if (pixels && material && x + w <= material->width && y + h <= material->height) {
+            if (!replay->after_undo) {
+                undo_save_material_rect(replay->undo, material, x, y, w, h);
+            }
+
+            for (int row=0; row<h; ++row) {
+                memcpy(material->pixels + sizeof(uint32_t) * ((y + row) * material->width + x),
+                        pixels + sizeof(uint32_t) * row * w, sizeof(uint32_t) * w);
+            }
+            material_touch(material, x, y, w, h);
+
+            journal_touch(replay->journal, team);
+        }
+    }
+}
+
+static bool
+journal_replay_block(struct JournalReplay *replay, const uint8_t *data, size_t length)
+{
+    struct JournalReader block = { data, length, 0, false };
+
+    while (block.offset < block.length) {
+        int type = journal_get_u8(&block);
+        uint32_t payload_length = journal_get_u32(&block);
+        const uint8_t *payload = journal_get(&block, payload_length);
+        if (block.error) {
+            return false;
+        }
+
+        struct JournalReader reader = { payload, payload_length, 0, false };
+
+        switch (type) {
+            case JOURNAL_CHECKPOINT:
+                undo_clear(replay->undo);
+                journal_replay_checkpoint(replay, &reader);
+                break;
+            case JOURNAL_STEP:
+                journal_replay_step(replay, &reader);
+                break;
+            case JOURNAL_DABS:
+                journal_replay_dabs(replay, &reader);
+                break;
+            case JOURNAL_TILES:
+                journal_replay_tiles(replay, &reader);
+                break;
+            case JOURNAL_UNDO:
+                // The following tiles restore the result, even if the step
+                // being undone happened before the last checkpoint
+                undo_undo(replay->undo);
+                replay->after_undo = true;
+                break;
+            case JOURNAL_REDO:
+                undo_redo(replay->undo);
+                replay->after_undo = true;
+                break;
+            case JOURNAL_CLEAR:
+                undo_clear(replay->undo);
+                break;
+            default:
+                printf("Skipping unknown journal record: %d\n", type);
+                break;
+        }
+
+        if (reader.error) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool
+journal_recover(struct Journal *journal, struct Undo *undo, int *current_team)
+{
+    TRACE_BEGIN("journal_recover");
+
+    FILE *fp = fopen(journal->filename, "rb");
+    if (!fp) {
+        TRACE_END("journal_recover");
+        return false;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size_t length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    uint8_t *data = malloc(length);
+    if (fread(data, 1, length, fp) != length) {
+        length = 0;
+    }
+    fclose(fp);
+
+    struct JournalReader reader = { data, length, 0, false };
+    const uint8_t *magic = journal_get(&reader, sizeof(JOURNAL_MAGIC));
+    if (!magic || memcmp(magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) {
+        printf("Not a valid journal: %s\n", journal->filename);
+        free(data);
+        TRACE_END("journal_recover");
+        return false;
+    }
+
+    struct JournalReplay replay = { journal, undo, *current_team, false };
+
+    undo_clear(undo);
+
+    int blocks = 0;
+    while (reader.offset < reader.length) {
+        uint32_t raw_length = journal_get_u32(&reader);
+        uint32_t compressed_length = journal_get_u32(&reader);
+        uint32_t checksum = journal_get_u32(&reader);
+        const uint8_t *compressed = journal_get(&reader, compressed_length);
+
+        if (!compressed || crc32(0, compressed, compressed_length) != checksum) {
+            // Torn write at the end of the journal, everything before is fine
+            printf("Journal truncated after %d blocks\n", blocks);
+            break;
+        }
+
+        uint8_t *raw = malloc(raw_length);
+        uLongf uncompressed_length = raw_length;
+        bool ok = (uncompress(raw, &uncompressed_length, compressed, compressed_length) == Z_OK &&
+                uncompressed_length == raw_length && journal_replay_block(&replay, raw, raw_length));
+        free(raw);
+
+        if (!ok) {
+            printf("Corrupt journal block %d\n", blocks);
+            break;
+        }
+
+        ++blocks;
+    }
+
+    free(data);
+
+    printf("Recovered %d journal blocks\n", blocks);
+    *current_team = replay.team;
+
+    TRACE_END("journal_recover");
+    return blocks > 0;
+}
+
+bool
+journal_start(struct Journal *journal, int current_team)
+{
+    journal->fp = fopen(journal->filename, "wb");
+    if (!journal->fp) {
+        printf("Could not create journal: %s\n", journal->filename);
+        return false;
+    }
+
+    fwrite(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC), 1, journal->fp);
+    fflush(journal->fp);
+
+    journal->mutex = SDL_CreateMutex();
+    journal->cond = SDL_CreateCond();
+    journal->thread = SDL_CreateThread(journal_writer_thread, "journal", journal);
+    journal->running = true;
+
+    journal_touch(journal, current_team);
+    journal_checkpoint(journal, current_team);
+
+    return true;
+}
+
+void
+journal_step(struct Journal *journal, int team, const char *label, bool stroke)
+{
+    if (!journal_active(journal)) {
+        return;
+    }
+
+    size_t label_length = strlen(label);
+
+    journal_record_begin(journal, JOURNAL_STEP);
+    journal_put_u16(&journal->record, team);
+    journal_put_u8(&journal->record, stroke ? JOURNAL_STEP_STROKE : 0);
+    journal_put_u16(&journal->record, label_length);
+    journal_put(&journal->record, label, label_length);
+    journal_record_commit(journal, false);
+
+    journal_touch(journal, team);
+}
+
+void
+journal_dabs_begin(struct Journal *journal, uint32_t color, float alpha_factor)
+{
+    if (!journal_active(journal)) {
+        return;
+    }
+
+    journal_record_begin(journal, JOURNAL_DABS);
+    journal_put_u32(&journal->record, color);
+    journal_put_f32(&journal->record, alpha_factor);
+
+    journal->dab_count_offset = journal->record.length;
+    journal->dab_count = 0;
+    journal_put_u32(&journal->record, 0);
+}
+
+void
+journal_dab(struct Journal *journal, int index, int u, int v, float alpha)
+{
+    if (!journal_active(journal)) {
+        return;
+    }
+
+    journal_put_u8(&journal->record, index);
+    journal_put_u16(&journal->record, u);
+    journal_put_u16(&journal->record, v);
+    journal_put_f32(&journal->record, alpha);
+
+    ++journal->dab_count;
+}
+
+void
+journal_dabs_end(struct Journal *journal)
+{
+    if (!journal_active(journal)) {
+        return;
+    }
+
+    if (journal->dab_count == 0) {
+        journal->record.length = 0;
+        return;
+    }
+
+    memcpy(journal->record.data + journal->dab_count_offset, &journal->dab_count, sizeof(journal->dab_count));
+    journal_record_commit(journal, false);
+}
+
+static void
+journal_operation_tiles(struct Journal *journal, struct UndoOperation *op)
+{
+    int team;
+    if (!journal_find_material(journal, op->material, &team)) {
+        return;
+    }
+
+    journal_record_begin(journal, JOURNAL_TILES);
+    journal_put_u16(&journal->record, team);
+    journal_put_u8(&journal->record, op->material->index);
+
+    size_t count_offset = journal->record.length;
+    uint32_t count = 0;
+    journal_put_u32(&journal->record, 0);
+
+    // Colors of a palette are used everywhere, and a surface that leaving or
+    // entering indexed mode freed cannot be compared: store the whole image once
+    bool whole = undo_operation_is_palette(op) || op->surface == NULL;
+
+    // Always the RGBA composite, the journal does not know about layers or indices
+    const uint32_t *pixels = material_rgba(op->material);
+
+    struct UndoTile *tile = op->tiles;
+    while (tile != NULL) {
+        // Only store tiles whose contents actually changed
+        if (op->surface == NULL || undo_tile_modified(op, tile)) {
+            int x, y, w, h;
+            if (whole) {
+                x = y = 0;
+                w = op->material->width;
+                h = op->material->height;
+            } else {
+                undo_tile_rect(op, tile->tile, &x, &y, &w, &h);
+            }
+
+            journal_put_u16(&journal->record, x);
+            journal_put_u16(&journal->record, y);
+            journal_put_u16(&journal->record, w);
+            journal_put_u16(&journal->record, h);
+            for (int row=0; row<h; ++row) {
+                journal_put(&journal->record, pixels + (y + row) * op->material->width + x, w * sizeof(uint32_t));
+            }
+
+            ++count;
+
+            if (whole) {
+                break;
+            }
+        }
+
+        tile = tile->next;
+    }
+
+    if (count == 0) {
+        journal->record.length = 0;
+        return;
+    }
+
+    memcpy(journal->record.data + count_offset, &count, sizeof(count));
+    journal_record_commit(journal, false);
+
+    journal_touch(journal, team);
+}
+
+void
+journal_step_tiles(struct Journal *journal, struct UndoStep *step)
+{
+    if (!journal_active(journal) || step == NULL) {
+        return;
+    }
+
+    struct UndoOperation *op = step->operations;
+    while (op != NULL) {
+        journal_operation_tiles(journal, op);
+        op = op->next;
+    }
+}
+
+void
+journal_undo(struct Journal *journal, struct UndoStep *step, bool redo)
+{
+    if (!journal_active(journal)) {
+        return;
+    }
+
+    journal_record_begin(journal, redo ? JOURNAL_REDO : JOURNAL_UNDO);
+    journal_record_commit(journal, false);
+
+    journal_step_tiles(journal, step);
+}
+
+void
+journal_clear(struct Journal *journal)
+{
+    if (!journal_active(journal)) {
+        return;
+    }
+
+    journal_record_begin(journal, JOURNAL_CLEAR);
+    journal_record_commit(journal, false);
+}
+
+void
+journal_materials(struct Journal *journal, int team)
+{
+    if (!journal_active(journal)) {
+        return;
+    }
+
+    for (int index=0; index<JOURNAL_MAX_MATERIALS; ++index) {
+        struct Material *material = journal_get_material(journal, team, index);
+        if (!material) {
+            continue;
+        }
+
+        journal_record_begin(journal, JOURNAL_TILES);
+        journal_put_u16(&journal->record, team);
+        journal_put_u8(&journal->record, index);
+        journal_put_u32(&journal->record, 1);
+        journal_put_u16(&journal->record, 0);
+        journal_put_u16(&journal->record, 0);
+        journal_put_u16(&journal->record, material->width);
+        journal_put_u16(&journal->record, material->height);
+        journal_put(&journal->record, material_rgba(material), sizeof(uint32_t) * material->width * material->height);
+        journal_record_commit(journal, false);
+    }
+
+    journal_touch(journal, team);
+}
+
+void
+journal_checkpoint(struct Journal *journal, int current_team)
+{
+    if (!journal_active(journal)) {
+        return;
+    }
+
+    TRACE_BEGIN("journal_checkpoint");
+
+    int count = 0;
+    for (int team=0; team<journal->host.num_teams; ++team) {
+        for (int index=0; index<JOURNAL_MAX_MATERIALS; ++index) {
+            if (journal->team_modified[team] && journal_get_material(journal, team, index)) {
+                ++count;
+            }
+        }
+    }
+
+    journal_record_begin(journal, JOURNAL_CHECKPOINT);
+    journal_put_u16(&journal->record, current_team);
+    journal_put_u16(&journal->record, count);
+
+    for (int team=0; team<journal->host.num_teams; ++team) {
+        for (int index=0; index<JOURNAL_MAX_MATERIALS; ++index) {
+            struct Material *material = journal_get_material(journal, team, index);
+            if (!journal->team_modified[team] || !material) {
+                continue;
+            }
+
+            journal_put_u16(&journal->record, team);
+            journal_put_u8(&journal->record, index);
+            journal_put_u16(&journal->record, material->width);
+            journal_put_u16(&journal->record, material->height);
+            journal_put(&journal->record, material_rgba(material), sizeof(uint32_t) * material->width * material->height);
+        }
+    }
+
+    journal_record_commit(journal, true);
+
+    journal->bytes_since_checkpoint = 0;
+    journal->last_checkpoint_ticks = SDL_GetTicks();
+
+    TRACE_END("journal_checkpoint");
+}
+
+void
+journal_tick(struct Journal *journal, int current_team)
+{
+    if (!journal_active(journal) || journal->bytes_since_checkpoint == 0) {
+        return;
+    }
+
+    if (journal->bytes_since_checkpoint >= JOURNAL_CHECKPOINT_BYTES ||
+            SDL_GetTicks() - journal->last_checkpoint_ticks >= JOURNAL_CHECKPOINT_INTERVAL_MS) {
+        journal_checkpoint(journal, current_team);
+    }
+}
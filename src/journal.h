@@ -0,0 +1,95 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "shipmodelformat.h"
+#include "undo.h"
+
+/**
+ * Crash recovery journal.
+ *
+ * Edits are appended to an on-disk journal as they happen: the parameters of
+ * every brush dab, the after-images of tiles changed by imports, quantization
+ * and undo/redo, and undo history markers. A background thread batches the
+ * records into zlib-compressed blocks and fsyncs them. Periodic checkpoints
+ * (a snapshot of all modified materials) start a fresh journal file, so the
+ * amount of data that has to be replayed on recovery stays small.
+ **/
+
+#define JOURNAL_MAX_MATERIALS 4
+
+struct JournalHost {
+    int num_teams;
+    struct Material *(*get_material)(int team, int index, void *user_data);
+    void *user_data;
+};
+
+struct Journal;
+
+struct Journal *
+journal_new(const char *filename, const struct JournalHost *host);
+
+void
+journal_free(struct Journal *journal, bool discard);
+
+bool
+journal_has_recovery(struct Journal *journal);
+
+bool
+journal_recover(struct Journal *journal, struct Undo *undo, int *current_team);
+
+bool
+journal_start(struct Journal *journal, int current_team);
+
+void
+journal_step(struct Journal *journal, int team, const char *label, bool stroke);
+
+void
+journal_dabs_begin(struct Journal *journal, uint32_t color, float alpha_factor);
+
+void
+journal_dab(struct Journal *journal, int index, int u, int v, float alpha);
+
+void
+journal_dabs_end(struct Journal *journal);
+
+void
+journal_step_tiles(struct Journal *journal, struct UndoStep *step);
+
+void
+journal_undo(struct Journal *journal, struct UndoStep *step, bool redo);
+
+void
+journal_clear(struct Journal *journal);
+
+void
+journal_materials(struct Journal *journal, int team);
+
+void
+journal_checkpoint(struct Journal *journal, int current_team);
+
+void
+journal_tick(struct Journal *journal, int current_team);
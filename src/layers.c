@@ -0,0 +1,462 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "layers.h"
+#include "memstat.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LAYERS_KERNEL_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LAYERS_KERNEL_NEON
+#include <arm_neon.h>
+#endif
+
+static const char *
+LAYER_BLEND_NAMES[LAYER_BLEND_COUNT] = {
+    "normal",
+    "multiply",
+    "screen",
+};
+
+/**
+ * All kernels compute, per channel (s = layer, premultiplied, d = below):
+ *
+ *   s' = s * opacity / 255, a' = alpha(s')
+ *   normal:   d = s' + d * (255 - a') / 255
+ *   multiply: d = s' * d / 255 + d * (255 - a') / 255
+ *   screen:   d = s' + d - s' * d / 255
+ *
+ * The alpha channel always uses the "normal" expression, results are
+ * clamped to 255. Divisions are done like in brush.c.
+ **/
+
+static inline uint32_t
+layers_div255(uint32_t t)
+{
+    return (t + 1 + (t >> 8)) >> 8;
+}
+
+static void
+layers_blend_scalar(uint32_t *dst, const uint32_t *src, size_t count, enum LayerBlend blend, uint8_t opacity)
+{
+    for (size_t i=0; i<count; ++i) {
+        uint32_t s = src[i];
+        uint32_t d = dst[i];
+
+        uint32_t sa = layers_div255((s >> 24) * opacity);
+        if (sa == 0) {
+            // Premultiplied, so the color is zero too and nothing changes
+            continue;
+        }
+
+        uint32_t result = 0;
+        for (int shift=0; shift<32; shift+=8) {
+            uint32_t sc = layers_div255(((s >> shift) & 0xFF) * opacity);
+            uint32_t dc = (d >> shift) & 0xFF;
+            uint32_t below = layers_div255(dc * (255 - sa));
+
+            uint32_t value;
+            if (shift == 24 || blend == LAYER_BLEND_NORMAL) {
+                value = sc + below;
+            } else if (blend == LAYER_BLEND_MULTIPLY) {
+                value = layers_div255(sc * dc) + below;
+            } else {
+                value = sc + dc - layers_div255(sc * dc);
+            }
+
+            result |= ((value > 255) ? 255 : value) << shift;
+        }
+
+        dst[i] = result;
+    }
+}
+
+#if defined(LAYERS_KERNEL_SSE2)
+static inline __m128i
+layers_div255_epi16(__m128i t)
+{
+    return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t, _mm_set1_epi16(1)), _mm_srli_epi16(t, 8)), 8);
+}
+
+static inline __m128i
+layers_blend_epi16(__m128i s, __m128i d, __m128i opacity, __m128i alpha_lanes, enum LayerBlend blend)
+{
+    s = layers_div255_epi16(_mm_mullo_epi16(s, opacity));
+
+    // replicate alpha into all four channels of each pixel
+    __m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i below = layers_div255_epi16(_mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(255), sa)));
+    __m128i normal = _mm_add_epi16(s, below);
+
+    __m128i result;
+    if (blend == LAYER_BLEND_MULTIPLY) {
+        result = _mm_add_epi16(layers_div255_epi16(_mm_mullo_epi16(s, d)), below);
+    } else if (blend == LAYER_BLEND_SCREEN) {
+        result = _mm_sub_epi16(_mm_add_epi16(s, d), layers_div255_epi16(_mm_mullo_epi16(s, d)));
+    } else {
+        return normal;
+    }
+
+    return _mm_or_si128(_mm_and_si128(alpha_lanes, normal), _mm_andnot_si128(alpha_lanes, result));
+}
+
+static size_t
+layers_blend_simd(uint32_t *dst, const uint32_t *src, size_t count, enum LayerBlend blend, uint8_t opacity)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i opacity16 = _mm_set1_epi16(opacity);
+    const __m128i alpha_lanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+
+        __m128i lo = layers_blend_epi16(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero), opacity16, alpha_lanes, blend);
+        __m128i hi = layers_blend_epi16(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero), opacity16, alpha_lanes, blend);
+
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+
+    return i;
+}
+#elif defined(LAYERS_KERNEL_NEON)
+static inline uint16x8_t
+layers_div255_u16(uint16x8_t t)
+{
+    return vshrq_n_u16(vaddq_u16(vaddq_u16(t, vdupq_n_u16(1)), vshrq_n_u16(t, 8)), 8);
+}
+
+static inline uint16x8_t
+layers_blend_u16(uint16x8_t s, uint16x8_t d, uint16_t opacity, uint16x8_t alpha_lanes, enum LayerBlend blend)
+{
+    s = layers_div255_u16(vmulq_n_u16(s, opacity));
+
+    // replicate alpha into all four channels of each pixel
+    uint16x4_t sa_lo = vdup_lane_u16(vget_low_u16(s), 3);
+    uint16x4_t sa_hi = vdup_lane_u16(vget_high_u16(s), 3);
+    uint16x8_t sa = vcombine_u16(sa_lo, sa_hi);
+
+    uint16x8_t below = layers_div255_u16(vmulq_u16(d, vsubq_u16(vdupq_n_u16(255), sa)));
+    uint16x8_t normal = vaddq_u16(s, below);
+
+    uint16x8_t result;
+    if (blend == LAYER_BLEND_MULTIPLY) {
+        result = vaddq_u16(layers_div255_u16(vmulq_u16(s, d)), below);
+    } else if (blend == LAYER_BLEND_SCREEN) {
+        result = vsubq_u16(vaddq_u16(s, d), layers_div255_u16(vmulq_u16(s, d)));
+    } else {
+        return normal;
+    }
+
+    return vbslq_u16(alpha_lanes, normal, result);
+}
+
+static size_t
+layers_blend_simd(uint32_t *dst, const uint32_t *src, size_t count, enum LayerBlend blend, uint8_t opacity)
+{
+    static const uint16_t
+    ALPHA_LANES[8] = { 0, 0, 0, 0xFFFF, 0, 0, 0, 0xFFFF };
+    const uint16x8_t alpha_lanes = vld1q_u16(ALPHA_LANES);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        uint8x16_t s = vreinterpretq_u8_u32(vld1q_u32(src + i));
+        uint8x16_t d = vreinterpretq_u8_u32(vld1q_u32(dst + i));
+
+        uint16x8_t lo = layers_blend_u16(vmovl_u8(vget_low_u8(s)), vmovl_u8(vget_low_u8(d)), opacity, alpha_lanes, blend);
+        uint16x8_t hi = layers_blend_u16(vmovl_u8(vget_high_u8(s)), vmovl_u8(vget_high_u8(d)), opacity, alpha_lanes, blend);
+
+        vst1q_u32(dst + i, vreinterpretq_u32_u8(vcombine_u8(vqmovn_u16(lo), vqmovn_u16(hi))));
+    }
+
+    return i;
+}
+#endif
+
+const char *
+layers_kernel_name()
+{
+#if defined(LAYERS_KERNEL_SSE2)
+    return "sse2";
+#elif defined(LAYERS_KERNEL_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+const char *
+layers_blend_name(enum LayerBlend blend)
+{
+    return (blend >= 0 && blend < LAYER_BLEND_COUNT) ? LAYER_BLEND_NAMES[blend] : "?";
+}
+
+void
+layers_blend_row(uint32_t *dst, const uint32_t *src, size_t count, enum LayerBlend blend, uint8_t opacity)
+{
+    size_t done = 0;
+
+#if defined(LAYERS_KERNEL_SSE2) || defined(LAYERS_KERNEL_NEON)
+    done = layers_blend_simd(dst, src, count, blend, opacity);
+#endif
+
+    layers_blend_scalar(dst + done, src + done, count - done, blend, opacity);
+}
+
+static size_t
+layers_buffer_size(const struct LayerStack *stack)
+{
+    return sizeof(uint32_t) * stack->width * stack->height;
+}
+
+void
+layers_enable(struct Material *material)
+{
+    if (material->layers != NULL) {
+        return;
+    }
+
+    struct LayerStack *stack = calloc(1, sizeof(struct LayerStack));
+
+    stack->width = material->width;
+    stack->height = material->height;
+    stack->tiles_x = (stack->width + LAYERS_TILE_SIZE - 1) / LAYERS_TILE_SIZE;
+    stack->tiles_y = (stack->height + LAYERS_TILE_SIZE - 1) / LAYERS_TILE_SIZE;
+    stack->dirty = calloc(stack->tiles_x * stack->tiles_y, sizeof(uint8_t));
+
+    // The base layer takes over the existing buffer, so undo history stays valid
+    stack->count = 1;
+    stack->active = 0;
+    stack->layers[0].pixels = (uint32_t *)material->pixels;
+    stack->layers[0].blend = LAYER_BLEND_NORMAL;
+    stack->layers[0].opacity = 255;
+    stack->layers[0].visible = true;
+
+    material->pixels = malloc(layers_buffer_size(stack));
+    memcpy(material->pixels, stack->layers[0].pixels, layers_buffer_size(stack));
+    material->layers = stack;
+
+    memstat_add(MEMSTAT_LAYERS, sizeof(struct LayerStack) + stack->tiles_x * stack->tiles_y + layers_buffer_size(stack));
+}
+
+uint32_t *
+layers_add(struct Material *material)
+{
+    layers_enable(material);
+
+    struct LayerStack *stack = material->layers;
+    if (stack->count == LAYERS_MAX) {
+        return NULL;
+    }
+
+    int index = stack->active + 1;
+    memmove(&stack->layers[index + 1], &stack->layers[index], sizeof(struct Layer) * (stack->count - index));
+    stack->count++;
+
+    struct Layer *layer = &stack->layers[index];
+    layer->pixels = calloc(stack->width * stack->height, sizeof(uint32_t));
+    layer->blend = LAYER_BLEND_NORMAL;
+    layer->opacity = 255;
+    layer->visible = true;
+
+    stack->active = index;
+
+    memstat_add(MEMSTAT_LAYERS, layers_buffer_size(stack));
+
+    // A new layer is transparent, the composite does not change
+    return layer->pixels;
+}
+
+void
+layers_remove(struct Material *material, int index)
+{
+    struct LayerStack *stack = material->layers;
+    if (stack == NULL || index <= 0 || index >= stack->count) {
+        return;
+    }
+
+    free(stack->layers[index].pixels);
+    memstat_sub(MEMSTAT_LAYERS, layers_buffer_size(stack));
+
+    memmove(&stack->layers[index], &stack->layers[index + 1], sizeof(struct Layer) * (stack->count - index - 1));
+    stack->count--;
+
+    if (stack->active >= index) {
+        stack->active--;
+    }
+
+    layers_mark_all(stack);
+}
+
+size_t
+layers_stack_bytes(const struct LayerStack *stack)
+{
+    // The base buffer belongs to the material, the composite takes its place
+    return sizeof(struct LayerStack) + stack->tiles_x * stack->tiles_y + stack->count * layers_buffer_size(stack);
+}
+
+struct LayerStack *
+layers_detach(struct Material *material)
+{
+    struct LayerStack *stack = material->layers;
+    if (stack == NULL) {
+        return NULL;
+    }
+
+    layers_composite(material);
+
+    // The base buffer becomes the material buffer again
+    uint32_t *base = stack->layers[0].pixels;
+    memcpy(base, material->pixels, layers_buffer_size(stack));
+    stack->composite = (uint32_t *)material->pixels;
+    material->pixels = (char *)base;
+    material->layers = NULL;
+
+    memstat_sub(MEMSTAT_LAYERS, layers_stack_bytes(stack));
+
+    return stack;
+}
+
+void
+layers_attach(struct Material *material, struct LayerStack *stack)
+{
+    material->pixels = (char *)stack->composite;
+    stack->composite = NULL;
+    material->layers = stack;
+
+    memstat_add(MEMSTAT_LAYERS, layers_stack_bytes(stack));
+
+    layers_mark_all(stack);
+}
+
+void
+layers_free(struct LayerStack *stack)
+{
+    if (stack == NULL) {
+        return;
+    }
+
+    for (int i=1; i<stack->count; ++i) {
+        free(stack->layers[i].pixels);
+    }
+
+    free(stack->composite);
+    free(stack->dirty);
+    free(stack);
+}
+
+void
+layers_flatten(struct Material *material)
+{
+    layers_free(layers_detach(material));
+}
+
+void
+layers_mark_rect(struct LayerStack *stack, int x, int y, int w, int h)
+{
+    if (stack == NULL || w <= 0 || h <= 0) {
+        return;
+    }
+
+    int tx0 = x / LAYERS_TILE_SIZE;
+    int ty0 = y / LAYERS_TILE_SIZE;
+    int tx1 = (x + w - 1) / LAYERS_TILE_SIZE;
+    int ty1 = (y + h - 1) / LAYERS_TILE_SIZE;
+
+    for (int ty=ty0; ty<=ty1 && ty<stack->tiles_y; ++ty) {
+        for (int tx=tx0; tx<=tx1 && tx<stack->tiles_x; ++tx) {
+            stack->dirty[ty * stack->tiles_x + tx] = 1;
+        }
+    }
+
+    stack->any_dirty = true;
+}
+
+void
+layers_mark_texels(struct LayerStack *stack, const uint32_t *index, size_t count)
+{
+    if (stack == NULL || count == 0) {
+        return;
+    }
+
+    for (size_t i=0; i<count; ++i) {
+        int x = index[i] % stack->width;
+        int y = index[i] / stack->width;
+        stack->dirty[(y / LAYERS_TILE_SIZE) * stack->tiles_x + (x / LAYERS_TILE_SIZE)] = 1;
+    }
+
+    stack->any_dirty = true;
+}
+
+void
+layers_mark_all(struct LayerStack *stack)
+{
+    if (stack != NULL) {
+        layers_mark_rect(stack, 0, 0, stack->width, stack->height);
+    }
+}
+
+bool
+layers_composite(struct Material *material)
+{
+    struct LayerStack *stack = material->layers;
+    if (stack == NULL || !stack->any_dirty) {
+        return false;
+    }
+
+    uint32_t *composite = (uint32_t *)material->pixels;
+
+    for (int tile=0; tile<stack->tiles_x*stack->tiles_y; ++tile) {
+        if (!stack->dirty[tile]) {
+            continue;
+        }
+
+        int x = (tile % stack->tiles_x) * LAYERS_TILE_SIZE;
+        int y = (tile / stack->tiles_x) * LAYERS_TILE_SIZE;
+        int w = (x + LAYERS_TILE_SIZE <= stack->width) ? LAYERS_TILE_SIZE : (stack->width - x);
+        int h = (y + LAYERS_TILE_SIZE <= stack->height) ? LAYERS_TILE_SIZE : (stack->height - y);
+
+        for (int row=y; row<y+h; ++row) {
+            uint32_t *dst = composite + row * stack->width + x;
+            memcpy(dst, stack->layers[0].pixels + row * stack->width + x, sizeof(uint32_t) * w);
+
+            for (int i=1; i<stack->count; ++i) {
+                const struct Layer *layer = &stack->layers[i];
+                if (layer->visible && layer->opacity > 0) {
+                    layers_blend_row(dst, layer->pixels + row * stack->width + x, w, layer->blend, layer->opacity);
+                }
+            }
+        }
+
+        stack->dirty[tile] = 0;
+    }
+
+    stack->any_dirty = false;
+    material->pixels_dirty = true;
+
+    return true;
+}
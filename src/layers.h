@@ -0,0 +1,126 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "shipmodelformat.h"
+
+/**
+ * Layer stack of a material.
+ *
+ * Layer 0 is the opaque base, the layers above it are stored with
+ * premultiplied alpha and are blended on top (normal, multiply or screen,
+ * with a per-layer opacity). The composite is kept in material->pixels, so
+ * uploading, quantizing and exporting work as before. Edits only mark the
+ * LAYERS_TILE_SIZE x LAYERS_TILE_SIZE tiles they touch, and layers_composite()
+ * only recomputes those tiles (with a SIMD kernel where available).
+ **/
+
+#define LAYERS_MAX 8
+#define LAYERS_TILE_SIZE 16
+
+enum LayerBlend {
+    LAYER_BLEND_NORMAL = 0,
+    LAYER_BLEND_MULTIPLY,
+    LAYER_BLEND_SCREEN,
+
+    LAYER_BLEND_COUNT,
+};
+
+struct Layer {
+    uint32_t *pixels;
+    enum LayerBlend blend;
+    uint8_t opacity;
+    bool visible;
+};
+
+struct LayerStack {
+    int width;
+    int height;
+    int tiles_x;
+    int tiles_y;
+
+    int count;
+    int active;
+    struct Layer layers[LAYERS_MAX];
+
+    // One entry per tile, non-zero if the composite of the tile is outdated
+    uint8_t *dirty;
+    bool any_dirty;
+
+    // The composite while the stack is detached from its material, else NULL
+    uint32_t *composite;
+};
+
+void
+layers_enable(struct Material *material);
+
+uint32_t *
+layers_add(struct Material *material);
+
+void
+layers_remove(struct Material *material, int index);
+
+void
+layers_flatten(struct Material *material);
+
+// Flattens into the base layer, but keeps the stack for layers_attach() (NULL if no layers)
+struct LayerStack *
+layers_detach(struct Material *material);
+
+// Restores a detached stack; the base layer must be the material buffer
+void
+layers_attach(struct Material *material, struct LayerStack *stack);
+
+// Frees a detached stack (except the base layer, which is the material buffer)
+void
+layers_free(struct LayerStack *stack);
+
+// Memory of the stack besides the base layer
+size_t
+layers_stack_bytes(const struct LayerStack *stack);
+
+void
+layers_mark_rect(struct LayerStack *stack, int x, int y, int w, int h);
+
+void
+layers_mark_texels(struct LayerStack *stack, const uint32_t *index, size_t count);
+
+void
+layers_mark_all(struct LayerStack *stack);
+
+bool
+layers_composite(struct Material *material);
+
+const char *
+layers_blend_name(enum LayerBlend blend);
+
+const char *
+layers_kernel_name();
+
+void
+layers_blend_row(uint32_t *dst, const uint32_t *src, size_t count, enum LayerBlend blend, uint8_t opacity);
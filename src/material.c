@@ -0,0 +1,193 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "material.h"
+#include "layers.h"
+#include "indexed.h"
+#include "colorhist.h"
+#include "memstat.h"
+
+#include <string.h>
+
+#include <SDL_opengl.h>
+
+// RGBA expansion of an indexed image, shared by all materials (see material_rgba())
+static uint32_t *
+g_material_rgba = NULL;
+
+static size_t
+g_material_rgba_length = 0;
+
+char *
+material_surface(struct Material *material)
+{
+    if (material->layers != NULL) {
+        return (char *)material->layers->layers[material->layers->active].pixels;
+    }
+
+    if (material->indices != NULL) {
+        return (char *)material->indices;
+    }
+
+    return material->pixels;
+}
+
+bool
+material_surface_is_layer(struct Material *material)
+{
+    return material->layers != NULL && material->layers->active > 0;
+}
+
+int
+material_texel_bits(struct Material *material)
+{
+    return (material->indices != NULL) ? 4 : 32;
+}
+
+const uint32_t *
+material_rgba(struct Material *material)
+{
+    if (material->indices == NULL) {
+        return (const uint32_t *)material->pixels;
+    }
+
+    size_t length = material->width * material->height;
+    if (length > g_material_rgba_length) {
+        memstat_sub(MEMSTAT_MATERIALS, sizeof(uint32_t) * g_material_rgba_length);
+        free(g_material_rgba);
+        g_material_rgba = malloc(sizeof(uint32_t) * length);
+        g_material_rgba_length = length;
+        memstat_add(MEMSTAT_MATERIALS, sizeof(uint32_t) * g_material_rgba_length);
+    }
+
+    indexed_expand(material, g_material_rgba);
+    return g_material_rgba;
+}
+
+void
+material_touch(struct Material *material, int x, int y, int w, int h)
+{
+    layers_mark_rect(material->layers, x, y, w, h);
+    colorhist_mark_rect(material->colors, x, y, w, h);
+}
+
+void
+material_touch_texels(struct Material *material, const uint32_t *index, size_t count)
+{
+    layers_mark_texels(material->layers, index, count);
+    colorhist_mark_texels(material->colors, index, count);
+}
+
+void
+material_upload(struct Material *material)
+{
+    layers_composite(material);
+
+    const uint32_t *rgba = material_rgba(material);
+
+    if (material->indices != NULL) {
+        // The histogram keeps a copy of the pixels, indexed_distinct() needs none
+        colorhist_free(material->colors);
+        material->colors = NULL;
+    } else if (material->colors == NULL) {
+        material->colors = colorhist_new(rgba, material->coverage, material->width, material->height);
+    } else {
+        colorhist_update(material->colors, rgba);
+    }
+
+    const void *shown = rgba;
+    if (material->preview != NULL) {
+        memcpy(material->preview, rgba, sizeof(uint32_t) * material->width * material->height);
+        quantize_fast(material->preview, material->coverage, material->width, material->height,
+                QUANTIZE_MAX_COLORS, &material->preview_options);
+        shown = material->preview;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, material->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, material->width, material->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, shown);
+}
+
+void
+material_set_preview(struct Material *material, const struct QuantizeOptions *options)
+{
+    size_t size = sizeof(uint32_t) * material->width * material->height;
+
+    if (options == NULL) {
+        if (material->preview == NULL) {
+            return;
+        }
+
+        free(material->preview);
+        material->preview = NULL;
+        memstat_sub(MEMSTAT_MATERIALS, size);
+    } else {
+        if (material->preview == NULL) {
+            material->preview = malloc(size);
+            memstat_add(MEMSTAT_MATERIALS, size);
+        }
+
+        material->preview_options = *options;
+    }
+
+    material_upload(material);
+}
+
+void
+material_plot(struct Material *material, int u, int v, float alpha, uint32_t color, float alpha_factor)
+{
+    uint32_t *pixels_rgba = (uint32_t *)material->pixels;
+    uint8_t *drawn_a = (uint8_t *)material->pixels_drawn;
+
+    union {
+        uint32_t u32;
+        uint8_t u8[4];
+    } color1, color2, color3;
+
+    color1.u32 = 0xFF000000 | color;
+    color2.u32 = pixels_rgba[v + u*material->width];
+
+    alpha = 1.f - alpha;
+    alpha *= alpha_factor;
+
+    uint8_t alpha_int = 255 * alpha;
+
+    if (alpha_int < drawn_a[v + u*material->width]) {
+        alpha_int = 0;
+    }
+
+    for (int i=0; i<3; ++i) {
+        uint16_t v = (((uint16_t)color1.u8[i] * alpha_int) + ((uint16_t)color2.u8[i] * (255 - alpha_int))) / 255;
+        if (v > 255) {
+            v = 255;
+        }
+        color3.u8[i] = (uint8_t)v;
+    }
+
+    color3.u32 |= 0xFF000000;
+
+    pixels_rgba[v + u*material->width] = color3.u32;
+    drawn_a[v + u*material->width] += alpha_int;
+
+    colorhist_mark_rect(material->colors, v, u, 1, 1);
+    material->pixels_dirty = true;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "shipmodelformat.h"
+
+// Buffer that edits go to (the active layer, if the material has layers)
+char *
+material_surface(struct Material *material);
+
+bool
+material_surface_is_layer(struct Material *material);
+
+int
+material_texel_bits(struct Material *material);
+
+// The RGBA image; indexed images are expanded into a buffer that the next call reuses
+const uint32_t *
+material_rgba(struct Material *material);
+
+// Mark texels of the surface as modified, so the composite gets updated
+void
+material_touch(struct Material *material, int x, int y, int w, int h);
+
+void
+material_touch_texels(struct Material *material, const uint32_t *index, size_t count);
+
+void
+material_upload(struct Material *material);
+
+// Shows the image quantized with a fast quantizer (NULL = the image itself)
+void
+material_set_preview(struct Material *material, const struct QuantizeOptions *options);
+
+void
+material_plot(struct Material *material, int u, int v, float alpha, uint32_t color, float alpha_factor);
@@ -0,0 +1,275 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "memstat.h"
+#include "trace.h"
+
+#include <string.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+static const char *
+MEMSTAT_NAMES[MEMSTAT_NUM_CATEGORIES] = {
+    "undo",
+    "wad",
+    "assets",
+    "materials",
+    "gl textures",
+    "quantizer",
+    "scene",
+    "journal",
+    "uv map",
+    "layers",
+};
+
+static const char *
+MEMSTAT_COUNTER_NAMES[MEMSTAT_NUM_CATEGORIES] = {
+    "mem: undo",
+    "mem: wad",
+    "mem: assets",
+    "mem: materials",
+    "mem: gl textures",
+    "mem: quantizer",
+    "mem: scene",
+    "mem: journal",
+    "mem: uv map",
+    "mem: layers",
+};
+
+static struct {
+    size_t live[MEMSTAT_NUM_CATEGORIES];
+    size_t peak[MEMSTAT_NUM_CATEGORIES];
+    size_t allocations[MEMSTAT_NUM_CATEGORIES];
+    size_t budget[MEMSTAT_NUM_CATEGORIES];
+} g_memstat;
+
+#if defined(_WIN32)
+static INIT_ONCE
+g_memstat_once = INIT_ONCE_STATIC_INIT;
+
+static CRITICAL_SECTION
+g_memstat_lock;
+
+static BOOL CALLBACK
+memstat_init_lock(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+    InitializeCriticalSection(&g_memstat_lock);
+    return TRUE;
+}
+
+static void
+memstat_lock(void)
+{
+    InitOnceExecuteOnce(&g_memstat_once, memstat_init_lock, NULL, NULL);
+    EnterCriticalSection(&g_memstat_lock);
+}
+
+static void
+memstat_unlock(void)
+{
+    LeaveCriticalSection(&g_memstat_lock);
+}
+#else
+static pthread_mutex_t
+g_memstat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+memstat_lock(void)
+{
+    pthread_mutex_lock(&g_memstat_lock);
+}
+
+static void
+memstat_unlock(void)
+{
+    pthread_mutex_unlock(&g_memstat_lock);
+}
+#endif
+
+void
+memstat_add(enum MemstatCategory category, size_t bytes)
+{
+    memstat_lock();
+
+    g_memstat.live[category] += bytes;
+    g_memstat.allocations[category]++;
+    if (g_memstat.live[category] > g_memstat.peak[category]) {
+        g_memstat.peak[category] = g_memstat.live[category];
+    }
+
+    memstat_unlock();
+}
+
+void
+memstat_sub(enum MemstatCategory category, size_t bytes)
+{
+    memstat_lock();
+
+    if (bytes > g_memstat.live[category]) {
+        // Unbalanced accounting is a bug at the call site, but don't wrap around
+        printf("memstat: freeing %zu bytes from %s with only %zu bytes live\n",
+                bytes, MEMSTAT_NAMES[category], g_memstat.live[category]);
+        g_memstat.live[category] = 0;
+    } else {
+        g_memstat.live[category] -= bytes;
+    }
+
+    memstat_unlock();
+}
+
+size_t
+memstat_live(enum MemstatCategory category)
+{
+    memstat_lock();
+    size_t result = g_memstat.live[category];
+    memstat_unlock();
+
+    return result;
+}
+
+size_t
+memstat_peak(enum MemstatCategory category)
+{
+    memstat_lock();
+    size_t result = g_memstat.peak[category];
+    memstat_unlock();
+
+    return result;
+}
+
+size_t
+memstat_allocations(enum MemstatCategory category)
+{
+    memstat_lock();
+    size_t result = g_memstat.allocations[category];
+    memstat_unlock();
+
+    return result;
+}
+
+void
+memstat_reset_peak(enum MemstatCategory category)
+{
+    memstat_lock();
+    g_memstat.peak[category] = g_memstat.live[category];
+    memstat_unlock();
+}
+
+size_t
+memstat_total(void)
+{
+    size_t result = 0;
+
+    memstat_lock();
+    for (int i=0; i<MEMSTAT_NUM_CATEGORIES; ++i) {
+        result += g_memstat.live[i];
+    }
+    memstat_unlock();
+
+    return result;
+}
+
+const char *
+memstat_name(enum MemstatCategory category)
+{
+    return MEMSTAT_NAMES[category];
+}
+
+void
+memstat_set_budget(enum MemstatCategory category, size_t bytes)
+{
+    memstat_lock();
+    g_memstat.budget[category] = bytes;
+    memstat_unlock();
+}
+
+bool
+memstat_over_budget(enum MemstatCategory category)
+{
+    memstat_lock();
+    bool result = (g_memstat.budget[category] != 0 && g_memstat.live[category] > g_memstat.budget[category]);
+    memstat_unlock();
+
+    return result;
+}
+
+void
+memstat_format_bytes(size_t bytes, char *buf, size_t len)
+{
+    if (bytes >= 1024 * 1024) {
+        snprintf(buf, len, "%.1f MiB", (double)bytes / (1024.0 * 1024.0));
+    } else if (bytes >= 1024) {
+        snprintf(buf, len, "%.1f KiB", (double)bytes / 1024.0);
+    } else {
+        snprintf(buf, len, "%zu B", bytes);
+    }
+}
+
+void
+memstat_trace_counters(void)
+{
+    if (!trace_enabled()) {
+        return;
+    }
+
+    for (int i=0; i<MEMSTAT_NUM_CATEGORIES; ++i) {
+        trace_counter(MEMSTAT_COUNTER_NAMES[i], (double)memstat_live(i));
+    }
+}
+
+void
+memstat_dump(FILE *fp)
+{
+    char live[32];
+    char peak[32];
+    char budget[32];
+
+    fprintf(fp, "%-12s %12s %12s %12s\n", "category", "live", "peak", "budget");
+
+    for (int i=0; i<MEMSTAT_NUM_CATEGORIES; ++i) {
+        memstat_lock();
+        size_t live_bytes = g_memstat.live[i];
+        size_t peak_bytes = g_memstat.peak[i];
+        size_t budget_bytes = g_memstat.budget[i];
+        memstat_unlock();
+
+        memstat_format_bytes(live_bytes, live, sizeof(live));
+        memstat_format_bytes(peak_bytes, peak, sizeof(peak));
+        if (budget_bytes != 0) {
+            memstat_format_bytes(budget_bytes, budget, sizeof(budget));
+        } else {
+            strcpy(budget, "-");
+        }
+
+        fprintf(fp, "%-12s %12s %12s %12s%s\n", MEMSTAT_NAMES[i], live, peak, budget,
+                (budget_bytes != 0 && live_bytes > budget_bytes) ? "  OVER BUDGET" : "");
+    }
+
+    memstat_format_bytes(memstat_total(), live, sizeof(live));
+    fprintf(fp, "%-12s %12s\n", "total", live);
+}
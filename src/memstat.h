@@ -0,0 +1,99 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Memory accounting: live and peak bytes per category.
+ *
+ * This does not wrap malloc(); allocation sites report the sizes of
+ * long-lived buffers with memstat_add() and memstat_sub(), so numbers are
+ * exact for what is tracked and cost nothing for what is not.
+ **/
+
+enum MemstatCategory {
+    MEMSTAT_UNDO = 0,
+    MEMSTAT_WAD,
+    MEMSTAT_ASSETS,
+    MEMSTAT_MATERIALS,
+    MEMSTAT_GL_TEXTURES,
+    MEMSTAT_QUANTIZER,
+    MEMSTAT_SCENE,
+    MEMSTAT_JOURNAL,
+    MEMSTAT_UVMAP,
+    MEMSTAT_LAYERS,
+
+    MEMSTAT_NUM_CATEGORIES,
+};
+
+void
+memstat_add(enum MemstatCategory category, size_t bytes);
+
+void
+memstat_sub(enum MemstatCategory category, size_t bytes);
+
+size_t
+memstat_live(enum MemstatCategory category);
+
+size_t
+memstat_peak(enum MemstatCategory category);
+
+// Number of memstat_add() calls, i.e. of tracked allocations
+size_t
+memstat_allocations(enum MemstatCategory category);
+
+// Starts measuring the peak from the current live bytes
+void
+memstat_reset_peak(enum MemstatCategory category);
+
+size_t
+memstat_total(void);
+
+const char *
+memstat_name(enum MemstatCategory category);
+
+void
+memstat_set_budget(enum MemstatCategory category, size_t bytes);
+
+bool
+memstat_over_budget(enum MemstatCategory category);
+
+void
+memstat_format_bytes(size_t bytes, char *buf, size_t len);
+
+void
+memstat_trace_counters(void);
+
+void
+memstat_dump(FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
@@ -24,6 +24,8 @@
 
 #include "SDL_syswm.h"
 
+#include <stdbool.h>
+
 void
 nativeui_init(const SDL_SysWMinfo *info, SDL_Window *window);
 
@@ -42,5 +44,8 @@ nativeui_open_file();
 void
 nativeui_show_error(const char *title, const char *message);
 
+bool
+nativeui_ask(const char *title, const char *message);
+
 void
 nativeui_deinit();
@@ -158,6 +158,30 @@ nativeui_show_error(const char *title, const char *message)
     }
 }
 
+bool
+nativeui_ask(const char *title, const char *message)
+{
+    GtkWidget *dialog;
+
+    if (!gtk_init_check(NULL, NULL)) {
+        // Can't ask, assume yes
+        return true;
+    }
+
+    dialog = gtk_message_dialog_new_with_markup(NULL, GTK_DIALOG_MODAL, GTK_MESSAGE_QUESTION, GTK_BUTTONS_YES_NO,
+                "<big>%s</big>\n\n%s", title, message);
+
+    gint response = gtk_dialog_run(GTK_DIALOG(dialog));
+
+    gtk_widget_destroy(dialog);
+
+    while (gtk_events_pending()) {
+        gtk_main_iteration();
+    }
+
+    return response == GTK_RESPONSE_YES;
+}
+
 void
 nativeui_deinit()
 {
@@ -154,6 +154,33 @@ nativeui_show_error(const char *title, const char *message)
     SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, title, message, g.window);
 }
 
+bool
+nativeui_ask(const char *title, const char *message)
+{
+    const SDL_MessageBoxButtonData buttons[] = {
+        { SDL_MESSAGEBOX_BUTTON_ESCAPEKEY_DEFAULT, 0, "No" },
+        { SDL_MESSAGEBOX_BUTTON_RETURNKEY_DEFAULT, 1, "Yes" },
+    };
+
+    const SDL_MessageBoxData data = {
+        SDL_MESSAGEBOX_INFORMATION,
+        g.window,
+        title,
+        message,
+        SDL_arraysize(buttons),
+        buttons,
+        NULL,
+    };
+
+    int button = 0;
+    if (SDL_ShowMessageBox(&data, &button) != 0) {
+        // Can't ask, assume yes
+        return true;
+    }
+
+    return button == 1;
+}
+
 void
 nativeui_deinit()
 {
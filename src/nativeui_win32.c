@@ -213,6 +213,12 @@ nativeui_show_error(const char *title, const char *message)
     MessageBox(g.hwnd, message, title, MB_OK | MB_ICONEXCLAMATION);
 }
 
+bool
+nativeui_ask(const char *title, const char *message)
+{
+    return MessageBox(g.hwnd, message, title, MB_YESNO | MB_ICONQUESTION) == IDYES;
+}
+
 void
 nativeui_deinit()
 {
@@ -36,6 +36,7 @@
 #include "hash.h"
 #include "kirk_engine.h"
 #include "psp-save.h"
+#include "trace.h"
 
 #define SFO_LEN 0x1330
 
@@ -160,21 +161,25 @@ void encrypt_file(FILE *in, FILE *out, const char *name, FILE *sfo_in,
         die("encrypt_file: read %d bytes, %d expected\n", tmp, SFO_LEN);
     }
 
+    TRACE_BEGIN("encrypt");
     if ((tmp = encrypt_data(mode, data, &len, &aligned_len, hash, key))) {
         free(data);
         free(hash);
         die("encrypt_data failed (%d)\n", tmp);
     }
+    TRACE_END("encrypt");
     if ((tmp = fwrite(data, 1, len, out)) != len) {
         free(data);
         free(hash);
         die("encrypt_file: wrote %d bytes, %d expected\n", tmp, len);
     }
     free(data);
+    TRACE_BEGIN("hash");
     if ((tmp = update_hashes(sfo, SFO_LEN, name, hash, key ? 3 : 1))) {
         /*free(hash);*/
         printf("update_hashes returned %d\n", tmp);
     }
+    TRACE_END("hash");
     if ((tmp = fwrite(sfo, 1, SFO_LEN, sfo_out)) != SFO_LEN) {
         free(hash);
         die("encrypt_file: wrote %d bytes, %d expected\n", tmp, SFO_LEN);
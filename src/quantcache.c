@@ -0,0 +1,477 @@
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+
+
+#include "quantcache.h"
+#include "memstat.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+// Cache files are only read back on the machine that wrote them,
+// so all values are stored in native byte order.
+static const char
+QUANTCACHE_MAGIC[8] = { 'S', 'H', 'Q', 'C', 'A', 'C', 'H', 'E' };
+
+struct QuantCacheEntry {
+    struct QuantCacheKey key;
+    int width;
+    int height;
+    int palette_size;
+    uint8_t palette[3 * QUANTCACHE_MAX_COLORS];
+    uint8_t *indices;
+    uint64_t used;
+};
+
+struct QuantCache {
+    size_t budget;
+    uint64_t tick;
+
+    struct QuantCacheEntry *entries;
+    size_t count;
+    size_t capacity;
+
+    struct QuantCacheStats stats;
+
+    // Only set for caches backed by a file
+    char *filename;
+    char *tmp_filename;
+    FILE *fp;
+    size_t file_bytes;
+};
+
+void
+quantcache_key_init(struct QuantCacheKey *key)
+{
+    key->hash[0] = 0xcbf29ce484222325ull;
+    key->hash[1] = 0x243f6a8885a308d3ull;
+}
+
+void
+quantcache_key_add(struct QuantCacheKey *key, const void *data, size_t length)
+{
+    // Two independent lanes: FNV-1a, and a multiply-xorshift mix
+    const uint8_t *bytes = data;
+    uint64_t a = key->hash[0];
+    uint64_t b = key->hash[1];
+
+    for (size_t i=0; i<length; ++i) {
+        a = (a ^ bytes[i]) * 0x100000001b3ull;
+        b = (b ^ bytes[i]) * 0x9e3779b97f4a7c15ull;
+        b ^= b >> 29;
+    }
+
+    key->hash[0] = a;
+    key->hash[1] = b;
+}
+
+static size_t
+quantcache_entry_bytes(const struct QuantCacheEntry *entry)
+{
+    return sizeof(struct QuantCacheEntry) + (size_t)entry->width * entry->height;
+}
+
+static struct QuantCacheEntry *
+quantcache_find(struct QuantCache *cache, const struct QuantCacheKey *key)
+{
+    for (size_t i=0; i<cache->count; ++i) {
+        struct QuantCacheEntry *entry = &cache->entries[i];
+        if (entry->key.hash[0] == key->hash[0] && entry->key.hash[1] == key->hash[1]) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+quantcache_remove(struct QuantCache *cache, size_t index)
+{
+    struct QuantCacheEntry *entry = &cache->entries[index];
+
+    size_t bytes = quantcache_entry_bytes(entry);
+    cache->stats.bytes -= bytes;
+    memstat_sub(MEMSTAT_QUANTIZER, bytes);
+
+    free(entry->indices);
+    cache->entries[index] = cache->entries[--cache->count];
+}
+
+static void
+quantcache_evict(struct QuantCache *cache)
+{
+    // Always keep the most recent entry, even if it alone exceeds the budget
+    while (cache->stats.bytes > cache->budget && cache->count > 1) {
+        size_t oldest = 0;
+        for (size_t i=1; i<cache->count; ++i) {
+            if (cache->entries[i].used < cache->entries[oldest].used) {
+                oldest = i;
+            }
+        }
+
+        quantcache_remove(cache, oldest);
+        cache->stats.evictions++;
+    }
+}
+
+// Takes ownership of entry->indices
+static struct QuantCacheEntry *
+quantcache_insert(struct QuantCache *cache, const struct QuantCacheEntry *entry)
+{
+    if (cache->count == cache->capacity) {
+        cache->capacity = cache->capacity ? cache->capacity * 2 : 64;
+        cache->entries = realloc(cache->entries, cache->capacity * sizeof(struct QuantCacheEntry));
+    }
+
+    struct QuantCacheEntry *result = &cache->entries[cache->count++];
+    *result = *entry;
+    result->used = ++cache->tick;
+
+    size_t bytes = quantcache_entry_bytes(result);
+    cache->stats.bytes += bytes;
+    memstat_add(MEMSTAT_QUANTIZER, bytes);
+
+    return result;
+}
+
+static size_t
+quantcache_write_entry(FILE *fp, const struct QuantCacheEntry *entry)
+{
+    size_t pixels = (size_t)entry->width * entry->height;
+    size_t palette_bytes = 3 * (size_t)entry->palette_size;
+
+    uint32_t fields[3] = { entry->width, entry->height, entry->palette_size };
+
+    size_t raw_length = sizeof(entry->key) + sizeof(fields) + palette_bytes + pixels;
+    uint8_t *raw = malloc(raw_length);
+    uint8_t *dst = raw;
+    memcpy(dst, &entry->key, sizeof(entry->key));
+    dst += sizeof(entry->key);
+    memcpy(dst, fields, sizeof(fields));
+    dst += sizeof(fields);
+    memcpy(dst, entry->palette, palette_bytes);
+    dst += palette_bytes;
+    memcpy(dst, entry->indices, pixels);
+
+    uLongf compressed_length = compressBound(raw_length);
+    uint8_t *compressed = malloc(compressed_length);
+    size_t written = 0;
+
+    if (compress2(compressed, &compressed_length, raw, raw_length, 1) == Z_OK) {
+        uint32_t header[3] = {
+            raw_length,
+            compressed_length,
+            crc32(0, compressed, compressed_length),
+        };
+
+        if (fwrite(header, sizeof(header), 1, fp) == 1 &&
+                fwrite(compressed, compressed_length, 1, fp) == 1) {
+            written = sizeof(header) + compressed_length;
+        }
+    }
+
+    free(compressed);
+    free(raw);
+
+    return written;
+}
+
+static bool
+quantcache_read_entry(FILE *fp, struct QuantCacheEntry *entry, size_t *length)
+{
+    uint32_t header[3];
+    if (fread(header, sizeof(header), 1, fp) != 1) {
+        return false;
+    }
+
+    uint32_t raw_length = header[0];
+    uint32_t compressed_length = header[1];
+    uint32_t fields[3];
+
+    // The lengths come from the file, allocate no more than the largest valid entry needs
+    size_t max_raw_length = sizeof(entry->key) + sizeof(fields) + 3 * QUANTCACHE_MAX_COLORS +
+        (size_t)QUANTCACHE_MAX_SIZE * QUANTCACHE_MAX_SIZE;
+    if (raw_length < sizeof(entry->key) + sizeof(fields) || raw_length > max_raw_length ||
+            compressed_length > compressBound(raw_length)) {
+        return false;
+    }
+
+    uint8_t *compressed = malloc(compressed_length);
+    uint8_t *raw = malloc(raw_length);
+    bool ok = false;
+
+    uLongf uncompressed_length = raw_length;
+    if (compressed != NULL && raw != NULL &&
+            fread(compressed, compressed_length, 1, fp) == 1 &&
+            crc32(0, compressed, compressed_length) == header[2] &&
+            uncompress(raw, &uncompressed_length, compressed, compressed_length) == Z_OK &&
+            uncompressed_length == raw_length) {
+        const uint8_t *src = raw;
+        memcpy(&entry->key, src, sizeof(entry->key));
+        src += sizeof(entry->key);
+        memcpy(fields, src, sizeof(fields));
+        src += sizeof(fields);
+
+        size_t pixels = (size_t)fields[0] * fields[1];
+        size_t palette_bytes = 3 * (size_t)fields[2];
+
+        if (fields[0] > 0 && fields[1] > 0 && fields[2] <= QUANTCACHE_MAX_COLORS &&
+                fields[0] <= QUANTCACHE_MAX_SIZE && fields[1] <= QUANTCACHE_MAX_SIZE &&
+                raw_length == sizeof(entry->key) + sizeof(fields) + palette_bytes + pixels) {
+            entry->width = fields[0];
+            entry->height = fields[1];
+            entry->palette_size = fields[2];
+            memcpy(entry->palette, src, palette_bytes);
+            src += palette_bytes;
+            entry->indices = malloc(pixels);
+            if (entry->indices != NULL) {
+                memcpy(entry->indices, src, pixels);
+                ok = true;
+            }
+
+            // Indices are only checked here, the cache trusts its own results
+            for (size_t i=0; ok && i<pixels; ++i) {
+                if (entry->indices[i] >= entry->palette_size) {
+                    free(entry->indices);
+                    ok = false;
+                    break;
+                }
+            }
+
+            *length = sizeof(header) + compressed_length;
+        }
+    }
+
+    free(raw);
+    free(compressed);
+
+    return ok;
+}
+
+// Replaces the file with the entries currently in the cache
+static void
+quantcache_rewrite(struct QuantCache *cache)
+{
+    TRACE_BEGIN("quantcache rewrite");
+
+    if (cache->fp) {
+        fclose(cache->fp);
+        cache->fp = NULL;
+    }
+
+    FILE *fp = fopen(cache->tmp_filename, "wb");
+    if (fp) {
+        uint32_t version = QUANTCACHE_VERSION;
+        fwrite(QUANTCACHE_MAGIC, sizeof(QUANTCACHE_MAGIC), 1, fp);
+        fwrite(&version, sizeof(version), 1, fp);
+        cache->file_bytes = sizeof(QUANTCACHE_MAGIC) + sizeof(version);
+
+        for (size_t i=0; i<cache->count; ++i) {
+            cache->file_bytes += quantcache_write_entry(fp, &cache->entries[i]);
+        }
+
+        fclose(fp);
+
+#if defined(_WIN32)
+        MoveFileEx(cache->tmp_filename, cache->filename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+        rename(cache->tmp_filename, cache->filename);
+#endif
+    } else {
+        printf("Could not write quantization cache: %s\n", cache->tmp_filename);
+    }
+
+    cache->fp = fopen(cache->filename, "ab");
+
+    TRACE_END("quantcache rewrite");
+}
+
+// Returns false if the file has to be rewritten
+static bool
+quantcache_load(struct QuantCache *cache)
+{
+    FILE *fp = fopen(cache->filename, "rb");
+    if (!fp) {
+        return false;
+    }
+
+    char magic[sizeof(QUANTCACHE_MAGIC)];
+    uint32_t version;
+    if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, QUANTCACHE_MAGIC, sizeof(magic)) != 0 ||
+            fread(&version, sizeof(version), 1, fp) != 1 || version != QUANTCACHE_VERSION) {
+        // Unknown file or results of an older quantizer
+        fclose(fp);
+        return false;
+    }
+
+    cache->file_bytes = sizeof(magic) + sizeof(version);
+
+    // Later records of the same key replace earlier ones
+    struct QuantCacheEntry entry;
+    size_t length;
+    while (quantcache_read_entry(fp, &entry, &length)) {
+        struct QuantCacheEntry *existing = quantcache_find(cache, &entry.key);
+        if (existing) {
+            quantcache_remove(cache, existing - cache->entries);
+        }
+
+        quantcache_insert(cache, &entry);
+        cache->file_bytes += length;
+    }
+
+    // A truncated or damaged tail (e.g. from a crash while appending) is
+    // dropped by rewriting the file, otherwise new records would follow it
+    bool ok = (fseek(fp, 0, SEEK_END) == 0 && ftell(fp) == (long)cache->file_bytes);
+
+    fclose(fp);
+
+    quantcache_evict(cache);
+
+    return ok && cache->file_bytes <= 2 * cache->budget;
+}
+
+struct QuantCache *
+quantcache_new(size_t budget, const char *filename)
+{
+    struct QuantCache *cache = calloc(1, sizeof(struct QuantCache));
+
+    cache->budget = budget;
+
+    if (filename) {
+        cache->filename = strdup(filename);
+        cache->tmp_filename = malloc(strlen(filename) + 5);
+        sprintf(cache->tmp_filename, "%s.tmp", filename);
+
+        TRACE_BEGIN("quantcache load");
+        bool ok = quantcache_load(cache);
+        TRACE_END("quantcache load");
+
+        if (ok) {
+            cache->fp = fopen(cache->filename, "ab");
+        } else {
+            quantcache_rewrite(cache);
+        }
+
+        if (!cache->fp) {
+            printf("Could not open quantization cache: %s\n", cache->filename);
+        }
+    }
+
+    return cache;
+}
+
+void
+quantcache_free(struct QuantCache *cache)
+{
+    if (cache->fp) {
+        fclose(cache->fp);
+    }
+
+    while (cache->count > 0) {
+        quantcache_remove(cache, cache->count - 1);
+    }
+
+    free(cache->entries);
+    free(cache->tmp_filename);
+    free(cache->filename);
+    free(cache);
+}
+
+bool
+quantcache_get(struct QuantCache *cache, const struct QuantCacheKey *key, uint8_t *indices, uint8_t *palette,
+        int *palette_size, int width, int height)
+{
+    struct QuantCacheEntry *entry = quantcache_find(cache, key);
+    if (!entry || entry->width != width || entry->height != height || entry->palette_size > *palette_size) {
+        cache->stats.misses++;
+        return false;
+    }
+
+    entry->used = ++cache->tick;
+    cache->stats.hits++;
+
+    memcpy(indices, entry->indices, (size_t)width * height);
+    memcpy(palette, entry->palette, 3 * (size_t)entry->palette_size);
+    *palette_size = entry->palette_size;
+
+    return true;
+}
+
+void
+quantcache_put(struct QuantCache *cache, const struct QuantCacheKey *key, const uint8_t *indices, const uint8_t *palette,
+        int palette_size, int width, int height)
+{
+    if (palette_size > QUANTCACHE_MAX_COLORS || width > QUANTCACHE_MAX_SIZE || height > QUANTCACHE_MAX_SIZE) {
+        return;
+    }
+
+    struct QuantCacheEntry *existing = quantcache_find(cache, key);
+    if (existing) {
+        // Same inputs give the same result, nothing to update
+        existing->used = ++cache->tick;
+        return;
+    }
+
+    struct QuantCacheEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.key = *key;
+    entry.width = width;
+    entry.height = height;
+    entry.palette_size = palette_size;
+    memcpy(entry.palette, palette, 3 * (size_t)palette_size);
+
+    size_t pixels = (size_t)width * height;
+    entry.indices = malloc(pixels);
+    memcpy(entry.indices, indices, pixels);
+
+    const struct QuantCacheEntry *result = quantcache_insert(cache, &entry);
+    cache->stats.stores++;
+
+    if (cache->fp) {
+        cache->file_bytes += quantcache_write_entry(cache->fp, result);
+        fflush(cache->fp);
+
+        if (cache->file_bytes > 2 * cache->budget) {
+            quantcache_evict(cache);
+            quantcache_rewrite(cache);
+            return;
+        }
+    }
+
+    quantcache_evict(cache);
+}
+
+void
+quantcache_stats(const struct QuantCache *cache, struct QuantCacheStats *stats)
+{
+    *stats = cache->stats;
+    stats->entries = cache->count;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/**
+ * Cache of quantization results.
+ *
+ * Results are keyed by a hash of everything they depend on (pixels, mask,
+ * palette size, algorithm, parameters, seed), which the caller feeds into
+ * the key, and stored as palette + indices. Beyond the size budget, the
+ * least recently used results are dropped. With a filename, results are
+ * also appended to that file (zlib-compressed records) and loaded again by
+ * the next quantcache_new(); the file is rewritten from the cache when it
+ * grows beyond twice the budget.
+ *
+ * The 128-bit hash is not cryptographic: good for telling images apart, not
+ * for cache files from untrusted sources. QUANTCACHE_VERSION must be bumped
+ * when a quantizer gives different results, so that old files are dropped.
+ **/
+
+#define QUANTCACHE_VERSION 1
+#define QUANTCACHE_MAX_COLORS 256
+// Largest width and height of a cached result
+#define QUANTCACHE_MAX_SIZE 1024
+#define QUANTCACHE_DEFAULT_BUDGET (16 * 1024 * 1024)
+
+struct QuantCacheKey {
+    uint64_t hash[2];
+};
+
+struct QuantCacheStats {
+    size_t hits;
+    size_t misses;
+    size_t stores;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;
+};
+
+struct QuantCache;
+
+// filename may be NULL (memory only)
+struct QuantCache *
+quantcache_new(size_t budget, const char *filename);
+
+void
+quantcache_free(struct QuantCache *cache);
+
+void
+quantcache_key_init(struct QuantCacheKey *key);
+
+void
+quantcache_key_add(struct QuantCacheKey *key, const void *data, size_t length);
+
+/**
+ * Writes the palette (RGB) and indices of the stored result. palette_size
+ * is the room in palette on input and the number of entries on output.
+ * Returns false if there is no result of that size that fits.
+ **/
+bool
+quantcache_get(struct QuantCache *cache, const struct QuantCacheKey *key, uint8_t *indices, uint8_t *palette,
+        int *palette_size, int width, int height);
+
+// Stores a result: palette_size (<= QUANTCACHE_MAX_COLORS) RGB entries and an index per pixel
+// (images larger than QUANTCACHE_MAX_SIZE are not cached)
+void
+quantcache_put(struct QuantCache *cache, const struct QuantCacheKey *key, const uint8_t *indices, const uint8_t *palette,
+        int palette_size, int width, int height);
+
+void
+quantcache_stats(const struct QuantCache *cache, struct QuantCacheStats *stats);
@@ -0,0 +1,588 @@
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "quantize.h"
+#include "memstat.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define QUANTIZE_KERNEL_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define QUANTIZE_KERNEL_NEON
+#include <arm_neon.h>
+#endif
+
+// Lloyd iterations of k-means (fewer if the palette stops changing)
+#define QUANTIZE_KMEANS_ITERATIONS 8
+
+// k-means runs on an evenly spaced sample of at most this many texels
+#define QUANTIZE_KMEANS_SAMPLES 4096
+
+// Amplitude of the ordered dither, in 8-bit steps
+#define QUANTIZE_BAYER_SPREAD 32.f
+
+// Fixed, so that the preview does not flicker while painting
+#define QUANTIZE_SEED 0x12345678u
+
+// Distance of unused palette slots, further away than any color
+#define QUANTIZE_UNUSED 1e6f
+
+static const char *
+QUANTIZE_PALETTE_NAMES[QUANTIZE_PALETTE_COUNT] = {
+    "median cut",
+    "k-means++",
+};
+
+static const char *
+QUANTIZE_DITHER_NAMES[QUANTIZE_DITHER_COUNT] = {
+    "no dither",
+    "Bayer",
+    "Floyd-Steinberg",
+};
+
+static const uint8_t
+QUANTIZE_BAYER[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+// Palette as planes of floats, unused slots padded with QUANTIZE_UNUSED
+struct QuantizePlanes {
+    float r[QUANTIZE_MAX_COLORS];
+    float g[QUANTIZE_MAX_COLORS];
+    float b[QUANTIZE_MAX_COLORS];
+};
+
+static inline int
+quantize_channel(uint32_t color, int c)
+{
+    return (color >> (8 * c)) & 0xFF;
+}
+
+static void
+quantize_planes_init(struct QuantizePlanes *planes, const uint32_t *palette, int palette_size)
+{
+    for (int i=0; i<QUANTIZE_MAX_COLORS; ++i) {
+        bool used = (i < palette_size);
+        planes->r[i] = used ? quantize_channel(palette[i], 0) : QUANTIZE_UNUSED;
+        planes->g[i] = used ? quantize_channel(palette[i], 1) : QUANTIZE_UNUSED;
+        planes->b[i] = used ? quantize_channel(palette[i], 2) : QUANTIZE_UNUSED;
+    }
+}
+
+#if defined(QUANTIZE_KERNEL_SSE2) || defined(QUANTIZE_KERNEL_NEON)
+// Lowest set bit of a nonzero mask, i.e. the first entry at the minimum distance
+static inline int
+quantize_first_bit(int mask)
+{
+    int i = 0;
+    while ((mask & (1 << i)) == 0) {
+        ++i;
+    }
+    return i;
+}
+#endif
+
+#if defined(QUANTIZE_KERNEL_SSE2)
+static inline int
+quantize_nearest(const struct QuantizePlanes *planes, float r, float g, float b)
+{
+    __m128 vr = _mm_set1_ps(r);
+    __m128 vg = _mm_set1_ps(g);
+    __m128 vb = _mm_set1_ps(b);
+
+    __m128 d[QUANTIZE_MAX_COLORS / 4];
+    for (int k=0; k<QUANTIZE_MAX_COLORS/4; ++k) {
+        __m128 dr = _mm_sub_ps(_mm_loadu_ps(planes->r + 4 * k), vr);
+        __m128 dg = _mm_sub_ps(_mm_loadu_ps(planes->g + 4 * k), vg);
+        __m128 db = _mm_sub_ps(_mm_loadu_ps(planes->b + 4 * k), vb);
+        d[k] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+    }
+
+    // Minimum in all lanes
+    __m128 m = _mm_min_ps(_mm_min_ps(d[0], d[1]), _mm_min_ps(d[2], d[3]));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+
+    int mask = 0;
+    for (int k=0; k<QUANTIZE_MAX_COLORS/4; ++k) {
+        mask |= _mm_movemask_ps(_mm_cmpeq_ps(d[k], m)) << (4 * k);
+    }
+
+    return quantize_first_bit(mask);
+}
+#elif defined(QUANTIZE_KERNEL_NEON)
+static inline int
+quantize_nearest(const struct QuantizePlanes *planes, float r, float g, float b)
+{
+    static const uint32_t bits[4] = { 1, 2, 4, 8 };
+
+    float32x4_t vr = vdupq_n_f32(r);
+    float32x4_t vg = vdupq_n_f32(g);
+    float32x4_t vb = vdupq_n_f32(b);
+
+    float32x4_t d[QUANTIZE_MAX_COLORS / 4];
+    for (int k=0; k<QUANTIZE_MAX_COLORS/4; ++k) {
+        float32x4_t dr = vsubq_f32(vld1q_f32(planes->r + 4 * k), vr);
+        float32x4_t dg = vsubq_f32(vld1q_f32(planes->g + 4 * k), vg);
+        float32x4_t db = vsubq_f32(vld1q_f32(planes->b + 4 * k), vb);
+        d[k] = vaddq_f32(vaddq_f32(vmulq_f32(dr, dr), vmulq_f32(dg, dg)), vmulq_f32(db, db));
+    }
+
+    float32x4_t m = vdupq_n_f32(vminvq_f32(vminq_f32(vminq_f32(d[0], d[1]), vminq_f32(d[2], d[3]))));
+
+    int mask = 0;
+    for (int k=0; k<QUANTIZE_MAX_COLORS/4; ++k) {
+        mask |= vaddvq_u32(vandq_u32(vceqq_f32(d[k], m), vld1q_u32(bits))) << (4 * k);
+    }
+
+    return quantize_first_bit(mask);
+}
+#else
+static inline int
+quantize_nearest(const struct QuantizePlanes *planes, float r, float g, float b)
+{
+    int result = 0;
+    float best = 0.f;
+
+    for (int i=0; i<QUANTIZE_MAX_COLORS; ++i) {
+        float dr = planes->r[i] - r;
+        float dg = planes->g[i] - g;
+        float db = planes->b[i] - b;
+        float distance = (dr * dr + dg * dg) + db * db;
+
+        if (i == 0 || distance < best) {
+            best = distance;
+            result = i;
+        }
+    }
+
+    return result;
+}
+#endif
+
+static inline int
+quantize_nearest_color(const struct QuantizePlanes *planes, uint32_t color)
+{
+    return quantize_nearest(planes, quantize_channel(color, 0), quantize_channel(color, 1), quantize_channel(color, 2));
+}
+
+// Texels that the palette is built from
+static size_t
+quantize_collect(const uint32_t *rgba, const uint8_t *coverage, size_t count, uint32_t *colors)
+{
+    size_t n = 0;
+    for (size_t i=0; i<count; ++i) {
+        if (coverage == NULL || coverage[i] != 0) {
+            colors[n++] = rgba[i];
+        }
+    }
+
+    if (n == 0) {
+        memcpy(colors, rgba, sizeof(uint32_t) * count);
+        n = count;
+    }
+
+    return n;
+}
+
+// Rounded mean of sums over n texels
+static uint32_t
+quantize_mean(const uint32_t *sums, size_t n)
+{
+    uint32_t color = 0xFF000000;
+    for (int c=0; c<3; ++c) {
+        color |= (uint32_t)((sums[c] + n / 2) / n) << (8 * c);
+    }
+    return color;
+}
+
+struct QuantizeBox {
+    size_t begin;
+    size_t end;
+    // Channel with the largest range, and its range
+    int channel;
+    int low;
+    int high;
+};
+
+static void
+quantize_box_measure(struct QuantizeBox *box, const uint32_t *colors)
+{
+    int low[3] = { 255, 255, 255 };
+    int high[3] = { 0, 0, 0 };
+
+    for (size_t i=box->begin; i<box->end; ++i) {
+        for (int c=0; c<3; ++c) {
+            int v = quantize_channel(colors[i], c);
+            low[c] = (v < low[c]) ? v : low[c];
+            high[c] = (v > high[c]) ? v : high[c];
+        }
+    }
+
+    box->channel = 0;
+    for (int c=1; c<3; ++c) {
+        if (high[c] - low[c] > high[box->channel] - low[box->channel]) {
+            box->channel = c;
+        }
+    }
+    box->low = low[box->channel];
+    box->high = high[box->channel];
+}
+
+// Splits at the median of the widest channel; both halves keep at least one color
+static size_t
+quantize_box_split(const struct QuantizeBox *box, uint32_t *colors)
+{
+    size_t histogram[256] = { 0 };
+    for (size_t i=box->begin; i<box->end; ++i) {
+        histogram[quantize_channel(colors[i], box->channel)]++;
+    }
+
+    // Texels below the threshold go to the first half
+    size_t half = (box->end - box->begin) / 2;
+    size_t below = 0;
+    int threshold = 0;
+    while (below < half) {
+        below += histogram[threshold++];
+    }
+    if (threshold > box->high) {
+        threshold = box->high;
+    }
+
+    size_t i = box->begin, j = box->end;
+    while (i < j) {
+        if (quantize_channel(colors[i], box->channel) < threshold) {
+            ++i;
+        } else {
+            uint32_t tmp = colors[i];
+            colors[i] = colors[--j];
+            colors[j] = tmp;
+        }
+    }
+
+    return i;
+}
+
+static int
+quantize_median_cut(uint32_t *colors, size_t n, int max_colors, uint32_t *palette)
+{
+    struct QuantizeBox boxes[QUANTIZE_MAX_COLORS];
+    int count = 1;
+
+    boxes[0].begin = 0;
+    boxes[0].end = n;
+    quantize_box_measure(&boxes[0], colors);
+
+    while (count < max_colors) {
+        // Split where the most texels are spread the widest
+        int best = -1;
+        size_t best_score = 0;
+        for (int i=0; i<count; ++i) {
+            size_t score = (boxes[i].end - boxes[i].begin) * (boxes[i].high - boxes[i].low);
+            if (score > best_score) {
+                best = i;
+                best_score = score;
+            }
+        }
+
+        if (best == -1) {
+            // Every box has a single color
+            break;
+        }
+
+        struct QuantizeBox *box = &boxes[best];
+        struct QuantizeBox *other = &boxes[count++];
+        other->begin = quantize_box_split(box, colors);
+        other->end = box->end;
+        box->end = other->begin;
+
+        quantize_box_measure(box, colors);
+        quantize_box_measure(other, colors);
+    }
+
+    for (int i=0; i<count; ++i) {
+        uint32_t sums[3] = { 0, 0, 0 };
+        for (size_t j=boxes[i].begin; j<boxes[i].end; ++j) {
+            for (int c=0; c<3; ++c) {
+                sums[c] += quantize_channel(colors[j], c);
+            }
+        }
+        palette[i] = quantize_mean(sums, boxes[i].end - boxes[i].begin);
+    }
+
+    return count;
+}
+
+static inline uint32_t
+quantize_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static inline float
+quantize_distance(uint32_t a, uint32_t b)
+{
+    float distance = 0.f;
+    for (int c=0; c<3; ++c) {
+        float d = quantize_channel(a, c) - quantize_channel(b, c);
+        distance += d * d;
+    }
+    return distance;
+}
+
+static int
+quantize_kmeans(uint32_t *colors, size_t n, int max_colors, uint32_t *palette)
+{
+    uint32_t state = QUANTIZE_SEED;
+
+    if (n > QUANTIZE_KMEANS_SAMPLES) {
+        size_t step = (n + QUANTIZE_KMEANS_SAMPLES - 1) / QUANTIZE_KMEANS_SAMPLES;
+        size_t samples = 0;
+        for (size_t i=0; i<n; i+=step) {
+            colors[samples++] = colors[i];
+        }
+        n = samples;
+    }
+
+    // k-means++ seeding: each center is picked with a probability proportional
+    // to the squared distance to the nearest center so far
+    float *distances = malloc(sizeof(float) * n);
+    memstat_add(MEMSTAT_QUANTIZER, sizeof(float) * n);
+    palette[0] = colors[quantize_random(&state) % n] | 0xFF000000;
+    for (size_t i=0; i<n; ++i) {
+        distances[i] = quantize_distance(colors[i], palette[0]);
+    }
+
+    int count = 1;
+    while (count < max_colors) {
+        double total = 0.0;
+        for (size_t i=0; i<n; ++i) {
+            total += distances[i];
+        }
+
+        if (total == 0.0) {
+            // Fewer distinct colors than palette entries
+            break;
+        }
+
+        double target = total * (quantize_random(&state) / 4294967296.0);
+        size_t pick = 0;
+        for (; pick<n-1; ++pick) {
+            target -= distances[pick];
+            if (target < 0.0) {
+                break;
+            }
+        }
+
+        // Rounding could land on a color that is already a center
+        while (distances[pick] == 0.f) {
+            pick = (pick + 1) % n;
+        }
+
+        palette[count] = colors[pick] | 0xFF000000;
+        for (size_t i=0; i<n; ++i) {
+            float distance = quantize_distance(colors[i], palette[count]);
+            if (distance < distances[i]) {
+                distances[i] = distance;
+            }
+        }
+        count++;
+    }
+
+    free(distances);
+    memstat_sub(MEMSTAT_QUANTIZER, sizeof(float) * n);
+
+    // Lloyd iterations
+    for (int iteration=0; iteration<QUANTIZE_KMEANS_ITERATIONS; ++iteration) {
+        struct QuantizePlanes planes;
+        quantize_planes_init(&planes, palette, count);
+
+        uint32_t sums[QUANTIZE_MAX_COLORS][3];
+        size_t members[QUANTIZE_MAX_COLORS];
+        memset(sums, 0, sizeof(sums));
+        memset(members, 0, sizeof(members));
+
+        for (size_t i=0; i<n; ++i) {
+            int index = quantize_nearest_color(&planes, colors[i]);
+            for (int c=0; c<3; ++c) {
+                sums[index][c] += quantize_channel(colors[i], c);
+            }
+            members[index]++;
+        }
+
+        bool changed = false;
+        for (int i=0; i<count; ++i) {
+            // Empty clusters keep their center
+            if (members[i] > 0) {
+                uint32_t center = quantize_mean(sums[i], members[i]);
+                changed = changed || (center != palette[i]);
+                palette[i] = center;
+            }
+        }
+
+        if (!changed) {
+            break;
+        }
+    }
+
+    return count;
+}
+
+int
+quantize_build_palette(const uint32_t *rgba, const uint8_t *coverage, size_t count, int colors,
+        enum QuantizePalette method, uint32_t *palette)
+{
+    if (count == 0 || colors <= 0) {
+        return 0;
+    }
+
+    if (colors > QUANTIZE_MAX_COLORS) {
+        colors = QUANTIZE_MAX_COLORS;
+    }
+
+    uint32_t *texels = malloc(sizeof(uint32_t) * count);
+    memstat_add(MEMSTAT_QUANTIZER, sizeof(uint32_t) * count);
+    size_t n = quantize_collect(rgba, coverage, count, texels);
+
+    int size;
+    if (method == QUANTIZE_PALETTE_KMEANS) {
+        size = quantize_kmeans(texels, n, colors, palette);
+    } else {
+        size = quantize_median_cut(texels, n, colors, palette);
+    }
+
+    free(texels);
+    memstat_sub(MEMSTAT_QUANTIZER, sizeof(uint32_t) * count);
+    return size;
+}
+
+void
+quantize_map(uint32_t *rgba, const uint8_t *coverage, int width, int height,
+        const uint32_t *palette, int palette_size, enum QuantizeDither dither)
+{
+    if (palette_size <= 0) {
+        return;
+    }
+
+    struct QuantizePlanes planes;
+    quantize_planes_init(&planes, palette, palette_size);
+
+    // Error of the current and the next row, with a texel of padding on each side
+    int row_length = (width + 2) * 3;
+    float *errors = NULL;
+    if (dither == QUANTIZE_DITHER_FLOYD_STEINBERG) {
+        errors = calloc(2 * row_length, sizeof(float));
+        memstat_add(MEMSTAT_QUANTIZER, sizeof(float) * 2 * row_length);
+    }
+
+    for (int y=0; y<height; ++y) {
+        float *current = NULL, *next = NULL;
+        if (errors != NULL) {
+            current = errors + (y & 1) * row_length + 3;
+            next = errors + ((y + 1) & 1) * row_length + 3;
+            memset(next - 3, 0, sizeof(float) * row_length);
+        }
+
+        for (int x=0; x<width; ++x) {
+            uint32_t *texel = &rgba[y * width + x];
+            bool covered = (coverage == NULL || coverage[y * width + x] != 0);
+
+            float value[3];
+            for (int c=0; c<3; ++c) {
+                value[c] = quantize_channel(*texel, c);
+            }
+
+            if (covered && dither == QUANTIZE_DITHER_BAYER) {
+                float offset = ((QUANTIZE_BAYER[y & 3][x & 3] + 0.5f) / 16.f - 0.5f) * QUANTIZE_BAYER_SPREAD;
+                for (int c=0; c<3; ++c) {
+                    value[c] += offset;
+                }
+            } else if (covered && errors != NULL) {
+                for (int c=0; c<3; ++c) {
+                    value[c] += current[3 * x + c];
+                    value[c] = (value[c] < 0.f) ? 0.f : ((value[c] > 255.f) ? 255.f : value[c]);
+                }
+            }
+
+            uint32_t entry = palette[quantize_nearest(&planes, value[0], value[1], value[2])];
+
+            if (covered && errors != NULL) {
+                for (int c=0; c<3; ++c) {
+                    float error = value[c] - quantize_channel(entry, c);
+                    current[3 * (x + 1) + c] += error * (7.f / 16.f);
+                    next[3 * (x - 1) + c] += error * (3.f / 16.f);
+                    next[3 * x + c] += error * (5.f / 16.f);
+                    next[3 * (x + 1) + c] += error * (1.f / 16.f);
+                }
+            }
+
+            *texel = (entry & 0x00FFFFFF) | (*texel & 0xFF000000);
+        }
+    }
+
+    if (errors != NULL) {
+        free(errors);
+        memstat_sub(MEMSTAT_QUANTIZER, sizeof(float) * 2 * row_length);
+    }
+}
+
+int
+quantize_fast(uint32_t *rgba, const uint8_t *coverage, int width, int height, int colors,
+        const struct QuantizeOptions *options)
+{
+    uint32_t palette[QUANTIZE_MAX_COLORS];
+    int size = quantize_build_palette(rgba, coverage, (size_t)width * height, colors, options->palette, palette);
+    quantize_map(rgba, coverage, width, height, palette, size, options->dither);
+    return size;
+}
+
+const char *
+quantize_palette_name(enum QuantizePalette method)
+{
+    return (method >= 0 && method < QUANTIZE_PALETTE_COUNT) ? QUANTIZE_PALETTE_NAMES[method] : "?";
+}
+
+const char *
+quantize_dither_name(enum QuantizeDither dither)
+{
+    return (dither >= 0 && dither < QUANTIZE_DITHER_COUNT) ? QUANTIZE_DITHER_NAMES[dither] : "?";
+}
+
+const char *
+quantize_kernel_name()
+{
+#if defined(QUANTIZE_KERNEL_SSE2)
+    return "sse2";
+#elif defined(QUANTIZE_KERNEL_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
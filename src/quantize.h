@@ -0,0 +1,91 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/**
+ * Fast quantizers for previews, a few milliseconds for a 128x128 image (see
+ * bench/quant_bench.c): a median cut or k-means++ palette, then ordered
+ * (Bayer) or Floyd-Steinberg dithering. The nearest palette entry is searched
+ * for all entries at once with SIMD where available (SSE2 or AArch64 NEON).
+ * The spatial quantizer in scolorq/ gives better results and stays the one
+ * used for exporting.
+ **/
+
+#define QUANTIZE_MAX_COLORS 16
+
+enum QuantizePalette {
+    QUANTIZE_PALETTE_MEDIAN_CUT = 0,
+    QUANTIZE_PALETTE_KMEANS,
+
+    QUANTIZE_PALETTE_COUNT,
+};
+
+enum QuantizeDither {
+    QUANTIZE_DITHER_NONE = 0,
+    QUANTIZE_DITHER_BAYER,
+    QUANTIZE_DITHER_FLOYD_STEINBERG,
+
+    QUANTIZE_DITHER_COUNT,
+};
+
+struct QuantizeOptions {
+    enum QuantizePalette palette;
+    enum QuantizeDither dither;
+};
+
+/**
+ * Builds a palette of at most colors (<= QUANTIZE_MAX_COLORS) RGBA entries
+ * from the texels with nonzero coverage (all texels if coverage is NULL or
+ * none is covered). Returns the palette size, which is smaller than colors
+ * if the texels have fewer distinct colors.
+ **/
+int
+quantize_build_palette(const uint32_t *rgba, const uint8_t *coverage, size_t count, int colors,
+        enum QuantizePalette method, uint32_t *palette);
+
+/**
+ * Replaces each texel by a palette entry (alpha is kept). Texels without
+ * coverage get the nearest entry, without dithering.
+ **/
+void
+quantize_map(uint32_t *rgba, const uint8_t *coverage, int width, int height,
+        const uint32_t *palette, int palette_size, enum QuantizeDither dither);
+
+// Both of the above, in place; returns the palette size
+int
+quantize_fast(uint32_t *rgba, const uint8_t *coverage, int width, int height, int colors,
+        const struct QuantizeOptions *options);
+
+const char *
+quantize_palette_name(enum QuantizePalette method);
+
+const char *
+quantize_dither_name(enum QuantizeDither dither);
+
+const char *
+quantize_kernel_name();
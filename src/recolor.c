@@ -0,0 +1,435 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "recolor.h"
+#include "material.h"
+#include "colorhist.h"
+
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RECOLOR_KERNEL_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RECOLOR_KERNEL_NEON
+#include <arm_neon.h>
+#endif
+
+/**
+ * All kernels compute, per output channel c (alpha is kept):
+ *
+ *   t = m[c][0] * R + m[c][1] * G + m[c][2] * B + (1 << (RECOLOR_SHIFT - 1))
+ *   c = clamp(t >> RECOLOR_SHIFT, 0, 255)
+ *
+ * The shift is arithmetic, so negative sums end up as 0.
+ **/
+
+static inline uint32_t
+recolor_scalar(const struct RecolorMatrix *matrix, uint32_t pixel)
+{
+    int32_t r = pixel & 0xFF;
+    int32_t g = (pixel >> 8) & 0xFF;
+    int32_t b = (pixel >> 16) & 0xFF;
+
+    uint32_t result = pixel & 0xFF000000;
+    for (int c=0; c<3; ++c) {
+        int32_t t = matrix->m[c][0] * r + matrix->m[c][1] * g + matrix->m[c][2] * b + (1 << (RECOLOR_SHIFT - 1));
+        t >>= RECOLOR_SHIFT;
+        t = (t < 0) ? 0 : ((t > 255) ? 255 : t);
+        result |= (uint32_t)t << (8 * c);
+    }
+
+    return result;
+}
+
+static int16_t
+recolor_fixed(float value)
+{
+    float fixed = roundf(value * (1 << RECOLOR_SHIFT));
+    return (fixed < -32768.f) ? -32768 : ((fixed > 32767.f) ? 32767 : (int16_t)fixed);
+}
+
+void
+recolor_hsb_matrix(struct RecolorMatrix *matrix, float hue_degrees, float saturation, float brightness)
+{
+    // Hue rotation and saturation around the luminance axis (as in SVG's feColorMatrix)
+    float c = cosf(hue_degrees * (float)M_PI / 180.f);
+    float s = sinf(hue_degrees * (float)M_PI / 180.f);
+
+    float hue[3][3] = {
+        { 0.213f + c * 0.787f - s * 0.213f, 0.715f - c * 0.715f - s * 0.715f, 0.072f - c * 0.072f + s * 0.928f },
+        { 0.213f - c * 0.213f + s * 0.143f, 0.715f + c * 0.285f + s * 0.140f, 0.072f - c * 0.072f - s * 0.283f },
+        { 0.213f - c * 0.213f - s * 0.787f, 0.715f - c * 0.715f + s * 0.715f, 0.072f + c * 0.928f + s * 0.072f },
+    };
+
+    float sat[3][3] = {
+        { 0.213f + 0.787f * saturation, 0.715f - 0.715f * saturation, 0.072f - 0.072f * saturation },
+        { 0.213f - 0.213f * saturation, 0.715f + 0.285f * saturation, 0.072f - 0.072f * saturation },
+        { 0.213f - 0.213f * saturation, 0.715f - 0.715f * saturation, 0.072f + 0.928f * saturation },
+    };
+
+    for (int row=0; row<3; ++row) {
+        for (int column=0; column<3; ++column) {
+            float value = 0.f;
+            for (int k=0; k<3; ++k) {
+                value += sat[row][k] * hue[k][column];
+            }
+
+            matrix->m[row][column] = recolor_fixed(value * brightness);
+        }
+    }
+}
+
+uint32_t
+recolor_color(const struct RecolorMatrix *matrix, uint32_t color)
+{
+    return recolor_scalar(matrix, color);
+}
+
+#if defined(RECOLOR_KERNEL_SSE2)
+static inline __m128i
+recolor_sums(__m128i mr, __m128i mg, __m128i mb, bool high)
+{
+    // Each madd result holds (R*m0 + G*m1, B*m2 + round) per pixel, add the halves
+    __m128i rg = high ? _mm_unpackhi_epi32(mr, mg) : _mm_unpacklo_epi32(mr, mg);
+    __m128i bb = high ? _mm_unpackhi_epi32(mb, mb) : _mm_unpacklo_epi32(mb, mb);
+    __m128i sum = _mm_add_epi32(_mm_unpacklo_epi64(rg, bb), _mm_unpackhi_epi64(rg, bb));
+    return _mm_srai_epi32(sum, RECOLOR_SHIFT);
+}
+
+static inline __m128i
+recolor_pair(__m128i p16, __m128i cr, __m128i cg, __m128i cb)
+{
+    __m128i mr = _mm_madd_epi16(p16, cr);
+    __m128i mg = _mm_madd_epi16(p16, cg);
+    __m128i mb = _mm_madd_epi16(p16, cb);
+
+    return _mm_packs_epi32(recolor_sums(mr, mg, mb, false), recolor_sums(mr, mg, mb, true));
+}
+
+static size_t
+recolor_pixels_simd(const struct RecolorMatrix *matrix, uint32_t *pixels, size_t count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+    // Alpha is replaced by 1, which multiplies the rounding term
+    const __m128i rgb16 = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    const __m128i one16 = _mm_set_epi16(1, 0, 0, 0, 1, 0, 0, 0);
+    const int16_t round = 1 << (RECOLOR_SHIFT - 1);
+
+    const __m128i cr = _mm_set_epi16(round, matrix->m[0][2], matrix->m[0][1], matrix->m[0][0],
+            round, matrix->m[0][2], matrix->m[0][1], matrix->m[0][0]);
+    const __m128i cg = _mm_set_epi16(round, matrix->m[1][2], matrix->m[1][1], matrix->m[1][0],
+            round, matrix->m[1][2], matrix->m[1][1], matrix->m[1][0]);
+    const __m128i cb = _mm_set_epi16(round, matrix->m[2][2], matrix->m[2][1], matrix->m[2][0],
+            round, matrix->m[2][2], matrix->m[2][1], matrix->m[2][0]);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(pixels + i));
+
+        __m128i lo = _mm_or_si128(_mm_and_si128(_mm_unpacklo_epi8(p, zero), rgb16), one16);
+        __m128i hi = _mm_or_si128(_mm_and_si128(_mm_unpackhi_epi8(p, zero), rgb16), one16);
+
+        __m128i result = _mm_packus_epi16(recolor_pair(lo, cr, cg, cb), recolor_pair(hi, cr, cg, cb));
+        result = _mm_or_si128(_mm_andnot_si128(alpha_mask, result), _mm_and_si128(p, alpha_mask));
+
+        _mm_storeu_si128((__m128i *)(pixels + i), result);
+    }
+
+    return i;
+}
+
+static size_t
+recolor_remap_simd(uint32_t *pixels, size_t count, const uint32_t *from, const uint32_t *to, int n)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(pixels + i));
+        __m128i result = p;
+
+        for (int j=0; j<n; ++j) {
+            __m128i mask = _mm_cmpeq_epi32(p, _mm_set1_epi32(from[j]));
+            result = _mm_or_si128(_mm_and_si128(mask, _mm_set1_epi32(to[j])), _mm_andnot_si128(mask, result));
+        }
+
+        _mm_storeu_si128((__m128i *)(pixels + i), result);
+    }
+
+    return i;
+}
+#elif defined(RECOLOR_KERNEL_NEON)
+static inline uint8x8_t
+recolor_channel(const int16_t *m, int16x8_t r, int16x8_t g, int16x8_t b)
+{
+    const int32x4_t round = vdupq_n_s32(1 << (RECOLOR_SHIFT - 1));
+
+    int32x4_t lo = vmlal_n_s16(vmlal_n_s16(vmlal_n_s16(round, vget_low_s16(r), m[0]), vget_low_s16(g), m[1]), vget_low_s16(b), m[2]);
+    int32x4_t hi = vmlal_n_s16(vmlal_n_s16(vmlal_n_s16(round, vget_high_s16(r), m[0]), vget_high_s16(g), m[1]), vget_high_s16(b), m[2]);
+
+    uint16x8_t t = vcombine_u16(vqmovun_s32(vshrq_n_s32(lo, RECOLOR_SHIFT)), vqmovun_s32(vshrq_n_s32(hi, RECOLOR_SHIFT)));
+    return vqmovn_u16(t);
+}
+
+static size_t
+recolor_pixels_simd(const struct RecolorMatrix *matrix, uint32_t *pixels, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t p = vld4_u8((const uint8_t *)(pixels + i));
+
+        int16x8_t r = vreinterpretq_s16_u16(vmovl_u8(p.val[0]));
+        int16x8_t g = vreinterpretq_s16_u16(vmovl_u8(p.val[1]));
+        int16x8_t b = vreinterpretq_s16_u16(vmovl_u8(p.val[2]));
+
+        p.val[0] = recolor_channel(matrix->m[0], r, g, b);
+        p.val[1] = recolor_channel(matrix->m[1], r, g, b);
+        p.val[2] = recolor_channel(matrix->m[2], r, g, b);
+
+        vst4_u8((uint8_t *)(pixels + i), p);
+    }
+
+    return i;
+}
+
+static size_t
+recolor_remap_simd(uint32_t *pixels, size_t count, const uint32_t *from, const uint32_t *to, int n)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        uint32x4_t p = vld1q_u32(pixels + i);
+        uint32x4_t result = p;
+
+        for (int j=0; j<n; ++j) {
+            result = vbslq_u32(vceqq_u32(p, vdupq_n_u32(from[j])), vdupq_n_u32(to[j]), result);
+        }
+
+        vst1q_u32(pixels + i, result);
+    }
+
+    return i;
+}
+#else
+static size_t
+recolor_pixels_simd(const struct RecolorMatrix *matrix, uint32_t *pixels, size_t count)
+{
+    return 0;
+}
+
+static size_t
+recolor_remap_simd(uint32_t *pixels, size_t count, const uint32_t *from, const uint32_t *to, int n)
+{
+    return 0;
+}
+#endif
+
+const char *
+recolor_kernel_name()
+{
+#if defined(RECOLOR_KERNEL_SSE2)
+    return "sse2";
+#elif defined(RECOLOR_KERNEL_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+void
+recolor_pixels(const struct RecolorMatrix *matrix, uint32_t *pixels, size_t count)
+{
+    for (size_t i=recolor_pixels_simd(matrix, pixels, count); i<count; ++i) {
+        pixels[i] = recolor_scalar(matrix, pixels[i]);
+    }
+}
+
+void
+recolor_remap_pixels(uint32_t *pixels, size_t count, const uint32_t *from, const uint32_t *to, int n)
+{
+    for (size_t i=recolor_remap_simd(pixels, count, from, to, n); i<count; ++i) {
+        uint32_t pixel = pixels[i];
+        for (int j=0; j<n; ++j) {
+            if (pixel == from[j]) {
+                pixels[i] = to[j];
+            }
+        }
+    }
+}
+
+static int
+recolor_find(const uint32_t *colors, int count, uint32_t color)
+{
+    for (int i=0; i<count; ++i) {
+        if (colors[i] == color) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+bool
+recolor_palette_of(struct Material *material, struct RecolorPalette *palette)
+{
+    palette->count = 0;
+
+    if (material->indices == NULL) {
+        palette->count = indexed_colors(material, palette->colors);
+        return palette->count != -1;
+    }
+
+    bool used[INDEXED_COLORS] = { false };
+    size_t length = material->width * material->height;
+    for (size_t i=0; i<length; ++i) {
+        used[indexed_get(material->indices, i)] = true;
+    }
+
+    for (int i=0; i<INDEXED_COLORS; ++i) {
+        if (used[i] && recolor_find(palette->colors, palette->count, material->palette[i]) == -1) {
+            palette->colors[palette->count++] = material->palette[i];
+        }
+    }
+
+    return true;
+}
+
+static int
+recolor_luma(uint32_t color)
+{
+    return 213 * (color & 0xFF) + 715 * ((color >> 8) & 0xFF) + 72 * ((color >> 16) & 0xFF);
+}
+
+static void
+recolor_sort_by_luma(const struct RecolorPalette *palette, int *order)
+{
+    for (int i=0; i<palette->count; ++i) {
+        int j = i;
+        while (j > 0 && recolor_luma(palette->colors[order[j - 1]]) > recolor_luma(palette->colors[i])) {
+            order[j] = order[j - 1];
+            --j;
+        }
+        order[j] = i;
+    }
+}
+
+void
+recolor_palette_map(const struct RecolorPalette *from, const struct RecolorPalette *to, uint32_t *mapped)
+{
+    if (to->count == 0) {
+        memcpy(mapped, from->colors, from->count * sizeof(uint32_t));
+        return;
+    }
+
+    int from_order[INDEXED_COLORS];
+    int to_order[INDEXED_COLORS];
+    recolor_sort_by_luma(from, from_order);
+    recolor_sort_by_luma(to, to_order);
+
+    // Spread the ranks, so that darkest and brightest colors map onto each other
+    for (int rank=0; rank<from->count; ++rank) {
+        int to_rank = (from->count > 1) ? (rank * (to->count - 1) + (from->count - 1) / 2) / (from->count - 1) : 0;
+        mapped[from_order[rank]] = to->colors[to_order[to_rank]];
+    }
+}
+
+// An RGBA image that has a palette's worth of colors (e.g. a loaded skin)
+static bool
+recolor_palette_exact(struct Material *material, struct RecolorPalette *palette)
+{
+    // The histogram only counts covered texels, but rules out most painted images for free
+    if (material->colors != NULL && material->colors->distinct > INDEXED_COLORS) {
+        return false;
+    }
+
+    return recolor_palette_of(material, palette);
+}
+
+void
+recolor_material_hsb(struct Material *material, const struct RecolorMatrix *matrix)
+{
+    struct RecolorPalette palette;
+
+    if (material->indices != NULL) {
+        for (int i=0; i<INDEXED_COLORS; ++i) {
+            material->palette[i] = recolor_scalar(matrix, material->palette[i]);
+        }
+    } else if (recolor_palette_exact(material, &palette)) {
+        uint32_t mapped[INDEXED_COLORS];
+        for (int i=0; i<palette.count; ++i) {
+            mapped[i] = recolor_scalar(matrix, palette.colors[i]);
+        }
+
+        recolor_remap_pixels((uint32_t *)material->pixels, material->width * material->height,
+                palette.colors, mapped, palette.count);
+    } else {
+        recolor_pixels(matrix, (uint32_t *)material->pixels, material->width * material->height);
+    }
+
+    material_touch(material, 0, 0, material->width, material->height);
+    material->pixels_dirty = true;
+}
+
+void
+recolor_material_replace(struct Material *material, uint32_t from, uint32_t to)
+{
+    if (material->indices != NULL) {
+        for (int i=0; i<INDEXED_COLORS; ++i) {
+            if (material->palette[i] == from) {
+                material->palette[i] = to;
+            }
+        }
+    } else {
+        recolor_remap_pixels((uint32_t *)material->pixels, material->width * material->height, &from, &to, 1);
+    }
+
+    material_touch(material, 0, 0, material->width, material->height);
+    material->pixels_dirty = true;
+}
+
+bool
+recolor_material_swap(struct Material *material, const struct RecolorPalette *to)
+{
+    struct RecolorPalette from;
+    if (!recolor_palette_of(material, &from)) {
+        return false;
+    }
+
+    uint32_t mapped[INDEXED_COLORS];
+    recolor_palette_map(&from, to, mapped);
+
+    if (material->indices != NULL) {
+        for (int i=0; i<INDEXED_COLORS; ++i) {
+            int j = recolor_find(from.colors, from.count, material->palette[i]);
+            if (j != -1) {
+                material->palette[i] = mapped[j];
+            }
+        }
+    } else {
+        recolor_remap_pixels((uint32_t *)material->pixels, material->width * material->height, from.colors, mapped, from.count);
+    }
+
+    material_touch(material, 0, 0, material->width, material->height);
+    material->pixels_dirty = true;
+    return true;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "shipmodelformat.h"
+#include "indexed.h"
+
+/**
+ * Color adjustments: hue/saturation/brightness, color replace and palette swap.
+ *
+ * Hue rotation, saturation and brightness are all linear in RGB, so a shift
+ * is one 3x3 matrix (fixed point). Materials in indexed mode only have their
+ * palette changed (16 colors instead of every texel), and RGBA images with no
+ * more than 16 colors have just those colors transformed and remapped;
+ * otherwise the pixels are transformed with a SIMD kernel (SSE2 or NEON,
+ * scalar fallback, all with identical results).
+ **/
+
+#define RECOLOR_SHIFT 12
+
+struct RecolorMatrix {
+    // Rows are the output channels (R, G, B), 1.0 = 1 << RECOLOR_SHIFT
+    int16_t m[3][3];
+};
+
+// Colors of a material, as used for palette swaps
+struct RecolorPalette {
+    uint32_t colors[INDEXED_COLORS];
+    int count;
+};
+
+void
+recolor_hsb_matrix(struct RecolorMatrix *matrix, float hue_degrees, float saturation, float brightness);
+
+uint32_t
+recolor_color(const struct RecolorMatrix *matrix, uint32_t color);
+
+void
+recolor_pixels(const struct RecolorMatrix *matrix, uint32_t *pixels, size_t count);
+
+// Replaces every pixel equal to from[i] with to[i] (matched against the original pixel)
+void
+recolor_remap_pixels(uint32_t *pixels, size_t count, const uint32_t *from, const uint32_t *to, int n);
+
+const char *
+recolor_kernel_name();
+
+bool
+recolor_palette_of(struct Material *material, struct RecolorPalette *palette);
+
+// For each color of "from", the color of "to" with the same brightness rank
+void
+recolor_palette_map(const struct RecolorPalette *from, const struct RecolorPalette *to, uint32_t *mapped);
+
+void
+recolor_material_hsb(struct Material *material, const struct RecolorMatrix *matrix);
+
+void
+recolor_material_replace(struct Material *material, uint32_t from, uint32_t to);
+
+bool
+recolor_material_swap(struct Material *material, const struct RecolorPalette *to);
@@ -80,6 +80,7 @@ asprintf(char** strp, const char* fmt, ...)
 
 #include "psp-save.h"
 #include "kirk_engine.h"
+#include "trace.h"
 
 
 static const unsigned char
@@ -173,6 +174,8 @@ void
 saveskin_save(const char *out_dir, char *buf, size_t len, int slot,
         void (*icon0_save_callback)(const char *filename, void *user_data), void *user_data)
 {
+    TRACE_BEGIN("saveskin_save");
+
     ensure_kirk_inited();
 
     char *team_name = strdup(buf);
@@ -206,6 +209,8 @@ saveskin_save(const char *out_dir, char *buf, size_t len, int slot,
     printf("in_filename: %s\nout_filename: %s\nsfo_in_filename: %s\nsfo_out_filename: %s\n",
             in_filename, out_filename, sfo_in_filename, sfo_out_filename);
 
+    TRACE_BEGIN("write temp");
+
     FILE *tmp = fopen(in_filename, "wb");
     fwrite(buf, len, 1, tmp);
     fclose(tmp);
@@ -232,6 +237,8 @@ saveskin_save(const char *out_dir, char *buf, size_t len, int slot,
     fwrite(param_sfo, PARAM_SFO_len, 1, tmp);
     fclose(tmp);
 
+    TRACE_END("write temp");
+
     FILE *in = fopen(in_filename, "rb");
     FILE *out = fopen(out_filename, "wb");
 
@@ -251,13 +258,19 @@ saveskin_save(const char *out_dir, char *buf, size_t len, int slot,
     unlink(in_filename);
     unlink(sfo_in_filename);
 
+    TRACE_BEGIN("icon");
+
     char *tmpstr;
     asprintf(&tmpstr, "%s/ICON0.PNG", save_dir);
     icon0_save_callback(tmpstr, user_data);
     free(tmpstr);
 
+    TRACE_END("icon");
+
     free(sfo_out_filename);
     free(sfo_in_filename);
     free(in_filename);
     free(out_filename);
+
+    TRACE_END("saveskin_save");
 }
@@ -21,7 +21,6 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
 #include <vector>
-#include <deque>
 #include <algorithm>
 #include <cassert>
 #include <iostream>
@@ -30,20 +29,28 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <time.h>
 #include <limits>
 #include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SCOLORQ_KERNEL_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define SCOLORQ_KERNEL_NEON
+#include <arm_neon.h>
+#endif
 
 #include "spatial_color_quant.h"
+#include "trace.h"
+#include "memstat.h"
 
 using namespace std;
 
-static std::mt19937 rand_engine;
-static std::uniform_real_distribution<double> rand_distribution;
-
-static double
-rand_double()
-{
-    return rand_distribution(rand_engine);
-}
-
 template <typename T, int length>
 class vector_fixed
 {
@@ -168,6 +175,36 @@ ostream& operator<<(ostream& out, vector_fixed<T, length> vec) {
     return out;
 }
 
+// Buffers are aligned for the SIMD kernels below
+#define SCOLORQ_ALIGN 64
+
+static void *
+aligned_alloc_bytes(size_t size)
+{
+    void *ptr = NULL;
+#if defined(_WIN32)
+    ptr = _aligned_malloc(size, SCOLORQ_ALIGN);
+#else
+    if (posix_memalign(&ptr, SCOLORQ_ALIGN, size) != 0) {
+	ptr = NULL;
+    }
+#endif
+    if (ptr == NULL) {
+	throw bad_alloc();
+    }
+    return ptr;
+}
+
+static void
+aligned_free_bytes(void *ptr)
+{
+#if defined(_WIN32)
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
 template <typename T>
 class array2d
 {
@@ -176,24 +213,20 @@ public:
     {
         this->width = width;
         this->height = height;
-        data = new T[width * height];
+        allocate();
     }
 
     array2d(const array2d<T>& rhs)
     {
         width = rhs.width;
         height = rhs.height;
-        data = new T[width * height];
-        for(int i=0; i<width; i++) {
-	    for(int j=0; j<height; j++) {
-		(*this)(i,j) = rhs.data[j*width + i];
-	    }
-	}
+        allocate();
+        copy(rhs.data, rhs.data + width * height, data);
     }
 
     ~array2d()
     {
-	delete [] data;
+        release();
     }
 
     T& operator()(int col, int row)
@@ -204,6 +237,11 @@ public:
     int get_width() { return width; }
     int get_height() { return height; }
 
+    void clear()
+    {
+        fill(data, data + width * height, T());
+    }
+
     array2d<T>& operator*=(T scalar) {
         for(int i=0; i<width; i++) {
 	    for(int j=0; j<height; j++) {
@@ -278,6 +316,24 @@ public:
     }
 
 private:
+    void allocate()
+    {
+        data = (T*)aligned_alloc_bytes(sizeof(T) * width * height);
+        for (int i=0; i<width * height; i++) {
+            new (&data[i]) T();
+        }
+        memstat_add(MEMSTAT_QUANTIZER, sizeof(T) * width * height);
+    }
+
+    void release()
+    {
+        for (int i=0; i<width * height; i++) {
+            data[i].~T();
+        }
+        aligned_free_bytes(data);
+        memstat_sub(MEMSTAT_QUANTIZER, sizeof(T) * width * height);
+    }
+
     T* data;
     int width, height;
 };
@@ -315,7 +371,7 @@ public:
         this->width = width;
         this->height = height;
         this->depth = depth;
-        data = new T[width * height * depth];
+        allocate();
     }
 
     array3d(const array3d<T>& rhs)
@@ -323,19 +379,14 @@ public:
         width = rhs.width;
         height = rhs.height;
         depth = rhs.depth;
-        data = new T[width * height * depth];
-        for(int i=0; i<width; i++) {
-	    for(int j=0; j<height; j++) {
-		for(int k=0; k<depth; k++) {
-		    (*this)(i,j,k) = rhs.data[j*width*depth + i*depth + k];
-		}
-	    }
-	}
+        allocate();
+        copy(rhs.data, rhs.data + width * height * depth, data);
     }
 
     ~array3d()
     {
-	delete [] data;
+        aligned_free_bytes(data);
+        memstat_sub(MEMSTAT_QUANTIZER, sizeof(T) * width * height * depth);
     }
 
     T& operator()(int col, int row, int layer)
@@ -343,11 +394,29 @@ public:
         return data[row*width*depth + col*depth + layer];
     }
 
+    // All layers of one position are contiguous
+    T* layers(int col, int row)
+    {
+        return &data[(row*width + col)*depth];
+    }
+
     int get_width() { return width; }
     int get_height() { return height; }
     int get_depth() { return depth; }
 
+    void clear()
+    {
+        fill(data, data + width * height * depth, T());
+    }
+
 private:
+    void allocate()
+    {
+        data = (T*)aligned_alloc_bytes(sizeof(T) * width * height * depth);
+        fill(data, data + width * height * depth, T());
+        memstat_add(MEMSTAT_QUANTIZER, sizeof(T) * width * height * depth);
+    }
+
     T* data;
     int width, height, depth;
 };
@@ -375,6 +444,398 @@ ostream& operator<<(ostream& out, array3d<T>& a) {
     return out;
 }
 
+// Color channels of an image in separate planes, for the SIMD kernels
+template <typename T>
+class planes3
+{
+public:
+    planes3(int width, int height)
+    {
+        this->width = width;
+        this->height = height;
+        allocate();
+    }
+
+    // Converts from the interleaved layout
+    explicit planes3(array2d< vector_fixed<double, 3> >& rhs)
+    {
+        width = rhs.get_width();
+        height = rhs.get_height();
+        allocate();
+        for (int y=0; y<height; y++) {
+            for (int x=0; x<width; x++) {
+                for (int c=0; c<3; c++) {
+                    data[c][y*width + x] = (T)rhs(x, y)(c);
+                }
+            }
+        }
+    }
+
+    planes3(const planes3<T>& rhs)
+    {
+        width = rhs.width;
+        height = rhs.height;
+        allocate();
+        for (int c=0; c<3; c++) {
+            copy(rhs.data[c], rhs.data[c] + width * height, data[c]);
+        }
+    }
+
+    ~planes3()
+    {
+        for (int c=0; c<3; c++) {
+            aligned_free_bytes(data[c]);
+        }
+        memstat_sub(MEMSTAT_QUANTIZER, sizeof(T) * width * height * 3);
+    }
+
+    T* channel(int c) { return data[c]; }
+    int index(int x, int y) { return y*width + x; }
+    int get_width() { return width; }
+    int get_height() { return height; }
+
+private:
+    planes3<T>& operator=(const planes3<T>&);
+
+    void allocate()
+    {
+        for (int c=0; c<3; c++) {
+            data[c] = (T*)aligned_alloc_bytes(sizeof(T) * width * height);
+            fill(data[c], data[c] + width * height, T());
+        }
+        memstat_add(MEMSTAT_QUANTIZER, sizeof(T) * width * height * 3);
+    }
+
+    T* data[3];
+    int width, height;
+};
+
+// Upper triangle of the symmetric K x K matrix S, one plane per channel.
+// Entry (v, alpha) with v <= alpha is at [v*K + alpha], so that the updates
+// of a row are contiguous.
+class SMatrix
+{
+public:
+    explicit SMatrix(int size)
+    {
+        this->size = size;
+        for (int c=0; c<3; c++) {
+            data[c] = (double*)aligned_alloc_bytes(sizeof(double) * size * size);
+        }
+        memstat_add(MEMSTAT_QUANTIZER, sizeof(double) * size * size * 3);
+        clear();
+    }
+
+    ~SMatrix()
+    {
+        for (int c=0; c<3; c++) {
+            aligned_free_bytes(data[c]);
+        }
+        memstat_sub(MEMSTAT_QUANTIZER, sizeof(double) * size * size * 3);
+    }
+
+    double* channel(int c) { return data[c]; }
+    int get_size() { return size; }
+
+    void clear()
+    {
+        for (int c=0; c<3; c++) {
+            fill(data[c], data[c] + size * size, 0.0);
+        }
+    }
+
+    void add(SMatrix& other)
+    {
+        for (int c=0; c<3; c++) {
+            for (int k=0; k<size * size; k++) {
+                data[c][k] += other.data[c][k];
+            }
+        }
+    }
+
+private:
+    SMatrix(const SMatrix&);
+    SMatrix& operator=(const SMatrix&);
+
+    double* data[3];
+    int size;
+};
+
+// Kernels over the palette entries of a pixel. The generic versions serve
+// any precision; float has SIMD versions where available.
+
+// w_c[k] += b_c * x[k]
+template <typename Real>
+static inline void
+kernel_axpy3(Real* w0, Real* w1, Real* w2, Real b0, Real b1, Real b2, const Real* x, int count)
+{
+    for (int k=0; k<count; k++) {
+        w0[k] += b0 * x[k];
+        w1[k] += b1 * x[k];
+        w2[k] += b2 * x[k];
+    }
+}
+
+// s[k] += scale * w[k], accumulated in double
+template <typename Real>
+static inline void
+kernel_accumulate(double* s, Real scale, const Real* w, int count)
+{
+    for (int k=0; k<count; k++) {
+        s[k] += (double)(scale * w[k]);
+    }
+}
+
+// out_c = sum of x[k] * p_c[k]
+template <typename Real>
+static inline void
+kernel_dot3(const Real* x, const Real* p0, const Real* p1, const Real* p2, int count, Real* out)
+{
+    Real sum0 = 0, sum1 = 0, sum2 = 0;
+    for (int k=0; k<count; k++) {
+        sum0 += x[k] * p0[k];
+        sum1 += x[k] * p1[k];
+        sum2 += x[k] * p2[k];
+    }
+    out[0] = sum0;
+    out[1] = sum1;
+    out[2] = sum2;
+}
+
+#if defined(SCOLORQ_KERNEL_SSE2) || defined(SCOLORQ_KERNEL_NEON)
+static inline void
+kernel_axpy3(float* w0, float* w1, float* w2, float b0, float b1, float b2, const float* x, int count)
+{
+    int k = 0;
+#if defined(SCOLORQ_KERNEL_SSE2)
+    __m128 v0 = _mm_set1_ps(b0), v1 = _mm_set1_ps(b1), v2 = _mm_set1_ps(b2);
+    for (; k+4<=count; k+=4) {
+        __m128 vx = _mm_loadu_ps(x + k);
+        _mm_storeu_ps(w0 + k, _mm_add_ps(_mm_loadu_ps(w0 + k), _mm_mul_ps(v0, vx)));
+        _mm_storeu_ps(w1 + k, _mm_add_ps(_mm_loadu_ps(w1 + k), _mm_mul_ps(v1, vx)));
+        _mm_storeu_ps(w2 + k, _mm_add_ps(_mm_loadu_ps(w2 + k), _mm_mul_ps(v2, vx)));
+    }
+#else
+    for (; k+4<=count; k+=4) {
+        float32x4_t vx = vld1q_f32(x + k);
+        vst1q_f32(w0 + k, vaddq_f32(vld1q_f32(w0 + k), vmulq_n_f32(vx, b0)));
+        vst1q_f32(w1 + k, vaddq_f32(vld1q_f32(w1 + k), vmulq_n_f32(vx, b1)));
+        vst1q_f32(w2 + k, vaddq_f32(vld1q_f32(w2 + k), vmulq_n_f32(vx, b2)));
+    }
+#endif
+    for (; k<count; k++) {
+        w0[k] += b0 * x[k];
+        w1[k] += b1 * x[k];
+        w2[k] += b2 * x[k];
+    }
+}
+
+static inline void
+kernel_accumulate(double* s, float scale, const float* w, int count)
+{
+    int k = 0;
+#if defined(SCOLORQ_KERNEL_SSE2)
+    __m128 vs = _mm_set1_ps(scale);
+    for (; k+4<=count; k+=4) {
+        __m128 p = _mm_mul_ps(vs, _mm_loadu_ps(w + k));
+        _mm_storeu_pd(s + k, _mm_add_pd(_mm_loadu_pd(s + k), _mm_cvtps_pd(p)));
+        _mm_storeu_pd(s + k + 2, _mm_add_pd(_mm_loadu_pd(s + k + 2), _mm_cvtps_pd(_mm_movehl_ps(p, p))));
+    }
+#else
+    for (; k+4<=count; k+=4) {
+        float32x4_t p = vmulq_n_f32(vld1q_f32(w + k), scale);
+        vst1q_f64(s + k, vaddq_f64(vld1q_f64(s + k), vcvt_f64_f32(vget_low_f32(p))));
+        vst1q_f64(s + k + 2, vaddq_f64(vld1q_f64(s + k + 2), vcvt_high_f64_f32(p)));
+    }
+#endif
+    for (; k<count; k++) {
+        s[k] += (double)(scale * w[k]);
+    }
+}
+
+static inline void
+kernel_dot3(const float* x, const float* p0, const float* p1, const float* p2, int count, float* out)
+{
+    int k = 0;
+    float sums[3][4];
+#if defined(SCOLORQ_KERNEL_SSE2)
+    __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps(), a2 = _mm_setzero_ps();
+    for (; k+4<=count; k+=4) {
+        __m128 vx = _mm_loadu_ps(x + k);
+        a0 = _mm_add_ps(a0, _mm_mul_ps(vx, _mm_loadu_ps(p0 + k)));
+        a1 = _mm_add_ps(a1, _mm_mul_ps(vx, _mm_loadu_ps(p1 + k)));
+        a2 = _mm_add_ps(a2, _mm_mul_ps(vx, _mm_loadu_ps(p2 + k)));
+    }
+    _mm_storeu_ps(sums[0], a0);
+    _mm_storeu_ps(sums[1], a1);
+    _mm_storeu_ps(sums[2], a2);
+#else
+    float32x4_t a0 = vdupq_n_f32(0), a1 = vdupq_n_f32(0), a2 = vdupq_n_f32(0);
+    for (; k+4<=count; k+=4) {
+        float32x4_t vx = vld1q_f32(x + k);
+        a0 = vaddq_f32(a0, vmulq_f32(vx, vld1q_f32(p0 + k)));
+        a1 = vaddq_f32(a1, vmulq_f32(vx, vld1q_f32(p1 + k)));
+        a2 = vaddq_f32(a2, vmulq_f32(vx, vld1q_f32(p2 + k)));
+    }
+    vst1q_f32(sums[0], a0);
+    vst1q_f32(sums[1], a1);
+    vst1q_f32(sums[2], a2);
+#endif
+    for (int c=0; c<3; c++) {
+        out[c] = (sums[c][0] + sums[c][1]) + (sums[c][2] + sums[c][3]);
+    }
+    for (; k<count; k++) {
+        out[0] += x[k] * p0[k];
+        out[1] += x[k] * p1[k];
+        out[2] += x[k] * p2[k];
+    }
+}
+#endif
+
+class ParallelRunner;
+
+// Queue of the pixels to visit, in a ring buffer of fixed capacity
+class VisitQueue
+{
+public:
+    VisitQueue() : head(0), count(0) {}
+
+    void reserve(int capacity)
+    {
+        items.resize(capacity);
+        clear();
+    }
+
+    void clear()
+    {
+        head = 0;
+        count = 0;
+    }
+
+    bool empty() { return count == 0; }
+    int size() { return count; }
+
+    void push_back(const pair<int, int>& item)
+    {
+        assert(count < (int)items.size());
+        items[(head + count) % items.size()] = item;
+        count++;
+    }
+
+    pair<int, int> pop_front()
+    {
+        pair<int, int> item = items[head];
+        head = (head + 1) % items.size();
+        count--;
+        return item;
+    }
+
+private:
+    vector< pair<int, int> > items;
+    int head, count;
+};
+
+// Filter used for dithering (1, 3 or 5)
+#define SCOLORQ_FILTER_SIZE 3
+
+// Buffers of the runs of a context. They are sized for one image size,
+// palette size and precision, and reused by the following runs of that
+// shape, so that these do not allocate.
+struct ScolorqWorkspace {
+    ScolorqWorkspace(int width, int height, int colors, int precision);
+    virtual ~ScolorqWorkspace();
+
+    int width, height, colors, precision;
+    int max_coarse_level;
+
+    array2d< vector_fixed<double, 3> > image;
+    array2d< int > quantized_image;
+    vector< vector_fixed<double, 3> > palette;
+    array2d< vector_fixed<double, 3> > filter_weights;
+
+    // a_I^l, b_{IJ}^l and the coverage of each coarse level
+    vector< array2d< vector_fixed<double, 3> >* > a_vec, b_vec;
+    vector< array2d<int>* > mask_vec;
+
+    // Pixels a warm start may change (see scolorq_quantize_warm())
+    array2d< int > dirty;
+
+    // Scratch of the visit loops (serial and parallel)
+    VisitQueue visit_queue;
+    vector<int> permutation;
+    vector<char> visit, next;
+    vector< vector< pair<int, int> > > changed;
+    vector<int> visited, failed;
+
+    // Scratch of the palette solve
+    vector<double> solve_a, solve_inverse;
+
+private:
+    ScolorqWorkspace(const ScolorqWorkspace&);
+    ScolorqWorkspace& operator=(const ScolorqWorkspace&);
+};
+
+// The buffers that depend on the precision, for each coarse level
+template <typename Real>
+struct ScolorqBuffers : ScolorqWorkspace {
+    ScolorqBuffers(int width, int height, int colors, int precision)
+	: ScolorqWorkspace(width, height, colors, precision),
+	  palette_planes(colors, 1),
+	  s(colors)
+    {
+	for (int level=0; level<=max_coarse_level; level++) {
+	    coarse_variables.push_back(new array3d<Real>(width >> level, height >> level, colors));
+	    j_palette_sum.push_back(new planes3<Real>(width >> level, height >> level));
+	    b_planes.push_back(new planes3<Real>(*b_vec[level]));
+	}
+    }
+
+    ~ScolorqBuffers()
+    {
+	for (int level=0; level<=max_coarse_level; level++) {
+	    delete coarse_variables[level];
+	    delete j_palette_sum[level];
+	    delete b_planes[level];
+	}
+    }
+
+    vector< array3d<Real>* > coarse_variables;
+    vector< planes3<Real>* > j_palette_sum;
+    vector< planes3<Real>* > b_planes;
+    planes3<Real> palette_planes;
+    SMatrix s;
+};
+
+// All state of a quantization run, so that runs on different threads are independent
+struct scolorq_ctx {
+    uint32_t seed;
+    std::mt19937 rand_engine;
+    std::uniform_real_distribution<double> rand_distribution;
+
+    scolorq_progress_func progress;
+    void *progress_user_data;
+
+    // Threads per run, 1 = serial annealing
+    int threads;
+
+    // SCOLORQ_PRECISION_*
+    int precision;
+
+    // Buffers, kept for the next run
+    ScolorqWorkspace* workspace;
+    ParallelRunner* runner;
+    vector<SMatrix*> partial_s;
+
+    // Counters of the last run
+    scolorq_stats stats;
+};
+
+static double
+rand_double(scolorq_ctx *ctx)
+{
+    return ctx->rand_distribution(ctx->rand_engine);
+}
+
 int compute_max_coarse_level(int width, int height) {
     // We want the coarsest layer to have at most MAX_PIXELS pixels
     const int MAX_PIXELS = 4000;
@@ -387,11 +848,12 @@ int compute_max_coarse_level(int width, int height) {
     return result;
 }
 
-void fill_random(array3d<double>& a) {
+template <typename Real>
+void fill_random(scolorq_ctx *ctx, array3d<Real>& a) {
     for(int i=0; i<a.get_width(); i++) {
 	for(int j=0; j<a.get_height(); j++) {
             for(int k=0; k<a.get_depth(); k++) {
-                a(i,j,k) = rand_double();
+                a(i,j,k) = (Real)rand_double(ctx);
 	    }
 	}
     }
@@ -405,20 +867,18 @@ double get_final_temperature() {
     return 0.02; // TODO: Figure out what to make this
 }
 
-void random_permutation(int count, vector<int>& result) {
+void random_permutation(scolorq_ctx *ctx, int count, vector<int>& result) {
     result.clear();
     for(int i=0; i<count; i++) {
         result.push_back(i);
     }
-    random_shuffle(result.begin(), result.end());
+    shuffle(result.begin(), result.end(), ctx->rand_engine);
 }
 
-void random_permutation_2d(int width, int height, deque< pair<int, int> >& result) {
-    vector<int> perm1d;
-    random_permutation(width*height, perm1d);
-    while(!perm1d.empty()) {
-        int idx = perm1d.back();
-        perm1d.pop_back();
+void random_permutation_2d(scolorq_ctx *ctx, int width, int height, VisitQueue& result, vector<int>& perm1d) {
+    random_permutation(ctx, width*height, perm1d);
+    for (int i=width*height-1; i>=0; i--) {
+        int idx = perm1d[i];
         result.push_back(pair<int,int>(idx % width, idx / width));
     }
 }
@@ -509,43 +969,86 @@ void sum_coarsen(array2d< vector_fixed<double, 3> >& fine,
     }
 }
 
-template <typename T, int length>
-array2d<T> extract_vector_layer_2d(array2d< vector_fixed<T, length> > s, int k)
+// Pixels outside of the mask have no variables (they are not visible anyway)
+static inline bool
+is_covered(array2d<int>* mask, int x, int y)
 {
-    array2d<T> result(s.get_width(), s.get_height());
-    for(int i=0; i < s.get_width(); i++) {
-	for(int j=0; j < s.get_height(); j++) {
-	    result(i,j) = s(i,j)(k);
+    return mask == NULL || (*mask)(x, y) != 0;
+}
+
+void or_coarsen(array2d<int>& fine, array2d<int>& coarse)
+{
+    for(int y=0; y<coarse.get_height(); y++) {
+	for(int x=0; x<coarse.get_width(); x++) {
+	    int val = fine(x*2, y*2);
+	    if (x*2 + 1 < fine.get_width()) val |= fine(x*2 + 1, y*2);
+	    if (y*2 + 1 < fine.get_height()) val |= fine(x*2, y*2 + 1);
+	    if (x*2 + 1 < fine.get_width() && y*2 + 1 < fine.get_height()) val |= fine(x*2 + 1, y*2 + 1);
+	    coarse(x, y) = val;
 	}
     }
-    return result;
 }
 
-template <typename T, int length>
-vector<T> extract_vector_layer_1d(vector< vector_fixed<T, length> > s, int k)
-{
-    vector<T> result;
-    for(unsigned int i=0; i < s.size(); i++) {
-	result.push_back(s[i](k));
+// Palettes have at most this many entries
+#define SCOLORQ_MAX_COLORS 256
+
+// Palette size known at compile time (Colors > 0) or at runtime (Colors == 0).
+// With a fixed size, the loops over the palette have constant trip counts.
+template <int Colors>
+struct PaletteSize {
+    enum { capacity = (Colors > 0) ? Colors : SCOLORQ_MAX_COLORS };
+
+    static inline int get(int size) { return (Colors > 0) ? Colors : size; }
+};
+
+// Starts each pixel close to its nearest palette color: the meanfield at the
+// given temperature, without the neighbors
+template <typename Real>
+void fill_from_palette(array3d<Real>& a, array2d< vector_fixed<double, 3> >& image,
+		       vector< vector_fixed<double, 3> >& palette, double temperature) {
+    int palette_size = palette.size();
+    double distances[SCOLORQ_MAX_COLORS];
+    for(int i=0; i<a.get_width(); i++) {
+	for(int j=0; j<a.get_height(); j++) {
+	    double min_distance = numeric_limits<double>::infinity();
+	    for (int v=0; v<palette_size; v++) {
+		distances[v] = (palette[v] - image(i,j)).norm_squared();
+		min_distance = min(min_distance, distances[v]);
+	    }
+	    double sum = 0.0;
+	    for (int v=0; v<palette_size; v++) {
+		distances[v] = exp(-(distances[v] - min_distance)/temperature);
+		sum += distances[v];
+	    }
+	    for (int v=0; v<palette_size; v++) {
+		double val = distances[v]/sum;
+		// Same limits as the annealing loop
+		if (val <= 1e-10) val = 1e-10;
+		if (val >= 1) val = 1 - 1e-10;
+		a(i,j,v) = (Real)val;
+	    }
+	}
     }
-    return result;
 }
 
-int best_match_color(array3d<double>& vars, int i_x, int i_y,
+template <typename Real, int Colors>
+int best_match_color(array3d<Real>& vars, int i_x, int i_y,
 		     vector< vector_fixed<double, 3> >& palette)
 {
+    int palette_size = PaletteSize<Colors>::get(palette.size());
+    Real* weights = vars.layers(i_x, i_y);
     int max_v = 0;
-    double max_weight = vars(i_x, i_y, 0);
-    for (unsigned int v=1; v < palette.size(); v++) {
-	if (vars(i_x, i_y, v) > max_weight) {
+    Real max_weight = weights[0];
+    for (int v=1; v < palette_size; v++) {
+	if (weights[v] > max_weight) {
 	    max_v = v;
-	    max_weight = vars(i_x, i_y, v);
+	    max_weight = weights[v];
 	}
     }
     return max_v;
 }
-
-void zoom_double(array3d<double>& small, array3d<double>& big)
+template <typename Real>
+void zoom_double(array3d<Real>& small, array3d<Real>& big)
 {
     // Simple scaling of the weights array based on mixing the four
     // pixels falling under each fine pixel, weighted by area.
@@ -586,106 +1089,178 @@ void zoom_double(array3d<double>& small, array3d<double>& big)
     }
 }
 
-void compute_initial_s(array2d< vector_fixed<double,3> >& s,
-		       array3d<double>& coarse_variables,
-                       array2d< vector_fixed<double, 3> >& b)
+template <typename Real, int Colors>
+void compute_initial_s(SMatrix& s,
+		       array3d<Real>& coarse_variables,
+                       planes3<Real>& b,
+		       array2d<int>* mask)
 {
-    int palette_size  = s.get_width();
+    int palette_size  = PaletteSize<Colors>::get(s.get_size());
     int coarse_width  = coarse_variables.get_width();
     int coarse_height = coarse_variables.get_height();
     int center_x = (b.get_width()-1)/2, center_y = (b.get_height()-1)/2;
-    vector_fixed<double,3> center_b = b_value(b,0,0,0,0);
-    vector_fixed<double,3> zero_vector;
-    for (int v=0; v<palette_size; v++) {
-	for (int alpha=v; alpha<palette_size; alpha++) {
-	    s(v,alpha) = zero_vector;
-	}
-    }
+    int center = b.index(center_x, center_y);
+    // w_c(alpha) = sum of b_ij * m_j,alpha over the neighbors j of pixel i
+    alignas(SCOLORQ_ALIGN) Real w[3][PaletteSize<Colors>::capacity];
+    s.clear();
     for (int i_y=0; i_y<coarse_height; i_y++) {
 	for (int i_x=0; i_x<coarse_width; i_x++) {
+	    if (!is_covered(mask, i_x, i_y)) continue;
+	    for (int c=0; c<3; c++) {
+		fill(w[c], w[c] + palette_size, Real(0));
+	    }
 	    int max_j_x = min(coarse_width,  i_x - center_x + b.get_width());
 	    int max_j_y = min(coarse_height, i_y - center_y + b.get_height());
 	    for (int j_y=max(0, i_y - center_y); j_y<max_j_y; j_y++) {
 		for (int j_x=max(0, i_x - center_x); j_x<max_j_x; j_x++) {
 		    if (i_x == j_x && i_y == j_y) continue;
-		    vector_fixed<double,3> b_ij = b_value(b,i_x,i_y,j_x,j_y);
-		    for (int v=0; v<palette_size; v++) {
-			for (int alpha=v; alpha<palette_size; alpha++) {
-			    double mult = coarse_variables(i_x,i_y,v)*
-				          coarse_variables(j_x,j_y,alpha);
-			    s(v,alpha)(0) += mult * b_ij(0);
-			    s(v,alpha)(1) += mult * b_ij(1);
-			    s(v,alpha)(2) += mult * b_ij(2);
-			}
-		    }
+		    if (!is_covered(mask, j_x, j_y)) continue;
+		    int k = b.index(j_x - i_x + center_x, j_y - i_y + center_y);
+		    kernel_axpy3(w[0], w[1], w[2], b.channel(0)[k], b.channel(1)[k], b.channel(2)[k],
+				 coarse_variables.layers(j_x, j_y), palette_size);
 		}
-	    }	    
+	    }
+	    // s(v,alpha) += m_i,v * w(alpha) for alpha >= v
+	    Real* m_i = coarse_variables.layers(i_x, i_y);
 	    for (int v=0; v<palette_size; v++) {
-		s(v,v) += coarse_variables(i_x,i_y,v)*center_b;
+		for (int c=0; c<3; c++) {
+		    double* row = s.channel(c) + v*palette_size;
+		    kernel_accumulate(row + v, m_i[v], w[c] + v, palette_size - v);
+		    row[v] += (double)(m_i[v] * b.channel(c)[center]);
+		}
 	    }
 	}
     }
 }
 
-void update_s(array2d< vector_fixed<double,3> >& s,
-	      array3d<double>& coarse_variables,
-	      array2d< vector_fixed<double, 3> >& b,
-	      int j_x, int j_y, int alpha,
-	      double delta)
+// Adds the changes of the variables of pixel j to s, delta is 0 for the
+// entries to skip. The neighbor sums are shared by all changed entries.
+template <typename Real, int Colors>
+void update_s(SMatrix& s,
+	      array3d<Real>& coarse_variables,
+	      planes3<Real>& b,
+	      int j_x, int j_y,
+	      const Real* delta,
+	      array2d<int>* mask)
 {
-    int palette_size  = s.get_width();
+    int palette_size  = PaletteSize<Colors>::get(s.get_size());
     int coarse_width  = coarse_variables.get_width();
     int coarse_height = coarse_variables.get_height();
     int center_x = (b.get_width()-1)/2, center_y = (b.get_height()-1)/2;
+    int center = b.index(center_x, center_y);
     int max_i_x = min(coarse_width,  j_x + center_x + 1);
     int max_i_y = min(coarse_height, j_y + center_y + 1);
+    // u_c(v) = sum of b_ij * m_i,v over the neighbors i of pixel j
+    alignas(SCOLORQ_ALIGN) Real u[3][PaletteSize<Colors>::capacity];
+    for (int c=0; c<3; c++) {
+	fill(u[c], u[c] + palette_size, Real(0));
+    }
     for (int i_y=max(0, j_y - center_y); i_y<max_i_y; i_y++) {
 	for (int i_x=max(0, j_x - center_x); i_x<max_i_x; i_x++) {
-	    vector_fixed<double,3> delta_b_ij = delta*b_value(b,i_x,i_y,j_x,j_y);
 	    if (i_x == j_x && i_y == j_y) continue;
+	    if (!is_covered(mask, i_x, i_y)) continue;
+	    int k = b.index(j_x - i_x + center_x, j_y - i_y + center_y);
+	    kernel_axpy3(u[0], u[1], u[2], b.channel(0)[k], b.channel(1)[k], b.channel(2)[k],
+			 coarse_variables.layers(i_x, i_y), palette_size);
+	}
+    }
+    for (int alpha=0; alpha<palette_size; alpha++) {
+	Real d = delta[alpha];
+	if (d == 0) continue;
+	for (int c=0; c<3; c++) {
+	    double* s_c = s.channel(c);
 	    for (int v=0; v <= alpha; v++) {
-		double mult = coarse_variables(i_x,i_y,v);
-		s(v,alpha)(0) += mult * delta_b_ij(0);
-		s(v,alpha)(1) += mult * delta_b_ij(1);
-		s(v,alpha)(2) += mult * delta_b_ij(2);
-	    }
-	    for (int v=alpha; v<palette_size; v++) {
-		double mult = coarse_variables(i_x,i_y,v);
-		s(alpha,v)(0) += mult * delta_b_ij(0);
-		s(alpha,v)(1) += mult * delta_b_ij(1);
-		s(alpha,v)(2) += mult * delta_b_ij(2);
+		s_c[v*palette_size + alpha] += (double)(d * u[c][v]);
 	    }
+	    kernel_accumulate(s_c + alpha*palette_size + alpha, d, u[c] + alpha, palette_size - alpha);
+	    s_c[alpha*palette_size + alpha] += (double)(d * b.channel(c)[center]);
 	}
     }
-    s(alpha,alpha) += delta*b_value(b,0,0,0,0);
 }
 
-void refine_palette(array2d< vector_fixed<double,3> >& s,
-		    array3d<double>& coarse_variables,
-		    array2d< vector_fixed<double, 3> >& a,
-		    vector< vector_fixed<double, 3> >& palette)
+// Computes -(2 S_k)^-1 R_k of one channel, in the same order of operations as
+// array2d::matrix_inverse() and its product. a and inverse are size x size
+// scratch buffers.
+template <int Colors>
+static void
+solve_palette_channel(double* s_k, const double* r_k, double* result, int size, double* a, double* inverse)
 {
+    int n = PaletteSize<Colors>::get(size);
     // We only computed the half of S above the diagonal - reflect it
-    for (int v=0; v<s.get_width(); v++) {
-	for (int alpha=0; alpha<v; alpha++) {
-	    s(v,alpha) = s(alpha,v);
+    for (int row=0; row<n; row++) {
+	for (int col=0; col<n; col++) {
+	    a[row*n + col] = 2.0 * s_k[min(row,col)*n + max(row,col)];
+	    inverse[row*n + col] = (row == col) ? 1.0 : 0.0;
 	}
     }
+    // Reduce to echelon form, mirroring in inverse
+    for (int i=0; i<n; i++) {
+	double mult = 1/a[i*n + i];
+	for (int col=0; col<n; col++) {
+	    inverse[i*n + col] *= mult;
+	}
+	for (int col=0; col<n; col++) {
+	    a[i*n + col] *= mult;
+	}
+	for (int j=i+1; j<n; j++) {
+	    double add = -a[j*n + i];
+	    for (int col=0; col<n; col++) {
+		inverse[j*n + col] += add*inverse[i*n + col];
+	    }
+	    for (int col=0; col<n; col++) {
+		a[j*n + col] += add*a[i*n + col];
+	    }
+	}
+    }
+    // Back substitute, mirroring in inverse
+    for (int i=n-1; i>=0; i--) {
+	for (int j=i-1; j>=0; j--) {
+	    double add = -a[j*n + i];
+	    for (int col=0; col<n; col++) {
+		inverse[j*n + col] += add*inverse[i*n + col];
+	    }
+	    for (int col=0; col<n; col++) {
+		a[j*n + col] += add*a[i*n + col];
+	    }
+	}
+    }
+    for (int row=0; row<n; row++) {
+	double sum = 0;
+	for (int col=0; col<n; col++) {
+	    sum += (-1.0*inverse[row*n + col]) * r_k[col];
+	}
+	result[row] = sum;
+    }
+}
 
-    vector< vector_fixed<double,3> > r(palette.size());
-    for (unsigned int v=0; v<palette.size(); v++) {
-	for (int i_y=0; i_y<coarse_variables.get_height(); i_y++) {
-	    for (int i_x=0; i_x<coarse_variables.get_width(); i_x++) {
-		r[v] += coarse_variables(i_x,i_y,v)*a(i_x,i_y);
+template <typename Real, int Colors>
+void refine_palette(SMatrix& s,
+		    array3d<Real>& coarse_variables,
+		    array2d< vector_fixed<double, 3> >& a,
+		    vector< vector_fixed<double, 3> >& palette,
+		    array2d<int>* mask,
+		    double* solve_a, double* solve_inverse)
+{
+    int palette_size = PaletteSize<Colors>::get(palette.size());
+    vector_fixed<double,3> r[PaletteSize<Colors>::capacity];
+    for (int i_y=0; i_y<coarse_variables.get_height(); i_y++) {
+	for (int i_x=0; i_x<coarse_variables.get_width(); i_x++) {
+	    if (!is_covered(mask, i_x, i_y)) continue;
+	    Real* m_i = coarse_variables.layers(i_x, i_y);
+	    for (int v=0; v<palette_size; v++) {
+		r[v] += (double)m_i[v]*a(i_x,i_y);
 	    }
 	}
     }
 
     for (unsigned int k=0; k<3; k++) {
-	array2d<double> S_k = extract_vector_layer_2d(s, k);
-	vector<double> R_k = extract_vector_layer_1d(r, k);
-	vector<double> palette_channel = -1.0*((2.0*S_k).matrix_inverse())*R_k;
-	for (unsigned int v=0; v<palette.size(); v++) {
+	double r_k[PaletteSize<Colors>::capacity];
+	double palette_channel[PaletteSize<Colors>::capacity];
+	for (int v=0; v<palette_size; v++) {
+	    r_k[v] = r[v](k);
+	}
+	solve_palette_channel<Colors>(s.channel(k), r_k, palette_channel, palette_size, solve_a, solve_inverse);
+	for (int v=0; v<palette_size; v++) {
 	    double val = palette_channel[v];
 	    if (val < 0) val = 0;
 	    if (val > 1) val = 1;
@@ -700,73 +1275,430 @@ void refine_palette(array2d< vector_fixed<double,3> >& s,
 #endif
 }
 
-void compute_initial_j_palette_sum(array2d< vector_fixed<double, 3> >& j_palette_sum,
-				   array3d<double>& coarse_variables,
-				   vector< vector_fixed<double, 3> >& palette)
+// Copies the palette to the layout of the kernels, one plane per channel
+template <typename Real>
+void update_palette_planes(planes3<Real>& palette_planes,
+			   vector< vector_fixed<double, 3> >& palette)
+{
+    for (unsigned int v=0; v<palette.size(); v++) {
+	for (int c=0; c<3; c++) {
+	    palette_planes.channel(c)[v] = (Real)palette[v](c);
+	}
+    }
+}
+
+template <typename Real, int Colors>
+void compute_initial_j_palette_sum(planes3<Real>& j_palette_sum,
+				   array3d<Real>& coarse_variables,
+				   planes3<Real>& palette_planes)
 {
+     int palette_size = PaletteSize<Colors>::get(coarse_variables.get_depth());
      for (int j_y=0; j_y<coarse_variables.get_height(); j_y++) {
 	 for (int j_x=0; j_x<coarse_variables.get_width(); j_x++) {
-	     vector_fixed<double, 3> palette_sum = vector_fixed<double, 3>();
-	     for (unsigned int alpha=0; alpha < palette.size(); alpha++) {
-		 palette_sum += coarse_variables(j_x,j_y,alpha)*palette[alpha];
+	     Real palette_sum[3];
+	     kernel_dot3(coarse_variables.layers(j_x, j_y), palette_planes.channel(0),
+			 palette_planes.channel(1), palette_planes.channel(2), palette_size, palette_sum);
+	     int j = j_palette_sum.index(j_x, j_y);
+	     for (int c=0; c<3; c++) {
+		 j_palette_sum.channel(c)[j] = palette_sum[c];
 	     }
-	     j_palette_sum(j_x, j_y) = palette_sum;
 	 }
      }
 }
 
-void spatial_color_quant(array2d< vector_fixed<double, 3> >& image,
-                         array2d< vector_fixed<double, 3> >& filter_weights,
-                         array2d< int >& quantized_image,
-                         vector< vector_fixed<double, 3> >& palette,
-			 array3d<double>*& p_coarse_variables,
-			 double initial_temperature,
-			 double final_temperature,
-			 int temps_per_level,
-			 int repeats_per_temp)
+// What the update of a single coarse pixel reads and writes
+template <typename Real>
+struct AnnealStep {
+    array3d<Real>* coarse_variables;
+    planes3<Real>* j_palette_sum;
+    array2d< vector_fixed<double, 3> >* a;
+    planes3<Real>* b;
+    array2d<int>* m;
+    // Pixels that are visited, NULL = all covered pixels
+    array2d<int>* active;
+    vector< vector_fixed<double, 3> >* palette;
+    planes3<Real>* palette_planes;
+    vector_fixed<double,3> middle_b;
+    double temperature;
+    bool maintain_s;
+};
+
+// Updates pixel i, adding its contribution to s. Returns 1 if its color
+// changed, 0 if not and -1 if the meanfield sum underflowed.
+template <typename Real, int Colors>
+static int
+anneal_pixel(AnnealStep<Real>& step, SMatrix& s, int i_x, int i_y)
 {
-    int max_coarse_level = //1;
-        compute_max_coarse_level(image.get_width(), image.get_height());
-    p_coarse_variables = new array3d<double>(
-	image.get_width()  >> max_coarse_level,
-	image.get_height() >> max_coarse_level,
-	palette.size());
-    // For syntactic convenience
-    array3d<double>& coarse_variables = *p_coarse_variables;
-    fill_random(coarse_variables);
+    array3d<Real>& coarse_variables = *step.coarse_variables;
+    planes3<Real>& j_palette_sum = *step.j_palette_sum;
+    array2d< vector_fixed<double, 3> >& a = *step.a;
+    planes3<Real>& b = *step.b;
+    array2d<int>* m = step.m;
+    vector< vector_fixed<double, 3> >& palette = *step.palette;
+    planes3<Real>& palette_planes = *step.palette_planes;
+    vector_fixed<double,3>& middle_b = step.middle_b;
+    double temperature = step.temperature;
+    int palette_size = PaletteSize<Colors>::get(palette.size());
+    int center_x = (b.get_width()-1)/2, center_y = (b.get_height()-1)/2;
 
-    double temperature = initial_temperature;
+    // Compute (25)
+    vector_fixed<double,3> p_i;
+    int max_j_x = min(coarse_variables.get_width(),  i_x - center_x + b.get_width());
+    int max_j_y = min(coarse_variables.get_height(), i_y - center_y + b.get_height());
+    for (int j_y=max(0, i_y - center_y); j_y<max_j_y; j_y++) {
+	for (int j_x=max(0, i_x - center_x); j_x<max_j_x; j_x++) {
+	    if (i_x == j_x && i_y == j_y) continue;
+	    if (!is_covered(m, j_x, j_y)) continue;
+	    int k = b.index(j_x - i_x + center_x, j_y - i_y + center_y);
+	    int j = j_palette_sum.index(j_x, j_y);
+	    p_i(0) += (double)b.channel(0)[k]*j_palette_sum.channel(0)[j];
+	    p_i(1) += (double)b.channel(1)[k]*j_palette_sum.channel(1)[j];
+	    p_i(2) += (double)b.channel(2)[k]*j_palette_sum.channel(2)[j];
+	}
+    }
+    p_i *= 2.0;
+    p_i += a(i_x, i_y);
+
+    double meanfields[PaletteSize<Colors>::capacity];
+    double max_meanfield_log = -numeric_limits<double>::infinity();
+    double meanfield_sum = 0.0;
+    for (int v=0; v < palette_size; v++) {
+	// Update m_{pi(i)v}^I according to (23)
+	// We can subtract an arbitrary factor to prevent overflow,
+	// since only the weight relative to the sum matters, so we
+	// will choose a value that makes the maximum e^100.
+	meanfields[v] = -(palette[v].dot_product(
+	    p_i + middle_b.direct_product(
+		palette[v])))/temperature;
+	if (meanfields[v] > max_meanfield_log) {
+	    max_meanfield_log = meanfields[v];
+	}
+    }
+    for (int v=0; v < palette_size; v++) {
+	meanfields[v] = exp(meanfields[v]-max_meanfield_log+100);
+	meanfield_sum += meanfields[v];
+    }
+    if (meanfield_sum == 0) {
+	cout << "Fatal error: Meanfield sum underflowed. Please contact developer." << endl;
+	return -1;
+    }
+    int old_max_v = best_match_color<Real, Colors>(coarse_variables, i_x, i_y, palette);
+    Real* m_i = coarse_variables.layers(i_x, i_y);
+    alignas(SCOLORQ_ALIGN) Real delta[PaletteSize<Colors>::capacity];
+    alignas(SCOLORQ_ALIGN) Real s_delta[PaletteSize<Colors>::capacity];
+    bool changed_s = false;
+    for (int v=0; v < palette_size; v++) {
+	double new_val = meanfields[v]/meanfield_sum;
+	// Prevent the matrix S from becoming singular (and float from
+	// going denormal, which is very slow)
+	if (new_val <= 1e-10) new_val = 1e-10;
+	if (new_val >= 1) new_val = 1 - 1e-10;
+	Real old_val = m_i[v];
+	m_i[v] = (Real)new_val;
+	delta[v] = m_i[v] - old_val;
+	s_delta[v] = 0;
+	if (abs(new_val - old_val) > 0.001 && step.maintain_s) {
+	    s_delta[v] = delta[v];
+	    changed_s = true;
+	}
+    }
+    Real j_pal_delta[3];
+    kernel_dot3(delta, palette_planes.channel(0), palette_planes.channel(1), palette_planes.channel(2),
+		palette_size, j_pal_delta);
+    int i = j_palette_sum.index(i_x, i_y);
+    for (int c=0; c<3; c++) {
+	j_palette_sum.channel(c)[i] += j_pal_delta[c];
+    }
+    if (changed_s) {
+	update_s<Real, Colors>(s, coarse_variables, b, i_x, i_y, s_delta, m);
+    }
+    int max_v = best_match_color<Real, Colors>(coarse_variables, i_x, i_y, palette);
+    // Only consider it a change if the colors are different enough
+    return ((palette[max_v]-palette[old_max_v]).norm_squared() >= 1.0/(255.0*255.0)) ? 1 : 0;
+}
+// Runs a function on a fixed set of threads (the calling thread is number 0)
+class ParallelRunner
+{
+public:
+    explicit ParallelRunner(int count)
+	: func(NULL), generation(0), running(0), quit(false)
+    {
+	for (int i=1; i<count; i++) {
+	    threads.push_back(thread(&ParallelRunner::worker, this, i));
+	}
+    }
+
+    ~ParallelRunner()
+    {
+	{
+	    lock_guard<mutex> lock(m);
+	    quit = true;
+	}
+	wake.notify_all();
+	for (size_t i=0; i<threads.size(); i++) {
+	    threads[i].join();
+	}
+    }
+
+    int count() { return threads.size() + 1; }
+
+    void run(const function<void(int)>& f)
+    {
+	{
+	    lock_guard<mutex> lock(m);
+	    func = &f;
+	    running = threads.size();
+	    generation++;
+	}
+	wake.notify_all();
+	f(0);
+	unique_lock<mutex> lock(m);
+	while (running > 0) {
+	    done.wait(lock);
+	}
+	func = NULL;
+    }
+
+private:
+    ParallelRunner(const ParallelRunner &);
+    ParallelRunner &operator=(const ParallelRunner &);
+
+    void worker(int index)
+    {
+	unsigned int seen = 0;
+	unique_lock<mutex> lock(m);
+	while (true) {
+	    while (!quit && generation == seen) {
+		wake.wait(lock);
+	    }
+	    if (quit) break;
+	    seen = generation;
+	    const function<void(int)>* f = func;
+	    lock.unlock();
+	    (*f)(index);
+	    lock.lock();
+	    if (--running == 0) done.notify_one();
+	}
+    }
+
+    vector<thread> threads;
+    mutex m;
+    condition_variable wake, done;
+    const function<void(int)>* func;
+    unsigned int generation;
+    int running;
+    bool quit;
+};
+
+// Upper bound of sweeps for pixels that keep changing
+#define ANNEAL_MAX_SWEEPS 8
+
+// Parallel version of one repeat of the visit loop. Pixels whose color
+// index (x mod (center_x+1), y mod (center_y+1)) is the same are outside of
+// each other's b neighborhood, so each such set is updated by all threads at
+// once. The contributions to s are summed afterwards, in thread order, so the
+// result does not depend on scheduling. Changed pixels have their neighbors
+// revisited in the next sweep (instead of the same repeat, as in the serial
+// loop).
+template <typename Real, int Colors>
+static int
+anneal_parallel(scolorq_ctx *ctx, ParallelRunner& runner, AnnealStep<Real>& step,
+		SMatrix& s, vector<SMatrix*>& partial_s, ScolorqWorkspace& workspace,
+		double work_done, double work_total, int& pixels_changed, int& pixels_visited)
+{
+    array3d<Real>& coarse_variables = *step.coarse_variables;
+    planes3<Real>& b = *step.b;
+    int width = coarse_variables.get_width(), height = coarse_variables.get_height();
+    int center_x = (b.get_width()-1)/2, center_y = (b.get_height()-1)/2;
+    int stride_x = center_x + 1, stride_y = center_y + 1;
+    int threads = runner.count();
+    int level_pixels = width * height;
+
+    vector<char>& visit = workspace.visit;
+    vector<char>& next = workspace.next;
+    for (int i_y=0; i_y<height; i_y++) {
+	for (int i_x=0; i_x<width; i_x++) {
+	    visit[i_y*width + i_x] = is_covered(step.m, i_x, i_y) && is_covered(step.active, i_x, i_y);
+	}
+    }
+
+    vector< vector< pair<int, int> > >& changed = workspace.changed;
+    vector<int>& visited = workspace.visited;
+    vector<int>& failed = workspace.failed;
+
+    for (int sweep=0; sweep<ANNEAL_MAX_SWEEPS; sweep++) {
+	bool again = false;
+	fill(next.begin(), next.begin() + width * height, 0);
+
+	for (int set_y=0; set_y<stride_y; set_y++) {
+	    for (int set_x=0; set_x<stride_x; set_x++) {
+		int rows = (height - set_y + stride_y - 1) / stride_y;
+		auto body = [&](int t) {
+		    for (int row=t; row<rows; row+=threads) {
+			int i_y = set_y + row * stride_y;
+			for (int i_x=set_x; i_x<width; i_x+=stride_x) {
+			    if (!visit[i_y*width + i_x]) continue;
+			    int result = anneal_pixel<Real, Colors>(step, *partial_s[t], i_x, i_y);
+			    if (result < 0) {
+				failed[t] = 1;
+				return;
+			    }
+			    visited[t]++;
+			    if (result > 0) {
+				changed[t].push_back(pair<int,int>(i_x, i_y));
+			    }
+			}
+		    }
+		};
+		// Passed by reference, so that the std::function does not allocate
+		runner.run(ref(body));
+
+		// Reduction
+		for (int t=0; t<threads; t++) {
+		    if (failed[t]) return -1;
+
+		    s.add(*partial_s[t]);
+		    partial_s[t]->clear();
+
+		    pixels_visited += visited[t];
+		    visited[t] = 0;
+
+		    // Same neighborhood as in the serial loop
+		    for (size_t k=0; k<changed[t].size(); k++) {
+			int i_x = changed[t][k].first, i_y = changed[t][k].second;
+			pixels_changed++;
+			for (int y=min(1,center_y-1); y<max(b.get_height()-1,center_y+1); y++) {
+			    for (int x=min(1,center_x-1); x<max(b.get_width()-1,center_x+1); x++) {
+				int j_x = x - center_x + i_x, j_y = y - center_y + i_y;
+				if (j_x < 0 || j_y < 0 || j_x >= width || j_y >= height) continue;
+				if (!is_covered(step.m, j_x, j_y) || !is_covered(step.active, j_x, j_y)) continue;
+				next[j_y*width + j_x] = 1;
+				again = true;
+			    }
+			}
+		    }
+		    changed[t].clear();
+		}
+
+		if (ctx->progress != NULL &&
+		    !ctx->progress((work_done + min(pixels_visited, level_pixels)) / work_total, ctx->progress_user_data)) {
+		    return SCOLORQ_CANCELLED;
+		}
+	    }
+	}
+
+	if (!again) break;
+	visit.swap(next);
+    }
+
+    return 0;
+}
+
+static void
+scolorq_ctx_release(scolorq_ctx *ctx)
+{
+    delete ctx->workspace;
+    ctx->workspace = NULL;
+    delete ctx->runner;
+    ctx->runner = NULL;
+    for (size_t t=0; t<ctx->partial_s.size(); t++) {
+	delete ctx->partial_s[t];
+    }
+    ctx->partial_s.clear();
+}
+
+// Number of coarse pixel visits of the annealing loop (mirrors its control flow)
+static double
+annealing_work(int width, int height, int max_coarse_level, int iters_per_level, int repeats_per_temp,
+               double temperature, double final_temperature, double temperature_multiplier)
+{
+    double work = 0.0;
+    int coarse_level = max_coarse_level;
+    int iters_at_current_level = 0;
+    while (coarse_level >= 0 || temperature > final_temperature) {
+	work += (double)(width >> coarse_level) * (height >> coarse_level) * repeats_per_temp;
+	iters_at_current_level++;
+	if ((temperature <= final_temperature || coarse_level > 0) &&
+	    iters_at_current_level >= iters_per_level)
+	{
+	    coarse_level--;
+	    if (coarse_level < 0) break;
+	    iters_at_current_level = 0;
+	}
+	if (temperature > final_temperature) {
+	    temperature *= temperature_multiplier;
+	}
+    }
+    return work;
+}
 
-    // Compute a_i, b_{ij} according to (11)
+// Normalized exponential falloff of the given size (1x1 is a single 1)
+static void
+compute_filter_weights(array2d< vector_fixed<double, 3> >& weights, double stddev)
+{
+    int size = weights.get_width(), center = (size-1)/2;
+    double sum = 0.0;
+    for(int i=0; i<size; i++) {
+	for(int j=0; j<size; j++) {
+	    for(int k=0; k<3; k++) {
+		sum += weights(i,j)(k) =
+		    exp(-sqrt((double)((i-center)*(i-center) + (j-center)*(j-center)))/(stddev*stddev));
+	    }
+	}
+    }
+    sum /= 3;
+    for(int i=0; i<size; i++) {
+	for(int j=0; j<size; j++) {
+	    for(int k=0; k<3; k++) {
+		weights(i,j)(k) /= sum;
+	    }
+	}
+    }
+}
+
+ScolorqWorkspace::ScolorqWorkspace(int width, int height, int colors, int precision)
+    : width(width), height(height), colors(colors), precision(precision),
+      image(width, height),
+      quantized_image(width, height),
+      palette(colors),
+      filter_weights(SCOLORQ_FILTER_SIZE, SCOLORQ_FILTER_SIZE),
+      dirty(width, height),
+      solve_a(colors * colors),
+      solve_inverse(colors * colors)
+{
+    max_coarse_level = //1;
+        compute_max_coarse_level(width, height);
+
+    // The filter only depends on the image and palette size
+    double dithering_level = 0.09*log((double)width*height) - 0.04*log((double)colors) + 0.001;
+    compute_filter_weights(filter_weights, dithering_level);
+
+    // Compute b_{ij} according to (11)
     int extended_neighborhood_width = filter_weights.get_width()*2 - 1;
     int extended_neighborhood_height = filter_weights.get_height()*2 - 1;
-    array2d< vector_fixed<double, 3> > b0(extended_neighborhood_width,
-                                          extended_neighborhood_height);
-    compute_b_array(filter_weights, b0);
-
-    array2d< vector_fixed<double, 3> > a0(image.get_width(), image.get_height());
-    compute_a_image(image, b0, a0);
+    b_vec.push_back(new array2d< vector_fixed<double, 3> >(extended_neighborhood_width,
+							     extended_neighborhood_height));
+    compute_b_array(filter_weights, *b_vec[0]);
 
-    // Compute a_I^l, b_{IJ}^l according to (18)
-    vector< array2d< vector_fixed<double, 3> > > a_vec, b_vec;
-    a_vec.push_back(a0);
-    b_vec.push_back(b0);
+    a_vec.push_back(new array2d< vector_fixed<double, 3> >(width, height));
+    mask_vec.push_back(new array2d<int>(width, height));
 
-    int coarse_level;
-    for(coarse_level=1; coarse_level <= max_coarse_level; coarse_level++)
+    // Compute b_{IJ}^l according to (18)
+    for(int coarse_level=1; coarse_level <= max_coarse_level; coarse_level++)
     {
 	int radius_width  = (filter_weights.get_width() - 1)/2,
 	    radius_height = (filter_weights.get_height() - 1)/2;
-	array2d< vector_fixed<double, 3> >
-	    bi(max(3, b_vec.back().get_width()-2),
-	       max(3, b_vec.back().get_height()-2));
-	for(int J_y=0; J_y<bi.get_height(); J_y++) {
-	    for(int J_x=0; J_x<bi.get_width(); J_x++) {
+	array2d< vector_fixed<double, 3> >& b_last = *b_vec.back();
+	array2d< vector_fixed<double, 3> >* bi =
+	    new array2d< vector_fixed<double, 3> >(max(3, b_last.get_width()-2),
+						   max(3, b_last.get_height()-2));
+	for(int J_y=0; J_y<bi->get_height(); J_y++) {
+	    for(int J_x=0; J_x<bi->get_width(); J_x++) {
 		for(int i_y=radius_height*2; i_y<radius_height*2+2; i_y++) {
 		    for(int i_x=radius_width*2; i_x<radius_width*2+2; i_x++) {
 			for(int j_y=J_y*2; j_y<J_y*2+2; j_y++) {
 			    for(int j_x=J_x*2; j_x<J_x*2+2; j_x++) {
-				bi(J_x,J_y) += b_value(b_vec.back(), i_x, i_y, j_x, j_y);
+				(*bi)(J_x,J_y) += b_value(b_last, i_x, i_y, j_x, j_y);
 			    }
 			}
 		    }
@@ -775,13 +1707,82 @@ void spatial_color_quant(array2d< vector_fixed<double, 3> >& image,
 	}
 	b_vec.push_back(bi);
 
-	array2d< vector_fixed<double, 3> >
-	    ai(image.get_width() >> coarse_level,
-	       image.get_height() >> coarse_level);
-	sum_coarsen(a_vec.back(), ai);
-	a_vec.push_back(ai);
+	a_vec.push_back(new array2d< vector_fixed<double, 3> >(width >> coarse_level, height >> coarse_level));
+	mask_vec.push_back(new array2d<int>(width >> coarse_level, height >> coarse_level));
     }
 
+    // The visit queue is restarted above 110% of the pixels, and a visit
+    // adds at most one neighborhood
+    visit_queue.reserve(width*height*11/10 + b_vec[0]->get_width()*b_vec[0]->get_height() + 1);
+    permutation.reserve(width*height);
+    visit.resize(width*height);
+    next.resize(width*height);
+}
+
+ScolorqWorkspace::~ScolorqWorkspace()
+{
+    for (size_t level=0; level<b_vec.size(); level++) {
+	delete a_vec[level];
+	delete b_vec[level];
+	delete mask_vec[level];
+    }
+}
+
+// Returns 0, SCOLORQ_CANCELLED if cancelled by the progress function or -1 on error.
+// Reads the image and the palette from the workspace and leaves the result there.
+// A warm start anneals only the full resolution, starting from the palette,
+// and with dirty only the pixels of the dirty mask of the workspace.
+template <typename Real, int Colors>
+int spatial_color_quant(scolorq_ctx *ctx,
+			 ScolorqBuffers<Real>& workspace,
+			 double initial_temperature,
+			 double final_temperature,
+			 int temps_per_level,
+			 int repeats_per_temp,
+			 bool masked,
+			 bool warm,
+			 bool dirty)
+{
+    array2d< vector_fixed<double, 3> >& image = workspace.image;
+    array2d< int >& quantized_image = workspace.quantized_image;
+    vector< vector_fixed<double, 3> >& palette = workspace.palette;
+    vector< array2d< vector_fixed<double, 3> >* >& a_vec = workspace.a_vec;
+    vector< array2d<int>* >& mask_vec = workspace.mask_vec;
+    vector< planes3<Real>* >& b_planes = workspace.b_planes;
+    planes3<Real>& palette_planes = workspace.palette_planes;
+    SMatrix& s = workspace.s;
+    int max_coarse_level = warm ? 0 : workspace.max_coarse_level;
+    array2d<int>* active = dirty ? &workspace.dirty : NULL;
+
+    array3d<Real>* p_coarse_variables = workspace.coarse_variables[max_coarse_level];
+    planes3<Real>* j_palette_sum = workspace.j_palette_sum[max_coarse_level];
+    // For syntactic convenience
+    array3d<Real>& coarse_variables = *p_coarse_variables;
+    if (warm) {
+	fill_from_palette(coarse_variables, image, palette, initial_temperature);
+    } else {
+	fill_random(ctx, coarse_variables);
+    }
+
+    double temperature = initial_temperature;
+
+    // Compute a_i according to (11), a_I^l according to (18)
+    a_vec[0]->clear();
+    compute_a_image(image, *workspace.b_vec[0], *a_vec[0]);
+
+    int coarse_level;
+    for(coarse_level=1; coarse_level <= max_coarse_level; coarse_level++)
+    {
+	sum_coarsen(*a_vec[coarse_level-1], *a_vec[coarse_level]);
+
+	// A coarse pixel is covered if any of its fine pixels is
+	if (masked) {
+	    or_coarsen(*mask_vec[coarse_level-1], *mask_vec[coarse_level]);
+	}
+    }
+
+    update_palette_planes(palette_planes, palette);
+
     // Multiscale annealing
     coarse_level = max_coarse_level;
     const int iters_per_level = temps_per_level;
@@ -791,17 +1792,36 @@ void spatial_color_quant(array2d< vector_fixed<double, 3> >& image,
 #endif
     int iters_at_current_level = 0;
     bool skip_palette_maintenance = false;
-    array2d< vector_fixed<double,3> > s(palette.size(), palette.size());
-    compute_initial_s(s, coarse_variables, b_vec[coarse_level]);
-    array2d< vector_fixed<double, 3> >* j_palette_sum =
-	new array2d< vector_fixed<double, 3> >(coarse_variables.get_width(), coarse_variables.get_height());
-    compute_initial_j_palette_sum(*j_palette_sum, coarse_variables, palette);
+    double work_total = annealing_work(image.get_width(), image.get_height(), max_coarse_level, iters_per_level,
+                                       repeats_per_temp, temperature, final_temperature, temperature_multiplier);
+    double work_done = 0.0;
+
+    // Only level 0 is annealed with a dirty mask, so the work scales with it
+    int active_pixels = image.get_width() * image.get_height();
+    if (active != NULL) {
+	active_pixels = 0;
+	for (int y=0; y<image.get_height(); y++) {
+	    for (int x=0; x<image.get_width(); x++) {
+		active_pixels += is_covered(active, x, y) && is_covered(masked ? mask_vec[0] : NULL, x, y);
+	    }
+	}
+	work_total = work_total * max(1, active_pixels) / (image.get_width() * image.get_height());
+    }
+
+    ctx->stats.levels = min(max_coarse_level + 1, SCOLORQ_MAX_LEVELS);
+
+    // Parallel annealing, with a partial s per thread
+    ParallelRunner* runner = ctx->runner;
+    vector<SMatrix*>& partial_s = ctx->partial_s;
+    compute_initial_s<Real, Colors>(s, coarse_variables, *b_planes[coarse_level], masked ? mask_vec[coarse_level] : NULL);
+    compute_initial_j_palette_sum<Real, Colors>(*j_palette_sum, coarse_variables, palette_planes);
     while (coarse_level >= 0 || temperature > final_temperature) {
 	// Need to reseat this reference in case we changed p_coarse_variables
-	array3d<double>& coarse_variables = *p_coarse_variables;
-	array2d< vector_fixed<double, 3> >& a = a_vec[coarse_level];
-	array2d< vector_fixed<double, 3> >& b = b_vec[coarse_level];
-	vector_fixed<double,3> middle_b = b_value(b,0,0,0,0);
+	array3d<Real>& coarse_variables = *p_coarse_variables;
+	array2d< vector_fixed<double, 3> >& a = *a_vec[coarse_level];
+	planes3<Real>& b = *b_planes[coarse_level];
+	array2d<int>* m = masked ? mask_vec[coarse_level] : NULL;
+	vector_fixed<double,3> middle_b = b_value(*workspace.b_vec[coarse_level],0,0,0,0);
 #if TRACE
 	cout << "Temperature: " << temperature << endl;
 #endif
@@ -810,8 +1830,20 @@ void spatial_color_quant(array2d< vector_fixed<double, 3> >& image,
 	for(int repeat=0; repeat<repeats_per_temp; repeat++)
 	{
 	    int pixels_changed = 0, pixels_visited = 0;
-	    deque< pair<int, int> > visit_queue;
-	    random_permutation_2d(coarse_variables.get_width(), coarse_variables.get_height(), visit_queue);
+	    int level_pixels = (active != NULL) ? active_pixels : coarse_variables.get_width() * coarse_variables.get_height();
+	    AnnealStep<Real> step = { &coarse_variables, j_palette_sum, &a, &b, m, active, &palette, &palette_planes,
+				      middle_b, temperature, !skip_palette_maintenance };
+
+	    VisitQueue& visit_queue = workspace.visit_queue;
+	    visit_queue.clear();
+	    if (runner != NULL) {
+		int result = anneal_parallel<Real, Colors>(ctx, *runner, step, s, partial_s, workspace,
+							   work_done, work_total, pixels_changed, pixels_visited);
+		if (result != 0) return result;
+	    } else {
+		random_permutation_2d(ctx, coarse_variables.get_width(), coarse_variables.get_height(), visit_queue,
+				      workspace.permutation);
+	    }
 
 	    // Compute 2*sum(j in extended neighborhood of i, j != i) b_ij
 
@@ -820,71 +1852,17 @@ void spatial_color_quant(array2d< vector_fixed<double, 3> >& image,
 		// If we get to 10% above initial size, just revisit them all
 		if ((int)visit_queue.size() > coarse_variables.get_width()*coarse_variables.get_height()*11/10) {
 		    visit_queue.clear();
-		    random_permutation_2d(coarse_variables.get_width(), coarse_variables.get_height(), visit_queue);
+		    random_permutation_2d(ctx, coarse_variables.get_width(), coarse_variables.get_height(), visit_queue,
+					  workspace.permutation);
 		}
 
-		int i_x = visit_queue.front().first, i_y = visit_queue.front().second;
-		visit_queue.pop_front();
-
-		// Compute (25)
-		vector_fixed<double,3> p_i;
-		for (int y=0; y<b.get_height(); y++) {
-		    for (int x=0; x<b.get_width(); x++) {
-			int j_x = x - center_x + i_x, j_y = y - center_y + i_y;
-			if (i_x == j_x && i_y == j_y) continue;
-			if (j_x < 0 || j_y < 0 || j_x >= coarse_variables.get_width() || j_y >= coarse_variables.get_height()) continue;
-			vector_fixed<double,3> b_ij = b_value(b, i_x, i_y, j_x, j_y);
-			vector_fixed<double,3> j_pal = (*j_palette_sum)(j_x,j_y);
-			p_i(0) += b_ij(0)*j_pal(0);
-			p_i(1) += b_ij(1)*j_pal(1);
-			p_i(2) += b_ij(2)*j_pal(2);
-		    }
-		}
-		p_i *= 2.0;
-		p_i += a(i_x, i_y);
-
-		vector<double> meanfield_logs, meanfields;
-		double max_meanfield_log = -numeric_limits<double>::infinity();
-		double meanfield_sum = 0.0;
-		for (unsigned int v=0; v < palette.size(); v++) {
-		    // Update m_{pi(i)v}^I according to (23)
-		    // We can subtract an arbitrary factor to prevent overflow,
-		    // since only the weight relative to the sum matters, so we
-		    // will choose a value that makes the maximum e^100.
-		    meanfield_logs.push_back(-(palette[v].dot_product(
-			p_i + middle_b.direct_product(
-			    palette[v])))/temperature);
-		    if (meanfield_logs.back() > max_meanfield_log) {
-			max_meanfield_log = meanfield_logs.back();
-		    }
-		}
-		for (unsigned int v=0; v < palette.size(); v++) {
-		    meanfields.push_back(exp(meanfield_logs[v]-max_meanfield_log+100));
-		    meanfield_sum += meanfields.back();
-		}
-		if (meanfield_sum == 0) {
-		    cout << "Fatal error: Meanfield sum underflowed. Please contact developer." << endl;
-		    exit(-1);
-		}
-		int old_max_v = best_match_color(coarse_variables, i_x, i_y, palette);
-		vector_fixed<double,3> & j_pal = (*j_palette_sum)(i_x,i_y);
-		for (unsigned int v=0; v < palette.size(); v++) {
-		    double new_val = meanfields[v]/meanfield_sum;
-		    // Prevent the matrix S from becoming singular
-		    if (new_val <= 0) new_val = 1e-10;
-		    if (new_val >= 1) new_val = 1 - 1e-10;
-		    double delta_m_iv = new_val - coarse_variables(i_x,i_y,v);
-		    coarse_variables(i_x,i_y,v) = new_val;
-		    j_pal(0) += delta_m_iv*palette[v](0);
-		    j_pal(1) += delta_m_iv*palette[v](1);
-		    j_pal(2) += delta_m_iv*palette[v](2);
-		    if (abs(delta_m_iv) > 0.001 && !skip_palette_maintenance) {
-			update_s(s, coarse_variables, b, i_x, i_y, v, delta_m_iv);
-		    }
-		}
-		int max_v = best_match_color(coarse_variables, i_x, i_y, palette);
-		// Only consider it a change if the colors are different enough
-		if ((palette[max_v]-palette[old_max_v]).norm_squared() >= 1.0/(255.0*255.0)) {
+		pair<int, int> i = visit_queue.pop_front();
+		int i_x = i.first, i_y = i.second;
+		if (!is_covered(m, i_x, i_y) || !is_covered(active, i_x, i_y)) continue;
+
+		int changed = anneal_pixel<Real, Colors>(step, s, i_x, i_y);
+		if (changed < 0) return -1;
+		if (changed) {
 		    pixels_changed++;
 		    // We don't add the outer layer of pixels , because
 		    // there isn't much weight there, and if it does need
@@ -897,34 +1875,44 @@ void spatial_color_quant(array2d< vector_fixed<double, 3> >& image,
 			for (int x=min(1,center_x-1); x<max(b.get_width()-1,center_x+1); x++) {
 			    int j_x = x - center_x + i_x, j_y = y - center_y + i_y;
 			    if (j_x < 0 || j_y < 0 || j_x >= coarse_variables.get_width() || j_y >= coarse_variables.get_height()) continue;
+			    if (!is_covered(m, j_x, j_y) || !is_covered(active, j_x, j_y)) continue;
 			    visit_queue.push_back(pair<int,int>(j_x,j_y));
 			}
 		    }
 		}
 		pixels_visited++;
 
-		// Show progress with dots - in a graphical interface,
-		// we'd show progressive refinements of the image instead,
-		// and maybe a palette preview.
 		step_counter++;
-		if ((step_counter % 10000) == 0) {
-		    cout << ".";
-		    cout.flush();
-#if TRACE
-		    cout << visit_queue.size();
-#endif
+		if (ctx->progress != NULL && (step_counter % 1024) == 0 &&
+		    !ctx->progress((work_done + min(pixels_visited, level_pixels)) / work_total, ctx->progress_user_data)) {
+		    return SCOLORQ_CANCELLED;
 		}
 	    }
 #if TRACE
 	    cout << "Pixels changed: " << pixels_changed << endl;
 #endif
 	    if (skip_palette_maintenance) {
-		compute_initial_s(s, *p_coarse_variables, b_vec[coarse_level]);
+		compute_initial_s<Real, Colors>(s, *p_coarse_variables, b, m);
+	    }
+	    refine_palette<Real, Colors>(s, coarse_variables, a, palette, m,
+					 &workspace.solve_a[0], &workspace.solve_inverse[0]);
+	    update_palette_planes(palette_planes, palette);
+	    compute_initial_j_palette_sum<Real, Colors>(*j_palette_sum, coarse_variables, palette_planes);
+	    work_done += level_pixels;
+
+	    if (coarse_level < SCOLORQ_MAX_LEVELS) {
+		ctx->stats.level[coarse_level].visits += pixels_visited;
+		ctx->stats.level[coarse_level].changes += pixels_changed;
 	    }
-	    refine_palette(s, coarse_variables, a, palette);
-	    compute_initial_j_palette_sum(*j_palette_sum, coarse_variables, palette);
         }
 
+	if (coarse_level < SCOLORQ_MAX_LEVELS) {
+	    scolorq_level_stats& level = ctx->stats.level[coarse_level];
+	    level.width = coarse_variables.get_width();
+	    level.height = coarse_variables.get_height();
+	    level.temperatures++;
+	}
+
 	iters_at_current_level++;
 	skip_palette_maintenance = false;
 	if ((temperature <= final_temperature || coarse_level > 0) &&
@@ -932,17 +1920,13 @@ void spatial_color_quant(array2d< vector_fixed<double, 3> >& image,
 	{
 	    coarse_level--;
 	    if (coarse_level < 0) break;
-	    array3d<double>* p_new_coarse_variables = new array3d<double>(
-		image.get_width()  >> coarse_level,
-		image.get_height() >> coarse_level,
-		palette.size());
+	    array3d<Real>* p_new_coarse_variables = workspace.coarse_variables[coarse_level];
+	    p_new_coarse_variables->clear();
 	    zoom_double(coarse_variables, *p_new_coarse_variables);
-	    delete p_coarse_variables;
 	    p_coarse_variables = p_new_coarse_variables;
 	    iters_at_current_level = 0;
-	    delete j_palette_sum;
-	    j_palette_sum = new array2d< vector_fixed<double, 3> >((*p_coarse_variables).get_width(), (*p_coarse_variables).get_height());
-	    compute_initial_j_palette_sum(*j_palette_sum, *p_coarse_variables, palette);
+	    j_palette_sum = workspace.j_palette_sum[coarse_level];
+	    compute_initial_j_palette_sum<Real, Colors>(*j_palette_sum, *p_coarse_variables, palette_planes);
 	    skip_palette_maintenance = true;
 #ifdef TRACE
 	    cout << "Image size: " << p_coarse_variables->get_width() << " " << p_coarse_variables->get_height() << endl;
@@ -956,23 +1940,20 @@ void spatial_color_quant(array2d< vector_fixed<double, 3> >& image,
     // This is normally not used, but is handy sometimes for debugging
     while (coarse_level > 0) {
 	coarse_level--;
-	array3d<double>* p_new_coarse_variables = new array3d<double>(
-	    image.get_width()  >> coarse_level,
-	    image.get_height() >> coarse_level,
-	    palette.size());
+	array3d<Real>* p_new_coarse_variables = workspace.coarse_variables[coarse_level];
+	p_new_coarse_variables->clear();
 	zoom_double(*p_coarse_variables, *p_new_coarse_variables);
-	delete p_coarse_variables;
 	p_coarse_variables = p_new_coarse_variables;
     }
 
     {
     // Need to reseat this reference in case we changed p_coarse_variables
-    array3d<double>& coarse_variables = *p_coarse_variables;
+    array3d<Real>& coarse_variables = *p_coarse_variables;
 
     for(int i_x = 0; i_x < image.get_width(); i_x++) {
 	for(int i_y = 0; i_y < image.get_height(); i_y++) {
 	    quantized_image(i_x,i_y) =
-		best_match_color(coarse_variables, i_x, i_y, palette);
+		best_match_color<Real, Colors>(coarse_variables, i_x, i_y, palette);
 	}
     }
     for (unsigned int v=0; v<palette.size(); v++) {
@@ -985,35 +1966,236 @@ void spatial_color_quant(array2d< vector_fixed<double, 3> >& image,
 #endif
     }
     }
+
+    if (ctx->progress != NULL) {
+	ctx->progress(1.f, ctx->progress_user_data);
+    }
+    return 0;
+}
+
+// Palette size of ship skins
+#define SCOLORQ_FIXED_COLORS 16
+
+// Uses the instantiation for a fixed palette size if there is one
+template <typename Real>
+static int
+spatial_color_quant_dispatch(scolorq_ctx *ctx,
+			     ScolorqWorkspace& workspace,
+			     double initial_temperature,
+			     double final_temperature,
+			     int temps_per_level,
+			     int repeats_per_temp,
+			     bool masked,
+			     bool warm,
+			     bool dirty)
+{
+    ScolorqBuffers<Real>& buffers = static_cast<ScolorqBuffers<Real>&>(workspace);
+    if (buffers.colors == SCOLORQ_FIXED_COLORS) {
+	return spatial_color_quant<Real, SCOLORQ_FIXED_COLORS>(ctx, buffers,
+		initial_temperature, final_temperature, temps_per_level, repeats_per_temp, masked, warm, dirty);
+    }
+    return spatial_color_quant<Real, 0>(ctx, buffers,
+	    initial_temperature, final_temperature, temps_per_level, repeats_per_temp, masked, warm, dirty);
+}
+
+// Reuses the buffers of the previous run if it had the same shape
+static ScolorqWorkspace *
+scolorq_ctx_prepare(scolorq_ctx *ctx, int width, int height, int colors)
+{
+    ScolorqWorkspace*& workspace = ctx->workspace;
+    if (workspace != NULL && (workspace->width != width || workspace->height != height ||
+			      workspace->colors != colors || workspace->precision != ctx->precision)) {
+	delete workspace;
+	workspace = NULL;
+    }
+    if (workspace == NULL) {
+	if (ctx->precision == SCOLORQ_PRECISION_DOUBLE) {
+	    workspace = new ScolorqBuffers<double>(width, height, colors, ctx->precision);
+	} else {
+	    workspace = new ScolorqBuffers<float>(width, height, colors, ctx->precision);
+	}
+    }
+
+    int threads = (ctx->threads > 1) ? ctx->threads : 0;
+    if (ctx->runner != NULL && ctx->runner->count() != threads) {
+	delete ctx->runner;
+	ctx->runner = NULL;
+    }
+    if (threads > 0 && ctx->runner == NULL) {
+	ctx->runner = new ParallelRunner(threads);
+    }
+
+    vector<SMatrix*>& partial_s = ctx->partial_s;
+    if ((int)partial_s.size() != threads || (threads > 0 && partial_s[0]->get_size() != colors)) {
+	for (size_t t=0; t<partial_s.size(); t++) {
+	    delete partial_s[t];
+	}
+	partial_s.clear();
+	for (int t=0; t<threads; t++) {
+	    partial_s.push_back(new SMatrix(colors));
+	}
+    }
+    // A cancelled run can leave partial sums behind
+    for (int t=0; t<threads; t++) {
+	partial_s[t]->clear();
+    }
+
+    if ((int)workspace->changed.size() != threads) {
+	workspace->changed.resize(threads);
+	for (int t=0; t<threads; t++) {
+	    workspace->changed[t].reserve(width*height);
+	}
+	workspace->visited.resize(threads);
+	workspace->failed.resize(threads);
+    }
+    for (int t=0; t<threads; t++) {
+	workspace->changed[t].clear();
+	workspace->visited[t] = 0;
+	workspace->failed[t] = 0;
+    }
+
+    return workspace;
+}
+
+extern "C" struct scolorq_ctx *
+scolorq_ctx_new(uint32_t seed)
+{
+    scolorq_ctx *ctx = new scolorq_ctx();
+    ctx->seed = seed;
+    ctx->progress = NULL;
+    ctx->progress_user_data = NULL;
+    ctx->threads = 1;
+    ctx->precision = SCOLORQ_PRECISION_FLOAT;
+    ctx->workspace = NULL;
+    ctx->runner = NULL;
+    return ctx;
+}
+
+extern "C" void
+scolorq_ctx_free(struct scolorq_ctx *ctx)
+{
+    scolorq_ctx_release(ctx);
+    delete ctx;
+}
+
+extern "C" void
+scolorq_ctx_set_progress(struct scolorq_ctx *ctx, scolorq_progress_func progress, void *user_data)
+{
+    ctx->progress = progress;
+    ctx->progress_user_data = user_data;
+}
+
+extern "C" void
+scolorq_ctx_set_threads(struct scolorq_ctx *ctx, int threads)
+{
+    if (threads <= 0) {
+	threads = thread::hardware_concurrency();
+    }
+    ctx->threads = max(1, threads);
+}
+
+extern "C" void
+scolorq_ctx_set_precision(struct scolorq_ctx *ctx, int precision)
+{
+    ctx->precision = precision;
+}
+
+extern "C" void
+scolorq_ctx_get_stats(const struct scolorq_ctx *ctx, struct scolorq_stats *stats)
+{
+    *stats = ctx->stats;
 }
 
 extern "C" int
 spatial_color_quant_inplace(int width, int height, uint8_t *rgb_pixels, int num_colors)
 {
-    // fixed seed so that it's deterministic
-    rand_engine.seed(0xDEADBEEF);
-
-    array2d< vector_fixed<double, 3> > image(width, height);
-    array2d< vector_fixed<double, 3> > filter1_weights(1, 1);
-    array2d< vector_fixed<double, 3> > filter3_weights(3, 3);
-    array2d< vector_fixed<double, 3> > filter5_weights(5, 5);
-    array2d< int > quantized_image(width, height);
-    vector< vector_fixed<double, 3> > palette;
+    return spatial_color_quant_inplace_masked(width, height, rgb_pixels, num_colors, NULL);
+}
+
+extern "C" int
+spatial_color_quant_inplace_masked(int width, int height, uint8_t *rgb_pixels, int num_colors, const uint8_t *mask)
+{
+    scolorq_ctx *ctx = scolorq_ctx_new(SCOLORQ_DEFAULT_SEED);
+    int result = scolorq_quantize(ctx, width, height, rgb_pixels, num_colors, mask);
+    scolorq_ctx_free(ctx);
+    return result;
+}
 
-    for(int k=0; k<3; k++) {
-	filter1_weights(0,0)(k) = 1.0;
+extern "C" int
+scolorq_quantize(struct scolorq_ctx *ctx, int width, int height, uint8_t *rgb_pixels, int num_colors, const uint8_t *mask)
+{
+    return scolorq_quantize_warm(ctx, width, height, rgb_pixels, num_colors, mask, NULL);
+}
+
+// Marks the dirty pixels and the neighbors whose dithering they affect
+static void
+scolorq_mark_dirty(ScolorqWorkspace* workspace, const uint8_t *dirty)
+{
+    int width = workspace->width, height = workspace->height;
+    int radius = (workspace->b_vec[0]->get_width() - 1)/2;
+    array2d<int>& marked = workspace->dirty;
+    marked.clear();
+    for (int y=0; y<height; y++) {
+	for (int x=0; x<width; x++) {
+	    if (!dirty[y*width+x]) continue;
+	    for (int j_y=max(0, y-radius); j_y<=min(height-1, y+radius); j_y++) {
+		for (int j_x=max(0, x-radius); j_x<=min(width-1, x+radius); j_x++) {
+		    marked(j_x, j_y) = 1;
+		}
+	    }
+	}
     }
+}
 
+// Pixels to the 0..1 range with a table instead of a division per channel
+static const double *
+unit_table()
+{
+    static struct UnitTable {
+	double values[256];
+	UnitTable() {
+	    for (int i=0; i<256; i++) values[i] = i/((double)255);
+	}
+    } table;
+    return table.values;
+}
+
+// Quantizes pixels of channels bytes (the first three are RGB) with stride
+// bytes between rows; the result is left in the workspace of ctx
+static int
+scolorq_run(struct scolorq_ctx *ctx, int width, int height, const uint8_t *pixels, int channels, int stride,
+	    int num_colors, const uint8_t *mask, const struct scolorq_warm_start *warm)
+{
     if (num_colors <= 1 || num_colors > 256) {
 	printf("Number of colors must be at least 2 and no more than 256.\n");
 	return -1;
     }
-    for (int i=0; i<num_colors; i++) {
-	vector_fixed<double, 3> v;
-	v(0) = rand_double();
-	v(1) = rand_double();
-	v(2) = rand_double();
-	palette.push_back(v);
+
+    if (warm != NULL && (warm->palette_size < 0 || warm->palette_size > num_colors || !(warm->temperature > 0.0))) {
+	printf("Warm start needs at most %d palette entries and a positive temperature.\n", num_colors);
+	return -1;
+    }
+
+    // Same seed, same result
+    ctx->rand_engine.seed(ctx->seed);
+    ctx->rand_distribution.reset();
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+
+    ScolorqWorkspace* workspace = scolorq_ctx_prepare(ctx, width, height, num_colors);
+    array2d< vector_fixed<double, 3> >& image = workspace->image;
+    vector< vector_fixed<double, 3> >& palette = workspace->palette;
+    const double *unit = unit_table();
+
+    int given_colors = (warm != NULL) ? warm->palette_size : 0;
+    for (int i=0; i<given_colors; i++) {
+	palette[i](0) = unit[warm->palette[i*3+0]];
+	palette[i](1) = unit[warm->palette[i*3+1]];
+	palette[i](2) = unit[warm->palette[i*3+2]];
+    }
+    for (int i=given_colors; i<num_colors; i++) {
+	palette[i](0) = rand_double(ctx);
+	palette[i](1) = rand_double(ctx);
+	palette[i](2) = rand_double(ctx);
     }
 
 #if TRACE
@@ -1023,65 +2205,102 @@ spatial_color_quant_inplace(int width, int height, uint8_t *rgb_pixels, int num_
 #endif
 
     for(int y=0; y<height; y++) {
+	const uint8_t *row = pixels + (size_t)y * stride;
 	for (int x=0; x<width; x++) {
 	    for(int ci=0; ci<3; ci++) {
-		image(x,y)(ci) = rgb_pixels[(y*width+x) * 3 + ci]/((double)255);
+		image(x,y)(ci) = unit[row[x * channels + ci]];
 	    }
 	}
     }
 
-    array3d<double>* coarse_variables;
-    double dithering_level = 0.09*log((double)image.get_width()*image.get_height()) - 0.04*log((double)palette.size()) + 0.001;
-    int filter_size = 3;
-
-    double stddev = dithering_level;
-    double sum = 0.0;
-    for(int i=0; i<3; i++) {
-	for(int j=0; j<3; j++) {
-	    for(int k=0; k<3; k++) {
-		sum += filter3_weights(i,j)(k) =
-		    exp(-sqrt((double)((i-1)*(i-1) + (j-1)*(j-1)))/(stddev*stddev));
-	    }
+    // Without any covered pixel, there is nothing to optimize for
+    array2d<int>& coverage = *workspace->mask_vec[0];
+    int covered = 0;
+    for(int y=0; mask != NULL && y<height; y++) {
+	for (int x=0; x<width; x++) {
+	    coverage(x,y) = (mask[y*width+x] != 0);
+	    covered += coverage(x,y);
 	}
     }
-    sum /= 3;
-    for(int i=0; i<3; i++) {
-	for(int j=0; j<3; j++) {
-	    for(int k=0; k<3; k++) {
-		filter3_weights(i,j)(k) /= sum;
-	    }
-	}
+
+    bool dirty = (warm != NULL && warm->dirty != NULL);
+    if (dirty) {
+	scolorq_mark_dirty(workspace, warm->dirty);
     }
-    sum = 0.0;
-    for(int i=0; i<5; i++) {
-	for(int j=0; j<5; j++) {
-	    for(int k=0; k<3; k++) {
-		sum += filter5_weights(i,j)(k) =
-		    exp(-sqrt((double)((i-2)*(i-2) + (j-2)*(j-2)))/(stddev*stddev));
-	    }
+
+    double initial_temperature = (warm != NULL) ? warm->temperature : SCOLORQ_INITIAL_TEMPERATURE;
+    int result = 0;
+    TRACE_SCOPE("spatial_color_quant") {
+        if (ctx->precision == SCOLORQ_PRECISION_DOUBLE) {
+            result = spatial_color_quant_dispatch<double>(ctx, *workspace, initial_temperature, 0.001, 3, 1,
+                                                          covered > 0, warm != NULL, dirty);
+        } else {
+            result = spatial_color_quant_dispatch<float>(ctx, *workspace, initial_temperature, 0.001, 3, 1,
+                                                         covered > 0, warm != NULL, dirty);
+        }
+    }
+
+    return result;
+}
+
+// Palette entries as bytes, as the RGB pixels have always been written
+static void
+scolorq_palette_bytes(ScolorqWorkspace* workspace, int num_colors, uint8_t *palette)
+{
+    for (int v=0; v<num_colors; v++) {
+	for (int k=0; k<3; k++) {
+	    palette[v*3+k] = (unsigned char)(255*workspace->palette[v](k));
 	}
     }
-    sum /= 3;
-    for(int i=0; i<5; i++) {
-	for(int j=0; j<5; j++) {
-	    for(int k=0; k<3; k++) {
-		filter5_weights(i,j)(k) /= sum;
-	    }
+}
+
+extern "C" int
+scolorq_quantize_warm(struct scolorq_ctx *ctx, int width, int height, uint8_t *rgb_pixels, int num_colors,
+		      const uint8_t *mask, const struct scolorq_warm_start *warm)
+{
+    TraceScope trace("spatial_color_quant_inplace");
+
+    int result = scolorq_run(ctx, width, height, rgb_pixels, 3, width * 3, num_colors, mask, warm);
+    if (result != 0) {
+	return result;
+    }
+
+    uint8_t palette[256 * 3];
+    scolorq_palette_bytes(ctx->workspace, num_colors, palette);
+
+    array2d< int >& quantized_image = ctx->workspace->quantized_image;
+    for(int y=0; y<height; y++) {
+	for (int x=0; x<width; x++) {
+	    memcpy(rgb_pixels + (y*width+x)*3, palette + quantized_image(x,y)*3, 3);
 	}
     }
 
-    array2d< vector_fixed<double, 3> >* filters[] =
-	{NULL, &filter1_weights, NULL, &filter3_weights,
-	 NULL, &filter5_weights};
-    spatial_color_quant(image, *filters[filter_size], quantized_image, palette, coarse_variables, 1.0, 0.001, 3, 1);
+    return 0;
+}
+
+extern "C" int
+scolorq_quantize_indexed(struct scolorq_ctx *ctx, int width, int height, const uint8_t *rgba_pixels, int stride,
+			 int num_colors, const uint8_t *mask, const struct scolorq_warm_start *warm,
+			 uint8_t *indices, uint8_t *palette)
+{
+    TraceScope trace("spatial_color_quant_indexed");
+
+    if (stride < width * 4) {
+	printf("Stride must be at least 4 bytes per pixel.\n");
+	return -1;
+    }
+
+    int result = scolorq_run(ctx, width, height, rgba_pixels, 4, stride, num_colors, mask, warm);
+    if (result != 0) {
+	return result;
+    }
 
-    cout << endl;
+    scolorq_palette_bytes(ctx->workspace, num_colors, palette);
 
+    array2d< int >& quantized_image = ctx->workspace->quantized_image;
     for(int y=0; y<height; y++) {
 	for (int x=0; x<width; x++) {
-            rgb_pixels[(y*width+x)*3+0] = (unsigned char)(255*palette[quantized_image(x,y)](0));
-            rgb_pixels[(y*width+x)*3+1] = (unsigned char)(255*palette[quantized_image(x,y)](1));
-            rgb_pixels[(y*width+x)*3+2] = (unsigned char)(255*palette[quantized_image(x,y)](2));
+	    indices[y*width+x] = (uint8_t)quantized_image(x,y);
 	}
     }
 
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -7,6 +10,146 @@ extern "C" {
 int
 spatial_color_quant_inplace(int width, int height, unsigned char *rgb_pixels, int num_colors);
 
+/**
+ * Like spatial_color_quant_inplace(), but only pixels with a non-zero mask
+ * value take part in the optimization. The remaining pixels are still
+ * mapped to the resulting palette, but do not influence it.
+ **/
+int
+spatial_color_quant_inplace_masked(int width, int height, unsigned char *rgb_pixels, int num_colors, const unsigned char *mask);
+
+/**
+ * Reentrant interface: the random number generator, the callbacks and the
+ * buffers of a run belong to a context, so different contexts can be used on
+ * different threads at the same time. The result only depends on the input
+ * and the seed. The buffers are kept after a run and reused by the next run
+ * with the same size, number of colors and precision, so quantizing many
+ * images in a row does no heap allocation; scolorq_ctx_free() releases them.
+ **/
+struct scolorq_ctx;
+
+#define SCOLORQ_DEFAULT_SEED 0xDEADBEEF
+
+// Returned by scolorq_quantize() when the progress function asked to stop
+#define SCOLORQ_CANCELLED 1
+
+/**
+ * Called regularly from the annealing loop with the estimated fraction of
+ * work done (0..1). Returning false cancels the quantization.
+ **/
+typedef bool (*scolorq_progress_func)(float progress, void *user_data);
+
+struct scolorq_ctx *
+scolorq_ctx_new(uint32_t seed);
+
+void
+scolorq_ctx_free(struct scolorq_ctx *ctx);
+
+void
+scolorq_ctx_set_progress(struct scolorq_ctx *ctx, scolorq_progress_func progress, void *user_data);
+
+/**
+ * Number of threads used by each run (default 1). With more than one, pixels
+ * of the annealing loop are updated in parallel, in independent sets. The
+ * result is deterministic for a given seed and the same for any number of
+ * threads above one, but differs from the serial result. 0 uses all CPU
+ * cores.
+ **/
+void
+scolorq_ctx_set_threads(struct scolorq_ctx *ctx, int threads);
+
+/**
+ * Precision of the per-pixel state of the annealing loop (the palette is
+ * always solved in double). Float is the default: it uses the SIMD kernels
+ * and is faster, and its results differ from double by less than the
+ * run-to-run variation between seeds (see bench/quant_bench.c).
+ **/
+#define SCOLORQ_PRECISION_FLOAT 0
+#define SCOLORQ_PRECISION_DOUBLE 1
+
+void
+scolorq_ctx_set_precision(struct scolorq_ctx *ctx, int precision);
+
+/**
+ * Like spatial_color_quant_inplace_masked(), with the settings of the
+ * context. Returns 0 on success, SCOLORQ_CANCELLED (pixels unchanged) or -1
+ * on error.
+ **/
+int
+scolorq_quantize(struct scolorq_ctx *ctx, int width, int height, unsigned char *rgb_pixels, int num_colors, const unsigned char *mask);
+
+// Starting temperature of the annealing of a cold start
+#define SCOLORQ_INITIAL_TEMPERATURE 1.0
+
+// Suggested starting temperature of a warm start after small edits
+#define SCOLORQ_WARM_TEMPERATURE 0.01
+
+/**
+ * Warm start, for quantizing again an image that was quantized before and
+ * then edited a little: the pixels start close to their nearest color of the
+ * given palette, and only the full resolution is annealed, from the given
+ * temperature. The palette is still refined from all pixels.
+ **/
+struct scolorq_warm_start {
+    // palette_size RGB entries (at most num_colors), the rest start random
+    const unsigned char *palette;
+    int palette_size;
+
+    // Starting temperature, e.g. SCOLORQ_WARM_TEMPERATURE
+    double temperature;
+
+    // width*height entries, nonzero = changed since the last run; only these
+    // pixels and their neighbors are updated. NULL updates all pixels.
+    const unsigned char *dirty;
+};
+
+/**
+ * Like scolorq_quantize(), starting from the state in warm (NULL = a cold
+ * start, as scolorq_quantize()).
+ **/
+int
+scolorq_quantize_warm(struct scolorq_ctx *ctx, int width, int height, unsigned char *rgb_pixels, int num_colors,
+                      const unsigned char *mask, const struct scolorq_warm_start *warm);
+
+/**
+ * Like scolorq_quantize_warm() (warm may be NULL), for RGBA pixels that are
+ * not changed: rows are stride bytes apart, alpha is ignored. Writes the
+ * palette index of each pixel to indices (width*height, row by row) and the
+ * palette to palette (num_colors RGB entries), as the RGB variants would
+ * have written the pixels.
+ **/
+int
+scolorq_quantize_indexed(struct scolorq_ctx *ctx, int width, int height, const unsigned char *rgba_pixels, int stride,
+                         int num_colors, const unsigned char *mask, const struct scolorq_warm_start *warm,
+                         unsigned char *indices, unsigned char *palette);
+
+// Levels of the multiscale annealing that are counted in scolorq_stats
+#define SCOLORQ_MAX_LEVELS 16
+
+struct scolorq_level_stats {
+    int width;
+    int height;
+
+    // Temperature steps annealed at this level
+    int temperatures;
+
+    // Pixel updates, and the updates that changed the pixel
+    long long visits;
+    long long changes;
+};
+
+/**
+ * Work done by the last run of a context, per level (0 = full resolution),
+ * e.g. to compare changes to the annealing schedule (see bench/quant_suite.c).
+ **/
+struct scolorq_stats {
+    int levels;
+    struct scolorq_level_stats level[SCOLORQ_MAX_LEVELS];
+};
+
+void
+scolorq_ctx_get_stats(const struct scolorq_ctx *ctx, struct scolorq_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,477 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "shipdat.h"
+
+#include <string.h>
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+#define SHIPDAT_KERNEL_SSSE3
+#include <tmmintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SHIPDAT_KERNEL_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define SHIPDAT_KERNEL_NEON
+#include <arm_neon.h>
+#endif
+
+// Pixels per SIMD block (8 bytes of indices)
+#define SHIPDAT_BLOCK 16
+
+// Open addressing table for palette lookups in the scalar paths
+#define SHIPDAT_LOOKUP_SIZE 64
+
+struct ShipdatLookup {
+    uint32_t colors[SHIPDAT_LOOKUP_SIZE];
+    int8_t index[SHIPDAT_LOOKUP_SIZE];
+};
+
+static inline uint32_t
+shipdat_hash(uint32_t color)
+{
+    return (color * 2654435761u) >> 26;
+}
+
+// Returns false if the color is already in the table
+static bool
+shipdat_lookup_insert(struct ShipdatLookup *lookup, uint32_t color, int index)
+{
+    uint32_t slot = shipdat_hash(color);
+    while (lookup->index[slot] != -1) {
+        if (lookup->colors[slot] == color) {
+            return false;
+        }
+        slot = (slot + 1) % SHIPDAT_LOOKUP_SIZE;
+    }
+
+    lookup->colors[slot] = color;
+    lookup->index[slot] = index;
+    return true;
+}
+
+// Returns false if the palette has duplicate entries
+static bool
+shipdat_lookup_init(struct ShipdatLookup *lookup, const uint32_t *palette, int palette_size)
+{
+    memset(lookup->index, -1, sizeof(lookup->index));
+
+    // Duplicate entries keep the first index, like a linear search would
+    bool unique = true;
+    for (int i=0; i<palette_size; ++i) {
+        unique = shipdat_lookup_insert(lookup, palette[i], i) && unique;
+    }
+
+    return unique;
+}
+
+static inline int
+shipdat_lookup_find(const struct ShipdatLookup *lookup, uint32_t color)
+{
+    uint32_t slot = shipdat_hash(color);
+    while (lookup->index[slot] != -1) {
+        if (lookup->colors[slot] == color) {
+            return lookup->index[slot];
+        }
+        slot = (slot + 1) % SHIPDAT_LOOKUP_SIZE;
+    }
+
+    return -1;
+}
+
+static int
+shipdat_nearest(const uint32_t *palette, int palette_size, uint32_t color)
+{
+    int result = 0;
+    int best = -1;
+
+    for (int i=0; i<palette_size; ++i) {
+        int distance = 0;
+        for (int c=0; c<4; ++c) {
+            int d = (int)((palette[i] >> (8 * c)) & 0xFF) - (int)((color >> (8 * c)) & 0xFF);
+            distance += d * d;
+        }
+
+        if (best == -1 || distance < best) {
+            best = distance;
+            result = i;
+        }
+    }
+
+    return result;
+}
+
+#if defined(SHIPDAT_KERNEL_SSSE3)
+static size_t
+shipdat_decode_simd(const uint8_t *image, const uint32_t *palette, uint32_t *rgba, size_t count)
+{
+    // Byte planes of the palette, so that one shuffle looks up one channel of 16 pixels
+    uint8_t planes[4][SHIPDAT_COLORS];
+    for (int i=0; i<SHIPDAT_COLORS; ++i) {
+        for (int c=0; c<4; ++c) {
+            planes[c][i] = palette[i] >> (8 * c);
+        }
+    }
+
+    const __m128i r = _mm_loadu_si128((const __m128i *)planes[0]);
+    const __m128i g = _mm_loadu_si128((const __m128i *)planes[1]);
+    const __m128i b = _mm_loadu_si128((const __m128i *)planes[2]);
+    const __m128i a = _mm_loadu_si128((const __m128i *)planes[3]);
+    const __m128i low = _mm_set1_epi8(0x0F);
+
+    size_t i = 0;
+    for (; i + SHIPDAT_BLOCK <= count; i += SHIPDAT_BLOCK) {
+        __m128i bytes = _mm_loadl_epi64((const __m128i *)(image + i / 2));
+        __m128i index = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(bytes, 4), low), _mm_and_si128(bytes, low));
+
+        __m128i rg = _mm_unpacklo_epi8(_mm_shuffle_epi8(r, index), _mm_shuffle_epi8(g, index));
+        __m128i ba = _mm_unpacklo_epi8(_mm_shuffle_epi8(b, index), _mm_shuffle_epi8(a, index));
+        __m128i rg_high = _mm_unpackhi_epi8(_mm_shuffle_epi8(r, index), _mm_shuffle_epi8(g, index));
+        __m128i ba_high = _mm_unpackhi_epi8(_mm_shuffle_epi8(b, index), _mm_shuffle_epi8(a, index));
+
+        _mm_storeu_si128((__m128i *)(rgba + i + 0), _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i *)(rgba + i + 4), _mm_unpackhi_epi16(rg, ba));
+        _mm_storeu_si128((__m128i *)(rgba + i + 8), _mm_unpacklo_epi16(rg_high, ba_high));
+        _mm_storeu_si128((__m128i *)(rgba + i + 12), _mm_unpackhi_epi16(rg_high, ba_high));
+    }
+
+    return i;
+}
+#elif defined(SHIPDAT_KERNEL_NEON)
+static size_t
+shipdat_decode_simd(const uint8_t *image, const uint32_t *palette, uint32_t *rgba, size_t count)
+{
+    uint8_t planes[4][SHIPDAT_COLORS];
+    for (int i=0; i<SHIPDAT_COLORS; ++i) {
+        for (int c=0; c<4; ++c) {
+            planes[c][i] = palette[i] >> (8 * c);
+        }
+    }
+
+    uint8x16_t table[4];
+    for (int c=0; c<4; ++c) {
+        table[c] = vld1q_u8(planes[c]);
+    }
+
+    size_t i = 0;
+    for (; i + SHIPDAT_BLOCK <= count; i += SHIPDAT_BLOCK) {
+        uint8x8_t bytes = vld1_u8(image + i / 2);
+        uint8x8x2_t index = vzip_u8(vshr_n_u8(bytes, 4), vand_u8(bytes, vdup_n_u8(0x0F)));
+        uint8x16_t index16 = vcombine_u8(index.val[0], index.val[1]);
+
+        uint8x16x4_t pixels;
+        for (int c=0; c<4; ++c) {
+            pixels.val[c] = vqtbl1q_u8(table[c], index16);
+        }
+
+        vst4q_u8((uint8_t *)(rgba + i), pixels);
+    }
+
+    return i;
+}
+#else
+static size_t
+shipdat_decode_simd(const uint8_t *image, const uint32_t *palette, uint32_t *rgba, size_t count)
+{
+    // Two pixels per byte from a table, instead of two nibble lookups
+    uint32_t pairs[256][2];
+    for (int i=0; i<256; ++i) {
+        pairs[i][0] = palette[i >> 4];
+        pairs[i][1] = palette[i & 0x0F];
+    }
+
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        memcpy(rgba + i, pairs[image[i / 2]], sizeof(pairs[0]));
+    }
+
+    return i;
+}
+#endif
+
+#if defined(SHIPDAT_KERNEL_SSSE3) || defined(SHIPDAT_KERNEL_SSE2)
+static size_t
+shipdat_encode_simd(const uint32_t *rgba, size_t count, const uint32_t *palette, int palette_size, uint8_t *image)
+{
+    __m128i entries[SHIPDAT_COLORS];
+    __m128i values[SHIPDAT_COLORS];
+    for (int j=0; j<palette_size; ++j) {
+        entries[j] = _mm_set1_epi32(palette[j]);
+        values[j] = _mm_set1_epi32(j);
+    }
+
+    const __m128i low_byte = _mm_set1_epi16(0x00FF);
+
+    size_t i = 0;
+    for (; i + SHIPDAT_BLOCK <= count; i += SHIPDAT_BLOCK) {
+        __m128i p0 = _mm_loadu_si128((const __m128i *)(rgba + i + 0));
+        __m128i p1 = _mm_loadu_si128((const __m128i *)(rgba + i + 4));
+        __m128i p2 = _mm_loadu_si128((const __m128i *)(rgba + i + 8));
+        __m128i p3 = _mm_loadu_si128((const __m128i *)(rgba + i + 12));
+
+        __m128i i0 = _mm_setzero_si128(), i1 = i0, i2 = i0, i3 = i0;
+        __m128i a0 = _mm_setzero_si128(), a1 = a0, a2 = a0, a3 = a0;
+
+        // Entries are unique, so at most one of them matches
+        for (int j=0; j<palette_size; ++j) {
+            __m128i m0 = _mm_cmpeq_epi32(p0, entries[j]);
+            __m128i m1 = _mm_cmpeq_epi32(p1, entries[j]);
+            __m128i m2 = _mm_cmpeq_epi32(p2, entries[j]);
+            __m128i m3 = _mm_cmpeq_epi32(p3, entries[j]);
+
+            i0 = _mm_or_si128(i0, _mm_and_si128(m0, values[j]));
+            i1 = _mm_or_si128(i1, _mm_and_si128(m1, values[j]));
+            i2 = _mm_or_si128(i2, _mm_and_si128(m2, values[j]));
+            i3 = _mm_or_si128(i3, _mm_and_si128(m3, values[j]));
+
+            a0 = _mm_or_si128(a0, m0);
+            a1 = _mm_or_si128(a1, m1);
+            a2 = _mm_or_si128(a2, m2);
+            a3 = _mm_or_si128(a3, m3);
+        }
+
+        __m128i found = _mm_and_si128(_mm_and_si128(a0, a1), _mm_and_si128(a2, a3));
+        if (_mm_movemask_epi8(found) != 0xFFFF) {
+            // Leave this block to the scalar code
+            break;
+        }
+
+        // 16 indices as bytes, then (even << 4) | odd per byte pair
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(i0, i1), _mm_packs_epi32(i2, i3));
+        __m128i nibbles = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(bytes, low_byte), 4), _mm_srli_epi16(bytes, 8));
+        _mm_storel_epi64((__m128i *)(image + i / 2), _mm_packus_epi16(nibbles, nibbles));
+    }
+
+    return i;
+}
+#elif defined(SHIPDAT_KERNEL_NEON)
+static size_t
+shipdat_encode_simd(const uint32_t *rgba, size_t count, const uint32_t *palette, int palette_size, uint8_t *image)
+{
+    size_t i = 0;
+    for (; i + SHIPDAT_BLOCK <= count; i += SHIPDAT_BLOCK) {
+        uint32x4_t p0 = vld1q_u32(rgba + i + 0);
+        uint32x4_t p1 = vld1q_u32(rgba + i + 4);
+        uint32x4_t p2 = vld1q_u32(rgba + i + 8);
+        uint32x4_t p3 = vld1q_u32(rgba + i + 12);
+
+        uint32x4_t i0 = vdupq_n_u32(0), i1 = i0, i2 = i0, i3 = i0;
+        uint32x4_t a0 = vdupq_n_u32(0), a1 = a0, a2 = a0, a3 = a0;
+
+        for (int j=0; j<palette_size; ++j) {
+            uint32x4_t entry = vdupq_n_u32(palette[j]);
+            uint32x4_t value = vdupq_n_u32(j);
+
+            uint32x4_t m0 = vceqq_u32(p0, entry);
+            uint32x4_t m1 = vceqq_u32(p1, entry);
+            uint32x4_t m2 = vceqq_u32(p2, entry);
+            uint32x4_t m3 = vceqq_u32(p3, entry);
+
+            i0 = vorrq_u32(i0, vandq_u32(m0, value));
+            i1 = vorrq_u32(i1, vandq_u32(m1, value));
+            i2 = vorrq_u32(i2, vandq_u32(m2, value));
+            i3 = vorrq_u32(i3, vandq_u32(m3, value));
+
+            a0 = vorrq_u32(a0, m0);
+            a1 = vorrq_u32(a1, m1);
+            a2 = vorrq_u32(a2, m2);
+            a3 = vorrq_u32(a3, m3);
+        }
+
+        uint32x4_t found = vandq_u32(vandq_u32(a0, a1), vandq_u32(a2, a3));
+        if (vminvq_u32(found) == 0) {
+            break;
+        }
+
+        uint8x16_t bytes = vcombine_u8(vmovn_u16(vcombine_u16(vmovn_u32(i0), vmovn_u32(i1))),
+                vmovn_u16(vcombine_u16(vmovn_u32(i2), vmovn_u32(i3))));
+        uint8x8x2_t pairs = vuzp_u8(vget_low_u8(bytes), vget_high_u8(bytes));
+        vst1_u8(image + i / 2, vorr_u8(vshl_n_u8(pairs.val[0], 4), pairs.val[1]));
+    }
+
+    return i;
+}
+#else
+static size_t
+shipdat_encode_simd(const uint32_t *rgba, size_t count, const uint32_t *palette, int palette_size, uint8_t *image)
+{
+    return 0;
+}
+#endif
+
+static bool
+shipdat_encode_scalar(const uint32_t *rgba, size_t count, const uint32_t *palette, int palette_size,
+        const struct ShipdatLookup *lookup, uint8_t *image, enum ShipdatMatch match)
+{
+    for (size_t i=0; i<count; i+=2) {
+        int pair[2];
+        for (int k=0; k<2; ++k) {
+            pair[k] = shipdat_lookup_find(lookup, rgba[i + k]);
+            if (pair[k] == -1) {
+                if (match == SHIPDAT_MATCH_EXACT || palette_size == 0) {
+                    return false;
+                }
+                pair[k] = shipdat_nearest(palette, palette_size, rgba[i + k]);
+            }
+        }
+
+        image[i / 2] = (pair[0] << 4) | pair[1];
+    }
+
+    return true;
+}
+
+const char *
+shipdat_kernel_name()
+{
+#if defined(SHIPDAT_KERNEL_SSSE3)
+    return "ssse3";
+#elif defined(SHIPDAT_KERNEL_SSE2)
+    return "sse2";
+#elif defined(SHIPDAT_KERNEL_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+size_t
+shipdat_material_offset(int index)
+{
+    return SHIPDAT_HEADER_SIZE + (size_t)index * SHIPDAT_MATERIAL_SIZE;
+}
+
+void
+shipdat_decode(const uint8_t *image, const uint32_t *palette, uint32_t *rgba, size_t count)
+{
+    for (size_t i=shipdat_decode_simd(image, palette, rgba, count); i<count; ++i) {
+        uint8_t pixel = image[i / 2];
+        rgba[i] = palette[(i % 2 == 0) ? (pixel >> 4) : (pixel & 0x0F)];
+    }
+}
+
+bool
+shipdat_decode_material(const uint8_t *buffer, size_t length, int index, uint32_t *rgba, uint32_t *palette)
+{
+    size_t offset = shipdat_material_offset(index);
+    if (index < 0 || offset + SHIPDAT_MATERIAL_SIZE > length) {
+        return false;
+    }
+
+    uint32_t entries[SHIPDAT_COLORS];
+    memcpy(entries, buffer + offset, sizeof(entries));
+    if (palette != NULL) {
+        memcpy(palette, entries, sizeof(entries));
+    }
+
+    shipdat_decode(buffer + offset + sizeof(entries), entries, rgba, SHIPDAT_WIDTH * SHIPDAT_HEIGHT);
+    return true;
+}
+
+int
+shipdat_build_palette(const uint32_t *rgba, const uint8_t *coverage, size_t count, uint32_t *palette)
+{
+    int size = 0;
+
+    struct ShipdatLookup lookup;
+    shipdat_lookup_init(&lookup, palette, 0);
+
+    for (int pass=0; pass<2; ++pass) {
+        bool covered = (pass == 0);
+        if (!covered && coverage == NULL) {
+            break;
+        }
+
+        int last = -1;
+        for (size_t i=0; i<count; ++i) {
+            if (coverage != NULL && (coverage[i] != 0) != covered) {
+                continue;
+            }
+
+            // Neighbouring texels mostly share colors
+            if (last != -1 && palette[last] == rgba[i]) {
+                continue;
+            }
+
+            last = shipdat_lookup_find(&lookup, rgba[i]);
+            if (last == -1) {
+                if (size == SHIPDAT_COLORS) {
+                    if (covered) {
+                        return -1;
+                    }
+                    // Uncovered texels get the nearest color when encoding
+                    continue;
+                }
+
+                shipdat_lookup_insert(&lookup, rgba[i], size);
+                palette[size] = rgba[i];
+                last = size++;
+            }
+        }
+    }
+
+    return size;
+}
+
+bool
+shipdat_encode(const uint32_t *rgba, size_t count, const uint32_t *palette, int palette_size, uint8_t *image, enum ShipdatMatch match)
+{
+    struct ShipdatLookup lookup;
+    bool unique = shipdat_lookup_init(&lookup, palette, palette_size);
+
+    size_t i = 0;
+    while (i < count) {
+        if (unique) {
+            i += shipdat_encode_simd(rgba + i, count - i, palette, palette_size, image + i / 2);
+        }
+
+        // The SIMD code stops at blocks with colors that are not in the palette
+        size_t n = (count - i < SHIPDAT_BLOCK) ? (count - i) : SHIPDAT_BLOCK;
+        if (n > 0 && !shipdat_encode_scalar(rgba + i, n, palette, palette_size, &lookup, image + i / 2, match)) {
+            return false;
+        }
+        i += n;
+    }
+
+    return true;
+}
+
+bool
+shipdat_encode_material(uint8_t *buffer, size_t length, int index, const uint32_t *rgba, const uint8_t *coverage)
+{
+    size_t offset = shipdat_material_offset(index);
+    if (index < 0 || offset + SHIPDAT_MATERIAL_SIZE > length) {
+        return false;
+    }
+
+    uint32_t palette[SHIPDAT_COLORS];
+    memset(palette, 0, sizeof(palette));
+
+    int size = shipdat_build_palette(rgba, coverage, SHIPDAT_WIDTH * SHIPDAT_HEIGHT, palette);
+    if (size == -1) {
+        return false;
+    }
+
+    memcpy(buffer + offset, palette, sizeof(palette));
+    return shipdat_encode(rgba, SHIPDAT_WIDTH * SHIPDAT_HEIGHT, palette, size, buffer + offset + sizeof(palette), SHIPDAT_MATCH_NEAREST);
+}
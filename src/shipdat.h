@@ -0,0 +1,82 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/**
+ * Codec for the 16 color, 4bpp images of ship.dat files and savegames.
+ *
+ * Layout: a 32 byte header, then per material 16 RGBA palette entries and
+ * 128x128 4-bit indices (high nibble first). Decoding and encoding work
+ * directly on that buffer. Palette lookups and matches use SIMD where
+ * available (SSSE3 or AArch64 NEON byte shuffles for decoding, SSE2 or
+ * NEON compares for encoding), with scalar fallbacks that give the same
+ * results.
+ **/
+
+#define SHIPDAT_WIDTH 128
+#define SHIPDAT_HEIGHT 128
+#define SHIPDAT_COLORS 16
+#define SHIPDAT_HEADER_SIZE 32
+#define SHIPDAT_IMAGE_SIZE (SHIPDAT_WIDTH * SHIPDAT_HEIGHT / 2)
+#define SHIPDAT_MATERIAL_SIZE (SHIPDAT_COLORS * 4 + SHIPDAT_IMAGE_SIZE)
+
+enum ShipdatMatch {
+    // Fail if a pixel is not in the palette
+    SHIPDAT_MATCH_EXACT = 0,
+    // Use the nearest palette entry for pixels that are not in the palette
+    SHIPDAT_MATCH_NEAREST,
+};
+
+size_t
+shipdat_material_offset(int index);
+
+// Expands count (even) 4-bit indices to RGBA
+void
+shipdat_decode(const uint8_t *image, const uint32_t *palette, uint32_t *rgba, size_t count);
+
+bool
+shipdat_decode_material(const uint8_t *buffer, size_t length, int index, uint32_t *rgba, uint32_t *palette);
+
+/**
+ * Collects the palette in order of appearance, texels covered by the model
+ * first (coverage may be NULL). Colors of uncovered texels are only added
+ * while there is room. Returns the palette size, -1 if covered texels have
+ * more than SHIPDAT_COLORS colors.
+ **/
+int
+shipdat_build_palette(const uint32_t *rgba, const uint8_t *coverage, size_t count, uint32_t *palette);
+
+bool
+shipdat_encode(const uint32_t *rgba, size_t count, const uint32_t *palette, int palette_size, uint8_t *image, enum ShipdatMatch match);
+
+// Builds the palette and writes palette and image of the material into the buffer
+bool
+shipdat_encode_material(uint8_t *buffer, size_t length, int index, const uint32_t *rgba, const uint8_t *coverage);
+
+const char *
+shipdat_kernel_name();
@@ -52,6 +52,23 @@
 #include "fileio.h"
 #include "util.h"
 #include "fps.h"
+#include "trace.h"
+#include "memstat.h"
+#include "material.h"
+#include "undo.h"
+#include "journal.h"
+#include "brush.h"
+#include "stroke.h"
+#include "uvmap.h"
+#include "coverage.h"
+#include "layers.h"
+#include "indexed.h"
+#include "recolor.h"
+#include "colorhist.h"
+#include "shipdat.h"
+#include "workers.h"
+#include "quantize.h"
+#include "quantcache.h"
 
 #define VERSION "v1.0.3"
 
@@ -79,6 +96,101 @@ set_uint32_callback(uint32_t new_value, void *user_data)
 static bool
 g_batch_mode = false;
 
+static bool
+g_show_memstats = false;
+
+static bool
+g_dump_memstats = false;
+
+static float
+g_stroke_spacing = STROKE_DEFAULT_SPACING;
+
+static bool
+g_seam_painting = true;
+
+static bool
+g_mirror_painting = false;
+
+// Live preview of the exported images with a fast quantizer (toggle with e)
+static bool
+g_export_preview = false;
+
+static struct QuantizeOptions
+g_preview_options = { QUANTIZE_PALETTE_MEDIAN_CUT, QUANTIZE_DITHER_FLOYD_STEINBERG };
+
+static const char *
+JOURNAL_FILENAME = "shipedit.journal";
+
+// Step sizes of the color adjustment keys
+#define RECOLOR_HUE_STEP 15.f
+#define RECOLOR_FACTOR_STEP 1.1f
+
+static struct RecolorPalette
+g_palette_clipboard[BRUSH_MAX_MATERIALS];
+
+static bool
+g_palette_clipboard_valid = false;
+
+static struct Journal *
+g_journal = NULL;
+
+static struct Workers *
+g_workers = NULL;
+
+// Created by the first "Quantize" command
+static struct QuantCache *
+g_quant_cache = NULL;
+
+static size_t
+g_quant_cache_budget = QUANTCACHE_DEFAULT_BUDGET;
+
+static const char *
+g_quant_cache_filename = NULL;
+
+// Quantization of one image, running on a worker thread
+struct QuantizeJob {
+    // Part of the current "Quantize" command
+    bool active;
+    struct Material *material;
+    uint32_t *rgba;
+    int threads;
+    int result;
+    struct WorkerJob *job;
+
+    // Palette index per texel and RGB palette of the result
+    uint8_t *indices;
+    uint8_t result_palette[3 * SHIPDAT_COLORS];
+    int result_colors;
+
+    // Set once the result is applied to the material, for encode_image()
+    bool result_valid;
+
+    // Kept for the next "Quantize" command, so that the buffers are reused
+    struct scolorq_ctx *ctx;
+
+    // Result of the last run (RGBA), to warm start the next run after small edits
+    uint32_t *previous;
+    const struct Material *previous_material;
+    uint8_t *dirty;
+    uint8_t palette[3 * SHIPDAT_COLORS];
+    struct scolorq_warm_start warm;
+    bool use_warm;
+
+    // Hash of the inputs of this run; cached results have no worker job
+    struct QuantCacheKey key;
+    bool cached;
+};
+
+// Quantizing again starts from the last result while at most this share of texels changed
+#define QUANTIZE_WARM_MAX_DIRTY_DIVISOR 4
+
+// Jobs of the current "Quantize" command (editing waits until all are done),
+// one slot per material index, so that a slot keeps the last result of its image
+static struct {
+    struct QuantizeJob jobs[BRUSH_MAX_MATERIALS];
+    int count;
+} g_quantize;
+
 static struct {
     bool dragging;
     bool panning;
@@ -203,26 +315,6 @@ png_load_rgba(const char *filename, int *w, int *h, int *channels)
 
 #define SHIP_FROM_SCENE(scene) (g_teams[(scene)->current_ship].loaded_model)
 
-struct UndoOperation {
-    struct Material *material;
-
-    uint32_t *old_pixels;
-    size_t old_pixels_length;
-
-    struct UndoOperation *next;
-};
-
-struct UndoStep {
-    char *label;
-    struct UndoOperation *operations;
-
-    struct UndoStep *next;
-};
-
-struct Undo {
-    struct UndoStep *step;
-};
-
 enum Mode {
     MODE_EDITOR = 0,
     MODE_OVERVIEW,
@@ -289,6 +381,8 @@ struct Scene {
     float time;
 
     struct Undo *undo;
+    struct Brush *brush;
+    struct Stroke stroke;
 };
 
 static struct Scene *
@@ -322,6 +416,7 @@ enum {
     ITEM_ICON0_PREVIEW,
     ITEM_RENDER_UV_MAP,
     ITEM_UNDO,
+    ITEM_REDO,
     ITEM_MAGNIFIER,
     ITEM_ABOUT,
 };
@@ -339,6 +434,7 @@ layout[] = {
     { "icon0 preview",   { 768+113, 314, 144, 80}, ITEM_ICON0_PREVIEW, "Savegame icon preview"}, // icon0 preview
 
     { "Undo",            { 137 + 616 - 50, 11 + 10, 40, 40 }, ITEM_UNDO | FLAG_BUTTON, "Undo last texture-changing action" }, // undo
+    { "Redo",            { 137 + 616 - 100, 11 + 10, 40, 40 }, ITEM_REDO | FLAG_BUTTON, "Redo last undone action" }, // redo
     { "save slot",       { 137 + 616 - 80 - 10, 11 + 383 - 20 - 10, 80, 20 }, ITEM_SAVE_SLOT | FLAG_BUTTON, "Slot to use when building savegame" }, // save slot
 
     { "Load Default",    { 769, 46 + 256 + 10 + 61 - 29 * 2, 105, 20 }, ITEM_DEFAULT_SKIN | FLAG_BUTTON, "Load default livery for current team" },
@@ -430,198 +526,17 @@ layout_to_png(int w, int h, struct LayoutItem *item, const char *filename)
 }
 
 
-void
-material_upload(struct Material *material)
-{
-    glBindTexture(GL_TEXTURE_2D, material->texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, material->width, material->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, material->pixels);
-}
-
-void
-material_plot(struct Material *material, int u, int v, float alpha)
-{
-    uint32_t *pixels_rgba = (uint32_t *)material->pixels;
-    uint8_t *drawn_a = (uint8_t *)material->pixels_drawn;
-
-    union {
-        uint32_t u32;
-        uint8_t u8[4];
-    } color1, color2, color3;
-
-    color1.u32 = 0xFF000000 | g_current_color;
-    color2.u32 = pixels_rgba[v + u*material->width];
-
-    alpha = 1.f - alpha;
-    alpha *= get_pen_alpha_factor();
-
-    uint8_t alpha_int = 255 * alpha;
-
-    if (alpha_int < drawn_a[v + u*material->width]) {
-        alpha_int = 0;
-    }
-
-    for (int i=0; i<3; ++i) {
-        uint16_t v = (((uint16_t)color1.u8[i] * alpha_int) + ((uint16_t)color2.u8[i] * (255 - alpha_int))) / 255;
-        if (v > 255) {
-            v = 255;
-        }
-        color3.u8[i] = (uint8_t)v;
-    }
-
-    color3.u32 |= 0xFF000000;
-
-    pixels_rgba[v + u*material->width] = color3.u32;
-    drawn_a[v + u*material->width] += alpha_int;
-
-    material->pixels_dirty = true;
-}
-
-void
-undo_push(struct Undo *undo, const char *label)
-{
-    // TODO: Limit number of undo steps to not run out of memory
-    struct UndoStep *step = calloc(1, sizeof(struct UndoStep));
-    step->label = strdup(label);
-    step->next = undo->step;
-    undo->step = step;
-}
-
-void
-undo_save_material_pixels(struct Undo *undo, struct Material *material)
-{
-    if (!undo->step) {
-        // No undo step recording in process
-        return;
-    }
-
-    struct UndoOperation *cur = undo->step->operations;
-    while (cur != NULL) {
-        if (cur->material == material) {
-            // If the material was already saved in this step, we can skip it
-            return;
-        }
-
-        cur = cur->next;
-    }
-
-    struct UndoOperation *op = calloc(1, sizeof(struct UndoOperation));
-
-    op->material = material;
-
-    op->old_pixels_length = sizeof(uint32_t) * material->width * material->height;
-    op->old_pixels = malloc(op->old_pixels_length);
-    memcpy(op->old_pixels, material->pixels, op->old_pixels_length);
-
-    op->next = undo->step->operations;
-    undo->step->operations = op;
-}
-
-void
-undo_undo(struct Undo *undo)
-{
-    struct UndoStep *step = undo->step;
-
-    if (step) {
-        printf("Undoing: %s\n", step->label);
-        struct UndoOperation *op = step->operations;
-        while (op != NULL) {
-            memcpy(op->material->pixels, op->old_pixels, op->old_pixels_length);
-            material_upload(op->material);
-
-            free(op->old_pixels);
-
-            struct UndoOperation *next = op->next;
-            free(op);
-            op = next;
-        }
-
-        struct UndoStep *next = step->next;
-        free(step->label);
-        free(step);
-        undo->step = next;
-    } else {
-        printf("Undo stack empty\n");
-    }
-}
-
-void
-undo_clear(struct Undo *undo)
-{
-    struct UndoStep *step = undo->step;
-
-    undo->step = NULL;
-
-    while (step) {
-        printf("Pop from undo stack: %s\n", step->label);
-
-        struct UndoOperation *op = step->operations;
-        while (op != NULL) {
-            free(op->old_pixels);
-
-            struct UndoOperation *next = op->next;
-            free(op);
-            op = next;
-        }
-
-        struct UndoStep *next = step->next;
-        free(step->label);
-        free(step);
-        step = next;
-    }
-}
-
-char *
-load_shipdat(const char *buffer, size_t buffer_len, int index, int *width, int *height, int *channels, int want_channels, uint32_t **palette)
-{
-    size_t expected = 32+index*(4*16+128*128/2)+128*128/2;
-    if (buffer_len < expected) {
-        fail("Buffer too short buffer_len=%d, expected=%d", buffer_len, expected);
-    }
-
-    *width = 128;
-    *height = 128;
-    *channels = 4;
-
-    char *result = malloc((*width) * (*height) * (*channels));
-
-    uint32_t *res_rgba = (uint32_t *)result;
-
-    const char *read_ptr = buffer + 32+index*(4*16+128*128/2);
-    *palette = malloc(4 * 16);
-
-    memcpy(*palette, read_ptr, 4 * 16);
-    read_ptr += 4 * 16;
-
-    char *map = malloc((*width) * (*height) / 2);
-    memcpy(map, read_ptr, (*width) * (*height) / 2);
-
-    for (int y=0; y<*height; ++y) {
-        for (int x=0; x<*width; ++x) {
-            uint8_t pixel = map[(y*(*width) + x)/2];
-
-            if (x % 2 == 0) {
-                pixel >>= 4;
-            } else {
-                pixel &= 0x0F;
-            }
-
-            res_rgba[y*(*width) + x] = (*palette)[pixel];
-        }
-    }
-
-    free(map);
-
-    return result;
-}
-
 struct ShipModel *
 parse_shm(const char *filename)
 {
+    TRACE_BEGIN("parse_shm");
+
     struct ShipModel *model = malloc(sizeof(struct ShipModel));
     memset(model, 0, sizeof(*model));
 
     size_t len;
     char *dat = read_file(filename, &len);
+    memstat_add(MEMSTAT_ASSETS, len);
 
     struct ShipModelHeader *smh = (struct ShipModelHeader *)dat;
 
@@ -663,6 +578,8 @@ parse_shm(const char *filename)
     // keep a pointer to the data, even though we never free it
     model->temp = (struct ShipModelTemp *)dat;
 
+    TRACE_END("parse_shm");
+
     return model;
 }
 
@@ -686,6 +603,8 @@ rgba32_flip_y(uint8_t *pixels, int width, int height)
 void
 instantiate_materials(struct ShipModel *model)
 {
+    TRACE_BEGIN("instantiate_materials");
+
     struct Material *material = model->materials;
     while (material != NULL) {
         if (material->index != -1 || material->is_cockpit_png) {
@@ -700,6 +619,10 @@ instantiate_materials(struct ShipModel *model)
             // 8 bpp how much the pixel has been drawn/blended during this draw operation
             material->pixels_drawn = malloc(sizeof(uint8_t) * material->width * material->height);
 
+            memstat_add(MEMSTAT_MATERIALS, (sizeof(uint32_t) + sizeof(uint8_t)) * material->width * material->height);
+            // texture + picker_texture, both RGBA8
+            memstat_add(MEMSTAT_GL_TEXTURES, 2 * sizeof(uint32_t) * material->width * material->height);
+
             {
                 glGenTextures(1, &material->texture);
                 glBindTexture(GL_TEXTURE_2D, material->texture);
@@ -745,6 +668,8 @@ instantiate_materials(struct ShipModel *model)
 
         material = material->next;
     }
+
+    TRACE_END("instantiate_materials");
 }
 
 void
@@ -1060,7 +985,7 @@ render_shipview(struct Scene *scene, struct ShipModel *model, int w, int h, bool
                 continue;
             }
 
-            bool have_material = cur->material && cur->material->pixels;
+            bool have_material = cur->material && (cur->material->pixels || cur->material->indices);
 
             if (i == DRAW_LINES) {
                 if (!have_material) {
@@ -1272,6 +1197,17 @@ about_lines[] = {
     "pack2_ui1.edat, pack3_ui1.edat, pack4_ui1.edat (from the DLCs) into the current directory.",
     "",
     "  [m] ... Toggle magnifier",
+    "  [i] ... Toggle memory usage overlay",
+    "  [s] ... Toggle painting across UV seams",
+    "  [x] ... Toggle mirror painting (X axis)",
+    "  [n] / [DEL] / [f] ... New layer / Delete layer / Flatten layers",
+    "  [[] / []] / [v] / [b] / [-] / [=] ... Select layer / Toggle visibility / Blend mode / Opacity",
+    "  [p] ... Toggle indexed mode (paint with the 16 colors of each image, no quantizing needed)",
+    "  [e] (+ [SHIFT] to change the quantizer) ... Toggle export preview (fast 16 color quantization)",
+    "  [h] / [j] / [k] (+ [SHIFT] to reverse) ... Shift hue / saturation / brightness of all images",
+    "  [r] ... Replace the color under the cursor with the current color",
+    "  [c] / [t] ... Copy palettes / Apply copied palettes (e.g. from another team)",
+    "  [CTRL+z] / [CTRL+y] ... Undo / Redo",
     "  [right mouse button] or [left mouse button + CTRL] ... Rotate view",
     "  [middle mouse button] or [left mouse button + ALT] ... Pan view",
     "  [q] ... Exit",
@@ -1298,9 +1234,165 @@ about_lines[] = {
 };
 
 
+static void
+draw_layers(struct Scene *scene, int x, int y)
+{
+    struct LayerStack *stack = NULL;
+    struct Material *mat = SHIP_FROM_SCENE(scene)->materials;
+    while (mat != NULL && stack == NULL) {
+        stack = mat->layers;
+        mat = mat->next;
+    }
+
+    if (stack == NULL) {
+        return;
+    }
+
+    char line[64];
+    int line_height = 12;
+
+    glEnable(GL_BLEND);
+    glColor4f(0.f, 0.f, 0.f, 0.7f);
+    draw_rect(x - 4, y - 4, 146, stack->count * line_height + 8);
+
+    // Topmost layer first
+    for (int i=stack->count-1; i>=0; --i) {
+        const struct Layer *layer = &stack->layers[i];
+        if (i == 0) {
+            snprintf(line, sizeof(line), "%s base", (i == stack->active) ? ">" : " ");
+        } else {
+            snprintf(line, sizeof(line), "%s %d %s %d%%%s", (i == stack->active) ? ">" : " ", i,
+                    layers_blend_name(layer->blend), layer->opacity * 100 / 255, layer->visible ? "" : " (hidden)");
+        }
+
+        glColor4f(1.f, 1.f, 1.f, (layer->visible || i == 0) ? 1.f : 0.5f);
+        draw_with_font_xy(g_font_gui, x, y + (stack->count - 1 - i) * line_height, line);
+    }
+
+    glDisable(GL_BLEND);
+}
+
+static float
+quantize_job_progress(const struct QuantizeJob *quantize)
+{
+    return quantize->job ? worker_job_progress(quantize->job) : 1.f;
+}
+
+static void
+draw_quantize_progress(int w, int h)
+{
+    glEnable(GL_BLEND);
+    glColor4f(0.f, 0.f, 0.f, 0.7f);
+    draw_rect(0, 0, w, h);
+
+    float total = 0.f;
+    for (int i=0; i<BRUSH_MAX_MATERIALS; ++i) {
+        if (g_quantize.jobs[i].active) {
+            total += quantize_job_progress(&g_quantize.jobs[i]);
+        }
+    }
+
+    char line[64];
+    snprintf(line, sizeof(line), "Quantizing... %d%%", (int)(100.f * total / g_quantize.count));
+
+    glColor4f(1.f, 1.f, 1.f, 1.f);
+    draw_with_font_xy(g_font_heading, 13, 10, line);
+
+    int row = 0;
+    for (int i=0; i<BRUSH_MAX_MATERIALS; ++i) {
+        if (!g_quantize.jobs[i].active) {
+            continue;
+        }
+
+        snprintf(line, sizeof(line), "Image %d: %d%%", g_quantize.jobs[i].material->index,
+                (int)(100.f * quantize_job_progress(&g_quantize.jobs[i])));
+        draw_with_font_xy(g_font_gui, 13, 34 + row++ * 12, line);
+    }
+
+    draw_with_font_xy(g_font_gui, 13, 40 + g_quantize.count * 12, "Press ESC to cancel");
+    glDisable(GL_BLEND);
+}
+
+static void
+draw_color_counts(struct Scene *scene, int x, int y)
+{
+    char line[128];
+    int length = snprintf(line, sizeof(line), "colors:");
+    bool ready = true;
+
+    struct Material *mat = SHIP_FROM_SCENE(scene)->materials;
+    for (; mat != NULL; mat = mat->next) {
+        if (mat->index == -1 || (mat->colors == NULL && mat->indices == NULL)) {
+            continue;
+        }
+
+        // encode_image() needs at most 16 colors on visible texels
+        uint32_t distinct = (mat->indices != NULL) ? indexed_distinct(mat) : mat->colors->distinct;
+        ready = ready && (mat->indices != NULL || distinct <= INDEXED_COLORS);
+        length += snprintf(line + length, sizeof(line) - length, " %u", distinct);
+    }
+
+    snprintf(line + length, sizeof(line) - length, ready ? " -- ready to export" : " -- quantize before export");
+
+    glEnable(GL_BLEND);
+    if (g_export_preview) {
+        char preview[96];
+        snprintf(preview, sizeof(preview), "preview: %s, %s", quantize_palette_name(g_preview_options.palette),
+                quantize_dither_name(g_preview_options.dither));
+        glColor4f(1.f, 1.f, 1.f, 0.8f);
+        draw_with_font_xy(g_font_gui, x, y - 12, preview);
+    }
+    if (ready) {
+        glColor4f(1.f, 1.f, 1.f, 0.8f);
+    } else {
+        glColor4f(1.f, 0.6f, 0.3f, 1.f);
+    }
+    draw_with_font_xy(g_font_gui, x, y, line);
+    glColor4f(1.f, 1.f, 1.f, 1.f);
+    glDisable(GL_BLEND);
+}
+
+static void
+draw_memstats(int x, int y)
+{
+    char line[128];
+    char live[32];
+    char peak[32];
+
+    int line_height = 12;
+    int rows = MEMSTAT_NUM_CATEGORIES + 1;
+
+    glEnable(GL_BLEND);
+    glColor4f(0.f, 0.f, 0.f, 0.7f);
+    draw_rect(x - 4, y - 4, 230, rows * line_height + 8);
+
+    for (int i=0; i<MEMSTAT_NUM_CATEGORIES; ++i) {
+        memstat_format_bytes(memstat_live(i), live, sizeof(live));
+        memstat_format_bytes(memstat_peak(i), peak, sizeof(peak));
+        snprintf(line, sizeof(line), "%s: %s (peak %s)", memstat_name(i), live, peak);
+
+        if (memstat_over_budget(i)) {
+            glColor4f(1.f, 0.3f, 0.3f, 1.f);
+        } else {
+            glColor4f(1.f, 1.f, 1.f, 1.f);
+        }
+        draw_with_font_xy(g_font_gui, x, y + i * line_height, line);
+    }
+
+    memstat_format_bytes(memstat_total(), live, sizeof(live));
+    snprintf(line, sizeof(line), "total: %s", live);
+    glColor4f(1.f, 1.f, 0.5f, 1.f);
+    draw_with_font_xy(g_font_gui, x, y + MEMSTAT_NUM_CATEGORIES * line_height, line);
+
+    glColor4f(1.f, 1.f, 1.f, 1.f);
+    glDisable(GL_BLEND);
+}
+
 void
 scene_render(struct Scene *scene, int w, int h, float t, bool picking)
 {
+    TRACE_BEGIN(picking ? "scene_render (picking)" : "scene_render");
+
     glClearColor(0.f, 0.f, 0.f, 0.f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -1581,6 +1673,19 @@ scene_render(struct Scene *scene, int w, int h, float t, bool picking)
         draw_with_font_xy(g_font_heading, shipview_layout->rect.x + 8, shipview_layout->rect.y + shipview_layout->rect.h - 28, g_teams[scene->current_ship].team_label);
     }
 
+    if (scene->mode == MODE_EDITOR && g_show_memstats && !picking) {
+        draw_memstats(shipview_layout->rect.x + 8, shipview_layout->rect.y + 8);
+    }
+
+    if (scene->mode == MODE_EDITOR && !picking) {
+        draw_layers(scene, shipview_layout->rect.x + shipview_layout->rect.w - 150, shipview_layout->rect.y + 8);
+        draw_color_counts(scene, shipview_layout->rect.x + shipview_layout->rect.w - 260, shipview_layout->rect.y + shipview_layout->rect.h - 20);
+    }
+
+    if (g_quantize.count > 0 && !picking) {
+        draw_quantize_progress(w, h);
+    }
+
     if (scene->mode == MODE_ABOUT) {
         glEnable(GL_BLEND);
         glColor4f(0.f, 0.f, 0.f, 0.9f * scene->about_transition);
@@ -1606,6 +1711,8 @@ scene_render(struct Scene *scene, int w, int h, float t, bool picking)
             }
         }
     }
+
+    TRACE_END(picking ? "scene_render (picking)" : "scene_render");
 }
 
 /**
@@ -1759,6 +1866,8 @@ meta_png_io(struct Scene *scene, uint32_t *rgba, int w, int h, bool writemode)
 bool
 load_png(struct Scene *scene, const char *filename)
 {
+    TRACE_BEGIN("load_png");
+
     png_image image;
     memset(&image, 0, sizeof(image));
     image.version = PNG_IMAGE_VERSION;
@@ -1785,11 +1894,13 @@ load_png(struct Scene *scene, const char *filename)
                         for (int y=0; y<128; ++y) {
                             memcpy(mat->pixels + ((127-y) * 128 + 0) * 4, buffer + ((sy + y) * image.width + sx) * 4, 128 * 4);
                         }
+                        material_touch(mat, 0, 0, mat->width, mat->height);
                         material_upload(mat);
                     }
                     mat = mat->next;
                 }
 
+                TRACE_END("load_png");
                 return true;
             }
         }
@@ -1798,12 +1909,15 @@ load_png(struct Scene *scene, const char *filename)
         free(buffer);
     }
 
+    TRACE_END("load_png");
     return false;
 }
 
 bool
 load_dat(struct Scene *scene, const char *filename)
 {
+    TRACE_BEGIN("load_dat");
+
     size_t shipdat_len;
     char *shipdat = read_file(filename, &shipdat_len);
 
@@ -1811,17 +1925,20 @@ load_dat(struct Scene *scene, const char *filename)
         if (!saveskin_decrypt(shipdat, &shipdat_len)) {
             printf("Could not decrypt\n");
             free(shipdat);
+            TRACE_END("load_dat");
             return false;
         }
     }
 
     if (strstr(filename, ".vex") == filename + strlen(filename) - 4) {
         free(shipdat);
+        TRACE_END("load_dat");
         return false;
     }
 
     if (shipdat_len != 26912 && shipdat_len != 24800) {
         free(shipdat);
+        TRACE_END("load_dat");
         return false;
     }
 
@@ -1848,63 +1965,98 @@ load_dat(struct Scene *scene, const char *filename)
         if (index != -1) {
             undo_save_material_pixels(scene->undo, mat);
 
-            uint8_t *new_pixels = load_shipdat(shipdat, shipdat_len, index, &mat->width, &mat->height, &mat->channels, 4, &mat->palette);
-            if (new_pixels) {
-                free(mat->pixels);
-                mat->pixels = new_pixels;
+            // Decode into the existing buffer, so undo history stays valid
+            if (mat->width == SHIPDAT_WIDTH && mat->height == SHIPDAT_HEIGHT) {
+                if (mat->palette == NULL) {
+                    mat->palette = malloc(sizeof(uint32_t) * SHIPDAT_COLORS);
+                }
+                undo_save_material_palette(scene->undo, mat, SHIPDAT_COLORS);
+
+                if (shipdat_decode_material((const uint8_t *)shipdat, shipdat_len, index, (uint32_t *)mat->pixels, mat->palette)) {
+                    material_touch(mat, 0, 0, mat->width, mat->height);
+                }
             }
             material_upload(mat);
         }
         mat = mat->next;
     }
     free(shipdat);
+
+    TRACE_END("load_dat");
     return true;
 }
 
+// Encodes the indices of the last "Quantize" result while the material still has exactly its pixels
+static bool
+quantize_result_encode(const struct Material *mat, uint32_t *palette, uint8_t *image)
+{
+    for (int i=0; i<BRUSH_MAX_MATERIALS; ++i) {
+        const struct QuantizeJob *quantize = &g_quantize.jobs[i];
+        if (quantize->material != mat || !quantize->result_valid ||
+                memcmp(quantize->previous, mat->pixels, 4 * 128 * 128) != 0) {
+            continue;
+        }
+
+        // Entries as they are in the pixels (with alpha), unused ones stay 0
+        const uint32_t *pixels = (const uint32_t *)mat->pixels;
+        bool used[SHIPDAT_COLORS] = { false };
+        memset(palette, 0, sizeof(uint32_t) * SHIPDAT_COLORS);
+        for (int j=0; j<128*128; ++j) {
+            int entry = quantize->indices[j];
+            if (used[entry] && palette[entry] != pixels[j]) {
+                // The texels of an entry kept different alpha, one entry cannot hold them all
+                return false;
+            }
+
+            used[entry] = true;
+            palette[entry] = pixels[j];
+        }
+
+        for (int j=0; j<128*128; j+=2) {
+            image[j / 2] = (quantize->indices[j] << 4) | (quantize->indices[j + 1] & 0x0F);
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
 bool
-encode_image(unsigned char *buf, struct Material *mat)
+encode_image(unsigned char *buf, size_t buf_len, struct Material *mat)
 {
+    TRACE_BEGIN("encode_image");
+
     int index = mat->index;
 
     printf("material index: %d\n", index);
 
-    size_t palette_offset = 32 + index * (4 * 16 + 128 * 128 / 2);
-    size_t image_offset = palette_offset + 4 * 16;
+    size_t palette_offset = shipdat_material_offset(index);
+    size_t image_offset = palette_offset + sizeof(uint32_t) * SHIPDAT_COLORS;
 
     printf("palette offset: %zu, image offset: %zu\n", palette_offset, image_offset);
 
-    uint32_t *palette = (uint32_t *)(buf + palette_offset);
-    uint32_t palette_size = 0;
-
-    uint8_t *image = buf + image_offset;
-
-    uint32_t *pixels = (uint32_t *)(mat->pixels);
-
-    for (int y=0; y<128; ++y) {
-        for (int x=0; x<128; ++x) {
-            uint32_t pixel = pixels[y*128+x];
-            int pixel_index = -1;
-            for (int j=0; j<16; ++j) {
-                if (palette[j] == pixel) {
-                    pixel_index = j;
-                    break;
-                }
-            }
+    if (mat->indices != NULL) {
+        // Already 16 colors, nothing to search
+        indexed_encode(mat, (uint32_t *)(buf + palette_offset), buf + image_offset);
+        TRACE_END("encode_image");
+        return true;
+    }
 
-            if (pixel_index == -1) {
-                pixel_index = palette_size++;
-                palette[pixel_index] = pixel;
-                if (palette_size > 16) {
-                    printf("Too big of a palette\n");
-                    return false;
-                }
-            }
+    if (quantize_result_encode(mat, (uint32_t *)(buf + palette_offset), buf + image_offset)) {
+        // Freshly quantized, the quantizer's indices need no palette search
+        TRACE_END("encode_image");
+        return true;
+    }
 
-            uint8_t pixel_value = pixel_index;
-            image[(y*128+x) / 2] |= (x % 2 == 0) ? (pixel_value << 4) : pixel_value;
-        }
+    // Visible texels get the palette entries, the rest the nearest color
+    if (!shipdat_encode_material(buf, buf_len, index, (const uint32_t *)mat->pixels, mat->coverage)) {
+        printf("Too big of a palette\n");
+        TRACE_END("encode_image");
+        return false;
     }
 
+    TRACE_END("encode_image");
     return true;
 }
 
@@ -1933,13 +2085,581 @@ save_layout(const char *filename, void *user_data)
     layout_to_png(ctx->w, ctx->h, ctx->item, filename);
 }
 
+static void
+scene_undo(struct Scene *scene, bool redo)
+{
+    if (redo) {
+        if (undo_redo(scene->undo)) {
+            journal_undo(g_journal, scene->undo->step, true);
+        }
+    } else {
+        if (undo_undo(scene->undo)) {
+            journal_undo(g_journal, scene->undo->redo, false);
+        }
+    }
+}
 
 static void
-plot_here(struct Scene *scene, int w, int h, int x, int y)
+scene_flatten_layers(struct Scene *scene)
 {
-    if (!scene->picking.inited ||
-            scene->picking.longitude != scene->longitude ||
-            scene->picking.latitude != scene->latitude ||
+    struct Material *mat = SHIP_FROM_SCENE(scene)->materials;
+    while (mat != NULL) {
+        struct LayerStack *stack = mat->layers;
+        if (stack != NULL) {
+            // The merged result goes into the base layer, and the step keeps
+            // the other layers, so that undo can bring them back
+            int active = stack->active;
+            stack->active = 0;
+            undo_save_material_pixels(scene->undo, mat);
+            stack->active = active;
+
+            undo_save_material_layers(scene->undo, mat, layers_detach(mat));
+            material_upload(mat);
+        }
+
+        mat = mat->next;
+    }
+}
+
+static bool
+scene_has_layers(struct Scene *scene)
+{
+    struct Material *mat = SHIP_FROM_SCENE(scene)->materials;
+    while (mat != NULL) {
+        if (mat->layers != NULL) {
+            return true;
+        }
+
+        mat = mat->next;
+    }
+
+    return false;
+}
+
+static bool
+scene_is_indexed(struct Scene *scene)
+{
+    struct Material *mat = SHIP_FROM_SCENE(scene)->materials;
+    while (mat != NULL) {
+        if (mat->indices != NULL) {
+            return true;
+        }
+
+        mat = mat->next;
+    }
+
+    return false;
+}
+
+static bool
+scene_can_set_indexed(struct Scene *scene, bool indexed)
+{
+    if (!indexed) {
+        return true;
+    }
+
+    if (scene_has_layers(scene)) {
+        printf("Flatten layers before switching to indexed mode\n");
+        return false;
+    }
+
+    struct Material *mat = SHIP_FROM_SCENE(scene)->materials;
+    for (; mat != NULL; mat = mat->next) {
+        if (mat->index >= 0 && mat->index < BRUSH_MAX_MATERIALS && !indexed_fits(mat)) {
+            printf("Image %d has more than %d colors, quantize first\n", mat->index, INDEXED_COLORS);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+scene_set_indexed(struct Scene *scene, bool indexed)
+{
+    if (indexed == scene_is_indexed(scene)) {
+        return true;
+    }
+
+    if (!scene_can_set_indexed(scene, indexed)) {
+        return false;
+    }
+
+    struct Material *mat;
+    for (mat = SHIP_FROM_SCENE(scene)->materials; mat != NULL; mat = mat->next) {
+        if (mat->index < 0 || mat->index >= BRUSH_MAX_MATERIALS) {
+            continue;
+        }
+
+        // Part of the current step, so that undo can recreate the buffer
+        // that the switch frees for the tiles saved for it
+        if (indexed) {
+            undo_save_material_palette(scene->undo, mat, INDEXED_COLORS);
+            undo_save_material_indexed(scene->undo, mat);
+            indexed_enable(mat);
+        } else {
+            undo_save_material_indexed(scene->undo, mat);
+            indexed_disable(mat);
+        }
+    }
+
+    printf("Indexed mode: %s\n", indexed ? "on" : "off");
+    return true;
+}
+
+static bool
+quantize_progress(float progress, void *user_data)
+{
+    struct WorkerJob *job = user_data;
+
+    worker_job_set_progress(job, progress);
+    return !worker_job_cancelled(job);
+}
+
+static void
+quantize_job_run(struct WorkerJob *job, void *user_data)
+{
+    struct QuantizeJob *quantize = user_data;
+
+    if (quantize->ctx == NULL) {
+        quantize->ctx = scolorq_ctx_new(SCOLORQ_DEFAULT_SEED);
+    }
+    scolorq_ctx_set_progress(quantize->ctx, quantize_progress, job);
+    scolorq_ctx_set_threads(quantize->ctx, quantize->threads);
+
+    printf("Quantizing: image %d%s\n", quantize->material->index, quantize->use_warm ? " (warm start)" : "");
+    quantize->result = scolorq_quantize_indexed(quantize->ctx, 128, 128, (const uint8_t *)quantize->rgba, 4 * 128,
+            SHIPDAT_COLORS, quantize->material->coverage, quantize->use_warm ? &quantize->warm : NULL,
+            quantize->indices, quantize->result_palette);
+    quantize->result_colors = SHIPDAT_COLORS;
+}
+
+// Marks the texels changed since the last result, and uses its palette if few did
+static bool
+quantize_warm_prepare(struct QuantizeJob *quantize)
+{
+    struct Material *mat = quantize->material;
+    if (quantize->previous == NULL || quantize->previous_material != mat) {
+        // The same image of another team has nothing to do with this one
+        return false;
+    }
+
+    int dirty = 0;
+    for (int i=0; i<128*128; ++i) {
+        bool covered = (mat->coverage == NULL || mat->coverage[i]);
+        quantize->dirty[i] = covered && ((quantize->rgba[i] ^ quantize->previous[i]) & 0x00FFFFFF) != 0;
+        dirty += quantize->dirty[i];
+    }
+
+    // Another skin or many edits: a cold start gives a better palette
+    if (dirty > 128 * 128 / QUANTIZE_WARM_MAX_DIRTY_DIVISOR) {
+        return false;
+    }
+
+    uint32_t palette[SHIPDAT_COLORS];
+    int size = shipdat_build_palette(quantize->previous, mat->coverage, 128 * 128, palette);
+    if (size <= 0) {
+        return false;
+    }
+
+    for (int i=0; i<size; ++i) {
+        memcpy(quantize->palette + 3 * i, &palette[i], 3);
+    }
+
+    quantize->warm.palette = quantize->palette;
+    quantize->warm.palette_size = size;
+    quantize->warm.temperature = SCOLORQ_WARM_TEMPERATURE;
+    quantize->warm.dirty = quantize->dirty;
+    return true;
+}
+
+// Everything the result of quantize_job_run() depends on
+static void
+quantize_cache_key(const struct QuantizeJob *quantize, bool warm, struct QuantCacheKey *key)
+{
+    const struct Material *mat = quantize->material;
+
+    // Results only differ between single- and multi-threaded runs, not with the thread count
+    uint32_t params[5] = { QUANTCACHE_VERSION, SCOLORQ_DEFAULT_SEED, 16, SCOLORQ_PRECISION_FLOAT, quantize->threads > 1 };
+
+    quantcache_key_init(key);
+    quantcache_key_add(key, "scolorq", 7);
+    quantcache_key_add(key, params, sizeof(params));
+    quantcache_key_add(key, quantize->rgba, 4 * 128 * 128);
+
+    uint8_t covered = (mat->coverage != NULL);
+    quantcache_key_add(key, &covered, 1);
+    if (covered) {
+        quantcache_key_add(key, mat->coverage, 128 * 128);
+    }
+
+    if (warm) {
+        quantcache_key_add(key, &quantize->warm.palette_size, sizeof(quantize->warm.palette_size));
+        quantcache_key_add(key, quantize->warm.palette, 3 * quantize->warm.palette_size);
+        quantcache_key_add(key, &quantize->warm.temperature, sizeof(quantize->warm.temperature));
+        quantcache_key_add(key, quantize->warm.dirty, 128 * 128);
+    }
+}
+
+// Takes the result from the cache, preferring that of a cold start
+static bool
+quantize_cache_lookup(struct QuantizeJob *quantize)
+{
+    quantize_cache_key(quantize, false, &quantize->key);
+    quantize->result_colors = SHIPDAT_COLORS;
+    if (quantcache_get(g_quant_cache, &quantize->key, quantize->indices, quantize->result_palette,
+                &quantize->result_colors, 128, 128)) {
+        return true;
+    }
+
+    if (quantize->use_warm) {
+        quantize_cache_key(quantize, true, &quantize->key);
+        quantize->result_colors = SHIPDAT_COLORS;
+        return quantcache_get(g_quant_cache, &quantize->key, quantize->indices, quantize->result_palette,
+                &quantize->result_colors, 128, 128);
+    }
+
+    return false;
+}
+
+static bool
+scene_quantize_busy()
+{
+    return g_quantize.count > 0;
+}
+
+static void
+scene_quantize_start(struct Scene *scene)
+{
+    if (scene_quantize_busy()) {
+        return;
+    }
+
+    if (g_quant_cache == NULL && g_quant_cache_budget > 0) {
+        g_quant_cache = quantcache_new(g_quant_cache_budget, g_quant_cache_filename);
+    }
+
+    struct Material *mat = SHIP_FROM_SCENE(scene)->materials;
+    for (; mat != NULL; mat = mat->next) {
+        if (mat->index < 0 || mat->index >= BRUSH_MAX_MATERIALS) {
+            continue;
+        }
+
+        // Brings the composite of layers up to date
+        material_upload(mat);
+
+        struct QuantizeJob *quantize = &g_quantize.jobs[mat->index];
+        quantize->active = true;
+        g_quantize.count++;
+        quantize->material = mat;
+        quantize->result = 0;
+        quantize->result_valid = false;
+        if (quantize->rgba == NULL) {
+            quantize->rgba = malloc(4 * 128 * 128);
+            quantize->dirty = malloc(128 * 128);
+            quantize->indices = malloc(128 * 128);
+            memstat_add(MEMSTAT_QUANTIZER, 6 * 128 * 128);
+        }
+
+        // The quantizer reads RGBA, so a copy is all it takes
+        memcpy(quantize->rgba, material_rgba(mat), 4 * 128 * 128);
+
+        // Texels nobody sees should not cost palette entries
+        coverage_fill(mat, (uint8_t *)quantize->rgba, 4);
+
+        quantize->use_warm = quantize_warm_prepare(quantize);
+    }
+
+    // Cores left over by running one image per core go to the annealing of each image
+    int threads = SDL_GetCPUCount() / (g_quantize.count > 0 ? g_quantize.count : 1);
+
+    for (int i=0; i<BRUSH_MAX_MATERIALS; ++i) {
+        struct QuantizeJob *quantize = &g_quantize.jobs[i];
+        if (!quantize->active) {
+            continue;
+        }
+
+        quantize->threads = (threads > 1) ? threads : 1;
+
+        quantize->cached = (g_quant_cache != NULL && quantize_cache_lookup(quantize));
+        if (quantize->cached) {
+            printf("Quantizing: image %d (cached)\n", quantize->material->index);
+            quantize->job = NULL;
+            continue;
+        }
+
+        quantize->job = workers_submit(g_workers, quantize_job_run, quantize);
+    }
+}
+
+static void
+scene_quantize_cancel()
+{
+    for (int i=0; i<BRUSH_MAX_MATERIALS; ++i) {
+        if (g_quantize.jobs[i].job) {
+            worker_job_cancel(g_quantize.jobs[i].job);
+        }
+    }
+}
+
+static void
+scene_quantize_free()
+{
+    for (int i=0; i<BRUSH_MAX_MATERIALS; ++i) {
+        if (g_quantize.jobs[i].job) {
+            worker_job_free(g_quantize.jobs[i].job);
+            g_quantize.jobs[i].job = NULL;
+        }
+        g_quantize.jobs[i].active = false;
+    }
+
+    g_quantize.count = 0;
+}
+
+// Frees the buffers kept for the next "Quantize" command
+static void
+scene_quantize_release()
+{
+    scene_quantize_free();
+
+    for (int i=0; i<BRUSH_MAX_MATERIALS; ++i) {
+        struct QuantizeJob *quantize = &g_quantize.jobs[i];
+        if (quantize->ctx != NULL) {
+            scolorq_ctx_free(quantize->ctx);
+            quantize->ctx = NULL;
+        }
+        if (quantize->rgba != NULL) {
+            free(quantize->rgba);
+            free(quantize->dirty);
+            free(quantize->indices);
+            memstat_sub(MEMSTAT_QUANTIZER, 6 * 128 * 128);
+            quantize->rgba = NULL;
+            quantize->dirty = NULL;
+            quantize->indices = NULL;
+            quantize->result_valid = false;
+        }
+        if (quantize->previous != NULL) {
+            free(quantize->previous);
+            memstat_sub(MEMSTAT_QUANTIZER, 4 * 128 * 128);
+            quantize->previous = NULL;
+        }
+    }
+}
+
+// Applies the results once all images are done, as a single undo step
+static void
+scene_quantize_finish(struct Scene *scene)
+{
+    bool cancelled = false;
+    bool failed = false;
+    for (int i=0; i<BRUSH_MAX_MATERIALS; ++i) {
+        struct QuantizeJob *quantize = &g_quantize.jobs[i];
+        if (!quantize->active) {
+            continue;
+        }
+
+        if (quantize->job && !worker_job_done(quantize->job)) {
+            return;
+        }
+
+        if (quantize->result == SCOLORQ_CANCELLED) {
+            cancelled = true;
+        } else if (quantize->result != 0) {
+            failed = true;
+        }
+    }
+
+    if (g_quantize.count == 0) {
+        return;
+    }
+
+    if (cancelled || failed) {
+        printf("Quantize %s\n", failed ? "failed" : "cancelled");
+        scene_quantize_free();
+
+        if (failed) {
+            nativeui_show_error("Could not quantize images", "The images have not been changed.");
+        }
+        return;
+    }
+
+    undo_push(scene->undo, "Quantize");
+    scene_flatten_layers(scene);
+    scene_set_indexed(scene, false);
+
+    for (int i=0; i<BRUSH_MAX_MATERIALS; ++i) {
+        struct QuantizeJob *quantize = &g_quantize.jobs[i];
+        if (!quantize->active) {
+            continue;
+        }
+
+        struct Material *mat = quantize->material;
+
+        undo_save_material_pixels(scene->undo, mat);
+
+        // Alpha is kept
+        for (int j=0; j<128*128; ++j) {
+            memcpy(mat->pixels + 4 * j, quantize->result_palette + 3 * quantize->indices[j], 3);
+        }
+
+        material_touch(mat, 0, 0, mat->width, mat->height);
+        material_upload(mat);
+
+        if (!quantize->cached && g_quant_cache != NULL) {
+            quantcache_put(g_quant_cache, &quantize->key, quantize->indices, quantize->result_palette,
+                    quantize->result_colors, 128, 128);
+        }
+
+        if (quantize->previous == NULL) {
+            quantize->previous = malloc(4 * 128 * 128);
+            memstat_add(MEMSTAT_QUANTIZER, 4 * 128 * 128);
+        }
+        memcpy(quantize->previous, mat->pixels, 4 * 128 * 128);
+        quantize->previous_material = mat;
+        quantize->result_valid = true;
+    }
+
+    scene_quantize_free();
+
+    journal_step(g_journal, scene->current_ship, "Quantize", false);
+    journal_step_tiles(g_journal, scene->undo->step);
+}
+
+// SHIFT cycles through the quantizers, e.g. to compare them while painting
+static void
+scene_export_preview_command(bool cycle)
+{
+    if (cycle) {
+        int next = g_preview_options.palette + 1;
+        if (next == QUANTIZE_PALETTE_COUNT) {
+            next = 0;
+            g_preview_options.dither = (g_preview_options.dither + 1) % QUANTIZE_DITHER_COUNT;
+        }
+        g_preview_options.palette = next;
+        g_export_preview = true;
+    } else {
+        g_export_preview = !g_export_preview;
+    }
+
+    for (int i=0; i<g_num_teams; ++i) {
+        if (!g_teams[i].loaded_model) {
+            continue;
+        }
+
+        struct Material *mat = g_teams[i].loaded_model->materials;
+        for (; mat != NULL; mat = mat->next) {
+            if (mat->index >= 0 && mat->index < BRUSH_MAX_MATERIALS) {
+                material_set_preview(mat, g_export_preview ? &g_preview_options : NULL);
+            }
+        }
+    }
+
+    if (g_export_preview) {
+        printf("Export preview: %s, %s\n", quantize_palette_name(g_preview_options.palette),
+                quantize_dither_name(g_preview_options.dither));
+    } else {
+        printf("Export preview: off\n");
+    }
+}
+
+static void
+scene_layers_command(struct Scene *scene, SDL_Keycode key)
+{
+    if (key == SDLK_n && scene_is_indexed(scene)) {
+        printf("Layers are not available in indexed mode\n");
+        return;
+    }
+
+    bool changed = false;
+    struct LayerStack *shown = NULL;
+
+    // All paintable materials of a ship share the same layer structure
+    struct Material *mat = SHIP_FROM_SCENE(scene)->materials;
+    for (; mat != NULL; mat = mat->next) {
+        if (mat->index < 0 || mat->index >= BRUSH_MAX_MATERIALS) {
+            continue;
+        }
+
+        if (key == SDLK_n) {
+            if (layers_add(mat) == NULL) {
+                printf("Cannot have more than %d layers\n", LAYERS_MAX);
+            }
+        }
+
+        struct LayerStack *stack = mat->layers;
+        if (stack == NULL) {
+            continue;
+        }
+
+        struct Layer *layer = &stack->layers[stack->active];
+        bool is_base = (stack->active == 0);
+
+        if (key == SDLK_LEFTBRACKET && stack->active > 0) {
+            stack->active--;
+        } else if (key == SDLK_RIGHTBRACKET && stack->active < stack->count - 1) {
+            stack->active++;
+        } else if (key == SDLK_v && !is_base) {
+            layer->visible = !layer->visible;
+            changed = true;
+        } else if (key == SDLK_b && !is_base) {
+            layer->blend = (layer->blend + 1) % LAYER_BLEND_COUNT;
+            changed = true;
+        } else if ((key == SDLK_MINUS || key == SDLK_EQUALS) && !is_base) {
+            int opacity = layer->opacity + ((key == SDLK_MINUS) ? -32 : 32);
+            layer->opacity = (opacity < 0) ? 0 : ((opacity > 255) ? 255 : opacity);
+            changed = true;
+        } else if (key == SDLK_DELETE && !is_base) {
+            undo_forget_surface(scene->undo, layer->pixels);
+            layers_remove(mat, stack->active);
+            changed = true;
+        }
+
+        if (changed) {
+            material_touch(mat, 0, 0, mat->width, mat->height);
+            material_upload(mat);
+        }
+
+        shown = stack;
+    }
+
+    if (shown != NULL) {
+        const struct Layer *layer = &shown->layers[shown->active];
+        printf("Layer %d/%d: %s, %d%% opacity%s\n", shown->active + 1, shown->count,
+                layers_blend_name(layer->blend), layer->opacity * 100 / 255, layer->visible ? "" : ", hidden");
+    }
+
+    if (changed) {
+        // Layer settings are not part of the undo history, snapshot the result
+        journal_checkpoint(g_journal, scene->current_ship);
+    }
+}
+
+static struct Material *
+journal_host_get_material(int team, int index, void *user_data)
+{
+    struct ShipModel *model = g_teams[team].loaded_model;
+    if (!model) {
+        return NULL;
+    }
+
+    struct Material *material = model->materials;
+    while (material != NULL) {
+        if (material->index == index) {
+            return material;
+        }
+
+        material = material->next;
+    }
+
+    return NULL;
+}
+
+static void
+scene_update_picking(struct Scene *scene, int w, int h)
+{
+    if (!scene->picking.inited ||
+            scene->picking.longitude != scene->longitude ||
+            scene->picking.latitude != scene->latitude ||
             scene->picking.zoom != scene->zoom ||
             scene->picking.dx != scene->dx ||
             scene->picking.dy != scene->dy ||
@@ -1947,6 +2667,7 @@ plot_here(struct Scene *scene, int w, int h, int x, int y)
         // The picking pixel buffer is out of date, need to redraw it
         if (!scene->picking.pixels) {
             scene->picking.pixels = malloc(sizeof(uint32_t) * w * h);
+            memstat_add(MEMSTAT_SCENE, sizeof(uint32_t) * w * h);
         }
 
         scene_render(scene, w, h, SDL_GetTicks() / 1000.f, true);
@@ -1960,11 +2681,146 @@ plot_here(struct Scene *scene, int w, int h, int x, int y)
         scene->picking.dy = scene->dy;
         scene->picking.ortho = scene->ortho;
     }
+}
+
+static bool
+picking_lookup(struct Scene *scene, int w, int h, int x, int y, int *material_index, int *u, int *v)
+{
+    if (x < 0 || x >= w || y < 0 || y >= h) {
+        // Out of bounds check
+        return false;
+    }
+
+    // Location of cursor relative to texture preview
+    int texture_x = x - texture_layout->rect.x;
+    int texture_y = y - texture_layout->rect.y;
+
+    // Vertical flip because of OpenGL bottom-left origin
+    y = h - 1 - y;
+
+    uint32_t pixel = scene->picking.pixels[y*w+x];
+
+    uint32_t r = (pixel & 0xFF);
+    uint32_t g = ((pixel >> 8) & 0xFF);
+    uint32_t b = ((pixel >> 16) & 0xFF);
+
+    uint32_t picking_material_index = r>>5;
+    uint32_t picking_u = g>>1;
+    uint32_t picking_v = b>>1;
+
+    // Do "picking" based on screen space coordinates texture preview
+    // (fixes incompatibilities with certain OpenGL drivers,
+    // seen for example with Windows 7 Generic GDI in a Boxes VM)
+    if (texture_x >= 0 && texture_x < texture_layout->rect.w &&
+            texture_y >= 0 && texture_y < texture_layout->rect.h) {
+        int part_w = 128;
+        int part_h = 128;
+        picking_material_index = 1 + (texture_y / part_h) * 2 + (texture_x / part_w);
+        picking_u = part_h - 1 - texture_y % part_h;
+        picking_v = texture_x % part_w;
+    }
+
+    if (picking_material_index > 0 && picking_material_index <= BRUSH_MAX_MATERIALS) {
+        *material_index = picking_material_index - 1;
+        *u = picking_u;
+        *v = picking_v;
+        return true;
+    }
+
+    return false;
+}
+
+static float
+picking_texel_scale(struct Scene *scene, int w, int h, int x, int y)
+{
+    // Texels per screen pixel, estimated from the picking buffer around (x, y)
+    const int step = 4;
+
+    int material, u, v;
+    if (!picking_lookup(scene, w, h, x, y, &material, &u, &v)) {
+        return 1.f;
+    }
+
+    float scale = 0.f;
+    const int offsets[2][2] = { { step, 0 }, { 0, step } };
+    for (int i=0; i<2; ++i) {
+        int nmaterial, nu, nv;
+        if (picking_lookup(scene, w, h, x + offsets[i][0], y + offsets[i][1], &nmaterial, &nu, &nv) && nmaterial == material) {
+            float du = nu - u;
+            float dv = nv - v;
+            scale = fmaxf(scale, sqrtf(du * du + dv * dv) / step);
+        }
+    }
+
+    return (scale > 0.f) ? scale : 1.f;
+}
+
+struct StrokeContext {
+    struct Scene *scene;
+    int w;
+    int h;
+    const struct BrushMask *mask;
+    struct Material *materials[BRUSH_MAX_MATERIALS];
+    struct UVMap *uvmap;
+    bool seams;
+    bool mirror;
+};
+
+static void
+plot_texel(struct StrokeContext *ctx, int material_index, int u, int v, float alpha, uint8_t alpha_int)
+{
+    struct Material *material = ctx->materials[material_index];
+    if (material) {
+        undo_save_material_texel(ctx->scene->undo, material, v, u);
+        brush_add(ctx->scene->brush, material, u, v, alpha_int);
+        if (material->layers == NULL && material->indices == NULL) {
+            journal_dab(g_journal, material_index, u, v, alpha);
+        }
+    }
+}
+
+static void
+plot_hit(struct StrokeContext *ctx, int material_index, int u, int v, float alpha, uint8_t alpha_int)
+{
+    plot_texel(ctx, material_index, u, v, alpha, alpha_int);
+
+    if (ctx->seams) {
+        uvmap_walk_hit(ctx->uvmap, material_index, v, u, alpha);
+    }
+}
+
+static void
+plot_bleed(int material_index, int x, int y, float alpha, void *user_data)
+{
+    struct StrokeContext *ctx = user_data;
+    plot_texel(ctx, material_index, y, x, alpha, brush_mask_alpha_int(ctx->mask, alpha));
+}
+
+static void
+plot_dab(float dab_x, float dab_y, void *user_data)
+{
+    struct StrokeContext *ctx = user_data;
+    struct Scene *scene = ctx->scene;
+    const struct BrushMask *mask = ctx->mask;
+    int w = ctx->w;
+    int h = ctx->h;
+
+    int x = floorf(dab_x + 0.5f);
+    int y = floorf(dab_y + 0.5f);
+    int grow = mask->grow;
+
+    if (ctx->seams) {
+        uvmap_walk_begin(ctx->uvmap);
+    }
 
-    float radius = get_pen_size_factor();
-    int grow = 2 * radius;
     for (int dx=-grow; dx<1+grow; ++dx) {
         for (int dy=-grow; dy<1+grow; ++dy) {
+            int mask_index = (dy + grow) * mask->size + (dx + grow);
+            if (mask->alpha[mask_index] > 1.f) {
+                // Outside of the pen radius
+                continue;
+            }
+
             int picking_x = x + dx;
             int picking_y = y + dy;
 
@@ -1975,63 +2831,175 @@ plot_here(struct Scene *scene, int w, int h, int x, int y)
                 continue;
             }
 
-            if (picking_x < 0 || picking_x >= w || picking_y < 0 || picking_y >= h) {
-                // Out of bounds check
-                continue;
+            int material_index, u, v;
+            if (picking_lookup(scene, w, h, picking_x, picking_y, &material_index, &u, &v)) {
+                plot_hit(ctx, material_index, u, v, mask->alpha[mask_index], mask->alpha_int[mask_index]);
+
+                if (ctx->mirror) {
+                    uint32_t link = uvmap_mirror(ctx->uvmap, material_index, v, u);
+                    if (link != UVMAP_NO_LINK && link != UVMAP_LINK(material_index, v + u * ctx->uvmap->materials[material_index].width)) {
+                        int mirror_index = UVMAP_LINK_MATERIAL(link);
+                        int texel = UVMAP_LINK_TEXEL(link);
+                        int width = ctx->uvmap->materials[mirror_index].width;
+                        plot_hit(ctx, mirror_index, texel / width, texel % width,
+                                mask->alpha[mask_index], mask->alpha_int[mask_index]);
+                    }
+                }
             }
+        }
+    }
+
+    if (ctx->seams) {
+        // Continue the dab on the other side of UV seams
+        float texel_radius = mask->radius * picking_texel_scale(scene, w, h, x, y);
+        uvmap_walk_bleed(ctx->uvmap, texel_radius, plot_bleed, ctx);
+    }
+}
 
-            // Location of cursor relative to texture preview
-            int texture_x = picking_x - texture_layout->rect.x;
-            int texture_y = picking_y - texture_layout->rect.y;
-
-            // Vertical flip because of OpenGL bottom-left origin
-            picking_y = h - 1 - picking_y;
-
-            uint32_t pixel = scene->picking.pixels[picking_y*w+picking_x];
-
-            uint32_t r = (pixel & 0xFF);
-            uint32_t g = ((pixel >> 8) & 0xFF);
-            uint32_t b = ((pixel >> 16) & 0xFF);
-            uint32_t a = ((pixel >> 24) & 0xFF);
-
-            uint32_t picking_material_index = r>>5;
-            uint32_t picking_u = g>>1;
-            uint32_t picking_v = b>>1;
-
-            // Do "picking" based on screen space coordinates texture preview
-            // (fixes incompatibilities with certain OpenGL drivers,
-            // seen for example with Windows 7 Generic GDI in a Boxes VM)
-            if (texture_x >= 0 && texture_x < texture_layout->rect.w &&
-                    texture_y >= 0 && texture_y < texture_layout->rect.h) {
-                int part_w = 128;
-                int part_h = 128;
-                picking_material_index = 1 + (texture_y / part_h) * 2 + (texture_x / part_w);
-                picking_u = part_h - 1 - texture_y % part_h;
-                picking_v = texture_x % part_w;
+static void
+scene_recolor_command(struct Scene *scene, SDL_Keycode key, bool reverse, int w, int h)
+{
+    uint32_t replace_from = 0;
+
+    if (key == SDLK_c) {
+        struct Material *mat = SHIP_FROM_SCENE(scene)->materials;
+        for (; mat != NULL; mat = mat->next) {
+            if (mat->index >= 0 && mat->index < BRUSH_MAX_MATERIALS &&
+                    !recolor_palette_of(mat, &g_palette_clipboard[mat->index])) {
+                printf("Image %d has more than %d colors, quantize first\n", mat->index, INDEXED_COLORS);
+                g_palette_clipboard_valid = false;
+                return;
             }
+        }
 
-            if (picking_material_index > 0 && picking_material_index < 5) {
-                picking_material_index--;
-                struct Material *material = SHIP_FROM_SCENE(scene)->materials;
-                while (material != NULL) {
-                    if (material->index == picking_material_index) {
-                        break;
-                    }
+        printf("Copied palettes\n");
+        g_palette_clipboard_valid = true;
+        return;
+    } else if (key == SDLK_t && !g_palette_clipboard_valid) {
+        printf("No palettes copied yet\n");
+        return;
+    }
 
-                    material = material->next;
-                }
+    // The colors are changed in place, layers would have to be flattened first
+    if (scene_has_layers(scene)) {
+        printf("Flatten layers before changing colors\n");
+        return;
+    }
 
-                if (material && material->index != -1) {
-                    float alpha = sqrtf((((float)dx*(float)dx) + ((float)dy*(float)dy))) / radius;
-                    if (alpha <= 1.f) {
-                        undo_save_material_pixels(scene->undo, material);
-                        material_plot(material, picking_u, picking_v, alpha);
-                    }
-                }
+    if (key == SDLK_r) {
+        int material_index, u, v;
+        scene_update_picking(scene, w, h);
+        if (!picking_lookup(scene, w, h, g_mouse.x, g_mouse.y, &material_index, &u, &v)) {
+            return;
+        }
+
+        struct Material *mat = SHIP_FROM_SCENE(scene)->materials;
+        while (mat != NULL && mat->index != material_index) {
+            mat = mat->next;
+        }
+        if (mat == NULL) {
+            return;
+        }
+
+        replace_from = material_rgba(mat)[v + u * mat->width];
+    }
+
+    const char *label = (key == SDLK_t) ? "Swap palettes" : ((key == SDLK_r) ? "Replace color" : "Adjust colors");
+
+    float hue = 0.f;
+    float saturation = 1.f;
+    float brightness = 1.f;
+    if (key == SDLK_h) {
+        hue = reverse ? -RECOLOR_HUE_STEP : RECOLOR_HUE_STEP;
+    } else if (key == SDLK_j) {
+        saturation = reverse ? 1.f / RECOLOR_FACTOR_STEP : RECOLOR_FACTOR_STEP;
+    } else if (key == SDLK_k) {
+        brightness = reverse ? 1.f / RECOLOR_FACTOR_STEP : RECOLOR_FACTOR_STEP;
+    }
+
+    struct RecolorMatrix matrix;
+    recolor_hsb_matrix(&matrix, hue, saturation, brightness);
+
+    undo_push(scene->undo, label);
+
+    struct Material *mat = SHIP_FROM_SCENE(scene)->materials;
+    for (; mat != NULL; mat = mat->next) {
+        if (mat->index < 0 || mat->index >= BRUSH_MAX_MATERIALS) {
+            continue;
+        }
+
+        // Indexed images only need their 16 palette entries changed
+        if (mat->indices != NULL) {
+            undo_save_material_palette(scene->undo, mat, INDEXED_COLORS);
+        } else {
+            undo_save_material_pixels(scene->undo, mat);
+        }
+
+        if (key == SDLK_t) {
+            if (!recolor_material_swap(mat, &g_palette_clipboard[mat->index])) {
+                printf("Image %d has more than %d colors, quantize first\n", mat->index, INDEXED_COLORS);
             }
+        } else if (key == SDLK_r) {
+            recolor_material_replace(mat, replace_from, 0xFF000000 | g_current_color);
+        } else {
+            recolor_material_hsb(mat, &matrix);
+        }
+
+        if (mat->pixels_dirty) {
+            material_upload(mat);
+            mat->pixels_dirty = false;
+        }
+    }
+
+    journal_step(g_journal, scene->current_ship, label, false);
+    journal_step_tiles(g_journal, scene->undo->step);
+}
+
+static void
+scene_flush_stroke(struct Scene *scene, int w, int h)
+{
+    if (!stroke_pending(&scene->stroke)) {
+        return;
+    }
+
+    TRACE_BEGIN("stroke");
+
+    scene_update_picking(scene, w, h);
+
+    struct StrokeContext ctx = { scene, w, h, NULL, { NULL }, NULL, false, false };
+    ctx.mask = brush_mask(scene->brush, get_pen_size_factor(), get_pen_alpha_factor());
+
+    if (g_seam_painting || g_mirror_painting) {
+        struct ShipModel *model = SHIP_FROM_SCENE(scene);
+        if (!model->uvmap) {
+            model->uvmap = uvmap_build(model);
+        }
+        ctx.uvmap = model->uvmap;
+        ctx.seams = g_seam_painting;
+        ctx.mirror = g_mirror_painting;
+    }
+
+    // Look up materials by index once instead of for every texel
+    struct Material *material = SHIP_FROM_SCENE(scene)->materials;
+    while (material != NULL) {
+        if (material->index >= 0 && material->index < BRUSH_MAX_MATERIALS) {
+            ctx.materials[material->index] = material;
         }
+
+        material = material->next;
     }
 
+    // All dabs along the path are blended as one batch, which gives
+    // the same result as blending them one after another
+    brush_begin(scene->brush, g_current_color);
+    journal_dabs_begin(g_journal, g_current_color, ctx.mask->alpha_factor);
+
+    stroke_flush(&scene->stroke, g_stroke_spacing * ctx.mask->radius, plot_dab, &ctx);
+
+    brush_apply(scene->brush);
+    journal_dabs_end(g_journal);
+
+    // Upload each modified material only once
     struct Material *cur = SHIP_FROM_SCENE(scene)->materials;
     while (cur != NULL) {
         if (cur->pixels_dirty) {
@@ -2041,6 +3009,8 @@ plot_here(struct Scene *scene, int w, int h, int x, int y)
 
         cur = cur->next;
     }
+
+    TRACE_END("stroke");
 }
 
 static void
@@ -2158,6 +3128,7 @@ scene_render_uv_map(struct Scene *scene, int w, int h)
 
             // We could use glCopyTexImage2D here, but we need to read the pixels anyway
             glReadPixels(0, 0, mat->width, mat->height, GL_RGBA, GL_UNSIGNED_BYTE, mat->pixels);
+            material_touch(mat, 0, 0, mat->width, mat->height);
             material_upload(mat);
 
             glDisable(GL_SCISSOR_TEST);
@@ -2171,6 +3142,10 @@ scene_render_uv_map(struct Scene *scene, int w, int h)
 bool
 scene_load_skin(struct Scene *scene, const char *filename)
 {
+    // A loaded skin replaces everything, including layers
+    scene_flatten_layers(scene);
+    scene_set_indexed(scene, false);
+
     if (load_png(scene, filename)) {
         return true;
     } else if (load_dat(scene, filename)) {
@@ -2202,7 +3177,7 @@ export_savegame(struct Scene *scene, int w, int h, const char *out_dir)
     struct Material *cur = SHIP_FROM_SCENE(scene)->materials;
     while (cur != NULL) {
         if (cur->index != -1) {
-            if (!encode_image(buf, cur)) {
+            if (!encode_image(buf, sizeof(buf), cur)) {
                 result = false;
                 break;
             }
@@ -2227,9 +3202,23 @@ export_savegame(struct Scene *scene, int w, int h, const char *out_dir)
 
 int main(int argc, char *argv[])
 {
+    // Tracing is set up before anything else, so that startup is covered
+    if (!trace_init_from_env()) {
+        for (int i=1; i<argc-1; ++i) {
+            if (strcmp(argv[i], "--trace") == 0) {
+                trace_init(argv[i+1]);
+                break;
+            }
+        }
+    }
+
+    TRACE_BEGIN("startup");
+
     SDL_Init(SDL_INIT_VIDEO);
     SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
 
+    g_workers = workers_new(0);
+
     SDL_Cursor *arrow = SDL_CreateSystemCursor(SDL_SYSTEM_CURSOR_ARROW);
     SDL_Cursor *hand = SDL_CreateSystemCursor(SDL_SYSTEM_CURSOR_HAND);
     SDL_Cursor *crosshair = SDL_CreateSystemCursor(SDL_SYSTEM_CURSOR_CROSSHAIR);
@@ -2253,6 +3242,7 @@ int main(int argc, char *argv[])
 
     size_t font_len;
     char *font = read_file("data/editor/pulse.fontaine", &font_len);
+    memstat_add(MEMSTAT_ASSETS, font_len);
     struct FontaineFontReader *reader = fontaine_font_reader_new(font, font_len);
 
     g_font_gui = in_memory_font_new_name(reader, "WipeoutPulseGUI", true);
@@ -2263,7 +3253,10 @@ int main(int argc, char *argv[])
     struct Scene *scene = malloc(sizeof(struct Scene));
     g_scene = scene;
     memset(scene, 0, sizeof(*scene));
-    scene->undo = calloc(1, sizeof(struct Undo));
+    scene->undo = undo_new(UNDO_DEFAULT_BUDGET_MIB * 1024 * 1024, true);
+    // A single step can exceed it, the memory stats then flag the history
+    memstat_set_budget(MEMSTAT_UNDO, scene->undo->budget);
+    scene->brush = brush_new();
 
     scene->mode = MODE_EDITOR;
 
@@ -2271,6 +3264,8 @@ int main(int argc, char *argv[])
     glGenTextures(1, &scene->magnifier.texture);
     glBindTexture(GL_TEXTURE_2D, scene->magnifier.texture);
     scene->magnifier.pixels = calloc(scene->magnifier.size * scene->magnifier.size, sizeof(uint32_t));
+    memstat_add(MEMSTAT_SCENE, sizeof(uint32_t) * scene->magnifier.size * scene->magnifier.size);
+    memstat_add(MEMSTAT_GL_TEXTURES, sizeof(uint32_t) * scene->magnifier.size * scene->magnifier.size);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, scene->magnifier.size, scene->magnifier.size, 0, GL_RGBA, GL_UNSIGNED_BYTE, scene->magnifier.pixels);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -2289,6 +3284,7 @@ int main(int argc, char *argv[])
         sprintf(tmp, "data/ships/%s/%s.shm", g_teams[i].slug, g_teams[i].slug);
         g_teams[i].loaded_model = parse_shm(tmp);
         instantiate_materials(g_teams[i].loaded_model);
+        coverage_build(g_teams[i].loaded_model);
 
         scene->current_ship = i;
 
@@ -2306,6 +3302,8 @@ int main(int argc, char *argv[])
 
     scene->current_ship = 0;
 
+    TRACE_END("startup");
+
     struct FPS fps;
     fps_init(&fps, SDL_GetTicks());
 
@@ -2317,6 +3315,8 @@ int main(int argc, char *argv[])
         const char *export_dir = NULL;
         const char *msg = NULL;
         bool want_version = false;
+        bool want_memstats = false;
+        bool want_quantize = false;
         while (argi < argc) {
             if (strcmp(argv[argi], "-h") == 0 || strcmp(argv[argi], "--help") == 0) {
                 want_usage = true;
@@ -2332,6 +3332,51 @@ int main(int argc, char *argv[])
                     break;
                 }
                 want_slot = atoi(argv[argi]);
+            } else if (strcmp(argv[argi], "--memstats") == 0) {
+                want_memstats = true;
+            } else if (strcmp(argv[argi], "--stroke-spacing") == 0) {
+                ++argi;
+                if (argi >= argc) {
+                    msg = "Missing argument: FACTOR";
+                    want_usage = true;
+                    break;
+                }
+                g_stroke_spacing = atof(argv[argi]);
+            } else if (strcmp(argv[argi], "--undo-budget") == 0) {
+                ++argi;
+                if (argi >= argc) {
+                    msg = "Missing argument: MIB";
+                    want_usage = true;
+                    break;
+                }
+                scene->undo->budget = (size_t)atoi(argv[argi]) * 1024 * 1024;
+                memstat_set_budget(MEMSTAT_UNDO, scene->undo->budget);
+            } else if (strcmp(argv[argi], "--trace") == 0) {
+                // already handled at startup
+                ++argi;
+                if (argi >= argc) {
+                    msg = "Missing argument: TRACEFILE";
+                    want_usage = true;
+                    break;
+                }
+            } else if (strcmp(argv[argi], "--quant-cache") == 0) {
+                ++argi;
+                if (argi >= argc) {
+                    msg = "Missing argument: CACHEFILE";
+                    want_usage = true;
+                    break;
+                }
+                g_quant_cache_filename = argv[argi];
+            } else if (strcmp(argv[argi], "--quant-cache-budget") == 0) {
+                ++argi;
+                if (argi >= argc) {
+                    msg = "Missing argument: MIB";
+                    want_usage = true;
+                    break;
+                }
+                g_quant_cache_budget = (size_t)atoi(argv[argi]) * 1024 * 1024;
+            } else if (strcmp(argv[argi], "--quantize") == 0) {
+                want_quantize = true;
             } else if (strcmp(argv[argi], "--export") == 0) {
                 ++argi;
                 if (argi >= argc) {
@@ -2357,13 +3402,34 @@ int main(int argc, char *argv[])
             printf("Save slot: %d\n", scene->save_slot);
         }
 
+        if (want_memstats) {
+            printf("\nMemory usage after loading:\n");
+            memstat_dump(stdout);
+            printf("\n");
+
+            // dump again at exit, to include everything that happened in between
+            g_dump_memstats = true;
+        }
+
         if (export_dir) {
             printf("Exporting to: %s\n", export_dir);
 
             g_batch_mode = true;
 
-            scene_render(scene, w, h, 0.f, false);
-            export_savegame(scene, w, h, export_dir);
+            if (want_quantize) {
+                TRACE_SCOPE("quantize") {
+                    scene_quantize_start(scene);
+                    while (scene_quantize_busy()) {
+                        SDL_Delay(10);
+                        scene_quantize_finish(scene);
+                    }
+                }
+            }
+
+            TRACE_SCOPE("export") {
+                scene_render(scene, w, h, 0.f, false);
+                export_savegame(scene, w, h, export_dir);
+            }
 
             running = false;
         }
@@ -2378,11 +3444,18 @@ int main(int argc, char *argv[])
         }
 
         if (want_usage) {
-            printf("\nUsage: %s [PNGFILE] [--slot SLOT] [--export OUTDIR] [--version]\n\n"
-                   " PNGFILE ........... Filename of a ship skin (PNG, DAT or 16034453 file) to load\n"
-                   " --slot SLOT ....... Set the savegame slot (XXXX in UCES00465DTEAMSKINXXXX)\n"
-                   " --export OUTDIR ... Batch mode: Export a savegame to the output folder\n"
-                   " --version ......... Show version, user guide and copyright information\n"
+            printf("\nUsage: %s [PNGFILE] [--slot SLOT] [--export OUTDIR] [--quantize] [--quant-cache CACHEFILE] [--quant-cache-budget MIB] [--trace TRACEFILE] [--memstats] [--undo-budget MIB] [--stroke-spacing FACTOR] [--version]\n\n"
+                   " PNGFILE ............ Filename of a ship skin (PNG, DAT or 16034453 file) to load\n"
+                   " --slot SLOT ........ Set the savegame slot (XXXX in UCES00465DTEAMSKINXXXX)\n"
+                   " --export OUTDIR .... Batch mode: Export a savegame to the output folder\n"
+                   " --quantize ......... Batch mode: Quantize the images before exporting\n"
+                   " --quant-cache CACHEFILE  Keep quantization results in CACHEFILE for later sessions\n"
+                   " --quant-cache-budget MIB  Limit memory used by cached quantization results (default: 16, 0 = no cache)\n"
+                   " --trace TRACEFILE .. Write Chrome trace events (JSON) to TRACEFILE (or set SHIPEDIT_TRACE)\n"
+                   " --memstats ......... Print memory usage per category after loading and at exit\n"
+                   " --undo-budget MIB .. Limit memory used by the undo history (default: 64, 0 = unlimited)\n"
+                   " --stroke-spacing FACTOR  Distance between dabs relative to the pen radius (default: 0.25)\n"
+                   " --version .......... Show version, user guide and copyright information\n"
                    "\n", argv[0]);
 
             if (msg) {
@@ -2392,13 +3465,50 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (running) {
+        struct JournalHost journal_host = { g_num_teams, journal_host_get_material, NULL };
+        g_journal = journal_new(JOURNAL_FILENAME, &journal_host);
+
+        if (journal_has_recovery(g_journal) && nativeui_ask("Recover unsaved changes?",
+                    "shipedit was not closed properly last time. Restore the changes from the previous session?")) {
+            int team = scene->current_ship;
+            if (journal_recover(g_journal, scene->undo, &team)) {
+                scene->current_ship = team;
+
+                for (int i=0; i<g_num_teams; ++i) {
+                    struct Material *mat = g_teams[i].loaded_model ? g_teams[i].loaded_model->materials : NULL;
+                    while (mat != NULL) {
+                        material_upload(mat);
+                        mat = mat->next;
+                    }
+                }
+            }
+        }
+
+        journal_start(g_journal, scene->current_ship);
+    }
+
     while (running) {
+        TRACE_BEGIN("frame");
+
         SDL_Event e;
         while (SDL_PollEvent(&e)) {
+            if (e.type != SDL_MOUSEMOTION) {
+                // Finish collected dabs before handling anything that could depend on them
+                scene_flush_stroke(scene, w, h);
+            }
+
             if (e.type == SDL_QUIT) {
                 running = false;
                 break;
             }
+            if (scene_quantize_busy()) {
+                // Nothing can be edited until the results are applied
+                if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_ESCAPE) {
+                    scene_quantize_cancel();
+                }
+                continue;
+            }
             if (e.type == SDL_KEYDOWN) {
                 if (e.key.keysym.sym == SDLK_q) {
                     running = false;
@@ -2407,6 +3517,51 @@ int main(int argc, char *argv[])
                 if (e.key.keysym.sym == SDLK_m) {
                     scene->magnifier.want = !scene->magnifier.want;
                 }
+                if (e.key.keysym.sym == SDLK_i) {
+                    g_show_memstats = !g_show_memstats;
+                }
+                if (e.key.keysym.sym == SDLK_s) {
+                    g_seam_painting = !g_seam_painting;
+                    printf("Painting across UV seams: %s\n", g_seam_painting ? "on" : "off");
+                }
+                if (e.key.keysym.sym == SDLK_x) {
+                    g_mirror_painting = !g_mirror_painting;
+                    printf("Mirror painting: %s\n", g_mirror_painting ? "on" : "off");
+                }
+                if (e.key.keysym.sym == SDLK_n || e.key.keysym.sym == SDLK_LEFTBRACKET || e.key.keysym.sym == SDLK_RIGHTBRACKET ||
+                        e.key.keysym.sym == SDLK_v || e.key.keysym.sym == SDLK_b || e.key.keysym.sym == SDLK_MINUS ||
+                        e.key.keysym.sym == SDLK_EQUALS || e.key.keysym.sym == SDLK_DELETE) {
+                    scene_layers_command(scene, e.key.keysym.sym);
+                }
+                // One undo step per key press (held keys repeat), and only on the ship being edited
+                if ((e.key.keysym.sym == SDLK_h || e.key.keysym.sym == SDLK_j || e.key.keysym.sym == SDLK_k ||
+                        e.key.keysym.sym == SDLK_r || e.key.keysym.sym == SDLK_c || e.key.keysym.sym == SDLK_t) &&
+                        !e.key.repeat && scene->mode == MODE_EDITOR) {
+                    scene_recolor_command(scene, e.key.keysym.sym, (e.key.keysym.mod & KMOD_SHIFT) != 0, w, h);
+                }
+                if (e.key.keysym.sym == SDLK_p && scene_can_set_indexed(scene, !scene_is_indexed(scene))) {
+                    const char *label = scene_is_indexed(scene) ? "Indexed mode off" : "Indexed mode on";
+                    undo_push(scene->undo, label);
+                    scene_set_indexed(scene, !scene_is_indexed(scene));
+                    journal_step(g_journal, scene->current_ship, label, false);
+                    journal_step_tiles(g_journal, scene->undo->step);
+                }
+                if (e.key.keysym.sym == SDLK_e) {
+                    scene_export_preview_command((e.key.keysym.mod & KMOD_SHIFT) != 0);
+                }
+                if (e.key.keysym.sym == SDLK_f && scene_has_layers(scene)) {
+                    undo_push(scene->undo, "Flatten layers");
+                    scene_flatten_layers(scene);
+                    journal_step(g_journal, scene->current_ship, "Flatten layers", false);
+                    journal_step_tiles(g_journal, scene->undo->step);
+                }
+                if ((e.key.keysym.mod & KMOD_CTRL) != 0) {
+                    if (e.key.keysym.sym == SDLK_z) {
+                        scene_undo(scene, false);
+                    } else if (e.key.keysym.sym == SDLK_y) {
+                        scene_undo(scene, true);
+                    }
+                }
             }
             if (e.type == SDL_MOUSEBUTTONDOWN) {
                 g_mouse.down_location.x = g_mouse.x = e.button.x;
@@ -2448,6 +3603,7 @@ int main(int argc, char *argv[])
                                         g_mouse.panning = true;
                                     } else if (e.button.button == SDL_BUTTON_LEFT) {
                                         undo_push(scene->undo, "Drawing");
+                                        journal_step(g_journal, scene->current_ship, "Drawing", true);
                                         g_mouse.drawing = true;
                                         drawing_on_item = item;
 
@@ -2458,7 +3614,7 @@ int main(int argc, char *argv[])
                                             mat = mat->next;
                                         }
 
-                                        plot_here(scene, w, h, e.button.x, e.button.y);
+                                        stroke_begin(&scene->stroke, e.button.x, e.button.y);
                                     }
                                 }
                             }
@@ -2507,6 +3663,8 @@ int main(int argc, char *argv[])
 
                                 // start new undo stack
                                 undo_clear(scene->undo);
+                                journal_clear(g_journal);
+                                journal_materials(g_journal, scene->current_ship);
                             }
                             if (ITEM_ID(item) == ITEM_OPEN_PNG) {
                                 char *filename = nativeui_open_file();
@@ -2517,6 +3675,9 @@ int main(int argc, char *argv[])
                                         nativeui_show_error("Invalid file", "File must be a 256x256 PNG or a DAT file.");
                                     }
 
+                                    journal_step(g_journal, scene->current_ship, "Load image file", false);
+                                    journal_step_tiles(g_journal, scene->undo->step);
+
                                     free(filename);
                                 }
                             }
@@ -2586,7 +3747,7 @@ int main(int argc, char *argv[])
                                         }
 
                                         printf("material: %s index=%d\n", mat->name, index);
-                                        uint32_t *mat_pixels = (uint32_t *)mat->pixels;
+                                        const uint32_t *mat_pixels = material_rgba(mat);
 
                                         int xoff = (index % 2 == 0) ? 0 : 128;
                                         int yoff = (index / 2 == 0) ? 0 : 128;
@@ -2614,11 +3775,18 @@ int main(int argc, char *argv[])
                                 scene->mode = MODE_ABOUT;
                             }
                             if (ITEM_ID(item) == ITEM_UNDO) {
-                                undo_undo(scene->undo);
+                                scene_undo(scene, false);
+                            }
+                            if (ITEM_ID(item) == ITEM_REDO) {
+                                scene_undo(scene, true);
                             }
                             if (ITEM_ID(item) == ITEM_RENDER_UV_MAP) {
                                 undo_push(scene->undo, "Render UV Map");
+                                scene_flatten_layers(scene);
+                                scene_set_indexed(scene, false);
                                 scene_render_uv_map(scene, w, h);
+                                journal_step(g_journal, scene->current_ship, "Render UV Map", false);
+                                journal_step_tiles(g_journal, scene->undo->step);
                             }
                             if (ITEM_ID(item) == ITEM_RESET_VIEW) {
                                 scene_reset_view(scene);
@@ -2631,66 +3799,8 @@ int main(int argc, char *argv[])
                                 }
                             }
                             if (ITEM_ID(item) == ITEM_QUANTIZE_COLORS) {
-                                undo_push(scene->undo, "Quantize");
-                                struct Material *mat = SHIP_FROM_SCENE(scene)->materials;
-
-                                int done = 0;
-                                int count = 3;
-                                while (mat != NULL) {
-                                    if (mat->index == -1) {
-                                        mat = mat->next;
-                                        continue;
-                                    }
-
-                                    ++done;
-
-                                    g_mouse.tooltip = NULL;
-                                    scene_render(scene, w, h, SDL_GetTicks() / 1000.f, false);
-
-                                    glEnable(GL_BLEND);
-                                    glColor4f(0.f, 0.f, 0.f, 0.9f);
-                                    draw_rect(0, 0, w, h);
-
-                                    glColor4f(1.f, 1.f, 1.f, 1.f);
-                                    char msg[32];
-                                    sprintf(msg, "Please wait (%d/%d)...", done, count);
-                                    draw_with_font_xy(g_font_heading, 13, 10, msg);
-                                    draw_with_font_xy(g_font_gui, 13, 30, "Sometimes quantization fails (known bug), just hit 'UNDO' and then retry");
-                                    SDL_GL_SwapWindow(window);
-
-                                    undo_save_material_pixels(scene->undo, mat);
-
-                                    printf("Quantizing: image %d\n", mat->index);
-
-                                    char *buf = malloc(3 * 128 * 128);
-
-                                    for (int y=0; y<128; ++y) {
-                                        for (int x=0; x<128; ++x) {
-                                            buf[3 * (y*128+x) + 0] = mat->pixels[4 * (y*128+x) + 0];
-                                            buf[3 * (y*128+x) + 1] = mat->pixels[4 * (y*128+x) + 1];
-                                            buf[3 * (y*128+x) + 2] = mat->pixels[4 * (y*128+x) + 2];
-                                        }
-                                    }
-
-                                    int res = spatial_color_quant_inplace(128, 128, buf, 16);
-                                    if (res != 0) {
-                                        fail("could not quantize image");
-                                    }
-
-                                    for (int y=0; y<128; ++y) {
-                                        for (int x=0; x<128; ++x) {
-                                            mat->pixels[4 * (y*128+x) + 0] = buf[3 * (y*128+x) + 0];
-                                            mat->pixels[4 * (y*128+x) + 1] = buf[3 * (y*128+x) + 1];
-                                            mat->pixels[4 * (y*128+x) + 2] = buf[3 * (y*128+x) + 2];
-                                        }
-                                    }
-
-                                    free(buf);
-
-                                    material_upload(mat);
-
-                                    mat = mat->next;
-                                }
+                                g_mouse.tooltip = NULL;
+                                scene_quantize_start(scene);
                             }
                             if (ITEM_ID(item) == ITEM_AUTO_MOVE) {
                                 scene->longitude_delta_target = (scene->longitude_delta_target == 0.f) ? 0.03f : 0.f;
@@ -2772,14 +3882,20 @@ int main(int argc, char *argv[])
                     scene->target_dx += f * (e.motion.x - g_mouse.x);
                     scene->target_dy -= f * (e.motion.y - g_mouse.y);
                 } else if (g_mouse.drawing) {
-                    plot_here(scene, w, h, e.motion.x, e.motion.y);
+                    // Drawn once all pending events have been processed
+                    stroke_move(&scene->stroke, e.motion.x, e.motion.y);
                 }
 
                 g_mouse.x = e.motion.x;
                 g_mouse.y = e.motion.y;
             }
             if (e.type == SDL_MOUSEBUTTONUP) {
+                if (g_mouse.drawing && (scene_has_layers(scene) || scene_is_indexed(scene))) {
+                    // Dabs on layers and indices are not journaled, store the resulting tiles
+                    journal_step_tiles(g_journal, scene->undo->step);
+                }
                 g_mouse.drawing = false;
+                stroke_end(&scene->stroke);
                 if (g_mouse.dragging) {
                     g_mouse.dragging = false;
                     scene->longitude_delta = scene->longitude_delta_target = 0;
@@ -2791,6 +3907,9 @@ int main(int argc, char *argv[])
             }
         }
 
+        scene_flush_stroke(scene, w, h);
+        scene_quantize_finish(scene);
+
         scene_render(scene, w, h, SDL_GetTicks() / 1000.f, false);
 
         if (!g_mouse.dragging) {
@@ -2808,10 +3927,68 @@ int main(int argc, char *argv[])
         scene->time += 0.1f;
 
         SDL_GL_SwapWindow(window);
+
+        memstat_trace_counters();
+
+        if (!g_mouse.drawing) {
+            journal_tick(g_journal, scene->current_ship);
+        }
+
+        TRACE_END("frame");
+
         SDL_Delay(fps_frame(&fps, SDL_GetTicks()));
     }
 
+    if (g_dump_memstats) {
+        printf("\nMemory usage at exit:\n");
+        memstat_dump(stdout);
+        printf("\n");
+    }
+
+    scene_quantize_cancel();
+    scene_quantize_release();
+    workers_free(g_workers);
+
+    if (g_quant_cache) {
+        if (g_dump_memstats) {
+            struct QuantCacheStats stats;
+            quantcache_stats(g_quant_cache, &stats);
+            printf("Quantization cache: %zu hits, %zu misses, %zu stored, %zu evicted, %zu entries (%zu KiB)\n\n",
+                    stats.hits, stats.misses, stats.stores, stats.evictions, stats.entries, stats.bytes / 1024);
+        }
+
+        quantcache_free(g_quant_cache);
+    }
+
     free(scene->picking.pixels);
+    undo_free(scene->undo);
+    brush_free(scene->brush);
+    stroke_free(&scene->stroke);
+
+    for (int i=0; i<g_num_teams; ++i) {
+        if (g_teams[i].loaded_model) {
+            uvmap_free(g_teams[i].loaded_model->uvmap);
+
+            struct Material *mat = g_teams[i].loaded_model->materials;
+            for (; mat != NULL; mat = mat->next) {
+                colorhist_free(mat->colors);
+                mat->colors = NULL;
+
+                if (mat->preview != NULL) {
+                    free(mat->preview);
+                    memstat_sub(MEMSTAT_MATERIALS, sizeof(uint32_t) * mat->width * mat->height);
+                    mat->preview = NULL;
+                }
+            }
+
+            coverage_free(g_teams[i].loaded_model);
+        }
+    }
+
+    if (g_journal) {
+        // Clean exit, nothing to recover next time
+        journal_free(g_journal, true);
+    }
 
     SDL_GL_DeleteContext(ctx);
 
@@ -27,6 +27,8 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
+#include "quantize.h"
+
 struct ShipModelHeader {
     uint32_t n_materials;
     uint32_t n_objects;
@@ -57,6 +59,9 @@ struct Vertex {
     float v;
 };
 
+struct LayerStack;
+struct ColorHistogram;
+
 struct Material {
     struct Material *next;
 
@@ -68,6 +73,7 @@ struct Material {
     bool is_other;
 
     // runtime stuff
+    // RGBA, NULL in indexed mode (see material_rgba())
     char *pixels;
     int width;
     int height;
@@ -75,11 +81,33 @@ struct Material {
     bool pixels_dirty;
     uint8_t *pixels_drawn;
 
+    // texels mapped by the model, NULL = all (see coverage.c)
+    uint8_t *coverage;
+
+    // layer stack, NULL = single buffer; pixels then holds the composite (see layers.c)
+    struct LayerStack *layers;
+
+    // palette indices in indexed mode (two per byte), NULL = RGBA editing (see indexed.c)
+    uint8_t *indices;
+
+    // distinct colors, created on first upload, NULL in indexed mode (see colorhist.c)
+    struct ColorHistogram *colors;
+
+    // export preview shown instead of the pixels, NULL = off (see material_set_preview())
+    uint32_t *preview;
+    struct QuantizeOptions preview_options;
+
     uint32_t *palette;
+    // real entries of palette in indexed mode (16 if it was loaded), the others are padding
+    int palette_count;
     uint32_t current_color;
 
     uint32_t texture;
     uint32_t picker_texture;
+
+    // undo operation of the current step (see undo.c)
+    struct UndoOperation *undo_op;
+    uint32_t undo_serial;
 };
 
 struct ObjectTemp;
@@ -97,11 +125,15 @@ struct Object {
 };
 
 struct ShipModelTemp;
+struct UVMap;
 
 struct ShipModel {
     struct Material *materials;
     struct Object *objects;
 
+    // texel adjacency, built on demand (see uvmap.c)
+    struct UVMap *uvmap;
+
     struct ShipModelTemp *temp;
 };
 
@@ -0,0 +1,129 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "stroke.h"
+
+#include <math.h>
+#include <string.h>
+
+static void
+stroke_add_point(struct Stroke *stroke, float x, float y)
+{
+    if (stroke->count == stroke->capacity) {
+        stroke->capacity = stroke->capacity ? 2 * stroke->capacity : 64;
+        stroke->points = realloc(stroke->points, sizeof(struct StrokePoint) * stroke->capacity);
+    }
+
+    stroke->points[stroke->count].x = x;
+    stroke->points[stroke->count].y = y;
+    ++stroke->count;
+}
+
+void
+stroke_begin(struct Stroke *stroke, float x, float y)
+{
+    stroke->active = true;
+    stroke->has_last = false;
+    stroke->distance = 0.f;
+    stroke->count = 0;
+
+    stroke_add_point(stroke, x, y);
+}
+
+void
+stroke_move(struct Stroke *stroke, float x, float y)
+{
+    if (stroke->active) {
+        stroke_add_point(stroke, x, y);
+    }
+}
+
+void
+stroke_end(struct Stroke *stroke)
+{
+    stroke->active = false;
+}
+
+bool
+stroke_pending(const struct Stroke *stroke)
+{
+    return stroke->count > 0;
+}
+
+size_t
+stroke_flush(struct Stroke *stroke, float spacing, void (*dab)(float x, float y, void *user_data), void *user_data)
+{
+    size_t dabs = 0;
+
+    if (spacing < 1.f) {
+        spacing = 1.f;
+    }
+
+    for (size_t i=0; i<stroke->count; ++i) {
+        struct StrokePoint p = stroke->points[i];
+
+        if (!stroke->has_last) {
+            // First point of the stroke always gets a dab
+            dab(p.x, p.y, user_data);
+            ++dabs;
+
+            stroke->last = p;
+            stroke->has_last = true;
+            stroke->distance = 0.f;
+            continue;
+        }
+
+        float dx = p.x - stroke->last.x;
+        float dy = p.y - stroke->last.y;
+        float length = sqrtf(dx * dx + dy * dy);
+        if (length == 0.f) {
+            continue;
+        }
+
+        // Position of the next dab along this segment
+        float t = spacing - stroke->distance;
+        while (t <= length) {
+            dab(stroke->last.x + dx * t / length, stroke->last.y + dy * t / length, user_data);
+            ++dabs;
+            t += spacing;
+        }
+
+        stroke->distance = length - (t - spacing);
+        stroke->last = p;
+    }
+
+    stroke->count = 0;
+
+    if (!stroke->active) {
+        stroke->has_last = false;
+    }
+
+    return dabs;
+}
+
+void
+stroke_free(struct Stroke *stroke)
+{
+    free(stroke->points);
+    memset(stroke, 0, sizeof(*stroke));
+}
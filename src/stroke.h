@@ -0,0 +1,76 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/**
+ * Stroke path collection and dab spacing.
+ *
+ * Mouse positions are only collected while events are processed; once per
+ * frame (or before any other input is handled) the path is flushed, and dabs
+ * are placed along it at a fixed spacing. This makes stroke quality and cost
+ * independent of the rate at which motion events arrive.
+ **/
+
+// Default distance between dabs, relative to the pen radius
+#define STROKE_DEFAULT_SPACING 0.25f
+
+struct StrokePoint {
+    float x;
+    float y;
+};
+
+struct Stroke {
+    bool active;
+
+    // End of the path that has already been flushed
+    bool has_last;
+    struct StrokePoint last;
+    // Distance travelled along the path since the last dab
+    float distance;
+
+    // Path points not yet flushed
+    struct StrokePoint *points;
+    size_t count;
+    size_t capacity;
+};
+
+void
+stroke_begin(struct Stroke *stroke, float x, float y);
+
+void
+stroke_move(struct Stroke *stroke, float x, float y);
+
+void
+stroke_end(struct Stroke *stroke);
+
+bool
+stroke_pending(const struct Stroke *stroke);
+
+size_t
+stroke_flush(struct Stroke *stroke, float spacing, void (*dab)(float x, float y, void *user_data), void *user_data);
+
+void
+stroke_free(struct Stroke *stroke);
@@ -0,0 +1,275 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#if defined(_MSC_VER)
+#define TRACE_THREAD_LOCAL __declspec(thread)
+#else
+#define TRACE_THREAD_LOCAL __thread
+#endif
+
+static struct {
+    FILE *fp;
+    bool first_event;
+    int next_tid;
+#if defined(_WIN32)
+    CRITICAL_SECTION lock;
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER start;
+#else
+    pthread_mutex_t lock;
+    struct timespec start;
+#endif
+} g_trace;
+
+static volatile bool
+g_trace_enabled = false;
+
+static TRACE_THREAD_LOCAL int
+g_trace_tid = 0;
+
+static void
+trace_lock(void)
+{
+#if defined(_WIN32)
+    EnterCriticalSection(&g_trace.lock);
+#else
+    pthread_mutex_lock(&g_trace.lock);
+#endif
+}
+
+static void
+trace_unlock(void)
+{
+#if defined(_WIN32)
+    LeaveCriticalSection(&g_trace.lock);
+#else
+    pthread_mutex_unlock(&g_trace.lock);
+#endif
+}
+
+static double
+trace_now_us(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (double)(now.QuadPart - g_trace.start.QuadPart) * 1000000.0 / (double)g_trace.frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - g_trace.start.tv_sec) * 1000000.0 +
+           (double)(now.tv_nsec - g_trace.start.tv_nsec) / 1000.0;
+#endif
+}
+
+static int
+trace_tid(void)
+{
+    // Small sequential thread IDs are much nicer to read in the viewer
+    // than the opaque values returned by the OS, and are assigned lazily
+    if (g_trace_tid == 0) {
+        trace_lock();
+        g_trace_tid = ++g_trace.next_tid;
+        trace_unlock();
+    }
+
+    return g_trace_tid;
+}
+
+static void
+trace_write_name(const char *name)
+{
+    fputc('"', g_trace.fp);
+    for (const char *cur = name; *cur; ++cur) {
+        if (*cur == '"' || *cur == '\\') {
+            fputc('\\', g_trace.fp);
+        }
+        if ((unsigned char)*cur >= 0x20) {
+            fputc(*cur, g_trace.fp);
+        }
+    }
+    fputc('"', g_trace.fp);
+}
+
+static void
+trace_event(const char *name, char phase, const char *args_key, double args_value)
+{
+    if (!g_trace_enabled) {
+        return;
+    }
+
+    int tid = trace_tid();
+
+    trace_lock();
+
+    if (g_trace.fp != NULL) {
+        double ts = trace_now_us();
+
+        fputs(g_trace.first_event ? "\n" : ",\n", g_trace.fp);
+        g_trace.first_event = false;
+
+        fputs("{\"name\":", g_trace.fp);
+        trace_write_name(name);
+        fprintf(g_trace.fp, ",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f", phase, tid, ts);
+        if (args_key != NULL) {
+            fprintf(g_trace.fp, ",\"args\":{\"%s\":%.3f}", args_key, args_value);
+        }
+        fputc('}', g_trace.fp);
+    }
+
+    trace_unlock();
+}
+
+bool
+trace_init(const char *filename)
+{
+    if (g_trace_enabled) {
+        return true;
+    }
+
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL) {
+        printf("Could not open trace file %s\n", filename);
+        return false;
+    }
+
+#if defined(_WIN32)
+    InitializeCriticalSection(&g_trace.lock);
+    QueryPerformanceFrequency(&g_trace.frequency);
+    QueryPerformanceCounter(&g_trace.start);
+#else
+    pthread_mutex_init(&g_trace.lock, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &g_trace.start);
+#endif
+
+    g_trace.fp = fp;
+    g_trace.first_event = true;
+    g_trace.next_tid = 0;
+
+    // The closing bracket of the JSON array is optional for trace viewers,
+    // so a trace of a crashed session can still be loaded
+    fputs("[", g_trace.fp);
+
+    g_trace_enabled = true;
+
+    atexit(trace_shutdown);
+
+    printf("Writing trace events to %s\n", filename);
+
+    trace_thread_name("main");
+
+    return true;
+}
+
+bool
+trace_init_from_env(void)
+{
+    const char *filename = getenv("SHIPEDIT_TRACE");
+    if (filename == NULL || filename[0] == '\0') {
+        return false;
+    }
+
+    return trace_init(filename);
+}
+
+bool
+trace_enabled(void)
+{
+    return g_trace_enabled;
+}
+
+void
+trace_begin(const char *name)
+{
+    trace_event(name, 'B', NULL, 0.0);
+}
+
+void
+trace_end(const char *name)
+{
+    trace_event(name, 'E', NULL, 0.0);
+}
+
+void
+trace_counter(const char *name, double value)
+{
+    trace_event(name, 'C', "value", value);
+}
+
+void
+trace_thread_name(const char *name)
+{
+    if (!g_trace_enabled) {
+        return;
+    }
+
+    int tid = trace_tid();
+
+    trace_lock();
+
+    if (g_trace.fp != NULL) {
+        fputs(g_trace.first_event ? "\n" : ",\n", g_trace.fp);
+        g_trace.first_event = false;
+
+        fprintf(g_trace.fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", tid);
+        trace_write_name(name);
+        fputs("}}", g_trace.fp);
+    }
+
+    trace_unlock();
+}
+
+void
+trace_shutdown(void)
+{
+    if (!g_trace_enabled) {
+        return;
+    }
+
+    trace_lock();
+
+    g_trace_enabled = false;
+
+    if (g_trace.fp != NULL) {
+        fputs("\n]\n", g_trace.fp);
+        fclose(g_trace.fp);
+        g_trace.fp = NULL;
+    }
+
+    trace_unlock();
+}
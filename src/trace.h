@@ -0,0 +1,98 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Chrome/Perfetto trace-event output (JSON array format).
+ *
+ * Tracing is off by default; it is switched on either by setting the
+ * environment variable SHIPEDIT_TRACE to an output filename or by passing
+ * "--trace FILE" on the command line. Load the resulting file in
+ * chrome://tracing or https://ui.perfetto.dev/ to inspect it.
+ *
+ * All functions are thread-safe and cheap no-ops while tracing is disabled.
+ **/
+
+bool
+trace_init(const char *filename);
+
+bool
+trace_init_from_env(void);
+
+bool
+trace_enabled(void);
+
+void
+trace_begin(const char *name);
+
+void
+trace_end(const char *name);
+
+void
+trace_counter(const char *name, double value);
+
+void
+trace_thread_name(const char *name);
+
+void
+trace_shutdown(void);
+
+#ifdef __cplusplus
+}
+
+class TraceScope {
+public:
+    explicit TraceScope(const char *name) : name(name) { trace_begin(name); }
+    ~TraceScope() { trace_end(name); }
+
+private:
+    TraceScope(const TraceScope &);
+    TraceScope &operator=(const TraceScope &);
+
+    const char *name;
+};
+#endif
+
+#define TRACE_BEGIN(name) trace_begin(name)
+#define TRACE_END(name) trace_end(name)
+
+/**
+ * Scoped trace event for C and C++, used with a block:
+ *
+ *     TRACE_SCOPE("parse_shm") {
+ *         ...
+ *     }
+ *
+ * Leaving the block with return/break/goto skips the end event, use
+ * TRACE_BEGIN()/TRACE_END() (or TraceScope in C++) in those cases.
+ **/
+#define TRACE_SCOPE(name) \
+    for (int trace_scope_once_ = (trace_begin(name), 1); \
+            trace_scope_once_; \
+            trace_scope_once_ = (trace_end(name), 0))
@@ -0,0 +1,711 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "undo.h"
+#include "material.h"
+#include "indexed.h"
+#include "layers.h"
+#include "memstat.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <zlib.h>
+
+// Tile data is only kept compressed if that saves at least this much
+static const int
+UNDO_MIN_COMPRESSION_GAIN = 64;
+
+static void
+undo_tile_store(struct Undo *undo, struct UndoTile *tile, const uint8_t *raw, uint32_t raw_length)
+{
+    if (undo->compress) {
+        uLongf compressed_length = compressBound(raw_length);
+        uint8_t *compressed = malloc(compressed_length);
+        if (compress2(compressed, &compressed_length, raw, raw_length, 1) == Z_OK &&
+                compressed_length + UNDO_MIN_COMPRESSION_GAIN <= raw_length) {
+            tile->data = realloc(compressed, compressed_length);
+            tile->data_length = compressed_length;
+            tile->compressed = true;
+            return;
+        }
+        free(compressed);
+    }
+
+    tile->data = malloc(raw_length);
+    memcpy(tile->data, raw, raw_length);
+    tile->data_length = raw_length;
+    tile->compressed = false;
+}
+
+static void
+undo_tile_load(struct UndoTile *tile, uint8_t *raw, uint32_t raw_length)
+{
+    if (tile->compressed) {
+        uLongf length = raw_length;
+        if (uncompress(raw, &length, tile->data, tile->data_length) != Z_OK || length != raw_length) {
+            fail("Corrupt undo tile");
+        }
+    } else {
+        memcpy(raw, tile->data, raw_length);
+    }
+}
+
+bool
+undo_operation_is_palette(struct UndoOperation *op)
+{
+    return op->surface != NULL && op->surface == (uint8_t *)op->material->palette;
+}
+
+void
+undo_tile_rect(struct UndoOperation *op, int tile, int *x, int *y, int *w, int *h)
+{
+    *x = (tile % op->tiles_x) * UNDO_TILE_SIZE;
+    *y = (tile / op->tiles_x) * UNDO_TILE_SIZE;
+    *w = (*x + UNDO_TILE_SIZE <= op->width) ? UNDO_TILE_SIZE : (op->width - *x);
+    *h = (*y + UNDO_TILE_SIZE <= op->height) ? UNDO_TILE_SIZE : (op->height - *y);
+}
+
+static uint32_t
+undo_tile_read(struct UndoOperation *op, int tile, uint8_t *raw)
+{
+    int x, y, w, h;
+    undo_tile_rect(op, tile, &x, &y, &w, &h);
+
+    // Tiles start on a byte, also with 4 bits per texel (see indexed_fits())
+    int row_length = w * op->bits_per_texel / 8;
+    for (int row=0; row<h; ++row) {
+        memcpy(raw + row * row_length, op->surface + (y + row) * op->stride + x * op->bits_per_texel / 8, row_length);
+    }
+
+    return row_length * h;
+}
+
+static void
+undo_tile_write(struct UndoOperation *op, int tile, const uint8_t *raw)
+{
+    int x, y, w, h;
+    undo_tile_rect(op, tile, &x, &y, &w, &h);
+
+    int row_length = w * op->bits_per_texel / 8;
+    for (int row=0; row<h; ++row) {
+        memcpy(op->surface + (y + row) * op->stride + x * op->bits_per_texel / 8, raw + row * row_length, row_length);
+    }
+}
+
+bool
+undo_tile_modified(struct UndoOperation *op, struct UndoTile *tile)
+{
+    uint8_t saved[UNDO_TILE_SIZE * UNDO_TILE_SIZE * sizeof(uint32_t)];
+    uint8_t current[UNDO_TILE_SIZE * UNDO_TILE_SIZE * sizeof(uint32_t)];
+
+    uint32_t length = undo_tile_read(op, tile->tile, current);
+    undo_tile_load(tile, saved, length);
+
+    return memcmp(saved, current, length) != 0;
+}
+
+static size_t
+undo_operation_overhead(struct UndoOperation *op)
+{
+    return sizeof(struct UndoOperation) + sizeof(struct UndoTile *) * op->tiles_x * op->tiles_y;
+}
+
+static void
+undo_account(struct Undo *undo, struct UndoStep *step, size_t bytes)
+{
+    step->bytes += bytes;
+    undo->bytes += bytes;
+    memstat_add(MEMSTAT_UNDO, bytes);
+}
+
+static void
+undo_unaccount(struct Undo *undo, struct UndoStep *step, size_t bytes)
+{
+    step->bytes -= bytes;
+    undo->bytes -= bytes;
+    memstat_sub(MEMSTAT_UNDO, bytes);
+}
+
+static void
+undo_buffer_free(struct UndoBuffer *buffer)
+{
+    if (buffer->kind == UNDO_BUFFER_LAYERS) {
+        layers_free(buffer->detached);
+    }
+
+    free(buffer);
+}
+
+static void
+undo_step_free(struct Undo *undo, struct UndoStep *step)
+{
+    struct UndoOperation *op = step->operations;
+    while (op != NULL) {
+        struct UndoTile *tile = op->tiles;
+        while (tile != NULL) {
+            struct UndoTile *next = tile->next;
+            free(tile->data);
+            free(tile);
+            tile = next;
+        }
+
+        if (op->material->undo_op == op) {
+            op->material->undo_op = NULL;
+        }
+
+        struct UndoOperation *next = op->next;
+        free(op->saved);
+        free(op);
+        op = next;
+    }
+
+    struct UndoBuffer *buffer = step->buffers;
+    while (buffer != NULL) {
+        struct UndoBuffer *next = buffer->next;
+        undo_buffer_free(buffer);
+        buffer = next;
+    }
+
+    undo->bytes -= step->bytes;
+    memstat_sub(MEMSTAT_UNDO, step->bytes);
+
+    free(step->label);
+    free(step);
+}
+
+static void
+undo_step_free_list(struct Undo *undo, struct UndoStep *step)
+{
+    while (step != NULL) {
+        struct UndoStep *next = step->next;
+        undo_step_free(undo, step);
+        step = next;
+    }
+}
+
+static void
+undo_enforce_budget(struct Undo *undo)
+{
+    if (undo->budget == 0 || undo->bytes <= undo->budget) {
+        return;
+    }
+
+    // Redo steps can be recreated by the user, drop them first
+    undo_step_free_list(undo, undo->redo);
+    undo->redo = NULL;
+
+    // Then evict the oldest undo steps, but never the one being recorded
+    while (undo->bytes > undo->budget && undo->step != NULL && undo->step->next != NULL) {
+        struct UndoStep **oldest = &undo->step->next;
+        while ((*oldest)->next != NULL) {
+            oldest = &(*oldest)->next;
+        }
+
+        printf("Undo budget exceeded, dropping: %s\n", (*oldest)->label);
+        undo_step_free(undo, *oldest);
+        *oldest = NULL;
+    }
+}
+
+struct Undo *
+undo_new(size_t budget, bool compress)
+{
+    struct Undo *undo = calloc(1, sizeof(struct Undo));
+
+    undo->budget = budget;
+    undo->compress = compress;
+    undo->next_serial = 1;
+
+    return undo;
+}
+
+void
+undo_free(struct Undo *undo)
+{
+    undo_clear(undo);
+    free(undo);
+}
+
+void
+undo_push(struct Undo *undo, const char *label)
+{
+    // A new action invalidates everything that could be redone
+    undo_step_free_list(undo, undo->redo);
+    undo->redo = NULL;
+
+    struct UndoStep *step = calloc(1, sizeof(struct UndoStep));
+    step->label = strdup(label);
+    step->serial = undo->next_serial++;
+    step->next = undo->step;
+    undo->step = step;
+
+    undo_enforce_budget(undo);
+}
+
+static struct UndoOperation *
+undo_get_operation(struct Undo *undo, struct Material *material, uint8_t *surface, int width, int height, int bits_per_texel)
+{
+    struct UndoStep *step = undo->step;
+
+    // Fast path: the material remembers its operation in the current step
+    if (material->undo_op != NULL && material->undo_serial == step->serial &&
+            material->undo_op->surface == surface) {
+        return material->undo_op;
+    }
+
+    struct UndoOperation *op = step->operations;
+    while (op != NULL) {
+        if (op->material == material && op->surface == surface) {
+            break;
+        }
+
+        op = op->next;
+    }
+
+    if (op == NULL) {
+        op = calloc(1, sizeof(struct UndoOperation));
+
+        op->material = material;
+        op->surface = surface;
+        op->width = width;
+        op->height = height;
+        op->bits_per_texel = bits_per_texel;
+        op->stride = op->width * op->bits_per_texel / 8;
+        op->tiles_x = (op->width + UNDO_TILE_SIZE - 1) / UNDO_TILE_SIZE;
+        op->tiles_y = (op->height + UNDO_TILE_SIZE - 1) / UNDO_TILE_SIZE;
+        op->saved = calloc(op->tiles_x * op->tiles_y, sizeof(struct UndoTile *));
+        op->sequence = step->sequence++;
+
+        op->next = step->operations;
+        step->operations = op;
+
+        undo_account(undo, step, undo_operation_overhead(op));
+    }
+
+    if (surface == (uint8_t *)material_surface(material)) {
+        material->undo_op = op;
+        material->undo_serial = step->serial;
+    }
+
+    return op;
+}
+
+static void
+undo_save_tile(struct Undo *undo, struct UndoOperation *op, int tile)
+{
+    if (op->saved[tile] != NULL) {
+        return;
+    }
+
+    uint8_t raw[UNDO_TILE_SIZE * UNDO_TILE_SIZE * sizeof(uint32_t)];
+    uint32_t raw_length = undo_tile_read(op, tile, raw);
+
+    struct UndoTile *saved = calloc(1, sizeof(struct UndoTile));
+    saved->tile = tile;
+    undo_tile_store(undo, saved, raw, raw_length);
+
+    saved->next = op->tiles;
+    op->tiles = saved;
+    op->saved[tile] = saved;
+
+    undo_account(undo, undo->step, sizeof(struct UndoTile) + saved->data_length);
+}
+
+void
+undo_save_material_rect(struct Undo *undo, struct Material *material, int x, int y, int w, int h)
+{
+    if (!undo->step) {
+        // No undo step recording in process
+        return;
+    }
+
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        h += y;
+        y = 0;
+    }
+    if (x + w > material->width) {
+        w = material->width - x;
+    }
+    if (y + h > material->height) {
+        h = material->height - y;
+    }
+    if (w <= 0 || h <= 0) {
+        return;
+    }
+
+    struct UndoOperation *op = undo_get_operation(undo, material, (uint8_t *)material_surface(material),
+            material->width, material->height, material_texel_bits(material));
+
+    int tx0 = x / UNDO_TILE_SIZE;
+    int ty0 = y / UNDO_TILE_SIZE;
+    int tx1 = (x + w - 1) / UNDO_TILE_SIZE;
+    int ty1 = (y + h - 1) / UNDO_TILE_SIZE;
+
+    for (int ty=ty0; ty<=ty1; ++ty) {
+        for (int tx=tx0; tx<=tx1; ++tx) {
+            undo_save_tile(undo, op, ty * op->tiles_x + tx);
+        }
+    }
+
+    undo_enforce_budget(undo);
+}
+
+void
+undo_save_material_pixels(struct Undo *undo, struct Material *material)
+{
+    undo_save_material_rect(undo, material, 0, 0, material->width, material->height);
+}
+
+void
+undo_save_material_palette(struct Undo *undo, struct Material *material, int count)
+{
+    if (!undo->step || material->palette == NULL) {
+        return;
+    }
+
+    // The palette is saved as a single row "image" of its own
+    struct UndoOperation *op = undo_get_operation(undo, material, (uint8_t *)material->palette,
+            count, 1, 8 * sizeof(uint32_t));
+    for (int tile=0; tile<op->tiles_x; ++tile) {
+        undo_save_tile(undo, op, tile);
+    }
+
+    undo_enforce_budget(undo);
+}
+
+void
+undo_save_material_texel(struct Undo *undo, struct Material *material, int x, int y)
+{
+    if (!undo->step) {
+        return;
+    }
+
+    // O(1) check whether the tile has already been saved in this step
+    struct UndoOperation *op = material->undo_op;
+    if (op != NULL && material->undo_serial == undo->step->serial && op->surface == (uint8_t *)material_surface(material) &&
+            op->saved[(y / UNDO_TILE_SIZE) * op->tiles_x + (x / UNDO_TILE_SIZE)] != NULL) {
+        return;
+    }
+
+    undo_save_material_rect(undo, material, x, y, 1, 1);
+}
+
+static size_t
+undo_buffer_bytes(struct UndoBuffer *buffer)
+{
+    if (buffer->kind == UNDO_BUFFER_LAYERS) {
+        return layers_stack_bytes(buffer->detached);
+    }
+
+    // A mode switch keeps no buffer, it recreates the freed one
+    return 0;
+}
+
+// Hands the tiles saved for a surface over to another one (either may be freed)
+static void
+undo_move_surface(struct Undo *undo, const uint8_t *surface, const struct UndoBuffer *freed_by,
+        uint8_t *to, struct UndoBuffer *to_freed_by)
+{
+    struct UndoStep *lists[] = { undo->step, undo->redo };
+    for (int i=0; i<2; ++i) {
+        for (struct UndoStep *step=lists[i]; step != NULL; step = step->next) {
+            for (struct UndoOperation *op=step->operations; op != NULL; op = op->next) {
+                if (op->surface == surface && op->freed_by == freed_by) {
+                    op->surface = to;
+                    op->freed_by = to_freed_by;
+                }
+            }
+        }
+    }
+}
+
+static void
+undo_save_buffer(struct Undo *undo, struct UndoBuffer *buffer)
+{
+    buffer->sequence = undo->step->sequence++;
+    buffer->next = undo->step->buffers;
+    undo->step->buffers = buffer;
+
+    buffer->bytes = (buffer->detached != NULL) ? undo_buffer_bytes(buffer) : 0;
+    undo_account(undo, undo->step, sizeof(struct UndoBuffer) + buffer->bytes);
+    undo_enforce_budget(undo);
+}
+
+void
+undo_save_material_indexed(struct Undo *undo, struct Material *material)
+{
+    // The surface that entering or leaving indexed mode is about to free
+    uint8_t *surface = (uint8_t *)material_surface(material);
+
+    if (!undo->step) {
+        // Nothing could recreate it
+        undo_forget_surface(undo, surface);
+        return;
+    }
+
+    struct UndoBuffer *buffer = calloc(1, sizeof(struct UndoBuffer));
+    buffer->material = material;
+    buffer->kind = UNDO_BUFFER_INDEXED;
+    buffer->palette_count = material->palette_count;
+
+    undo_move_surface(undo, surface, NULL, NULL, buffer);
+    undo_save_buffer(undo, buffer);
+}
+
+void
+undo_save_material_layers(struct Undo *undo, struct Material *material, struct LayerStack *detached)
+{
+    struct UndoBuffer *buffer = calloc(1, sizeof(struct UndoBuffer));
+    buffer->material = material;
+    buffer->kind = UNDO_BUFFER_LAYERS;
+    buffer->detached = detached;
+
+    if (!undo->step) {
+        // Nothing could attach it again
+        undo_buffer_free(buffer);
+        return;
+    }
+
+    undo_save_buffer(undo, buffer);
+}
+
+static void
+undo_buffer_swap(struct Undo *undo, struct UndoStep *step, struct UndoBuffer *buffer)
+{
+    struct Material *material = buffer->material;
+
+    if (buffer->kind == UNDO_BUFFER_LAYERS) {
+        void *attached = layers_detach(material);
+        if (buffer->detached != NULL) {
+            layers_attach(material, buffer->detached);
+        }
+
+        undo_unaccount(undo, step, buffer->bytes);
+        buffer->detached = attached;
+        buffer->bytes = (attached != NULL) ? undo_buffer_bytes(buffer) : 0;
+        undo_account(undo, step, buffer->bytes);
+    } else {
+        // The freed surface comes back with the same contents as when it was
+        // freed, so its tiles are handed over to it, and the other one leaves
+        uint8_t *freed = (uint8_t *)material_surface(material);
+        if (material->indices != NULL) {
+            buffer->palette_count = material->palette_count;
+            indexed_disable(material);
+        } else {
+            indexed_enable(material);
+            material->palette_count = buffer->palette_count;
+        }
+
+        undo_move_surface(undo, NULL, buffer, (uint8_t *)material_surface(material), NULL);
+        undo_move_surface(undo, freed, NULL, NULL, buffer);
+    }
+
+    material_touch(material, 0, 0, material->width, material->height);
+    material_upload(material);
+}
+
+static void
+undo_operation_swap(struct Undo *undo, struct UndoStep *step, struct UndoOperation *op)
+{
+    uint8_t raw[UNDO_TILE_SIZE * UNDO_TILE_SIZE * sizeof(uint32_t)];
+    uint8_t current[UNDO_TILE_SIZE * UNDO_TILE_SIZE * sizeof(uint32_t)];
+
+    if (op->surface == NULL) {
+        return;
+    }
+
+    struct UndoTile *tile = op->tiles;
+    while (tile != NULL) {
+        uint32_t raw_length = undo_tile_read(op, tile->tile, current);
+        undo_tile_load(tile, raw, raw_length);
+        undo_tile_write(op, tile->tile, raw);
+
+        // Keep the contents we just replaced, so the step can be re-applied
+        size_t old_length = tile->data_length;
+        free(tile->data);
+        undo_tile_store(undo, tile, current, raw_length);
+
+        if (tile->data_length > old_length) {
+            undo_account(undo, step, tile->data_length - old_length);
+        } else {
+            undo_unaccount(undo, step, old_length - tile->data_length);
+        }
+
+        int x, y, w, h;
+        undo_tile_rect(op, tile->tile, &x, &y, &w, &h);
+        if (undo_operation_is_palette(op)) {
+            // A palette entry can be used by any texel
+            material_touch(op->material, 0, 0, op->material->width, op->material->height);
+        } else {
+            material_touch(op->material, x, y, w, h);
+        }
+
+        tile = tile->next;
+    }
+
+    material_upload(op->material);
+}
+
+static void
+undo_step_swap(struct Undo *undo, struct UndoStep *step, bool redo)
+{
+    // Attach layer stacks first, so that touching tiles below updates the right ones
+    struct UndoBuffer *buffer;
+    for (buffer = step->buffers; buffer != NULL; buffer = buffer->next) {
+        if (buffer->kind == UNDO_BUFFER_LAYERS) {
+            undo_buffer_swap(undo, step, buffer);
+        }
+    }
+
+    // Switching indexed mode replaces the surface that tiles of one side of
+    // the switch were saved for, so go in recorded order (reversed for undo)
+    for (uint32_t i=0; i<step->sequence; ++i) {
+        uint32_t sequence = redo ? i : (step->sequence - 1 - i);
+
+        struct UndoOperation *op = step->operations;
+        while (op != NULL && op->sequence != sequence) {
+            op = op->next;
+        }
+        if (op != NULL) {
+            undo_operation_swap(undo, step, op);
+            continue;
+        }
+
+        buffer = step->buffers;
+        while (buffer != NULL && buffer->sequence != sequence) {
+            buffer = buffer->next;
+        }
+        if (buffer != NULL && buffer->kind == UNDO_BUFFER_INDEXED) {
+            undo_buffer_swap(undo, step, buffer);
+        }
+    }
+}
+
+bool
+undo_undo(struct Undo *undo)
+{
+    struct UndoStep *step = undo->step;
+
+    if (!step) {
+        printf("Undo stack empty\n");
+        return false;
+    }
+
+    printf("Undoing: %s\n", step->label);
+    undo_step_swap(undo, step, false);
+
+    undo->step = step->next;
+    step->next = undo->redo;
+    undo->redo = step;
+
+    return true;
+}
+
+bool
+undo_redo(struct Undo *undo)
+{
+    struct UndoStep *step = undo->redo;
+
+    if (!step) {
+        printf("Redo stack empty\n");
+        return false;
+    }
+
+    printf("Redoing: %s\n", step->label);
+    undo_step_swap(undo, step, true);
+
+    undo->redo = step->next;
+    step->next = undo->step;
+    undo->step = step;
+
+    return true;
+}
+
+static void
+undo_forget_in_list(struct Undo *undo, struct UndoStep *step, const void *surface)
+{
+    while (step != NULL) {
+        struct UndoOperation **op = &step->operations;
+        while (*op != NULL) {
+            if ((*op)->surface != surface) {
+                op = &(*op)->next;
+                continue;
+            }
+
+            struct UndoOperation *remove = *op;
+            *op = remove->next;
+
+            size_t bytes = undo_operation_overhead(remove);
+            struct UndoTile *tile = remove->tiles;
+            while (tile != NULL) {
+                struct UndoTile *next = tile->next;
+                bytes += sizeof(struct UndoTile) + tile->data_length;
+                free(tile->data);
+                free(tile);
+                tile = next;
+            }
+
+            if (remove->material->undo_op == remove) {
+                remove->material->undo_op = NULL;
+            }
+
+            free(remove->saved);
+            free(remove);
+
+            undo_unaccount(undo, step, bytes);
+        }
+
+        step = step->next;
+    }
+}
+
+void
+undo_forget_surface(struct Undo *undo, const void *surface)
+{
+    undo_forget_in_list(undo, undo->step, surface);
+    undo_forget_in_list(undo, undo->redo, surface);
+}
+
+void
+undo_clear(struct Undo *undo)
+{
+    struct UndoStep *step = undo->step;
+    undo->step = NULL;
+
+    while (step) {
+        printf("Pop from undo stack: %s\n", step->label);
+
+        struct UndoStep *next = step->next;
+        undo_step_free(undo, step);
+        step = next;
+    }
+
+    undo_step_free_list(undo, undo->redo);
+    undo->redo = NULL;
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "shipmodelformat.h"
+
+/**
+ * Undo/redo history based on copy-on-write tiles.
+ *
+ * Each step only keeps the UNDO_TILE_SIZE x UNDO_TILE_SIZE tiles that were
+ * modified while it was recorded (optionally zlib-compressed). Undoing or
+ * redoing a step swaps the saved tiles with the current image contents, so
+ * the same data serves both directions. A layer stack that a step detaches
+ * from a material when flattening is kept by the step and swapped back in the
+ * same way, so older tiles always find their surface. Entering or leaving
+ * indexed mode frees the pixels or the indices instead: the step only records
+ * the switch, and undoing or redoing it recreates the freed buffer from the
+ * other one, handing the tiles saved for it over to the new buffer. If a byte
+ * budget is set, the oldest steps are evicted once the history grows beyond
+ * it.
+ **/
+
+#define UNDO_TILE_SIZE 16
+
+#define UNDO_DEFAULT_BUDGET_MIB 64
+
+struct UndoTile {
+    int tile;
+    uint8_t *data;
+    uint32_t data_length;
+    bool compressed;
+
+    struct UndoTile *next;
+};
+
+struct UndoOperation {
+    struct Material *material;
+
+    // The buffer that is being modified and its layout
+    uint8_t *surface;
+    int width;
+    int height;
+    int stride;
+    int bits_per_texel;
+    int tiles_x;
+    int tiles_y;
+
+    // One entry per tile of the surface (NULL if not saved in this step)
+    struct UndoTile **saved;
+    struct UndoTile *tiles;
+
+    // While the surface is freed (surface is NULL): the mode switch that recreates it
+    struct UndoBuffer *freed_by;
+    // Order within the step, relative to mode switches
+    uint32_t sequence;
+
+    struct UndoOperation *next;
+};
+
+enum UndoBufferKind {
+    UNDO_BUFFER_INDEXED,
+    UNDO_BUFFER_LAYERS,
+};
+
+// A layer stack that a step detached from (or attached to) a material, or a switch of indexed mode
+struct UndoBuffer {
+    struct Material *material;
+    enum UndoBufferKind kind;
+
+    // The layer stack while it is not attached to the material, else NULL
+    void *detached;
+    // material->palette_count of the indexed side of a mode switch
+    int palette_count;
+    size_t bytes;
+    uint32_t sequence;
+
+    struct UndoBuffer *next;
+};
+
+struct UndoStep {
+    char *label;
+    uint32_t serial;
+    size_t bytes;
+    struct UndoOperation *operations;
+    struct UndoBuffer *buffers;
+    // Next sequence number of an operation or buffer
+    uint32_t sequence;
+
+    struct UndoStep *next;
+};
+
+struct Undo {
+    // Most recent step first, "next" points to older steps
+    struct UndoStep *step;
+    // Most recently undone step first
+    struct UndoStep *redo;
+
+    size_t bytes;
+    size_t budget;
+    bool compress;
+    uint32_t next_serial;
+};
+
+struct Undo *
+undo_new(size_t budget, bool compress);
+
+void
+undo_free(struct Undo *undo);
+
+void
+undo_push(struct Undo *undo, const char *label);
+
+void
+undo_save_material_pixels(struct Undo *undo, struct Material *material);
+
+void
+undo_save_material_rect(struct Undo *undo, struct Material *material, int x, int y, int w, int h);
+
+// Palette entries [0, count), for edits that only change colors
+void
+undo_save_material_palette(struct Undo *undo, struct Material *material, int count);
+
+void
+undo_save_material_texel(struct Undo *undo, struct Material *material, int x, int y);
+
+// The material is about to enter or leave indexed mode in this step, which
+// frees the pixels or the indices (see indexed_enable() and indexed_disable())
+void
+undo_save_material_indexed(struct Undo *undo, struct Material *material);
+
+// The layers of the material were flattened in this step (see layers_detach())
+void
+undo_save_material_layers(struct Undo *undo, struct Material *material, struct LayerStack *detached);
+
+bool
+undo_undo(struct Undo *undo);
+
+bool
+undo_redo(struct Undo *undo);
+
+void
+undo_clear(struct Undo *undo);
+
+// Drop all saved tiles of a buffer that is about to be freed
+void
+undo_forget_surface(struct Undo *undo, const void *surface);
+
+bool
+undo_operation_is_palette(struct UndoOperation *op);
+
+void
+undo_tile_rect(struct UndoOperation *op, int tile, int *x, int *y, int *w, int *h);
+
+bool
+undo_tile_modified(struct UndoOperation *op, struct UndoTile *tile);
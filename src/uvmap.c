@@ -0,0 +1,873 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "uvmap.h"
+#include "memstat.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+// Positions closer than 1/UVMAP_POSITION_SCALE are considered the same vertex
+static const float
+UVMAP_POSITION_SCALE = 4096.f;
+
+static const float
+UVMAP_UV_SCALE = 65536.f;
+
+struct UVMapTriangle {
+    const struct Vertex *v;
+    int material;
+};
+
+struct UVMapEdge {
+    int32_t key[7];
+    int triangle;
+    int edge;
+};
+
+struct UVMapBuild {
+    struct UVMap *uvmap;
+    struct UVMapTriangle *triangles;
+    int *parent;
+
+    // Surface position and normal of each owned texel (6 floats per texel)
+    float *surface[UVMAP_MAX_MATERIALS];
+
+    uint64_t *pairs;
+    size_t pairs_count;
+    size_t pairs_capacity;
+};
+
+static int
+uvmap_material_index(struct Material *material)
+{
+    if (material == NULL || material->index < 0 || material->index >= UVMAP_MAX_MATERIALS ||
+            material->width * material->height > 0x10000) {
+        return -1;
+    }
+
+    return material->index;
+}
+
+static int
+uvmap_find(int *parent, int i)
+{
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+
+    return i;
+}
+
+static void
+uvmap_union(int *parent, int a, int b)
+{
+    a = uvmap_find(parent, a);
+    b = uvmap_find(parent, b);
+    if (a != b) {
+        parent[b] = a;
+    }
+}
+
+static int
+uvmap_edge_compare(const void *a, const void *b)
+{
+    return memcmp(((const struct UVMapEdge *)a)->key, ((const struct UVMapEdge *)b)->key, sizeof(((struct UVMapEdge *)a)->key));
+}
+
+static int
+uvmap_pair_compare(const void *a, const void *b)
+{
+    uint64_t pa = *(const uint64_t *)a;
+    uint64_t pb = *(const uint64_t *)b;
+    return (pa > pb) - (pa < pb);
+}
+
+static void
+uvmap_edge_key_uv(struct UVMapEdge *edge, int material, const struct Vertex *a, const struct Vertex *b)
+{
+    int32_t ka[2] = { lroundf(a->u * UVMAP_UV_SCALE), lroundf(a->v * UVMAP_UV_SCALE) };
+    int32_t kb[2] = { lroundf(b->u * UVMAP_UV_SCALE), lroundf(b->v * UVMAP_UV_SCALE) };
+
+    if (memcmp(ka, kb, sizeof(ka)) > 0) {
+        int32_t tmp[2];
+        memcpy(tmp, ka, sizeof(ka));
+        memcpy(ka, kb, sizeof(ka));
+        memcpy(kb, tmp, sizeof(kb));
+    }
+
+    edge->key[0] = material;
+    memcpy(edge->key + 1, ka, sizeof(ka));
+    memcpy(edge->key + 3, kb, sizeof(kb));
+    edge->key[5] = edge->key[6] = 0;
+}
+
+static void
+uvmap_position_key(int32_t *key, const struct Vertex *v)
+{
+    key[0] = lroundf(v->x * UVMAP_POSITION_SCALE);
+    key[1] = lroundf(v->y * UVMAP_POSITION_SCALE);
+    key[2] = lroundf(v->z * UVMAP_POSITION_SCALE);
+}
+
+static void
+uvmap_edge_key_position(struct UVMapEdge *edge, const struct Vertex *a, const struct Vertex *b)
+{
+    int32_t ka[3];
+    int32_t kb[3];
+    uvmap_position_key(ka, a);
+    uvmap_position_key(kb, b);
+
+    edge->key[0] = 0;
+    if (memcmp(ka, kb, sizeof(ka)) <= 0) {
+        memcpy(edge->key + 1, ka, sizeof(ka));
+        memcpy(edge->key + 4, kb, sizeof(kb));
+    } else {
+        memcpy(edge->key + 1, kb, sizeof(kb));
+        memcpy(edge->key + 4, ka, sizeof(ka));
+    }
+}
+
+static int
+uvmap_wrap(int value, int size)
+{
+    value %= size;
+    return (value < 0) ? (value + size) : value;
+}
+
+static void
+uvmap_set_surface(struct UVMapBuild *build, int triangle, int texel, float b0, float b1, float b2)
+{
+    struct UVMapTriangle *tri = &build->triangles[triangle];
+    const struct Vertex *v = tri->v;
+    float *surface = build->surface[tri->material] + 6 * texel;
+
+    surface[0] = b0 * v[0].x + b1 * v[1].x + b2 * v[2].x;
+    surface[1] = b0 * v[0].y + b1 * v[1].y + b2 * v[2].y;
+    surface[2] = b0 * v[0].z + b1 * v[1].z + b2 * v[2].z;
+
+    float ax = v[1].x - v[0].x, ay = v[1].y - v[0].y, az = v[1].z - v[0].z;
+    float bx = v[2].x - v[0].x, by = v[2].y - v[0].y, bz = v[2].z - v[0].z;
+    surface[3] = ay * bz - az * by;
+    surface[4] = az * bx - ax * bz;
+    surface[5] = ax * by - ay * bx;
+}
+
+static void
+uvmap_rasterize(struct UVMapBuild *build, int triangle)
+{
+    struct UVMapTriangle *tri = &build->triangles[triangle];
+    struct UVMapMaterial *mat = &build->uvmap->materials[tri->material];
+
+    // Texel space, texel centers at integer coordinates
+    float x[3], y[3];
+    for (int i=0; i<3; ++i) {
+        x[i] = tri->v[i].u * mat->width - 0.5f;
+        y[i] = tri->v[i].v * mat->height - 0.5f;
+    }
+
+    float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (fabsf(area) < 1e-6f) {
+        return;
+    }
+
+    int x0 = ceilf(fminf(x[0], fminf(x[1], x[2])));
+    int x1 = floorf(fmaxf(x[0], fmaxf(x[1], x[2])));
+    int y0 = ceilf(fminf(y[0], fminf(y[1], y[2])));
+    int y1 = floorf(fmaxf(y[0], fmaxf(y[1], y[2])));
+
+    for (int py=y0; py<=y1; ++py) {
+        for (int px=x0; px<=x1; ++px) {
+            float w0 = (x[2] - x[1]) * (py - y[1]) - (y[2] - y[1]) * (px - x[1]);
+            float w1 = (x[0] - x[2]) * (py - y[2]) - (y[0] - y[2]) * (px - x[2]);
+            float w2 = (x[1] - x[0]) * (py - y[0]) - (y[1] - y[0]) * (px - x[0]);
+
+            bool inside = (area > 0.f) ? (w0 >= 0.f && w1 >= 0.f && w2 >= 0.f) : (w0 <= 0.f && w1 <= 0.f && w2 <= 0.f);
+            if (inside) {
+                int texel = uvmap_wrap(px, mat->width) + uvmap_wrap(py, mat->height) * mat->width;
+                if (mat->owner[texel] == -1) {
+                    mat->owner[texel] = triangle;
+                    uvmap_set_surface(build, triangle, texel, w0 / area, w1 / area, w2 / area);
+                }
+            }
+        }
+    }
+}
+
+static void
+uvmap_add_pair(struct UVMapBuild *build, uint32_t from, uint32_t to)
+{
+    if (build->pairs_count == build->pairs_capacity) {
+        build->pairs_capacity = build->pairs_capacity ? 2 * build->pairs_capacity : 1024;
+        build->pairs = realloc(build->pairs, sizeof(uint64_t) * build->pairs_capacity);
+    }
+
+    build->pairs[build->pairs_count++] = ((uint64_t)from << 32) | to;
+}
+
+static uint32_t
+uvmap_edge_texel(struct UVMapBuild *build, int triangle, const struct Vertex *a, const struct Vertex *b, float t)
+{
+    struct UVMapTriangle *tri = &build->triangles[triangle];
+    struct UVMapMaterial *mat = &build->uvmap->materials[tri->material];
+
+    float cx = 0.f, cy = 0.f;
+    for (int i=0; i<3; ++i) {
+        cx += tri->v[i].u * mat->width / 3.f;
+        cy += tri->v[i].v * mat->height / 3.f;
+    }
+
+    float px = (a->u + (b->u - a->u) * t) * mat->width;
+    float py = (a->v + (b->v - a->v) * t) * mat->height;
+
+    // Move half a texel into the triangle, so we pick a texel on the right side of the seam
+    float dx = cx - px;
+    float dy = cy - py;
+    float d = sqrtf(dx * dx + dy * dy);
+    if (d > 0.5f) {
+        px += 0.5f * dx / d;
+        py += 0.5f * dy / d;
+    }
+
+    int texel = uvmap_wrap(floorf(px), mat->width) + uvmap_wrap(floorf(py), mat->height) * mat->width;
+    if (mat->owner[texel] == -1) {
+        // Texel center not covered by any triangle, but the edge goes through it
+        mat->owner[texel] = triangle;
+
+        float bary[3] = { 0.f, 0.f, 0.f };
+        bary[a - tri->v] = 1.f - t;
+        bary[b - tri->v] = t;
+        uvmap_set_surface(build, triangle, texel, bary[0], bary[1], bary[2]);
+    }
+
+    return UVMAP_LINK(tri->material, texel);
+}
+
+static float
+uvmap_edge_length(struct UVMapBuild *build, int triangle, const struct Vertex *a, const struct Vertex *b)
+{
+    struct UVMapMaterial *mat = &build->uvmap->materials[build->triangles[triangle].material];
+
+    float dx = (b->u - a->u) * mat->width;
+    float dy = (b->v - a->v) * mat->height;
+    return sqrtf(dx * dx + dy * dy);
+}
+
+static void
+uvmap_link_seam(struct UVMapBuild *build, const struct UVMapEdge *ea, const struct UVMapEdge *eb)
+{
+    const struct Vertex *a0 = &build->triangles[ea->triangle].v[ea->edge];
+    const struct Vertex *a1 = &build->triangles[ea->triangle].v[(ea->edge + 1) % 3];
+    const struct Vertex *b0 = &build->triangles[eb->triangle].v[eb->edge];
+    const struct Vertex *b1 = &build->triangles[eb->triangle].v[(eb->edge + 1) % 3];
+
+    // Orient the other edge so that b0 is at the same position as a0
+    int32_t ka[3], kb[3];
+    uvmap_position_key(ka, a0);
+    uvmap_position_key(kb, b0);
+    if (memcmp(ka, kb, sizeof(ka)) != 0) {
+        const struct Vertex *tmp = b0;
+        b0 = b1;
+        b1 = tmp;
+    }
+
+    float length = fmaxf(uvmap_edge_length(build, ea->triangle, a0, a1), uvmap_edge_length(build, eb->triangle, b0, b1));
+    int samples = 2 * (int)ceilf(length) + 1;
+
+    for (int i=0; i<samples; ++i) {
+        float t = (i + 0.5f) / samples;
+
+        uint32_t la = uvmap_edge_texel(build, ea->triangle, a0, a1, t);
+        uint32_t lb = uvmap_edge_texel(build, eb->triangle, b0, b1, t);
+        if (la != lb) {
+            uvmap_add_pair(build, la, lb);
+            uvmap_add_pair(build, lb, la);
+        }
+    }
+}
+
+// Grid cells per axis (along the longest side of the model) for the mirror search
+static const int
+UVMAP_MIRROR_GRID = 32;
+
+// Mirror texels further away than this (in grid cells) are not used
+static const int
+UVMAP_MIRROR_SEARCH = 3;
+
+struct UVMapGrid {
+    float origin[3];
+    float cell;
+    int dim[3];
+
+    uint32_t *start;
+    uint32_t *links;
+};
+
+static int
+uvmap_grid_cell(const struct UVMapGrid *grid, const float *p, int axis)
+{
+    int c = floorf((p[axis] - grid->origin[axis]) / grid->cell);
+    return (c < 0) ? 0 : ((c >= grid->dim[axis]) ? grid->dim[axis] - 1 : c);
+}
+
+static uint32_t
+uvmap_grid_nearest(const struct UVMapGrid *grid, const struct UVMapBuild *build, const float *p, const float *n)
+{
+    int c[3];
+    for (int axis=0; axis<3; ++axis) {
+        c[axis] = uvmap_grid_cell(grid, p, axis);
+    }
+
+    // Prefer texels facing the same way (e.g. the top vs. the bottom of a thin wing)
+    uint32_t best_facing = UVMAP_NO_LINK;
+    uint32_t best_any = UVMAP_NO_LINK;
+    float best_facing_d2 = INFINITY;
+    float best_any_d2 = INFINITY;
+
+    for (int r=0; r<=UVMAP_MIRROR_SEARCH; ++r) {
+        for (int z=c[2]-r; z<=c[2]+r; ++z) {
+            for (int y=c[1]-r; y<=c[1]+r; ++y) {
+                for (int x=c[0]-r; x<=c[0]+r; ++x) {
+                    if (x < 0 || y < 0 || z < 0 || x >= grid->dim[0] || y >= grid->dim[1] || z >= grid->dim[2]) {
+                        continue;
+                    }
+
+                    if (abs(x - c[0]) != r && abs(y - c[1]) != r && abs(z - c[2]) != r) {
+                        // Inner cell, already searched
+                        continue;
+                    }
+
+                    int cell = x + grid->dim[0] * (y + grid->dim[1] * z);
+                    for (uint32_t i=grid->start[cell]; i<grid->start[cell + 1]; ++i) {
+                        uint32_t link = grid->links[i];
+                        const float *q = build->surface[UVMAP_LINK_MATERIAL(link)] + 6 * UVMAP_LINK_TEXEL(link);
+
+                        float dx = q[0] - p[0], dy = q[1] - p[1], dz = q[2] - p[2];
+                        float d2 = dx * dx + dy * dy + dz * dz;
+
+                        if (d2 < best_any_d2) {
+                            best_any_d2 = d2;
+                            best_any = link;
+                        }
+
+                        if (d2 < best_facing_d2 && q[3] * n[0] + q[4] * n[1] + q[5] * n[2] > 0.f) {
+                            best_facing_d2 = d2;
+                            best_facing = link;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Everything outside of this ring is at least r cells away
+        float reach = r * grid->cell;
+        if (best_facing != UVMAP_NO_LINK && best_facing_d2 <= reach * reach) {
+            break;
+        }
+    }
+
+    return (best_facing != UVMAP_NO_LINK) ? best_facing : best_any;
+}
+
+static size_t
+uvmap_build_mirror(struct UVMapBuild *build)
+{
+    struct UVMap *uvmap = build->uvmap;
+    struct UVMapGrid grid;
+    memset(&grid, 0, sizeof(grid));
+
+    float lo[3] = { INFINITY, INFINITY, INFINITY };
+    float hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+    size_t count = 0;
+
+    for (int m=0; m<UVMAP_MAX_MATERIALS; ++m) {
+        struct UVMapMaterial *mat = &uvmap->materials[m];
+        for (int i=0; mat->owner != NULL && i<mat->width*mat->height; ++i) {
+            if (mat->owner[i] != -1) {
+                const float *p = build->surface[m] + 6 * i;
+                for (int axis=0; axis<3; ++axis) {
+                    lo[axis] = fminf(lo[axis], p[axis]);
+                    hi[axis] = fmaxf(hi[axis], p[axis]);
+                }
+                ++count;
+            }
+        }
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    // Sort texels into a uniform grid over the bounding box of the surface
+    float extent = fmaxf(hi[0] - lo[0], fmaxf(hi[1] - lo[1], hi[2] - lo[2]));
+    grid.cell = fmaxf(extent / UVMAP_MIRROR_GRID, 1e-6f);
+    for (int axis=0; axis<3; ++axis) {
+        grid.origin[axis] = lo[axis];
+        grid.dim[axis] = 1 + (int)((hi[axis] - lo[axis]) / grid.cell);
+    }
+
+    size_t cells = grid.dim[0] * grid.dim[1] * grid.dim[2];
+    grid.start = calloc(cells + 1, sizeof(uint32_t));
+    grid.links = malloc(sizeof(uint32_t) * count);
+
+    for (int pass=0; pass<2; ++pass) {
+        for (int m=0; m<UVMAP_MAX_MATERIALS; ++m) {
+            struct UVMapMaterial *mat = &uvmap->materials[m];
+            for (int i=0; mat->owner != NULL && i<mat->width*mat->height; ++i) {
+                if (mat->owner[i] != -1) {
+                    const float *p = build->surface[m] + 6 * i;
+                    int cell = uvmap_grid_cell(&grid, p, 0) + grid.dim[0] *
+                        (uvmap_grid_cell(&grid, p, 1) + grid.dim[1] * uvmap_grid_cell(&grid, p, 2));
+
+                    if (pass == 0) {
+                        grid.start[cell + 1]++;
+                    } else {
+                        grid.links[grid.start[cell]++] = UVMAP_LINK(m, i);
+                    }
+                }
+            }
+        }
+
+        if (pass == 0) {
+            for (size_t c=0; c<cells; ++c) {
+                grid.start[c + 1] += grid.start[c];
+            }
+        } else {
+            // Filling advanced each start to the end of its cell
+            memmove(grid.start + 1, grid.start, sizeof(uint32_t) * cells);
+            grid.start[0] = 0;
+        }
+    }
+
+    // Reflect on the X axis through the center of the model
+    float center = 0.5f * (lo[0] + hi[0]);
+    size_t bytes = 0;
+
+    for (int m=0; m<UVMAP_MAX_MATERIALS; ++m) {
+        struct UVMapMaterial *mat = &uvmap->materials[m];
+        if (mat->owner == NULL) {
+            continue;
+        }
+
+        size_t texels = mat->width * mat->height;
+        mat->mirror = malloc(sizeof(uint32_t) * texels);
+        bytes += sizeof(uint32_t) * texels;
+
+        for (size_t i=0; i<texels; ++i) {
+            mat->mirror[i] = UVMAP_NO_LINK;
+
+            if (mat->owner[i] != -1) {
+                const float *p = build->surface[m] + 6 * i;
+                float mp[3] = { 2.f * center - p[0], p[1], p[2] };
+                float mn[3] = { -p[3], p[4], p[5] };
+
+                mat->mirror[i] = uvmap_grid_nearest(&grid, build, mp, mn);
+            }
+        }
+    }
+
+    free(grid.start);
+    free(grid.links);
+
+    return bytes;
+}
+
+struct UVMap *
+uvmap_build(struct ShipModel *model)
+{
+    TRACE_BEGIN("uvmap_build");
+
+    struct UVMap *uvmap = calloc(1, sizeof(struct UVMap));
+    struct UVMapBuild build;
+    memset(&build, 0, sizeof(build));
+    build.uvmap = uvmap;
+
+    size_t bytes = sizeof(struct UVMap);
+
+    struct Material *material = model->materials;
+    while (material != NULL) {
+        int index = uvmap_material_index(material);
+        if (index != -1) {
+            struct UVMapMaterial *mat = &uvmap->materials[index];
+            size_t texels = material->width * material->height;
+
+            mat->width = material->width;
+            mat->height = material->height;
+            mat->owner = malloc(sizeof(int32_t) * texels);
+            for (size_t i=0; i<texels; ++i) {
+                mat->owner[i] = -1;
+            }
+            mat->link_offset = calloc(texels + 1, sizeof(uint32_t));
+            mat->stamp = calloc(texels, sizeof(uint32_t));
+            build.surface[index] = malloc(sizeof(float) * 6 * texels);
+
+            bytes += (2 * sizeof(uint32_t) + sizeof(int32_t)) * texels;
+        }
+
+        material = material->next;
+    }
+
+    // Collect all triangles on paintable materials
+    int capacity = 0;
+    struct Object *obj = model->objects;
+    while (obj != NULL) {
+        if (uvmap_material_index(obj->material) != -1) {
+            capacity += obj->vertexdata_size / 3;
+        }
+
+        obj = obj->next;
+    }
+
+    build.triangles = malloc(sizeof(struct UVMapTriangle) * (capacity + 1));
+
+    obj = model->objects;
+    while (obj != NULL) {
+        int index = uvmap_material_index(obj->material);
+        if (index != -1) {
+            for (size_t i=0; i+2<obj->vertexdata_size; i+=3) {
+                build.triangles[uvmap->num_triangles].v = obj->vertexdata + i;
+                build.triangles[uvmap->num_triangles].material = index;
+                uvmap->num_triangles++;
+            }
+        }
+
+        obj = obj->next;
+    }
+
+    for (int i=0; i<uvmap->num_triangles; ++i) {
+        uvmap_rasterize(&build, i);
+    }
+
+    // UV islands: triangles sharing an edge in UV space
+    int num_edges = 3 * uvmap->num_triangles;
+    struct UVMapEdge *edges = malloc(sizeof(struct UVMapEdge) * (num_edges + 1));
+
+    build.parent = malloc(sizeof(int) * (uvmap->num_triangles + 1));
+    for (int i=0; i<uvmap->num_triangles; ++i) {
+        build.parent[i] = i;
+    }
+
+    for (int i=0; i<uvmap->num_triangles; ++i) {
+        for (int e=0; e<3; ++e) {
+            struct UVMapEdge *edge = &edges[3 * i + e];
+            uvmap_edge_key_uv(edge, build.triangles[i].material, &build.triangles[i].v[e], &build.triangles[i].v[(e + 1) % 3]);
+            edge->triangle = i;
+            edge->edge = e;
+        }
+    }
+
+    qsort(edges, num_edges, sizeof(struct UVMapEdge), uvmap_edge_compare);
+    for (int i=1; i<num_edges; ++i) {
+        if (uvmap_edge_compare(&edges[i - 1], &edges[i]) == 0) {
+            uvmap_union(build.parent, edges[i - 1].triangle, edges[i].triangle);
+        }
+    }
+
+    uvmap->island = malloc(sizeof(int) * (uvmap->num_triangles + 1));
+    for (int i=0; i<uvmap->num_triangles; ++i) {
+        uvmap->island[i] = uvmap_find(build.parent, i);
+    }
+    bytes += sizeof(int) * uvmap->num_triangles;
+
+    // Seams: triangles sharing an edge in 3D, but not in UV space
+    for (int i=0; i<uvmap->num_triangles; ++i) {
+        for (int e=0; e<3; ++e) {
+            struct UVMapEdge *edge = &edges[3 * i + e];
+            uvmap_edge_key_position(edge, &build.triangles[i].v[e], &build.triangles[i].v[(e + 1) % 3]);
+            edge->triangle = i;
+            edge->edge = e;
+        }
+    }
+
+    qsort(edges, num_edges, sizeof(struct UVMapEdge), uvmap_edge_compare);
+    for (int start=0; start<num_edges; ) {
+        int end = start + 1;
+        while (end < num_edges && uvmap_edge_compare(&edges[start], &edges[end]) == 0) {
+            ++end;
+        }
+
+        for (int a=start; a<end; ++a) {
+            for (int b=a+1; b<end; ++b) {
+                struct UVMapEdge ka, kb;
+                const struct UVMapTriangle *ta = &build.triangles[edges[a].triangle];
+                const struct UVMapTriangle *tb = &build.triangles[edges[b].triangle];
+                uvmap_edge_key_uv(&ka, ta->material, &ta->v[edges[a].edge], &ta->v[(edges[a].edge + 1) % 3]);
+                uvmap_edge_key_uv(&kb, tb->material, &tb->v[edges[b].edge], &tb->v[(edges[b].edge + 1) % 3]);
+
+                if (uvmap_edge_compare(&ka, &kb) != 0) {
+                    uvmap_link_seam(&build, &edges[a], &edges[b]);
+                }
+            }
+        }
+
+        start = end;
+    }
+
+    free(edges);
+
+    // Build per-material CSR tables from the sorted, de-duplicated link pairs
+    if (build.pairs_count > 0) {
+        qsort(build.pairs, build.pairs_count, sizeof(uint64_t), uvmap_pair_compare);
+    }
+
+    size_t unique = 0;
+    for (size_t i=0; i<build.pairs_count; ++i) {
+        if (unique == 0 || build.pairs[unique - 1] != build.pairs[i]) {
+            build.pairs[unique++] = build.pairs[i];
+        }
+    }
+
+    for (size_t i=0; i<unique; ++i) {
+        uint32_t from = build.pairs[i] >> 32;
+        uvmap->materials[UVMAP_LINK_MATERIAL(from)].link_offset[UVMAP_LINK_TEXEL(from) + 1]++;
+    }
+
+    for (int m=0; m<UVMAP_MAX_MATERIALS; ++m) {
+        struct UVMapMaterial *mat = &uvmap->materials[m];
+        if (mat->owner == NULL) {
+            continue;
+        }
+
+        size_t texels = mat->width * mat->height;
+        for (size_t i=0; i<texels; ++i) {
+            mat->link_offset[i + 1] += mat->link_offset[i];
+        }
+
+        mat->links = malloc(sizeof(uint32_t) * (mat->link_offset[texels] + 1));
+        bytes += sizeof(uint32_t) * mat->link_offset[texels];
+    }
+
+    // Pairs are sorted by source, so links can be filled in order
+    size_t slot = 0;
+    for (size_t i=0; i<unique; ++i) {
+        uint32_t from = build.pairs[i] >> 32;
+        uint32_t to = build.pairs[i] & 0xFFFFFFFF;
+
+        if (i == 0 || (build.pairs[i - 1] >> 32) != from) {
+            slot = 0;
+        }
+
+        struct UVMapMaterial *mat = &uvmap->materials[UVMAP_LINK_MATERIAL(from)];
+        mat->links[mat->link_offset[UVMAP_LINK_TEXEL(from)] + slot++] = to;
+    }
+
+    uvmap->num_links = unique;
+
+    bytes += uvmap_build_mirror(&build);
+
+    for (int m=0; m<UVMAP_MAX_MATERIALS; ++m) {
+        free(build.surface[m]);
+    }
+    free(build.pairs);
+    free(build.parent);
+    free(build.triangles);
+
+    memstat_add(MEMSTAT_UVMAP, bytes);
+
+    printf("UV map: %d triangles, %zu seam links\n", uvmap->num_triangles, uvmap->num_links);
+
+    TRACE_END("uvmap_build");
+
+    return uvmap;
+}
+
+void
+uvmap_free(struct UVMap *uvmap)
+{
+    if (uvmap == NULL) {
+        return;
+    }
+
+    size_t bytes = sizeof(struct UVMap) + sizeof(int) * uvmap->num_triangles;
+
+    for (int m=0; m<UVMAP_MAX_MATERIALS; ++m) {
+        struct UVMapMaterial *mat = &uvmap->materials[m];
+        if (mat->owner != NULL) {
+            size_t texels = mat->width * mat->height;
+            bytes += (2 * sizeof(uint32_t) + sizeof(int32_t)) * texels + sizeof(uint32_t) * mat->link_offset[texels];
+            if (mat->mirror != NULL) {
+                bytes += sizeof(uint32_t) * texels;
+            }
+        }
+
+        free(mat->owner);
+        free(mat->mirror);
+        free(mat->link_offset);
+        free(mat->links);
+        free(mat->stamp);
+    }
+
+    memstat_sub(MEMSTAT_UVMAP, bytes);
+
+    free(uvmap->island);
+    free(uvmap->seeds);
+    free(uvmap->queue);
+    free(uvmap);
+}
+
+uint32_t
+uvmap_mirror(const struct UVMap *uvmap, int material, int x, int y)
+{
+    if (material < 0 || material >= UVMAP_MAX_MATERIALS || uvmap->materials[material].mirror == NULL) {
+        return UVMAP_NO_LINK;
+    }
+
+    const struct UVMapMaterial *mat = &uvmap->materials[material];
+    return mat->mirror[x + y * mat->width];
+}
+
+void
+uvmap_walk_begin(struct UVMap *uvmap)
+{
+    if (++uvmap->serial == 0) {
+        for (int m=0; m<UVMAP_MAX_MATERIALS; ++m) {
+            struct UVMapMaterial *mat = &uvmap->materials[m];
+            if (mat->stamp != NULL) {
+                memset(mat->stamp, 0, sizeof(uint32_t) * mat->width * mat->height);
+            }
+        }
+        uvmap->serial = 1;
+    }
+
+    uvmap->seeds_count = 0;
+}
+
+void
+uvmap_walk_hit(struct UVMap *uvmap, int material, int x, int y, float alpha)
+{
+    if (material < 0 || material >= UVMAP_MAX_MATERIALS || uvmap->materials[material].owner == NULL) {
+        return;
+    }
+
+    struct UVMapMaterial *mat = &uvmap->materials[material];
+    int texel = x + y * mat->width;
+
+    mat->stamp[texel] = uvmap->serial;
+
+    for (uint32_t i=mat->link_offset[texel]; i<mat->link_offset[texel + 1]; ++i) {
+        if (uvmap->seeds_count == uvmap->seeds_capacity) {
+            uvmap->seeds_capacity = uvmap->seeds_capacity ? 2 * uvmap->seeds_capacity : 256;
+            uvmap->seeds = realloc(uvmap->seeds, sizeof(struct UVMapSeed) * uvmap->seeds_capacity);
+        }
+
+        uvmap->seeds[uvmap->seeds_count].link = mat->links[i];
+        uvmap->seeds[uvmap->seeds_count].alpha = alpha;
+        uvmap->seeds_count++;
+    }
+}
+
+static int
+uvmap_seed_compare(const void *a, const void *b)
+{
+    float fa = ((const struct UVMapSeed *)a)->alpha;
+    float fb = ((const struct UVMapSeed *)b)->alpha;
+    return (fa > fb) - (fa < fb);
+}
+
+void
+uvmap_walk_bleed(struct UVMap *uvmap, float texel_radius,
+        void (*visit)(int material, int x, int y, float alpha, void *user_data), void *user_data)
+{
+    if (uvmap->seeds_count == 0 || texel_radius <= 0.f) {
+        return;
+    }
+
+    // Start with the seeds closest to the dab center, so they claim texels first
+    qsort(uvmap->seeds, uvmap->seeds_count, sizeof(struct UVMapSeed), uvmap_seed_compare);
+
+    size_t head = 0;
+    size_t tail = 0;
+
+    for (size_t s=0; s<uvmap->seeds_count; ++s) {
+        uint32_t link = uvmap->seeds[s].link;
+        struct UVMapMaterial *mat = &uvmap->materials[UVMAP_LINK_MATERIAL(link)];
+        int texel = UVMAP_LINK_TEXEL(link);
+
+        if (mat->stamp[texel] == uvmap->serial || mat->owner[texel] == -1) {
+            continue;
+        }
+
+        if (tail == uvmap->queue_capacity) {
+            uvmap->queue_capacity = uvmap->queue_capacity ? 2 * uvmap->queue_capacity : 1024;
+            uvmap->queue = realloc(uvmap->queue, sizeof(struct UVMapNode) * uvmap->queue_capacity);
+        }
+
+        mat->stamp[texel] = uvmap->serial;
+        uvmap->queue[tail].link = link;
+        uvmap->queue[tail].seed_x = texel % mat->width;
+        uvmap->queue[tail].seed_y = texel / mat->width;
+        uvmap->queue[tail].island = uvmap->island[mat->owner[texel]];
+        uvmap->queue[tail].alpha = uvmap->seeds[s].alpha;
+        ++tail;
+    }
+
+    static const int
+    NEIGHBORS[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+
+    while (head < tail) {
+        struct UVMapNode node = uvmap->queue[head++];
+
+        int material = UVMAP_LINK_MATERIAL(node.link);
+        struct UVMapMaterial *mat = &uvmap->materials[material];
+        int texel = UVMAP_LINK_TEXEL(node.link);
+        int x = texel % mat->width;
+        int y = texel / mat->width;
+
+        float dx = x - node.seed_x;
+        float dy = y - node.seed_y;
+        float alpha = node.alpha + sqrtf(dx * dx + dy * dy) / texel_radius;
+        if (alpha > 1.f) {
+            continue;
+        }
+
+        visit(material, x, y, alpha, user_data);
+
+        // Continue on this side of the seam, but stay within the same UV island
+        for (int n=0; n<4; ++n) {
+            int nx = x + NEIGHBORS[n][0];
+            int ny = y + NEIGHBORS[n][1];
+            if (nx < 0 || nx >= mat->width || ny < 0 || ny >= mat->height) {
+                continue;
+            }
+
+            int ntexel = nx + ny * mat->width;
+            if (mat->stamp[ntexel] == uvmap->serial || mat->owner[ntexel] == -1 ||
+                    uvmap->island[mat->owner[ntexel]] != node.island) {
+                continue;
+            }
+
+            if (tail == uvmap->queue_capacity) {
+                uvmap->queue_capacity = uvmap->queue_capacity ? 2 * uvmap->queue_capacity : 1024;
+                uvmap->queue = realloc(uvmap->queue, sizeof(struct UVMapNode) * uvmap->queue_capacity);
+            }
+
+            mat->stamp[ntexel] = uvmap->serial;
+            uvmap->queue[tail] = node;
+            uvmap->queue[tail].link = UVMAP_LINK(material, ntexel);
+            ++tail;
+        }
+    }
+}
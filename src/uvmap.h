@@ -0,0 +1,117 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "shipmodelformat.h"
+
+/**
+ * Texel/triangle adjacency of a ship model.
+ *
+ * Built once per ship from the triangle soup of the SHM: every texel knows
+ * the triangle that covers it (and through that its UV island), and texels
+ * along UV seams know the texels on the other side of the seam. This lets
+ * the brush continue across seams by walking lookup tables instead of doing
+ * extra picking passes.
+ *
+ * The same surface positions give the mirror table: each texel maps to the
+ * nearest texel at its position reflected on the X axis of the model, so a
+ * symmetric dab is one extra table read per texel.
+ **/
+
+#define UVMAP_MAX_MATERIALS 4
+
+// Texel reference across materials (texel index = x + y * width)
+#define UVMAP_LINK(material, texel) (((uint32_t)(material) << 16) | (uint32_t)(texel))
+#define UVMAP_LINK_MATERIAL(link) ((int)((link) >> 16))
+#define UVMAP_LINK_TEXEL(link) ((int)((link) & 0xFFFF))
+#define UVMAP_NO_LINK 0xFFFFFFFFu
+
+struct UVMapMaterial {
+    int width;
+    int height;
+
+    // Triangle covering each texel (-1 = not covered)
+    int32_t *owner;
+
+    // Cross-seam neighbors of each texel: links[link_offset[i]..link_offset[i+1]]
+    uint32_t *link_offset;
+    uint32_t *links;
+
+    // Texel at the X-mirrored surface position (UVMAP_NO_LINK = none)
+    uint32_t *mirror;
+
+    // Scratch space for uvmap_walk_*()
+    uint32_t *stamp;
+};
+
+struct UVMapSeed {
+    uint32_t link;
+    float alpha;
+};
+
+struct UVMapNode {
+    uint32_t link;
+    int seed_x;
+    int seed_y;
+    int island;
+    float alpha;
+};
+
+struct UVMap {
+    int num_triangles;
+    int *island;
+
+    struct UVMapMaterial materials[UVMAP_MAX_MATERIALS];
+    size_t num_links;
+
+    // Walk state
+    uint32_t serial;
+    struct UVMapSeed *seeds;
+    size_t seeds_count;
+    size_t seeds_capacity;
+    struct UVMapNode *queue;
+    size_t queue_capacity;
+};
+
+struct UVMap *
+uvmap_build(struct ShipModel *model);
+
+void
+uvmap_free(struct UVMap *uvmap);
+
+uint32_t
+uvmap_mirror(const struct UVMap *uvmap, int material, int x, int y);
+
+void
+uvmap_walk_begin(struct UVMap *uvmap);
+
+void
+uvmap_walk_hit(struct UVMap *uvmap, int material, int x, int y, float alpha);
+
+void
+uvmap_walk_bleed(struct UVMap *uvmap, float texel_radius,
+        void (*visit)(int material, int x, int y, float alpha, void *user_data), void *user_data);
@@ -0,0 +1,233 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include "workers.h"
+#include "trace.h"
+
+#include <stdlib.h>
+
+#include <SDL.h>
+
+#define WORKERS_MAX_THREADS 16
+
+// Progress is stored in steps of 1/WORKER_PROGRESS_SCALE
+#define WORKER_PROGRESS_SCALE 10000
+
+struct WorkerJob {
+    worker_func func;
+    void *user_data;
+
+    struct Workers *workers;
+    struct WorkerJob *next;
+
+    SDL_atomic_t progress;
+    SDL_atomic_t cancel;
+
+    // Protected by the workers mutex
+    bool done;
+};
+
+struct Workers {
+    SDL_Thread *threads[WORKERS_MAX_THREADS];
+    int count;
+
+    SDL_mutex *mutex;
+    SDL_cond *wake;
+    SDL_cond *finished;
+
+    // Jobs that have not been started yet (protected by mutex)
+    struct WorkerJob *head;
+    struct WorkerJob *tail;
+    bool quit;
+};
+
+static int
+workers_thread(void *user_data)
+{
+    struct Workers *workers = user_data;
+
+    trace_thread_name("worker");
+
+    SDL_LockMutex(workers->mutex);
+    while (true) {
+        while (!workers->quit && workers->head == NULL) {
+            SDL_CondWait(workers->wake, workers->mutex);
+        }
+
+        if (workers->quit) {
+            break;
+        }
+
+        struct WorkerJob *job = workers->head;
+        workers->head = job->next;
+        if (workers->head == NULL) {
+            workers->tail = NULL;
+        }
+        SDL_UnlockMutex(workers->mutex);
+
+        if (!worker_job_cancelled(job)) {
+            job->func(job, job->user_data);
+        }
+
+        SDL_LockMutex(workers->mutex);
+        job->done = true;
+        SDL_CondBroadcast(workers->finished);
+    }
+    SDL_UnlockMutex(workers->mutex);
+
+    return 0;
+}
+
+struct Workers *
+workers_new(int count)
+{
+    if (count <= 0) {
+        count = SDL_GetCPUCount();
+    }
+
+    if (count < 1) {
+        count = 1;
+    } else if (count > WORKERS_MAX_THREADS) {
+        count = WORKERS_MAX_THREADS;
+    }
+
+    struct Workers *workers = calloc(1, sizeof(struct Workers));
+
+    workers->mutex = SDL_CreateMutex();
+    workers->wake = SDL_CreateCond();
+    workers->finished = SDL_CreateCond();
+
+    for (int i=0; i<count; ++i) {
+        workers->threads[i] = SDL_CreateThread(workers_thread, "worker", workers);
+        if (workers->threads[i] == NULL) {
+            break;
+        }
+        workers->count++;
+    }
+
+    return workers;
+}
+
+void
+workers_free(struct Workers *workers)
+{
+    SDL_LockMutex(workers->mutex);
+    workers->quit = true;
+    SDL_CondBroadcast(workers->wake);
+    SDL_UnlockMutex(workers->mutex);
+
+    for (int i=0; i<workers->count; ++i) {
+        SDL_WaitThread(workers->threads[i], NULL);
+    }
+
+    SDL_DestroyCond(workers->finished);
+    SDL_DestroyCond(workers->wake);
+    SDL_DestroyMutex(workers->mutex);
+
+    free(workers);
+}
+
+int
+workers_count(struct Workers *workers)
+{
+    return workers->count;
+}
+
+struct WorkerJob *
+workers_submit(struct Workers *workers, worker_func func, void *user_data)
+{
+    struct WorkerJob *job = calloc(1, sizeof(struct WorkerJob));
+
+    job->func = func;
+    job->user_data = user_data;
+    job->workers = workers;
+
+    SDL_LockMutex(workers->mutex);
+    if (workers->tail != NULL) {
+        workers->tail->next = job;
+    } else {
+        workers->head = job;
+    }
+    workers->tail = job;
+    SDL_CondSignal(workers->wake);
+    SDL_UnlockMutex(workers->mutex);
+
+    return job;
+}
+
+bool
+worker_job_done(struct WorkerJob *job)
+{
+    SDL_LockMutex(job->workers->mutex);
+    bool done = job->done;
+    SDL_UnlockMutex(job->workers->mutex);
+
+    return done;
+}
+
+float
+worker_job_progress(struct WorkerJob *job)
+{
+    return (float)SDL_AtomicGet(&job->progress) / (float)WORKER_PROGRESS_SCALE;
+}
+
+void
+worker_job_cancel(struct WorkerJob *job)
+{
+    SDL_AtomicSet(&job->cancel, 1);
+}
+
+void
+worker_job_wait(struct WorkerJob *job)
+{
+    SDL_LockMutex(job->workers->mutex);
+    while (!job->done) {
+        SDL_CondWait(job->workers->finished, job->workers->mutex);
+    }
+    SDL_UnlockMutex(job->workers->mutex);
+}
+
+void
+worker_job_free(struct WorkerJob *job)
+{
+    worker_job_wait(job);
+    free(job);
+}
+
+bool
+worker_job_cancelled(struct WorkerJob *job)
+{
+    return SDL_AtomicGet(&job->cancel) != 0;
+}
+
+void
+worker_job_set_progress(struct WorkerJob *job, float progress)
+{
+    if (progress < 0.f) {
+        progress = 0.f;
+    } else if (progress > 1.f) {
+        progress = 1.f;
+    }
+
+    SDL_AtomicSet(&job->progress, (int)(progress * WORKER_PROGRESS_SCALE));
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+
+#include <stdbool.h>
+
+/**
+ * Pool of background threads for long-running jobs (e.g. quantization).
+ *
+ * Jobs are started in submission order by the first idle thread. The UI
+ * thread polls a job for its progress and completion, and can ask it to
+ * cancel; the job function checks worker_job_cancelled() and reports
+ * progress with worker_job_set_progress() as it goes.
+ **/
+
+struct Workers;
+struct WorkerJob;
+
+typedef void (*worker_func)(struct WorkerJob *job, void *user_data);
+
+// count <= 0 starts one thread per CPU core
+struct Workers *
+workers_new(int count);
+
+// All jobs have to be freed before the pool
+void
+workers_free(struct Workers *workers);
+
+int
+workers_count(struct Workers *workers);
+
+struct WorkerJob *
+workers_submit(struct Workers *workers, worker_func func, void *user_data);
+
+bool
+worker_job_done(struct WorkerJob *job);
+
+float
+worker_job_progress(struct WorkerJob *job);
+
+void
+worker_job_cancel(struct WorkerJob *job);
+
+void
+worker_job_wait(struct WorkerJob *job);
+
+// Waits for the job to finish first (cancel it to return quickly)
+void
+worker_job_free(struct WorkerJob *job);
+
+// Called from the job function
+bool
+worker_job_cancelled(struct WorkerJob *job);
+
+void
+worker_job_set_progress(struct WorkerJob *job, float progress);
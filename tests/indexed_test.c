@@ -0,0 +1,167 @@
+
+/**
+ * shipedit -- WipeOut Pulse PSP Ship Skin Editor
+ * Copyright (c) 2021 Thomas Perl <m@thp.io>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ **/
+
+/**
+ * Indexed mode (indexed.c): painting a color that is not in the palette
+ * must map to one of the colors in use, never to a padding entry, and the
+ * packed indices must expand back to the pixels they were built from.
+ **/
+
+#include "indexed.h"
+#include "memstat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_SIZE 128
+
+static int
+g_failures = 0;
+
+static void
+check(bool ok, const char *what)
+{
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        g_failures++;
+    }
+}
+
+static void
+test_paint_black_on_three_colors()
+{
+    static uint32_t original[TEST_SIZE * TEST_SIZE];
+    static uint32_t pixels[TEST_SIZE * TEST_SIZE];
+    static uint8_t drawn[TEST_SIZE * TEST_SIZE];
+    static uint32_t index[TEST_SIZE * TEST_SIZE];
+    static uint8_t alpha[TEST_SIZE * TEST_SIZE];
+
+    // White and red stripes and red/blue checks, all opaque
+    const uint32_t colors[] = { 0xFFFFFFFF, 0xFF0000FF, 0xFFFF0000 };
+    for (int i=0; i<TEST_SIZE * TEST_SIZE; ++i) {
+        original[i] = ((i / TEST_SIZE) % 3 == 2) ? colors[1 + i % 2] : colors[(i / TEST_SIZE) % 3];
+    }
+
+    struct Material material;
+    memset(&material, 0, sizeof(material));
+    material.pixels = malloc(sizeof(original));
+    memcpy(material.pixels, original, sizeof(original));
+    memstat_add(MEMSTAT_MATERIALS, sizeof(original));
+    material.width = TEST_SIZE;
+    material.height = TEST_SIZE;
+    material.pixels_drawn = drawn;
+
+    check(indexed_enable(&material), "indexed_enable");
+    check(material.pixels == NULL, "pixels are freed in indexed mode");
+    check(material.palette_count == 3, "palette_count of a 3 color image");
+
+    indexed_expand(&material, pixels);
+    check(memcmp(pixels, original, sizeof(original)) == 0, "indices expand to the original pixels");
+
+    // A full-strength dab over the whole image, with soft (dithered) edges
+    for (int i=0; i<TEST_SIZE * TEST_SIZE; ++i) {
+        index[i] = i;
+        alpha[i] = (i % TEST_SIZE < 16) ? 128 : 255;
+    }
+
+    uint8_t color = indexed_nearest(material.palette, material.palette_count, 0xFF000000);
+    check(color < material.palette_count, "nearest color is a used entry");
+
+    indexed_paint_texels(material.indices, drawn, TEST_SIZE, index, alpha, TEST_SIZE * TEST_SIZE, color);
+    indexed_expand(&material, pixels);
+
+    bool opaque = true;
+    bool used = true;
+    for (int i=0; i<TEST_SIZE * TEST_SIZE; ++i) {
+        opaque = opaque && (pixels[i] >> 24) == 0xFF;
+        used = used && indexed_get(material.indices, i) < material.palette_count;
+    }
+    check(opaque, "painted pixels stay opaque");
+    check(used, "painted indices are used entries");
+
+    // The exported palette entries that the image refers to are opaque as well
+    uint32_t palette[INDEXED_COLORS];
+    static uint8_t image[TEST_SIZE * TEST_SIZE / 2];
+    indexed_encode(&material, palette, image);
+    for (int i=0; i<TEST_SIZE * TEST_SIZE / 2; ++i) {
+        opaque = opaque && (palette[image[i] >> 4] >> 24) == 0xFF && (palette[image[i] & 0xF] >> 24) == 0xFF;
+    }
+    check(opaque, "exported texels are opaque");
+
+    indexed_disable(&material);
+    check(material.indices == NULL && material.pixels != NULL, "indexed_disable");
+    check(memcmp(material.pixels, pixels, sizeof(pixels)) == 0, "pixels are the expanded indices");
+
+    free(material.pixels);
+    free(material.palette);
+}
+
+static void
+test_kept_palette_unused_entries()
+{
+    static uint8_t drawn[TEST_SIZE * TEST_SIZE];
+
+    // A loaded palette of 16 grays, the image only uses the 3 lightest ones
+    uint32_t *palette = malloc(INDEXED_COLORS * sizeof(uint32_t));
+    for (int i=0; i<INDEXED_COLORS; ++i) {
+        uint32_t gray = 0xFF - i * 0x11;
+        palette[i] = 0xFF000000 | (gray << 16) | (gray << 8) | gray;
+    }
+    uint32_t *pixels = malloc(sizeof(uint32_t) * TEST_SIZE * TEST_SIZE);
+    memstat_add(MEMSTAT_MATERIALS, sizeof(uint32_t) * TEST_SIZE * TEST_SIZE);
+    for (int i=0; i<TEST_SIZE * TEST_SIZE; ++i) {
+        pixels[i] = palette[(i / TEST_SIZE) % 3];
+    }
+
+    struct Material material;
+    memset(&material, 0, sizeof(material));
+    material.pixels = (char *)pixels;
+    material.width = TEST_SIZE;
+    material.height = TEST_SIZE;
+    material.pixels_drawn = drawn;
+    material.palette = palette;
+
+    check(indexed_enable(&material), "indexed_enable (kept palette)");
+    check(material.palette_count == INDEXED_COLORS, "palette_count of a kept palette");
+
+    // Black is the last entry, which no texel uses yet
+    uint8_t color = indexed_nearest(material.palette, material.palette_count, 0xFF000000);
+    check(color == INDEXED_COLORS - 1, "unused entries of a kept palette can be painted");
+
+    indexed_disable(&material);
+    free(material.pixels);
+    free(material.palette);
+}
+
+int
+main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    test_paint_black_on_three_colors();
+    test_kept_palette_unused_entries();
+
+    printf("%s\n", (g_failures == 0) ? "OK" : "FAILED");
+    return (g_failures == 0) ? 0 : 1;
+}